@@ -1,4 +1,7 @@
 #include "cqueue.h"
+#include "slab.h"
+#include "fiber.h"
+#include "futex.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
@@ -7,15 +10,103 @@
 #include <unistd.h>
 #include <sys/errno.h>
 #include <stdbool.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #define DEFAULT_BLOCK_SIZE 128
 #define DEFAULT_NUM_BLOCKS 32
+#define CQUEUE_WAIT_ANY_SLICE_NSECS 1000000   // per queue, without futex_waitv
+
+// Slot states in locked mode (the lock-free mode keeps a sequence number in the same field).
+#define CQUEUE_SLOT_FREE 0
+#define CQUEUE_SLOT_RESERVED 1
+#define CQUEUE_SLOT_COMMITTED 2
+#define CQUEUE_SLOT_PUBLISHED 3
+#define CQUEUE_SLOT_PEEKED 4
+#define CQUEUE_SLOT_RELEASED 5
+#define CQUEUE_SLOT_PAD 6          // byte-ring mode: filler up to the end of the ring
 
 typedef struct cqueue_item {
+    atomic_uint sequence;
     uint32_t size;
     char data[];
 } cqueue_item_t;
 
+static inline cqueue_item_t* cqueue_slot(cqueue_obj_t* obj, uint32_t index) {
+    void* slot = &obj->data;
+    slot += index * (obj->block_size + sizeof(cqueue_item_t));
+    return slot;
+}
+
+// The largest item an enqueue accepts.
+static inline uint32_t cqueue_max_item(cqueue_obj_t* obj) {
+    if (obj->mode == CqueueModeByteRing)
+        return obj->ring_bytes - sizeof(cqueue_item_t);
+    return obj->block_size;
+}
+
+static inline void cqueue_futex_wake(cqueue_obj_t* obj, atomic_uint* word, atomic_uint* waiters, uint32_t count) {
+    if (atomic_load(waiters) > 0) {
+        // As in locked mode, see cqueue_locked_wake.
+        if (word == &obj->not_empty && atomic_load(&obj->watchers) > 0)
+            count = INT_MAX;
+        STATS_ADD(STATS_STRIPE(obj->stats).futex_wakes, 1);
+        atomic_fetch_add(word, 1);
+        syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, NULL);
+    }
+}
+
+// Locked mode wakes whoever may sleep on one of the counters. A cqueue_wait_any caller
+// that takes a wake need not dequeue, so while one watches every consumer is woken.
+static inline void cqueue_locked_wake(cqueue_obj_t* obj, uint32_t* counter, uint32_t count) {
+    if (counter == &obj->available_msgs && atomic_load(&obj->watchers) > 0)
+        count = INT_MAX;
+    STATS_ADD(STATS_STRIPE(obj->stats).futex_wakes, 1);
+    syscall(SYS_futex, counter, FUTEX_WAKE, count, NULL, NULL, NULL);
+}
+
+static inline void cqueue_count_dequeued(cqueue_obj_t* obj, uint32_t count) {
+    (void)obj;
+    (void)count;
+    STATS_ADD(STATS_STRIPE(obj->stats).dequeued, count);
+}
+
+// Lock-free mode: end_pos is the enqueue position just past the published items.
+static inline void cqueue_lf_count_enqueued(cqueue_obj_t* obj, uint32_t count, uint32_t end_pos) {
+    (void)obj;
+    (void)count;
+    (void)end_pos;
+#ifdef POOL_STATS
+    int32_t depth = (int32_t)(end_pos - atomic_load_explicit(&obj->dequeue_pos, memory_order_relaxed));
+    STATS_ADD(STATS_STRIPE(obj->stats).enqueued, count);
+    STATS_MAX(STATS_STRIPE(obj->stats).max_depth, depth > 0 ? (uint64_t)depth : 0);
+#endif
+}
+
+// Sleeps while *word == expected, until woken or the deadline (NULL: none) passes.
+// A deadline already behind us fails without the syscall, which would otherwise
+// still sleep for the timer slack: a zero timeout is a try, not a short nap.
+// On a fiber only the fiber waits; its thread runs other tasks meanwhile.
+static rc_t cqueue_futex_wait(void* word, uint32_t expected, timespec_t* deadline) {
+    if (futex_passed(deadline))
+        return Timeout;
+
+    rc_t rc = fiber_wait(word, expected, deadline);
+    if (rc != InvalidOperation)
+        return rc;
+
+    long frc = syscall(SYS_futex, word, FUTEX_WAIT_BITSET, expected, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    if (frc == -1 && errno == ETIMEDOUT)
+        return Timeout;
+    return Success;
+}
+
+static void cqueue_seg_room(cqueue_obj_t* obj);
+static void cqueue_seg_free_all(cqueue_obj_t* obj);
+
 rc_t cqueue_attr_init(cqueue_attr_t* attrs) {
     rc_t rc;
     if (attrs == NULL) {
@@ -25,6 +116,8 @@ rc_t cqueue_attr_init(cqueue_attr_t* attrs) {
 
     attrs->block_size = DEFAULT_BLOCK_SIZE;
     attrs->num_blocks = DEFAULT_NUM_BLOCKS;
+    attrs->mode = CqueueModeLocked;
+    attrs->max_segments = 0;
     rc = spinlock_attr_init(&attrs->lock_attrs);
     if (rc != Success) {
         fprintf(stderr, "On cqueue_attr_init the lock attrs could not be initialized.\n");
@@ -48,7 +141,9 @@ rc_t cqueue_alloc_size(cqueue_attr_t* attrs, int* required_bytes) {
 
     uint32_t sz = 0;
     sz += sizeof(cqueue_obj_t);
-    sz += (attrs->block_size + sizeof(cqueue_item_t)) * attrs->num_blocks;
+    // Segmented mode allocates its slots as it grows.
+    if (attrs->mode != CqueueModeSegmented)
+        sz += (attrs->block_size + sizeof(cqueue_item_t)) * attrs->num_blocks;
 
     *required_bytes = sz;
 
@@ -78,6 +173,11 @@ rc_t cqueue_init(cqueue_t* handle, cqueue_obj_t* obj, cqueue_attr_t* attrs) {
         }
     }
 
+    if (attrs->mode == CqueueModeLockFree && (attrs->num_blocks & (attrs->num_blocks - 1)) != 0) {
+        fprintf(stderr, "The lock-free mode needs num_blocks to be a power of two.\n");
+        return InvalidArgument;
+    }
+
     rc = spinlock_init(&handle->lock, &obj->lock_obj, &attrs->lock_attrs);
     if (rc != Success) {
         fprintf(stderr, "Could not init the queue lock.\n");
@@ -85,12 +185,56 @@ rc_t cqueue_init(cqueue_t* handle, cqueue_obj_t* obj, cqueue_attr_t* attrs) {
     }
 
     handle->obj = obj;
+    handle->mapped_bytes = 0;
     obj->block_size = attrs->block_size;
     obj->num_blocks = attrs->num_blocks;
     obj->head = 0;
     obj->tail = 0;
     obj->available_msgs = 0;
     obj->free_blocks = obj->num_blocks;
+    obj->mode = attrs->mode;
+
+    atomic_init(&obj->enqueue_pos, 0);
+    atomic_init(&obj->dequeue_pos, 0);
+    atomic_init(&obj->full_waiters, 0);
+    atomic_init(&obj->empty_waiters, 0);
+    atomic_init(&obj->not_full, 0);
+    atomic_init(&obj->not_empty, 0);
+    atomic_init(&obj->watchers, 0);
+    obj->commit_index = 0;
+    obj->release_index = 0;
+    obj->saved_valid = 0;
+    obj->saved_owner = 0;
+    obj->rollbacks = 0;
+    memset(obj->rolled_back, 0, sizeof(obj->rolled_back));
+    obj->ring_bytes = 0;
+    obj->unpublished = 0;
+    obj->unreleased = 0;
+    obj->head_segment = NULL;
+    obj->commit_segment = NULL;
+    obj->tail_segment = NULL;
+    obj->release_segment = NULL;
+    obj->spare_segments = NULL;
+    obj->num_segments = 0;
+    obj->num_spare = 0;
+    obj->max_segments = attrs->max_segments;
+#ifdef POOL_STATS
+    memset(obj->stats, 0, sizeof(obj->stats));
+#endif
+    if (obj->mode == CqueueModeByteRing) {
+        // The same memory as num_blocks full slots, used as one ring of 8-byte aligned records.
+        obj->ring_bytes = ((obj->block_size + sizeof(cqueue_item_t)) * obj->num_blocks) & ~7u;
+        obj->free_blocks = obj->ring_bytes;
+        return Success;
+    }
+
+    if (obj->mode == CqueueModeSegmented) {
+        cqueue_seg_room(obj);
+        return Success;
+    }
+
+    for (uint32_t i = 0; i < obj->num_blocks; i++)
+        atomic_init(&cqueue_slot(obj, i)->sequence, obj->mode == CqueueModeLockFree ? i : CQUEUE_SLOT_FREE);
 
     return Success;
 }
@@ -126,6 +270,7 @@ rc_t cqueue_create(cqueue_t* handle, cqueue_attr_t* attrs) {
     rc = cqueue_init(handle, obj, attrs);
     if (rc != Success) {
         fprintf(stderr, "Could not init the cqueue in create.\n");
+        free(obj);
         return rc;        
     }
 
@@ -143,177 +288,1962 @@ rc_t cqueue_destroy(cqueue_t* handle) {
        return InvalidArgument;        
     }
 
-    free(handle->obj);
+    if (handle->obj->mode == CqueueModeSegmented)
+        cqueue_seg_free_all(handle->obj);
+
+    if (handle->mapped_bytes > 0)
+        munmap(handle->obj, handle->mapped_bytes);
+    else
+        free(handle->obj);
 
     return Success;
 }
 
-rc_t cqueue_enqueue(cqueue_t* handle, void* item, uint32_t size, timespec_t* timeout) {
-    rc_t rc;
+/*
+ * Shared memory queues live in a POSIX shared memory object, so any process
+ * that opens it by name can enqueue and dequeue. Items are copied in and out
+ * of the mapping; anything an item points to must be described by an offset
+ * into memory both sides map. Only the locked mode is supported, with the
+ * robust lock kind so a process that dies holding the lock does not wedge the
+ * others. The lock-free mode has no owner to detect, so its claimed slots
+ * cannot be recovered.
+ */
 
-    if (handle == NULL) {
-        fprintf(stderr, "The handle cannot be NULL\n");
-        return InvalidArgument;
-    } 
+/**
+ * @brief: Creates a queue in a new shared memory object.
+ *
+ * @param: handle -- the queue.
+ * @param: name -- the shm_open name, e.g. "/jobs". Fails if it already exists.
+ * @param: attrs -- the queue attributes (NULL for defaults). The mode must be locked; the lock kind is forced to robust.
+ * @return: the rc_t value (Success, InvalidArgument, Error etc.)
+*/
+rc_t cqueue_create_shared(cqueue_t* handle, const char* name, cqueue_attr_t* attrs) {
+    cqueue_attr_t shared_attrs;
+    rc_t rc;
 
-    if (item == NULL) {
-        fprintf(stderr, "The item cannot be NULL\n");
+    if (handle == NULL || name == NULL) {
+        fprintf(stderr, "The handle and name cannot be NULL.\n");
         return InvalidArgument;
-    } 
+    }
 
-    if (size == 0) {
-        fprintf(stderr, "The byte_size cannot be zero\n");
-        return InvalidArgument;
-    } 
+    if (attrs == NULL) {
+        rc = cqueue_attr_init(&shared_attrs);
+        if (rc != Success) {
+            fprintf(stderr, "Could not init default attrs\n");
+            return rc;
+        }
+    } else {
+        shared_attrs = *attrs;
+    }
 
-    if (size > handle->obj->block_size) {
-        fprintf(stderr, "The item cannot fit in the queue\n");
+    if (shared_attrs.mode != CqueueModeLocked) {
+        fprintf(stderr, "A shared queue must use the locked mode.\n");
         return InvalidArgument;
     }
+    shared_attrs.lock_attrs.kind = SpinlockKindRobust;
 
-    rc = spinlock_acquire(&handle->lock);
+    int sz;
+    rc = cqueue_alloc_size(&shared_attrs, &sz);
     if (rc != Success) {
-        fprintf(stderr, "The spin lock was not acquired\n");
+        fprintf(stderr, "Could not get the cqueue allocation size\n");
         return rc;
     }
 
-    while (handle->obj->free_blocks == 0) {
-        spinlock_release(&handle->lock);
-        long frc = syscall(SYS_futex, &handle->obj->free_blocks, FUTEX_WAIT, 0, timeout, NULL, NULL);
-        if (frc == ETIMEDOUT) 
-            return Timeout;
-        
-        rc = spinlock_acquire(&handle->lock);
-        if (rc !=Success) {
-            fprintf(stderr, "The spin lock was not acquired\n");
-            return rc;  
-        }
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        perror("shm_open");
+        return Error;
     }
 
-    void* dest = &handle->obj->data;
-    dest += handle->obj->head * (handle->obj->block_size + sizeof(cqueue_item_t));
+    if (ftruncate(fd, sz) != 0) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return Error;
+    }
 
-    cqueue_item_t* item_ptr = dest;
-    item_ptr->size = size;
-    memcpy(&item_ptr->data, item, size);
-    handle->obj->head = (handle->obj->head + 1) % handle->obj->num_blocks;
-    handle->obj->available_msgs += 1;
-    handle->obj->free_blocks -= 1;
+    void* obj = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (obj == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(name);
+        return Error;
+    }
 
-    rc = spinlock_release(&handle->lock);
+    rc = cqueue_init(handle, obj, &shared_attrs);
     if (rc != Success) {
-        fprintf(stderr, "The spin lock was not released\n");
+        fprintf(stderr, "Could not init the shared cqueue.\n");
+        munmap(obj, sz);
+        shm_unlink(name);
         return rc;
-    }   
-
-    syscall(SYS_futex, &handle->obj->available_msgs, FUTEX_WAKE, 1, NULL, NULL, NULL);
+    }
+    handle->mapped_bytes = sz;
 
     return Success;
 }
 
-rc_t cqueue_dequeue(cqueue_t* handle, uint32_t max_size, void** item, uint32_t* size, timespec_t* timeout) {
-    rc_t rc;
-
-    if (handle == NULL) {
-        fprintf(stderr, "The handle cannot be NULL\n");
+/**
+ * @brief: Maps a queue made by cqueue_create_shared in another process.
+ *
+ * @param: handle -- the queue. cqueue_destroy unmaps it; the object stays until cqueue_unlink_shared.
+ * @param: name -- the name given to cqueue_create_shared, which must have returned already.
+ * @return: the rc_t value (Success, InvalidArgument, Error etc.)
+*/
+rc_t cqueue_open_shared(cqueue_t* handle, const char* name) {
+    if (handle == NULL || name == NULL) {
+        fprintf(stderr, "The handle and name cannot be NULL.\n");
         return InvalidArgument;
-    } 
+    }
 
-    if (item == NULL) {
-        fprintf(stderr, "The item cannot be NULL\n");
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        perror("shm_open");
+        return Error;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(cqueue_obj_t)) {
+        fprintf(stderr, "The shared memory object is not a queue.\n");
+        close(fd);
         return InvalidArgument;
-    } 
+    }
 
-    if (max_size == 0) {
-        fprintf(stderr, "The max_bytes cannot be zero\n");
+    cqueue_obj_t* obj = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (obj == MAP_FAILED) {
+        perror("mmap");
+        return Error;
+    }
+
+    size_t needed = sizeof(cqueue_obj_t) + (size_t)(obj->block_size + sizeof(cqueue_item_t)) * obj->num_blocks;
+    if (obj->mode != CqueueModeLocked || obj->lock_obj.kind != SpinlockKindRobust || needed > (size_t) st.st_size) {
+        fprintf(stderr, "The shared memory object is not an initialized shared queue.\n");
+        munmap(obj, st.st_size);
         return InvalidArgument;
-    } 
+    }
 
-    if (size == NULL) {
-        fprintf(stderr, "The item size cannot be NULL\n");
+    handle->obj = obj;
+    handle->lock.obj = &obj->lock_obj;
+    handle->mapped_bytes = st.st_size;
+
+    return Success;
+}
+
+/**
+ * @brief: Removes the name of a shared queue. Processes that have it mapped keep using it.
+ *
+ * @param: name -- the name given to cqueue_create_shared.
+ * @return: the rc_t value (Success, InvalidArgument, Error)
+*/
+rc_t cqueue_unlink_shared(const char* name) {
+    if (name == NULL) {
+        fprintf(stderr, "The name cannot be NULL.\n");
         return InvalidArgument;
     }
 
-    rc = spinlock_acquire(&handle->lock);
-    if (rc != Success) {
-        fprintf(stderr, "The spin lock was not acquired\n");
-        return rc;
+    if (shm_unlink(name) != 0) {
+        perror("shm_unlink");
+        return Error;
+    }
+
+    return Success;
+}
+
+/*
+ * Locked mode. Slots move FREE -> RESERVED -> COMMITTED -> PUBLISHED -> PEEKED
+ * -> RELEASED -> FREE, all under the spinlock. head/tail hand out slots to producers and
+ * consumers; commit_index/release_index trail behind them and only advance
+ * over slots that are finished, so a slow reserve/commit or peek/release
+ * pair never exposes a half-written or still-in-use slot.
+ */
+
+static inline cqueue_item_t* cqueue_item_of(void* data) {
+    return (cqueue_item_t*)((char*)data - offsetof(cqueue_item_t, data));
+}
+
+static inline void cqueue_slot_set(cqueue_item_t* slot, uint32_t state) {
+    atomic_store_explicit(&slot->sequence, state, memory_order_relaxed);
+}
+
+static inline uint32_t cqueue_slot_get(cqueue_item_t* slot) {
+    return atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+}
+
+static uint32_t cqueue_locked_publish(cqueue_obj_t* obj);
+static uint32_t cqueue_locked_reclaim(cqueue_obj_t* obj);
+
+/*
+ * Shared queues use the robust lock kind. Every holder saves the cursors when
+ * it takes the lock and clears saved_valid just before letting go, so when a
+ * holder dies in the middle of a critical section the next one can put the
+ * ring back the way it was: producer slots claimed in that section go back to
+ * FREE and consumer slots back to PUBLISHED (their messages are delivered
+ * again). Commits and releases made earlier by live processes stand and are
+ * published or reclaimed as usual. A process that dies between a separate
+ * cqueue_reserve and cqueue_commit (or cqueue_peek and cqueue_release) still
+ * loses that slot, as it would in a private queue. The queue remembers whose
+ * sections it rolled back, so whoever tracks what a dead process had taken
+ * (cqueue_rolled_back) can tell a batch dequeue that came undone from one that
+ * completed.
+ */
+
+static inline uint32_t cqueue_distance(cqueue_obj_t* obj, uint32_t from, uint32_t to) {
+    return (to + obj->num_blocks - from) % obj->num_blocks;
+}
+
+static void cqueue_locked_recover(cqueue_obj_t* obj) {
+    cqueue_cursors_t* saved = &obj->saved;
+    uint32_t n = obj->num_blocks;
+
+    if (!obj->saved_valid)
+        return;
+
+    obj->rolled_back[obj->rollbacks++ % CQUEUE_ROLLBACK_HISTORY] = obj->saved_owner;
+
+    // Slots outside the free and published runs were reserved, committed, peeked or released;
+    // the ring was split between [release_index, tail) and [commit_index, head).
+    uint32_t consumed = cqueue_distance(obj, saved->release_index, saved->tail);
+    uint32_t pending = cqueue_distance(obj, saved->commit_index, saved->head);
+    if (consumed + pending + saved->free_blocks + saved->available_msgs < n) {
+        // Both cursors pairs met: the whole remainder belongs to one of them. The
+        // first slot tells which, as it only moved within its own side of the ring.
+        uint32_t state = cqueue_slot_get(cqueue_slot(obj, saved->release_index));
+        if (state == CQUEUE_SLOT_PEEKED || state == CQUEUE_SLOT_RELEASED || state == CQUEUE_SLOT_FREE)
+            consumed = n - saved->free_blocks - saved->available_msgs;
+        else
+            pending = n - saved->free_blocks - saved->available_msgs;
+    }
+
+    for (uint32_t i = 0; i < saved->free_blocks; i++)
+        cqueue_slot_set(cqueue_slot(obj, (saved->head + i) % n), CQUEUE_SLOT_FREE);
+
+    for (uint32_t i = 0; i < pending; i++) {
+        cqueue_item_t* slot = cqueue_slot(obj, (saved->commit_index + i) % n);
+        if (cqueue_slot_get(slot) == CQUEUE_SLOT_PUBLISHED)
+            cqueue_slot_set(slot, CQUEUE_SLOT_COMMITTED);
+    }
+
+    for (uint32_t i = 0; i < saved->available_msgs; i++)
+        cqueue_slot_set(cqueue_slot(obj, (saved->tail + i) % n), CQUEUE_SLOT_PUBLISHED);
+
+    for (uint32_t i = 0; i < consumed; i++) {
+        cqueue_item_t* slot = cqueue_slot(obj, (saved->release_index + i) % n);
+        if (cqueue_slot_get(slot) == CQUEUE_SLOT_FREE)
+            cqueue_slot_set(slot, CQUEUE_SLOT_RELEASED);
+    }
+
+    obj->head = saved->head;
+    obj->tail = saved->tail;
+    obj->commit_index = saved->commit_index;
+    obj->release_index = saved->release_index;
+    obj->available_msgs = saved->available_msgs;
+    obj->free_blocks = saved->free_blocks;
+    obj->saved_valid = 0;
+
+    cqueue_locked_publish(obj);
+    cqueue_locked_reclaim(obj);
+
+    // Whoever slept on the old counts re-checks the repaired ones.
+    cqueue_locked_wake(obj, &obj->available_msgs, INT_MAX);
+    cqueue_locked_wake(obj, &obj->free_blocks, INT_MAX);
+}
+
+static rc_t cqueue_lock(cqueue_t* handle) {
+    cqueue_obj_t* obj = handle->obj;
+
+    rc_t rc = spinlock_acquire(&handle->lock);
+    if (rc == OwnerDied) {
+        fprintf(stderr, "The queue lock holder died, rolling its operation back.\n");
+        cqueue_locked_recover(obj);
+        rc = Success;
+    }
+
+    if (rc == Success && obj->lock_obj.kind == SpinlockKindRobust && obj->mode == CqueueModeLocked) {
+        obj->saved.head = obj->head;
+        obj->saved.tail = obj->tail;
+        obj->saved.commit_index = obj->commit_index;
+        obj->saved.release_index = obj->release_index;
+        obj->saved.available_msgs = obj->available_msgs;
+        obj->saved.free_blocks = obj->free_blocks;
+        obj->saved_owner = spinlock_owner(&handle->lock);
+        atomic_signal_fence(memory_order_seq_cst);
+        obj->saved_valid = 1;
+    }
+
+    return rc;
+}
+
+static rc_t cqueue_unlock(cqueue_t* handle) {
+    if (handle->obj->lock_obj.kind == SpinlockKindRobust) {
+        handle->obj->saved_valid = 0;
+        atomic_signal_fence(memory_order_seq_cst);
+    }
+
+    return spinlock_release(&handle->lock);
+}
+
+// Called with the lock held. Waits until *counter is non-zero; the lock is not held on failure.
+static rc_t cqueue_locked_wait(cqueue_t* handle, uint32_t* counter, timespec_t* deadline) {
+    rc_t rc;
+
+    if (*counter == 0) {
+        if (counter == &handle->obj->free_blocks)
+            STATS_ADD(STATS_STRIPE(handle->obj->stats).full_waits, 1);
+        else
+            STATS_ADD(STATS_STRIPE(handle->obj->stats).empty_waits, 1);
     }
 
-    while (handle->obj->available_msgs == 0) {
-        spinlock_release(&handle->lock);
-        long frc = syscall(SYS_futex, &handle->obj->available_msgs, FUTEX_WAIT, 0, timeout, NULL, NULL);
-        if (frc == ETIMEDOUT) 
+    while (*counter == 0) {
+        cqueue_unlock(handle);
+        STATS_ADD(STATS_STRIPE(handle->obj->stats).futex_waits, 1);
+        if (cqueue_futex_wait(counter, 0, deadline) == Timeout)
             return Timeout;
         
-        rc = spinlock_acquire(&handle->lock);
+        rc = cqueue_lock(handle);
         if (rc !=Success) {
             fprintf(stderr, "The spin lock was not acquired\n");
             return rc;  
         }
     }
 
-    void* src = &handle->obj->data;
-    src += handle->obj->tail * (handle->obj->block_size + sizeof(cqueue_item_t));
+    return Success;
+}
+
+// Called with the lock held. Makes committed slots visible to consumers in order.
+static uint32_t cqueue_locked_publish(cqueue_obj_t* obj) {
+    uint32_t published = 0;
 
-    cqueue_item_t* item_ptr = src;
-    if (item_ptr->size > max_size) {
-        spinlock_release(&handle->lock);
-        fprintf(stderr, "The item size cannot be NULL\n");
-        return InvalidArgument;  
+    while (true) {
+        cqueue_item_t* slot = cqueue_slot(obj, obj->commit_index);
+        if (cqueue_slot_get(slot) != CQUEUE_SLOT_COMMITTED)
+            break;
+        cqueue_slot_set(slot, CQUEUE_SLOT_PUBLISHED);
+        obj->commit_index = (obj->commit_index + 1) % obj->num_blocks;
+        published++;
     }
 
-    void* data = malloc(item_ptr->size);
-    if (data == NULL) {
-        fprintf(stderr, "Out of Memory.\n");
-        spinlock_release(&handle->lock);
-        return OutOfMemory;         
+    obj->available_msgs += published;
+    STATS_ADD(STATS_STRIPE(obj->stats).enqueued, published);
+    STATS_MAX(STATS_STRIPE(obj->stats).max_depth, obj->available_msgs);
+    return published;
+}
+
+// Called with the lock held. Hands released slots back to producers in order.
+static uint32_t cqueue_locked_reclaim(cqueue_obj_t* obj) {
+    uint32_t reclaimed = 0;
+
+    while (true) {
+        cqueue_item_t* slot = cqueue_slot(obj, obj->release_index);
+        if (cqueue_slot_get(slot) != CQUEUE_SLOT_RELEASED)
+            break;
+        cqueue_slot_set(slot, CQUEUE_SLOT_FREE);
+        obj->release_index = (obj->release_index + 1) % obj->num_blocks;
+        reclaimed++;
     }
 
-    *size = item_ptr->size;
-    memcpy(data, &item_ptr->data, *size);
+    obj->free_blocks += reclaimed;
+    return reclaimed;
+}
+
+// Called with the lock held. Claims the slot at head; the lock is not held on failure.
+static rc_t cqueue_locked_reserve(cqueue_t* handle, uint32_t size, cqueue_item_t** slot, timespec_t* deadline) {
+    rc_t rc = cqueue_locked_wait(handle, &handle->obj->free_blocks, deadline);
+    if (rc != Success)
+        return rc;
+
+    cqueue_item_t* item_ptr = cqueue_slot(handle->obj, handle->obj->head);
+    item_ptr->size = size;
+    cqueue_slot_set(item_ptr, CQUEUE_SLOT_RESERVED);
+    handle->obj->head = (handle->obj->head + 1) % handle->obj->num_blocks;
+    handle->obj->free_blocks -= 1;
+    *slot = item_ptr;
+
+    return Success;
+}
+
+// Called with the lock held. Claims the slot at tail; the lock is not held on failure.
+static rc_t cqueue_locked_peek(cqueue_t* handle, uint32_t max_size, cqueue_item_t** slot, timespec_t* deadline) {
+    rc_t rc = cqueue_locked_wait(handle, &handle->obj->available_msgs, deadline);
+    if (rc != Success)
+        return rc;
+
+    cqueue_item_t* item_ptr = cqueue_slot(handle->obj, handle->obj->tail);
+    if (item_ptr->size > max_size) {
+        cqueue_unlock(handle);
+        fprintf(stderr, "The item is larger than max_size\n");
+        return InvalidArgument;  
+    }
+
+    cqueue_slot_set(item_ptr, CQUEUE_SLOT_PEEKED);
     handle->obj->tail = (handle->obj->tail + 1) % handle->obj->num_blocks;
     handle->obj->available_msgs -= 1;
-    handle->obj->free_blocks += 1;
-    *item = data;
+    cqueue_count_dequeued(handle->obj, 1);
+    *slot = item_ptr;
 
-    rc = spinlock_release(&handle->lock);
-    if (rc != Success) {
-        fprintf(stderr, "The spin lock was not released\n");
-        return rc;
-    } 
+    return Success;
+}
+
+/*
+ * Lock-free mode (Vyukov's bounded MPMC ring). Each slot carries a sequence
+ * number: a slot at position pos is free for the producer when sequence == pos
+ * and holds a message for the consumer when sequence == pos + 1. Producers and
+ * consumers only contend on their own position counter. Blocking on a full or
+ * empty ring goes through an event word plus a waiter count, so the futex wake
+ * is only issued when somebody is actually parked.
+ *
+ * A reserved slot keeps sequence == pos until it is committed and a peeked slot
+ * keeps sequence == pos + 1 until it is released, so commit and release can
+ * recover pos from the slot itself.
+ */
+
+static rc_t cqueue_lf_wait(atomic_uint* word, atomic_uint* waiters, atomic_uint* pos, cqueue_obj_t* obj,
+                           uint32_t expected_offset, timespec_t* deadline) {
+    unsigned int seen = atomic_load(word);
+    atomic_fetch_add(waiters, 1);
+
+    if (word == &obj->not_full)
+        STATS_ADD(STATS_STRIPE(obj->stats).full_waits, 1);
+    else
+        STATS_ADD(STATS_STRIPE(obj->stats).empty_waits, 1);
+
+    // Recheck after registering: a peer that published in between either sees us or bumped word.
+    uint32_t p = atomic_load(pos);
+    uint32_t seq = atomic_load(&cqueue_slot(obj, p & (obj->num_blocks - 1))->sequence);
+    rc_t rc = Success;
+    if ((int32_t)(seq - (p + expected_offset)) < 0) {
+        STATS_ADD(STATS_STRIPE(obj->stats).futex_waits, 1);
+        rc = cqueue_futex_wait(word, seen, deadline);
+    }
+
+    atomic_fetch_sub(waiters, 1);
+    return rc;
+}
+
+static rc_t cqueue_lf_reserve(cqueue_obj_t* obj, uint32_t size, cqueue_item_t** out, timespec_t* deadline) {
+    uint32_t mask = obj->num_blocks - 1;
+    cqueue_item_t* slot;
+    uint32_t pos = atomic_load_explicit(&obj->enqueue_pos, memory_order_relaxed);
+
+    while (true) {
+        slot = cqueue_slot(obj, pos & mask);
+        uint32_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int32_t diff = (int32_t)(seq - pos);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&obj->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            rc_t rc = cqueue_lf_wait(&obj->not_full, &obj->full_waiters, &obj->enqueue_pos, obj, 0, deadline);
+            if (rc != Success)
+                return rc;
+            pos = atomic_load_explicit(&obj->enqueue_pos, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&obj->enqueue_pos, memory_order_relaxed);
+        }
+    }
+
+    // Relaxed so a consumer peeking at a recycled slot (and then losing its CAS) is not a data race.
+    __atomic_store_n(&slot->size, size, __ATOMIC_RELAXED);
+    *out = slot;
 
-    syscall(SYS_futex, &handle->obj->free_blocks, FUTEX_WAKE, 1, NULL, NULL, NULL);
- 
     return Success;
 }
 
-rc_t cqueue_size(cqueue_t* handle, uint32_t* size) {
-    rc_t rc;
+static void cqueue_lf_commit(cqueue_obj_t* obj, cqueue_item_t* slot) {
+    uint32_t pos = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    atomic_store(&slot->sequence, pos + 1);
+    cqueue_lf_count_enqueued(obj, 1, pos + 1);
 
-    if (handle == NULL) {
-        fprintf(stderr, "The handle cannot be NULL\n");
-        return InvalidArgument;
-    } 
+    cqueue_futex_wake(obj, &obj->not_empty, &obj->empty_waiters, 1);
+}
 
-    if (size == NULL) {
-        fprintf(stderr, "The size cannot be NULL\n");
-        return InvalidArgument;
-    } 
+static rc_t cqueue_lf_peek(cqueue_obj_t* obj, uint32_t max_size, cqueue_item_t** out, timespec_t* deadline) {
+    uint32_t mask = obj->num_blocks - 1;
+    cqueue_item_t* slot;
+    uint32_t pos = atomic_load_explicit(&obj->dequeue_pos, memory_order_relaxed);
 
-    rc = spinlock_acquire(&handle->lock);
-    if (rc != Success) {
-        fprintf(stderr, "The spin lock was not acquired\n");
-        return rc;
+    while (true) {
+        slot = cqueue_slot(obj, pos & mask);
+        uint32_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        int32_t diff = (int32_t)(seq - (pos + 1));
+
+        if (diff == 0) {
+            if (__atomic_load_n(&slot->size, __ATOMIC_RELAXED) > max_size) {
+                fprintf(stderr, "The item is larger than max_size\n");
+                return InvalidArgument;
+            }
+            if (atomic_compare_exchange_weak_explicit(&obj->dequeue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cqueue_count_dequeued(obj, 1);
+                break;
+            }
+        } else if (diff < 0) {
+            rc_t rc = cqueue_lf_wait(&obj->not_empty, &obj->empty_waiters, &obj->dequeue_pos, obj, 1, deadline);
+            if (rc != Success)
+                return rc;
+            pos = atomic_load_explicit(&obj->dequeue_pos, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(&obj->dequeue_pos, memory_order_relaxed);
+        }
     }
 
-    *size = handle->obj->available_msgs;
+    *out = slot;
 
-    rc = spinlock_release(&handle->lock);
-    if (rc != Success) {
-        fprintf(stderr, "The spin lock was not released\n");
-        return rc;
-    } 
-        
     return Success;
 }
+
+static void cqueue_lf_release(cqueue_obj_t* obj, cqueue_item_t* slot) {
+    uint32_t seq = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+    atomic_store(&slot->sequence, seq - 1 + obj->num_blocks);
+
+    cqueue_futex_wake(obj, &obj->not_full, &obj->full_waiters, 1);
+}
+
+/*
+ * Byte-ring mode. Records are packed back to back in one ring of bytes, each
+ * an item header (state and size) followed by the payload rounded up to 8
+ * bytes, so a queue of small messages holds many more of them than slots of
+ * block_size would, and one message may take nearly the whole ring. A record
+ * that does not fit before the end of the ring is preceded by a padding
+ * record running to the end, and goes at offset 0. Records move through the
+ * same states as locked-mode slots, under the same lock, with head, tail,
+ * commit_index and release_index as byte offsets and free_blocks counting
+ * free bytes. Padding is skipped by consumers and reclaimed like a released
+ * record.
+ */
+
+static inline uint32_t cqueue_bytes_record(uint32_t size) {
+    return sizeof(cqueue_item_t) + ((size + 7) & ~7u);
+}
+
+static inline cqueue_item_t* cqueue_bytes_at(cqueue_obj_t* obj, uint32_t offset) {
+    return (cqueue_item_t*)((char*)obj->data + offset);
+}
+
+static inline uint32_t cqueue_bytes_advance(cqueue_obj_t* obj, uint32_t offset, uint32_t len) {
+    offset += len;
+    return offset == obj->ring_bytes ? 0 : offset;
+}
+
+// Called with the lock held. Claims a record for size bytes at head, or returns false if there is no room yet.
+static bool cqueue_bytes_claim(cqueue_obj_t* obj, uint32_t size, cqueue_item_t** out) {
+    uint32_t len = cqueue_bytes_record(size);
+
+    // An empty ring starts over at 0, so the largest record always fits in one.
+    if (obj->free_blocks == obj->ring_bytes) {
+        obj->head = 0;
+        obj->tail = 0;
+        obj->commit_index = 0;
+        obj->release_index = 0;
+    }
+
+    if (obj->free_blocks < len)
+        return false;
+
+    uint32_t to_end = obj->ring_bytes - obj->head;
+    if (to_end < len) {
+        // The free bytes run on past the end of the ring; pad to the end and start at 0.
+        if (obj->free_blocks - to_end < len)
+            return false;
+
+        cqueue_item_t* pad = cqueue_bytes_at(obj, obj->head);
+        pad->size = to_end - sizeof(cqueue_item_t);
+        cqueue_slot_set(pad, CQUEUE_SLOT_PAD);
+        obj->head = 0;
+        obj->free_blocks -= to_end;
+        obj->unpublished += to_end;
+    }
+
+    cqueue_item_t* item_ptr = cqueue_bytes_at(obj, obj->head);
+    item_ptr->size = size;
+    cqueue_slot_set(item_ptr, CQUEUE_SLOT_RESERVED);
+    obj->head = cqueue_bytes_advance(obj, obj->head, len);
+    obj->free_blocks -= len;
+    obj->unpublished += len;
+    *out = item_ptr;
+
+    return true;
+}
+
+// Called with the lock held. Makes committed records visible to consumers in order.
+static uint32_t cqueue_bytes_publish(cqueue_obj_t* obj) {
+    uint32_t published = 0;
+
+    while (obj->unpublished > 0) {
+        cqueue_item_t* item_ptr = cqueue_bytes_at(obj, obj->commit_index);
+        uint32_t state = cqueue_slot_get(item_ptr);
+        if (state == CQUEUE_SLOT_COMMITTED) {
+            cqueue_slot_set(item_ptr, CQUEUE_SLOT_PUBLISHED);
+            published++;
+        } else if (state != CQUEUE_SLOT_PAD) {
+            break;
+        }
+
+        uint32_t len = cqueue_bytes_record(item_ptr->size);
+        obj->commit_index = cqueue_bytes_advance(obj, obj->commit_index, len);
+        obj->unpublished -= len;
+    }
+
+    obj->available_msgs += published;
+    STATS_ADD(STATS_STRIPE(obj->stats).enqueued, published);
+    STATS_MAX(STATS_STRIPE(obj->stats).max_depth, obj->available_msgs);
+    return published;
+}
+
+// Called with the lock held and available_msgs > 0. Steps over padding to the oldest published record.
+static cqueue_item_t* cqueue_bytes_front(cqueue_obj_t* obj) {
+    while (true) {
+        cqueue_item_t* item_ptr = cqueue_bytes_at(obj, obj->tail);
+        if (cqueue_slot_get(item_ptr) != CQUEUE_SLOT_PAD)
+            return item_ptr;
+
+        uint32_t len = cqueue_bytes_record(item_ptr->size);
+        cqueue_slot_set(item_ptr, CQUEUE_SLOT_RELEASED);
+        obj->tail = cqueue_bytes_advance(obj, obj->tail, len);
+        obj->unreleased += len;
+    }
+}
+
+// Called with the lock held. Hands the record from cqueue_bytes_front to the caller.
+static void cqueue_bytes_take(cqueue_obj_t* obj, cqueue_item_t* item_ptr) {
+    uint32_t len = cqueue_bytes_record(item_ptr->size);
+
+    cqueue_slot_set(item_ptr, CQUEUE_SLOT_PEEKED);
+    obj->tail = cqueue_bytes_advance(obj, obj->tail, len);
+    obj->unreleased += len;
+    obj->available_msgs -= 1;
+}
+
+// Called with the lock held. Hands released records back to producers in order; returns the bytes freed.
+static uint32_t cqueue_bytes_reclaim(cqueue_obj_t* obj) {
+    uint32_t reclaimed = 0;
+
+    while (obj->unreleased > 0) {
+        cqueue_item_t* item_ptr = cqueue_bytes_at(obj, obj->release_index);
+        if (cqueue_slot_get(item_ptr) != CQUEUE_SLOT_RELEASED)
+            break;
+
+        uint32_t len = cqueue_bytes_record(item_ptr->size);
+        obj->release_index = cqueue_bytes_advance(obj, obj->release_index, len);
+        obj->unreleased -= len;
+        reclaimed += len;
+    }
+
+    obj->free_blocks += reclaimed;
+    return reclaimed;
+}
+
+/*
+ * Segmented mode. Slots live in a chain of malloc'd segments of num_blocks
+ * slots each and follow the locked-mode states and cursors, except that each
+ * cursor is a segment plus an index into it. A producer that reaches the end
+ * of the last segment appends another one instead of waiting for consumers,
+ * so bursts never block; it only waits when max_segments are allocated and
+ * none is spare. Once the release cursor leaves a segment, every slot in it
+ * is reclaimed and it goes onto a short spare list for reuse, or back to
+ * malloc when the list is full. unpublished and unreleased count slots and
+ * bound the publish and reclaim walks, as in byte-ring mode.
+ */
+
+#define CQUEUE_SPARE_SEGMENTS 4
+
+typedef struct cqueue_segment_st {
+    struct cqueue_segment_st* next;
+    uint64_t data[];
+} cqueue_segment_t;
+
+static inline cqueue_item_t* cqueue_seg_slot(cqueue_obj_t* obj, cqueue_segment_t* segment, uint32_t index) {
+    return (cqueue_item_t*)((char*)segment->data + (size_t)index * (obj->block_size + sizeof(cqueue_item_t)));
+}
+
+// free_blocks is what producers wait on: the segments they can still get, plus one while the last has room.
+static void cqueue_seg_room(cqueue_obj_t* obj) {
+    if (obj->max_segments == 0)
+        obj->free_blocks = UINT32_MAX;
+    else
+        obj->free_blocks = obj->num_spare + (obj->max_segments - obj->num_segments) +
+                           (obj->head_segment != NULL && obj->head < obj->num_blocks);
+}
+
+static void cqueue_seg_retire(cqueue_obj_t* obj, cqueue_segment_t* segment) {
+    if (obj->num_spare < CQUEUE_SPARE_SEGMENTS) {
+        segment->next = obj->spare_segments;
+        obj->spare_segments = segment;
+        obj->num_spare++;
+    } else {
+        free(segment);
+        obj->num_segments--;
+    }
+}
+
+// Called with the lock held. Claims the slot at head, appending a segment when the last one is full.
+static rc_t cqueue_seg_claim(cqueue_obj_t* obj, uint32_t size, cqueue_item_t** out) {
+    uint32_t n = obj->num_blocks;
+
+    if (obj->head_segment == NULL || obj->head == n) {
+        cqueue_segment_t* segment = obj->spare_segments;
+        if (segment != NULL) {
+            obj->spare_segments = segment->next;
+            obj->num_spare--;
+        } else {
+            if (obj->max_segments != 0 && obj->num_segments >= obj->max_segments)
+                return QueueFull;
+            segment = malloc(sizeof(cqueue_segment_t) + (size_t)n * (obj->block_size + sizeof(cqueue_item_t)));
+            if (segment == NULL) {
+                fprintf(stderr, "Out of Memory.\n");
+                return OutOfMemory;
+            }
+            obj->num_segments++;
+        }
+        segment->next = NULL;
+
+        if (obj->head_segment == NULL) {
+            obj->commit_segment = segment;
+            obj->tail_segment = segment;
+            obj->release_segment = segment;
+        } else {
+            obj->head_segment->next = segment;
+        }
+        obj->head_segment = segment;
+        obj->head = 0;
+        cqueue_seg_room(obj);
+    }
+
+    cqueue_item_t* item_ptr = cqueue_seg_slot(obj, obj->head_segment, obj->head);
+    item_ptr->size = size;
+    cqueue_slot_set(item_ptr, CQUEUE_SLOT_RESERVED);
+    obj->head++;
+    obj->unpublished++;
+    if (obj->head == n)
+        cqueue_seg_room(obj);
+    *out = item_ptr;
+
+    return Success;
+}
+
+// Called with the lock held. Makes committed slots visible to consumers in order.
+static uint32_t cqueue_seg_publish(cqueue_obj_t* obj) {
+    uint32_t published = 0;
+
+    while (obj->unpublished > 0) {
+        if (obj->commit_index == obj->num_blocks) {
+            obj->commit_segment = obj->commit_segment->next;
+            obj->commit_index = 0;
+        }
+
+        cqueue_item_t* item_ptr = cqueue_seg_slot(obj, obj->commit_segment, obj->commit_index);
+        if (cqueue_slot_get(item_ptr) != CQUEUE_SLOT_COMMITTED)
+            break;
+        cqueue_slot_set(item_ptr, CQUEUE_SLOT_PUBLISHED);
+        obj->commit_index++;
+        obj->unpublished--;
+        published++;
+    }
+
+    obj->available_msgs += published;
+    STATS_ADD(STATS_STRIPE(obj->stats).enqueued, published);
+    STATS_MAX(STATS_STRIPE(obj->stats).max_depth, obj->available_msgs);
+    return published;
+}
+
+// Called with the lock held and available_msgs > 0.
+static cqueue_item_t* cqueue_seg_front(cqueue_obj_t* obj) {
+    if (obj->tail == obj->num_blocks) {
+        obj->tail_segment = obj->tail_segment->next;
+        obj->tail = 0;
+    }
+
+    return cqueue_seg_slot(obj, obj->tail_segment, obj->tail);
+}
+
+static void cqueue_seg_take(cqueue_obj_t* obj, cqueue_item_t* item_ptr) {
+    cqueue_slot_set(item_ptr, CQUEUE_SLOT_PEEKED);
+    obj->tail++;
+    obj->available_msgs -= 1;
+    obj->unreleased++;
+}
+
+// Called with the lock held. Reclaims released slots in order; returns the segments made available again.
+static uint32_t cqueue_seg_reclaim(cqueue_obj_t* obj) {
+    uint32_t retired = 0;
+
+    while (obj->unreleased > 0) {
+        if (obj->release_index == obj->num_blocks) {
+            cqueue_segment_t* drained = obj->release_segment;
+            obj->release_segment = drained->next;
+            obj->release_index = 0;
+            cqueue_seg_retire(obj, drained);
+            retired++;
+        }
+
+        cqueue_item_t* item_ptr = cqueue_seg_slot(obj, obj->release_segment, obj->release_index);
+        if (cqueue_slot_get(item_ptr) != CQUEUE_SLOT_RELEASED)
+            break;
+        cqueue_slot_set(item_ptr, CQUEUE_SLOT_FREE);
+        obj->release_index++;
+        obj->unreleased--;
+    }
+
+    // The last segment is full and everything in it was reclaimed: start it over.
+    if (obj->head == obj->num_blocks && obj->release_segment == obj->head_segment &&
+        obj->release_index == obj->num_blocks) {
+        obj->head = 0;
+        obj->commit_index = 0;
+        obj->tail = 0;
+        obj->release_index = 0;
+        retired++;
+    }
+
+    if (retired > 0)
+        cqueue_seg_room(obj);
+    return retired;
+}
+
+static void cqueue_seg_free_all(cqueue_obj_t* obj) {
+    cqueue_segment_t* lists[2] = { obj->release_segment, obj->spare_segments };
+
+    for (int i = 0; i < 2; i++) {
+        cqueue_segment_t* segment = lists[i];
+        while (segment != NULL) {
+            cqueue_segment_t* next = segment->next;
+            free(segment);
+            segment = next;
+        }
+    }
+}
+
+/*
+ * The byte-ring and segmented modes run the locked-mode protocol over a
+ * different slot layout. These pick the layout; the operations below them
+ * are shared.
+ */
+
+static inline bool cqueue_ext_mode(cqueue_obj_t* obj) {
+    return obj->mode == CqueueModeByteRing || obj->mode == CqueueModeSegmented;
+}
+
+static inline rc_t cqueue_ext_claim(cqueue_obj_t* obj, uint32_t size, cqueue_item_t** out) {
+    if (obj->mode == CqueueModeByteRing)
+        return cqueue_bytes_claim(obj, size, out) ? Success : QueueFull;
+    return cqueue_seg_claim(obj, size, out);
+}
+
+static inline uint32_t cqueue_ext_publish(cqueue_obj_t* obj) {
+    return obj->mode == CqueueModeByteRing ? cqueue_bytes_publish(obj) : cqueue_seg_publish(obj);
+}
+
+static inline cqueue_item_t* cqueue_ext_front(cqueue_obj_t* obj) {
+    return obj->mode == CqueueModeByteRing ? cqueue_bytes_front(obj) : cqueue_seg_front(obj);
+}
+
+static inline void cqueue_ext_take(cqueue_obj_t* obj, cqueue_item_t* item_ptr) {
+    if (obj->mode == CqueueModeByteRing)
+        cqueue_bytes_take(obj, item_ptr);
+    else
+        cqueue_seg_take(obj, item_ptr);
+}
+
+// Returns bytes (byte ring) or segments (segmented) given back to producers.
+static inline uint32_t cqueue_ext_reclaim(cqueue_obj_t* obj) {
+    return obj->mode == CqueueModeByteRing ? cqueue_bytes_reclaim(obj) : cqueue_seg_reclaim(obj);
+}
+
+// Producers wait for different amounts of room, so every one of them re-checks.
+static inline void cqueue_ext_wake_producers(cqueue_obj_t* obj, uint32_t reclaimed) {
+    if (reclaimed > 0 && (obj->mode == CqueueModeByteRing || obj->max_segments != 0))
+        cqueue_locked_wake(obj, &obj->free_blocks, INT_MAX);
+}
+
+// Called with the lock held. Waits until a slot for size bytes can be claimed; the lock is not held on failure.
+static rc_t cqueue_ext_reserve(cqueue_t* handle, uint32_t size, cqueue_item_t** out, timespec_t* deadline) {
+    cqueue_obj_t* obj = handle->obj;
+    bool waited = false;
+    rc_t rc;
+
+    while ((rc = cqueue_ext_claim(obj, size, out)) == QueueFull) {
+        if (!waited) {
+            STATS_ADD(STATS_STRIPE(obj->stats).full_waits, 1);
+            waited = true;
+        }
+
+        // Any change of free_blocks may make room; the value seen is the futex word.
+        uint32_t seen = obj->free_blocks;
+        cqueue_unlock(handle);
+        STATS_ADD(STATS_STRIPE(obj->stats).futex_waits, 1);
+        if (cqueue_futex_wait(&obj->free_blocks, seen, deadline) == Timeout)
+            return Timeout;
+
+        rc = cqueue_lock(handle);
+        if (rc != Success) {
+            fprintf(stderr, "The spin lock was not acquired\n");
+            return rc;
+        }
+    }
+
+    if (rc != Success)
+        cqueue_unlock(handle);
+    return rc;
+}
+
+static rc_t cqueue_ext_enqueue(cqueue_t* handle, void* item, uint32_t size, timespec_t* deadline) {
+    cqueue_item_t* item_ptr;
+
+    rc_t rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+
+    rc = cqueue_ext_reserve(handle, size, &item_ptr, deadline);
+    if (rc != Success)
+        return rc;
+
+    memcpy(&item_ptr->data, item, size);
+    cqueue_slot_set(item_ptr, CQUEUE_SLOT_COMMITTED);
+    uint32_t published = cqueue_ext_publish(handle->obj);
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    }
+
+    if (published > 0)
+        cqueue_locked_wake(handle->obj, &handle->obj->available_msgs, published);
+
+    return Success;
+}
+
+// Copies returned by the dequeue calls come from malloc (cqueue_dequeue) or the slab allocator (cqueue_dequeue_slab).
+static inline void* cqueue_copy_alloc(bool slab, size_t size) {
+    return slab ? slab_alloc(size) : malloc(size);
+}
+
+static inline void cqueue_copy_free(bool slab, void* data) {
+    if (slab)
+        slab_free(data);
+    else
+        free(data);
+}
+
+static rc_t cqueue_ext_dequeue(cqueue_t* handle, uint32_t max_size, void** item, uint32_t* size, timespec_t* deadline,
+                               bool slab) {
+    cqueue_obj_t* obj = handle->obj;
+
+    rc_t rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+
+    rc = cqueue_locked_wait(handle, &obj->available_msgs, deadline);
+    if (rc != Success)
+        return rc;
+
+    cqueue_item_t* item_ptr = cqueue_ext_front(obj);
+    if (item_ptr->size > max_size) {
+        cqueue_unlock(handle);
+        fprintf(stderr, "The item is larger than max_size\n");
+        return InvalidArgument;
+    }
+
+    // Sized to the record, so allocated under the lock; on failure the message stays queued.
+    void* data = cqueue_copy_alloc(slab, item_ptr->size);
+    if (data == NULL) {
+        cqueue_unlock(handle);
+        fprintf(stderr, "Out of Memory.\n");
+        return OutOfMemory;
+    }
+
+    *size = item_ptr->size;
+    memcpy(data, &item_ptr->data, *size);
+    cqueue_ext_take(obj, item_ptr);
+    cqueue_slot_set(item_ptr, CQUEUE_SLOT_RELEASED);
+    cqueue_count_dequeued(obj, 1);
+    uint32_t reclaimed = cqueue_ext_reclaim(obj);
+    *item = data;
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    }
+
+    cqueue_ext_wake_producers(obj, reclaimed);
+    return Success;
+}
+
+static rc_t cqueue_ext_enqueue_batch(cqueue_t* handle, void* items, uint32_t size, uint32_t count, uint32_t* enqueued,
+                                       timespec_t* deadline) {
+    cqueue_obj_t* obj = handle->obj;
+    cqueue_item_t* item_ptr;
+
+    rc_t rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+
+    rc = cqueue_ext_reserve(handle, size, &item_ptr, deadline);
+    if (rc != Success)
+        return rc;
+
+    uint32_t run = 0;
+    do {
+        memcpy(&item_ptr->data, (char*)items + (size_t)run * size, size);
+        cqueue_slot_set(item_ptr, CQUEUE_SLOT_COMMITTED);
+        run++;
+    } while (run < count && cqueue_ext_claim(obj, size, &item_ptr) == Success);
+    uint32_t published = cqueue_ext_publish(obj);
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    }
+
+    if (published > 0)
+        cqueue_locked_wake(obj, &obj->available_msgs, published);
+
+    *enqueued = run;
+    return Success;
+}
+
+static rc_t cqueue_ext_dequeue_batch(cqueue_t* handle, void* items, uint32_t size, uint32_t max_count, uint32_t* dequeued,
+                                       timespec_t* deadline) {
+    cqueue_obj_t* obj = handle->obj;
+
+    rc_t rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+
+    rc = cqueue_locked_wait(handle, &obj->available_msgs, deadline);
+    if (rc != Success)
+        return rc;
+
+    uint32_t run = 0;
+    while (run < max_count && obj->available_msgs > 0) {
+        cqueue_item_t* item_ptr = cqueue_ext_front(obj);
+        if (item_ptr->size > size)
+            break;
+        memcpy((char*)items + (size_t)run * size, &item_ptr->data, item_ptr->size);
+        cqueue_ext_take(obj, item_ptr);
+        cqueue_slot_set(item_ptr, CQUEUE_SLOT_RELEASED);
+        run++;
+    }
+    cqueue_count_dequeued(obj, run);
+    uint32_t reclaimed = cqueue_ext_reclaim(obj);
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    }
+
+    if (run == 0) {
+        fprintf(stderr, "The item is larger than max_size\n");
+        return InvalidArgument;
+    }
+
+    cqueue_ext_wake_producers(obj, reclaimed);
+    *dequeued = run;
+    return Success;
+}
+
+rc_t cqueue_enqueue(cqueue_t* handle, void* item, uint32_t size, timespec_t* timeout) {
+    timespec_t until;
+    timespec_t* deadline = futex_deadline(timeout, &until);
+    rc_t rc;
+    cqueue_item_t* item_ptr;
+
+    if (handle == NULL) {
+        fprintf(stderr, "The handle cannot be NULL\n");
+        return InvalidArgument;
+    } 
+
+    if (item == NULL) {
+        fprintf(stderr, "The item cannot be NULL\n");
+        return InvalidArgument;
+    } 
+
+    if (size == 0) {
+        fprintf(stderr, "The byte_size cannot be zero\n");
+        return InvalidArgument;
+    } 
+
+    if (size > cqueue_max_item(handle->obj)) {
+        fprintf(stderr, "The item cannot fit in the queue\n");
+        return InvalidArgument;
+    }
+
+    if (handle->obj->mode == CqueueModeLockFree) {
+        rc = cqueue_lf_reserve(handle->obj, size, &item_ptr, deadline);
+        if (rc != Success)
+            return rc;
+        memcpy(&item_ptr->data, item, size);
+        cqueue_lf_commit(handle->obj, item_ptr);
+        return Success;
+    }
+
+    if (cqueue_ext_mode(handle->obj))
+        return cqueue_ext_enqueue(handle, item, size, deadline);
+
+    rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+
+    rc = cqueue_locked_reserve(handle, size, &item_ptr, deadline);
+    if (rc != Success)
+        return rc;
+
+    memcpy(&item_ptr->data, item, size);
+    cqueue_slot_set(item_ptr, CQUEUE_SLOT_COMMITTED);
+    uint32_t published = cqueue_locked_publish(handle->obj);
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    }   
+
+    if (published > 0)
+        cqueue_locked_wake(handle->obj, &handle->obj->available_msgs, published);
+
+    return Success;
+}
+
+static rc_t cqueue_dequeue_copy(cqueue_t* handle, uint32_t max_size, void** item, uint32_t* size, timespec_t* timeout,
+                                bool slab) {
+    timespec_t until;
+    timespec_t* deadline = futex_deadline(timeout, &until);
+    rc_t rc;
+    cqueue_item_t* item_ptr;
+
+    if (handle == NULL) {
+        fprintf(stderr, "The handle cannot be NULL\n");
+        return InvalidArgument;
+    } 
+
+    if (item == NULL) {
+        fprintf(stderr, "The item cannot be NULL\n");
+        return InvalidArgument;
+    } 
+
+    if (max_size == 0) {
+        fprintf(stderr, "The max_bytes cannot be zero\n");
+        return InvalidArgument;
+    } 
+
+    if (size == NULL) {
+        fprintf(stderr, "The item size cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    if (cqueue_ext_mode(handle->obj))
+        return cqueue_ext_dequeue(handle, max_size, item, size, deadline, slab);
+
+    // Allocate up front so a failed allocation never drops a claimed message.
+    void* data = cqueue_copy_alloc(slab, max_size < handle->obj->block_size ? max_size : handle->obj->block_size);
+    if (data == NULL) {
+        fprintf(stderr, "Out of Memory.\n");
+        return OutOfMemory;         
+    }
+
+    if (handle->obj->mode == CqueueModeLockFree) {
+        rc = cqueue_lf_peek(handle->obj, max_size, &item_ptr, deadline);
+        if (rc != Success) {
+            cqueue_copy_free(slab, data);
+            return rc;
+        }
+        *size = item_ptr->size;
+        memcpy(data, &item_ptr->data, *size);
+        cqueue_lf_release(handle->obj, item_ptr);
+        *item = data;
+        return Success;
+    }
+
+    rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        cqueue_copy_free(slab, data);
+        return rc;
+    }
+
+    rc = cqueue_locked_peek(handle, max_size, &item_ptr, deadline);
+    if (rc != Success) {
+        cqueue_copy_free(slab, data);
+        return rc;
+    }
+
+    *size = item_ptr->size;
+    memcpy(data, &item_ptr->data, *size);
+    cqueue_slot_set(item_ptr, CQUEUE_SLOT_RELEASED);
+    uint32_t reclaimed = cqueue_locked_reclaim(handle->obj);
+    *item = data;
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    } 
+
+    if (reclaimed > 0)
+        cqueue_locked_wake(handle->obj, &handle->obj->free_blocks, reclaimed);
+ 
+    return Success;
+}
+
+/**
+ * @brief: Takes the oldest item off the queue into a copy the caller owns, waiting while the queue is empty.
+ *
+ * @param: handle -- the queue.
+ * @param: max_size -- the largest item the caller accepts.
+ * @param: item -- receives the copy, allocated with malloc; the caller releases it with free().
+ * @param: size -- receives the item size.
+ * @param: timeout -- optional timeout for the whole call, NULL to wait forever.
+ * @return: the rc_t value (Success, Timeout, InvalidArgument, OutOfMemory)
+*/
+rc_t cqueue_dequeue(cqueue_t* handle, uint32_t max_size, void** item, uint32_t* size, timespec_t* timeout) {
+    return cqueue_dequeue_copy(handle, max_size, item, size, timeout, false);
+}
+
+/**
+ * @brief: Like cqueue_dequeue, but the copy comes from the calling thread's slab cache instead of malloc.
+ *
+ * Cheaper for small items that are released soon; release the copy with cqueue_item_free, never free().
+ *
+ * @return: the rc_t value (Success, Timeout, InvalidArgument, OutOfMemory)
+*/
+rc_t cqueue_dequeue_slab(cqueue_t* handle, uint32_t max_size, void** item, uint32_t* size, timespec_t* timeout) {
+    return cqueue_dequeue_copy(handle, max_size, item, size, timeout, true);
+}
+
+/**
+ * @brief: Releases an item returned by cqueue_dequeue_slab.
+ * 
+ * @param: item -- the item (NULL is ignored).
+*/
+void cqueue_item_free(void* item) {
+    slab_free(item);
+}
+
+/**
+ * @brief: Reserves the next free slot so the caller can write the item in place.
+ * 
+ * The slot is not visible to consumers until cqueue_commit is called on it. Blocks like cqueue_enqueue while the queue is full.
+ * 
+ * @param: handle -- the queue.
+ * @param: size -- the number of bytes that will be written (at most block_size).
+ * @param: slot -- receives a pointer to the slot's payload.
+ * @param: timeout -- optional limit on the whole call, NULL to wait forever.
+ * @return: the rc_t value (Success, Timeout, InvalidArgument etc.)
+*/
+rc_t cqueue_reserve(cqueue_t* handle, uint32_t size, void** slot, timespec_t* timeout) {
+    timespec_t until;
+    timespec_t* deadline = futex_deadline(timeout, &until);
+    rc_t rc;
+    cqueue_item_t* item_ptr;
+
+    if (handle == NULL || slot == NULL) {
+        fprintf(stderr, "The handle and slot cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    if (size == 0 || size > cqueue_max_item(handle->obj)) {
+        fprintf(stderr, "The item cannot fit in the queue\n");
+        return InvalidArgument;
+    }
+
+    if (handle->obj->mode == CqueueModeLockFree) {
+        rc = cqueue_lf_reserve(handle->obj, size, &item_ptr, deadline);
+        if (rc != Success)
+            return rc;
+        *slot = &item_ptr->data;
+        return Success;
+    }
+
+    rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+
+    if (cqueue_ext_mode(handle->obj))
+        rc = cqueue_ext_reserve(handle, size, &item_ptr, deadline);
+    else
+        rc = cqueue_locked_reserve(handle, size, &item_ptr, deadline);
+    if (rc != Success)
+        return rc;
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    }
+
+    *slot = &item_ptr->data;
+    return Success;
+}
+
+/**
+ * @brief: Publishes a slot obtained from cqueue_reserve to consumers.
+ * 
+ * @param: handle -- the queue.
+ * @param: slot -- the pointer returned by cqueue_reserve.
+ * @return: the rc_t value (Success, InvalidArgument etc.)
+*/
+rc_t cqueue_commit(cqueue_t* handle, void* slot) {
+    rc_t rc;
+
+    if (handle == NULL || slot == NULL) {
+        fprintf(stderr, "The handle and slot cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    cqueue_item_t* item_ptr = cqueue_item_of(slot);
+
+    if (handle->obj->mode == CqueueModeLockFree) {
+        cqueue_lf_commit(handle->obj, item_ptr);
+        return Success;
+    }
+
+    rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+
+    cqueue_slot_set(item_ptr, CQUEUE_SLOT_COMMITTED);
+    uint32_t published;
+    if (cqueue_ext_mode(handle->obj))
+        published = cqueue_ext_publish(handle->obj);
+    else
+        published = cqueue_locked_publish(handle->obj);
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    }
+
+    if (published > 0)
+        cqueue_locked_wake(handle->obj, &handle->obj->available_msgs, published);
+
+    return Success;
+}
+
+/**
+ * @brief: Claims the oldest item and returns a pointer to it inside the ring.
+ * 
+ * The slot stays owned by the caller, and cannot be reused by producers, until cqueue_release is called on it. Blocks like cqueue_dequeue while the queue is empty.
+ * 
+ * @param: handle -- the queue.
+ * @param: max_size -- the largest item the caller accepts.
+ * @param: item -- receives a pointer to the slot's payload.
+ * @param: size -- receives the item size.
+ * @param: timeout -- optional limit on the whole call, NULL to wait forever.
+ * @return: the rc_t value (Success, Timeout, InvalidArgument etc.)
+*/
+rc_t cqueue_peek(cqueue_t* handle, uint32_t max_size, void** item, uint32_t* size, timespec_t* timeout) {
+    timespec_t until;
+    timespec_t* deadline = futex_deadline(timeout, &until);
+    rc_t rc;
+    cqueue_item_t* item_ptr;
+
+    if (handle == NULL || item == NULL || size == NULL) {
+        fprintf(stderr, "The handle, item and size cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    if (handle->obj->mode == CqueueModeLockFree) {
+        rc = cqueue_lf_peek(handle->obj, max_size, &item_ptr, deadline);
+        if (rc != Success)
+            return rc;
+        *item = &item_ptr->data;
+        *size = item_ptr->size;
+        return Success;
+    }
+
+    rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+
+    if (cqueue_ext_mode(handle->obj)) {
+        rc = cqueue_locked_wait(handle, &handle->obj->available_msgs, deadline);
+        if (rc != Success)
+            return rc;
+
+        item_ptr = cqueue_ext_front(handle->obj);
+        if (item_ptr->size > max_size) {
+            cqueue_unlock(handle);
+            fprintf(stderr, "The item is larger than max_size\n");
+            return InvalidArgument;
+        }
+        cqueue_ext_take(handle->obj, item_ptr);
+        cqueue_count_dequeued(handle->obj, 1);
+    } else {
+        rc = cqueue_locked_peek(handle, max_size, &item_ptr, deadline);
+        if (rc != Success)
+            return rc;
+    }
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    }
+
+    *item = &item_ptr->data;
+    *size = item_ptr->size;
+    return Success;
+}
+
+/**
+ * @brief: Returns a slot obtained from cqueue_peek to producers.
+ * 
+ * @param: handle -- the queue.
+ * @param: item -- the pointer returned by cqueue_peek.
+ * @return: the rc_t value (Success, InvalidArgument etc.)
+*/
+rc_t cqueue_release(cqueue_t* handle, void* item) {
+    rc_t rc;
+
+    if (handle == NULL || item == NULL) {
+        fprintf(stderr, "The handle and item cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    cqueue_item_t* item_ptr = cqueue_item_of(item);
+
+    if (handle->obj->mode == CqueueModeLockFree) {
+        cqueue_lf_release(handle->obj, item_ptr);
+        return Success;
+    }
+
+    rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+
+    cqueue_slot_set(item_ptr, CQUEUE_SLOT_RELEASED);
+
+    if (cqueue_ext_mode(handle->obj)) {
+        uint32_t reclaimed = cqueue_ext_reclaim(handle->obj);
+
+        rc = cqueue_unlock(handle);
+        if (rc != Success) {
+            fprintf(stderr, "The spin lock was not released\n");
+            return rc;
+        }
+
+        cqueue_ext_wake_producers(handle->obj, reclaimed);
+        return Success;
+    }
+
+    uint32_t reclaimed = cqueue_locked_reclaim(handle->obj);
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    }
+
+    if (reclaimed > 0)
+        cqueue_locked_wake(handle->obj, &handle->obj->free_blocks, reclaimed);
+
+    return Success;
+}
+
+/*
+ * Batched lock-free claims. The slots pos .. pos + count - 1 are all in the
+ * wanted state only while nobody has moved the position counter past them, so
+ * one CAS on the counter claims the whole run.
+ */
+
+static rc_t cqueue_lf_claim_run(cqueue_obj_t* obj, atomic_uint* position, uint32_t offset, uint32_t max_count,
+                                uint32_t max_size, atomic_uint* word, atomic_uint* waiters,
+                                uint32_t* first, uint32_t* count, timespec_t* deadline) {
+    uint32_t mask = obj->num_blocks - 1;
+    uint32_t pos = atomic_load_explicit(position, memory_order_relaxed);
+
+    while (true) {
+        uint32_t run = 0;
+        int32_t diff = 0;
+        while (run < max_count) {
+            cqueue_item_t* slot = cqueue_slot(obj, (pos + run) & mask);
+            uint32_t seq = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+            diff = (int32_t)(seq - (pos + run + offset));
+            if (diff != 0)
+                break;
+            if (offset == 1 && __atomic_load_n(&slot->size, __ATOMIC_RELAXED) > max_size) {
+                if (run == 0) {
+                    fprintf(stderr, "The item is larger than max_size\n");
+                    return InvalidArgument;
+                }
+                break;
+            }
+            run++;
+        }
+
+        if (run > 0) {
+            if (atomic_compare_exchange_weak_explicit(position, &pos, pos + run,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *first = pos;
+                *count = run;
+                return Success;
+            }
+        } else if (diff < 0) {
+            rc_t rc = cqueue_lf_wait(word, waiters, position, obj, offset, deadline);
+            if (rc != Success)
+                return rc;
+            pos = atomic_load_explicit(position, memory_order_relaxed);
+        } else {
+            pos = atomic_load_explicit(position, memory_order_relaxed);
+        }
+    }
+}
+
+/**
+ * @brief: Enqueues up to count fixed-size items in one critical section.
+ * 
+ * Blocks until at least one slot is free, then copies as many items as fit and wakes that many consumers with a single FUTEX_WAKE.
+ * 
+ * @param: handle -- the queue.
+ * @param: items -- count items of size bytes each, laid out contiguously.
+ * @param: size -- the size of each item (at most block_size).
+ * @param: count -- the number of items offered.
+ * @param: enqueued -- receives the number of items actually enqueued (at least 1 on Success).
+ * @param: timeout -- optional limit on the whole call, NULL to wait forever.
+ * @return: the rc_t value (Success, Timeout, InvalidArgument etc.)
+*/
+rc_t cqueue_enqueue_batch(cqueue_t* handle, void* items, uint32_t size, uint32_t count, uint32_t* enqueued, timespec_t* timeout) {
+    timespec_t until;
+    timespec_t* deadline = futex_deadline(timeout, &until);
+    rc_t rc;
+
+    if (handle == NULL || items == NULL || enqueued == NULL) {
+        fprintf(stderr, "The handle, items and enqueued cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    if (size == 0 || size > cqueue_max_item(handle->obj) || count == 0) {
+        fprintf(stderr, "The items cannot fit in the queue\n");
+        return InvalidArgument;
+    }
+
+    cqueue_obj_t* obj = handle->obj;
+
+    if (obj->mode == CqueueModeLockFree) {
+        uint32_t first, run;
+        rc = cqueue_lf_claim_run(obj, &obj->enqueue_pos, 0, count, 0, &obj->not_full, &obj->full_waiters,
+                                 &first, &run, deadline);
+        if (rc != Success)
+            return rc;
+
+        for (uint32_t i = 0; i < run; i++) {
+            cqueue_item_t* slot = cqueue_slot(obj, (first + i) & (obj->num_blocks - 1));
+            __atomic_store_n(&slot->size, size, __ATOMIC_RELAXED);
+            memcpy(&slot->data, (char*)items + (size_t)i * size, size);
+            atomic_store(&slot->sequence, first + i + 1);
+        }
+        cqueue_lf_count_enqueued(obj, run, first + run);
+
+        cqueue_futex_wake(obj, &obj->not_empty, &obj->empty_waiters, run);
+        *enqueued = run;
+        return Success;
+    }
+
+    if (cqueue_ext_mode(obj))
+        return cqueue_ext_enqueue_batch(handle, items, size, count, enqueued, deadline);
+
+    rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+
+    rc = cqueue_locked_wait(handle, &obj->free_blocks, deadline);
+    if (rc != Success)
+        return rc;
+
+    uint32_t run = count < obj->free_blocks ? count : obj->free_blocks;
+    for (uint32_t i = 0; i < run; i++) {
+        cqueue_item_t* slot = cqueue_slot(obj, obj->head);
+        slot->size = size;
+        memcpy(&slot->data, (char*)items + (size_t)i * size, size);
+        cqueue_slot_set(slot, CQUEUE_SLOT_COMMITTED);
+        obj->head = (obj->head + 1) % obj->num_blocks;
+    }
+    obj->free_blocks -= run;
+    uint32_t published = cqueue_locked_publish(obj);
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    }
+
+    if (published > 0)
+        cqueue_locked_wake(obj, &obj->available_msgs, published);
+
+    *enqueued = run;
+    return Success;
+}
+
+/**
+ * @brief: Dequeues up to max_count items in one critical section.
+ * 
+ * Blocks until at least one item is available, then copies as many as are available (up to max_count) into items and wakes that many producers with a single FUTEX_WAKE.
+ * 
+ * @param: handle -- the queue.
+ * @param: items -- buffer for max_count items of size bytes each.
+ * @param: size -- the stride of the buffer; every dequeued item must be at most this large.
+ * @param: max_count -- the capacity of the buffer in items.
+ * @param: dequeued -- receives the number of items copied out (at least 1 on Success).
+ * @param: timeout -- optional limit on the whole call, NULL to wait forever.
+ * @return: the rc_t value (Success, Timeout, InvalidArgument etc.)
+*/
+rc_t cqueue_dequeue_batch(cqueue_t* handle, void* items, uint32_t size, uint32_t max_count, uint32_t* dequeued, timespec_t* timeout) {
+    timespec_t until;
+    timespec_t* deadline = futex_deadline(timeout, &until);
+    rc_t rc;
+
+    if (handle == NULL || items == NULL || dequeued == NULL) {
+        fprintf(stderr, "The handle, items and dequeued cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    if (size == 0 || max_count == 0) {
+        fprintf(stderr, "The size and max_count cannot be zero\n");
+        return InvalidArgument;
+    }
+
+    cqueue_obj_t* obj = handle->obj;
+
+    if (obj->mode == CqueueModeLockFree) {
+        uint32_t first, run;
+        rc = cqueue_lf_claim_run(obj, &obj->dequeue_pos, 1, max_count, size, &obj->not_empty, &obj->empty_waiters,
+                                 &first, &run, deadline);
+        if (rc != Success)
+            return rc;
+
+        for (uint32_t i = 0; i < run; i++) {
+            cqueue_item_t* slot = cqueue_slot(obj, (first + i) & (obj->num_blocks - 1));
+            memcpy((char*)items + (size_t)i * size, &slot->data, slot->size);
+            atomic_store(&slot->sequence, first + i + obj->num_blocks);
+        }
+        cqueue_count_dequeued(obj, run);
+
+        cqueue_futex_wake(obj, &obj->not_full, &obj->full_waiters, run);
+        *dequeued = run;
+        return Success;
+    }
+
+    if (cqueue_ext_mode(obj))
+        return cqueue_ext_dequeue_batch(handle, items, size, max_count, dequeued, deadline);
+
+    rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+
+    rc = cqueue_locked_wait(handle, &obj->available_msgs, deadline);
+    if (rc != Success)
+        return rc;
+
+    uint32_t run = 0;
+    while (run < max_count && run < obj->available_msgs) {
+        cqueue_item_t* slot = cqueue_slot(obj, obj->tail);
+        if (slot->size > size)
+            break;
+        memcpy((char*)items + (size_t)run * size, &slot->data, slot->size);
+        cqueue_slot_set(slot, CQUEUE_SLOT_RELEASED);
+        obj->tail = (obj->tail + 1) % obj->num_blocks;
+        run++;
+    }
+    obj->available_msgs -= run;
+    cqueue_count_dequeued(obj, run);
+    uint32_t reclaimed = cqueue_locked_reclaim(obj);
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    }
+
+    if (run == 0) {
+        fprintf(stderr, "The item is larger than max_size\n");
+        return InvalidArgument;
+    }
+
+    if (reclaimed > 0)
+        cqueue_locked_wake(obj, &obj->free_blocks, reclaimed);
+
+    *dequeued = run;
+    return Success;
+}
+
+rc_t cqueue_size(cqueue_t* handle, uint32_t* size) {
+    rc_t rc;
+
+    if (handle == NULL) {
+        fprintf(stderr, "The handle cannot be NULL\n");
+        return InvalidArgument;
+    } 
+
+    if (size == NULL) {
+        fprintf(stderr, "The size cannot be NULL\n");
+        return InvalidArgument;
+    } 
+
+    if (handle->obj->mode == CqueueModeLockFree) {
+        uint32_t dequeue_pos = atomic_load(&handle->obj->dequeue_pos);
+        int32_t pending = (int32_t)(atomic_load(&handle->obj->enqueue_pos) - dequeue_pos);
+        if (pending < 0)
+            pending = 0;
+        if (pending > (int32_t)handle->obj->num_blocks)
+            pending = handle->obj->num_blocks;
+        *size = pending;
+        return Success;
+    }
+
+    rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+
+    *size = handle->obj->available_msgs;
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    } 
+        
+    return Success;
+}
+
+/**
+ * @brief: Tells whether a shared locked queue rolled back a critical section of a holder that died.
+ * 
+ * Takes the lock first, so a section the holder left unfinished is rolled back now if nobody did so yet. Each rollback is reported once.
+ * 
+ * @param: handle -- the queue, with a robust lock.
+ * @param: tid -- the thread id of the dead holder.
+ * @param: rolled_back -- receives whether a section of tid was rolled back.
+ * @return: the rc_t value (Success, InvalidArgument etc.)
+*/
+rc_t cqueue_rolled_back(cqueue_t* handle, int tid, bool* rolled_back) {
+    rc_t rc;
+
+    if (handle == NULL || rolled_back == NULL || tid <= 0) {
+        fprintf(stderr, "The handle and rolled_back cannot be NULL and tid must be positive\n");
+        return InvalidArgument;
+    }
+
+    *rolled_back = false;
+    if (handle->obj->mode != CqueueModeLocked || handle->obj->lock_obj.kind != SpinlockKindRobust)
+        return Success;
+
+    rc = cqueue_lock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+
+    cqueue_obj_t* obj = handle->obj;
+    for (int i = 0; i < CQUEUE_ROLLBACK_HISTORY; i++) {
+        if (obj->rolled_back[i] == tid) {
+            obj->rolled_back[i] = 0;
+            *rolled_back = true;
+            break;
+        }
+    }
+
+    rc = cqueue_unlock(handle);
+    if (rc != Success) {
+        fprintf(stderr, "The spin lock was not released\n");
+        return rc;
+    }
+
+    return Success;
+}
+
+/**
+ * @brief: Sums the queue's counters and those of its lock.
+ * 
+ * @param: handle -- the queue.
+ * @param: stats -- receives the totals since the queue was initialized and the current depth.
+ * @return: the rc_t value (Success, InvalidArgument, InvalidOperation when built with POOL_NO_STATS)
+*/
+rc_t cqueue_stats(cqueue_t* handle, cqueue_stats_t* stats) {
+    if (handle == NULL || stats == NULL) {
+        fprintf(stderr, "The handle and stats cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    memset(stats, 0, sizeof(cqueue_stats_t));
+
+#ifdef POOL_STATS
+    for (int i = 0; i < STATS_STRIPES; i++) {
+        cqueue_counters_t* stripe = &handle->obj->stats[i];
+        stats->enqueued += stats_load(&stripe->enqueued);
+        stats->dequeued += stats_load(&stripe->dequeued);
+        stats->full_waits += stats_load(&stripe->full_waits);
+        stats->empty_waits += stats_load(&stripe->empty_waits);
+        stats->futex_waits += stats_load(&stripe->futex_waits);
+        stats->futex_wakes += stats_load(&stripe->futex_wakes);
+        uint64_t max_depth = stats_load(&stripe->max_depth);
+        if (max_depth > stats->max_depth)
+            stats->max_depth = max_depth;
+    }
+
+    rc_t rc = cqueue_size(handle, &stats->depth);
+    if (rc != Success)
+        return rc;
+
+    return spinlock_stats(&handle->lock, &stats->lock);
+#else
+    fprintf(stderr, "The counters were compiled out (POOL_NO_STATS)\n");
+    return InvalidOperation;
+#endif
+}
+
+/**
+ * @brief: Prepares to sleep until the queue has an item, unless it has one already.
+ * 
+ * The caller counts as a watcher from here on, so producers wake every sleeper instead of as many as there are new items: a wake the caller took need not turn into a dequeue, and would otherwise be lost to a blocked consumer. In lock-free mode it also counts as an empty-queue waiter, so producers bump not_empty and wake at all. cqueue_unwatch ends both.
+ * 
+ * @param: handle -- the queue.
+ * @param: watch -- receives the futex word and the value to sleep on.
+ * @param: available -- set to true if an item is there; nothing is left to unwatch then.
+ * @return: the rc_t value (Success, or the lock's error)
+*/
+static rc_t cqueue_watch(cqueue_t* handle, futex_watch_t* watch, bool* available) {
+    cqueue_obj_t* obj = handle->obj;
+
+    watch->flags = FUTEX_32;
+    watch->reserved = 0;
+
+    if (obj->mode == CqueueModeLockFree) {
+        watch->uaddr = (uintptr_t)&obj->not_empty;
+        watch->val = atomic_load(&obj->not_empty);
+        atomic_fetch_add(&obj->watchers, 1);
+        atomic_fetch_add(&obj->empty_waiters, 1);
+
+        // Recheck after registering, as in cqueue_lf_wait.
+        uint32_t p = atomic_load(&obj->dequeue_pos);
+        uint32_t seq = atomic_load(&cqueue_slot(obj, p & (obj->num_blocks - 1))->sequence);
+        *available = (int32_t)(seq - (p + 1)) >= 0;
+        if (*available) {
+            atomic_fetch_sub(&obj->empty_waiters, 1);
+            atomic_fetch_sub(&obj->watchers, 1);
+        }
+        return Success;
+    }
+
+    // Registered before the check under the lock, so a publish after it sees the watcher.
+    atomic_fetch_add(&obj->watchers, 1);
+    rc_t rc = cqueue_lock(handle);
+    if (rc != Success) {
+        atomic_fetch_sub(&obj->watchers, 1);
+        fprintf(stderr, "The spin lock was not acquired\n");
+        return rc;
+    }
+    uint32_t available_msgs = obj->available_msgs;
+    cqueue_unlock(handle);
+
+    watch->uaddr = (uintptr_t)&obj->available_msgs;
+    watch->val = 0;
+    *available = available_msgs != 0;
+    if (*available)
+        atomic_fetch_sub(&obj->watchers, 1);
+    return Success;
+}
+
+static void cqueue_unwatch(cqueue_t* handle) {
+    if (handle->obj->mode == CqueueModeLockFree)
+        atomic_fetch_sub(&handle->obj->empty_waiters, 1);
+    atomic_fetch_sub(&handle->obj->watchers, 1);
+}
+
+/**
+ * @brief: Waits until at least one of several queues has an item, or an absolute deadline passes.
+ * 
+ * One thread can serve several queues this way without polling them: it sleeps on all of their futex words at once with futex_waitv. Nothing is dequeued, and another consumer may take the item first, so dequeue with a zero timeout and wait again when that times out. On kernels without futex_waitv, and on a fiber, the wait takes turns over the queues, CQUEUE_WAIT_ANY_SLICE_NSECS at a time.
+ * 
+ * @param: queues -- the queues, in any mode.
+ * @param: count -- the number of queues, at most CQUEUE_WAIT_ANY_MAX.
+ * @param: index -- receives the index of a queue that had an item.
+ * @param: deadline -- absolute CLOCK_MONOTONIC time to give up at, NULL to wait forever.
+ * @return: the rc_t value (Success, Timeout, InvalidArgument, Error)
+*/
+rc_t cqueue_wait_any(cqueue_t* queues[], int count, int* index, timespec_t* deadline) {
+    futex_watch_t watches[CQUEUE_WAIT_ANY_MAX];
+    int turn = 0;
+    rc_t rc;
+
+    if (queues == NULL || index == NULL || count <= 0 || count > CQUEUE_WAIT_ANY_MAX) {
+        fprintf(stderr, "Between 1 and %d queues can be waited on, and index cannot be NULL\n", CQUEUE_WAIT_ANY_MAX);
+        return InvalidArgument;
+    }
+
+    while (true) {
+        int watched = 0;
+        bool available = false;
+
+        for (; watched < count; watched++) {
+            rc = cqueue_watch(queues[watched], &watches[watched], &available);
+            if (rc != Success || available)
+                break;
+        }
+
+        if (watched < count) {
+            for (int i = 0; i < watched; i++)
+                cqueue_unwatch(queues[i]);
+            if (rc != Success)
+                return rc;
+            *index = watched;
+            return Success;
+        }
+
+        // A fiber cannot park on several words, so it takes the turns below, parking on one queue at a time.
+        int error = ENOSYS;
+        if (fiber_current() == NULL) {
+            long frc = syscall(SYS_futex_waitv, watches, count, 0, deadline, CLOCK_MONOTONIC);
+            error = frc == -1 ? errno : 0;
+        }
+
+        if (error == ENOSYS) {
+            timespec_t slice_length = { 0, CQUEUE_WAIT_ANY_SLICE_NSECS };
+            timespec_t slice;
+            futex_deadline(&slice_length, &slice);
+            bool last = deadline != NULL && !futex_before(&slice, deadline);
+            futex_watch_t* watch = &watches[turn++ % count];
+            if (cqueue_futex_wait((void*)(uintptr_t)watch->uaddr, (uint32_t)watch->val, last ? deadline : &slice) == Timeout && last)
+                error = ETIMEDOUT;
+        }
+
+        for (int i = 0; i < count; i++)
+            cqueue_unwatch(queues[i]);
+
+        if (error == ETIMEDOUT)
+            return Timeout;
+
+        // EAGAIN: a word had already moved; EINTR: a signal. Anything else would fail the same way again.
+        if (error != 0 && error != EAGAIN && error != EINTR && error != ENOSYS) {
+            fprintf(stderr, "The futex_waitv call failed, errno was %d\n", error);
+            return Error;
+        }
+    }
+}
@@ -3,31 +3,123 @@
 
 #include "rc.h"
 #include "spinlock.h"
+#include "stats.h"
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#define CQUEUE_CACHE_LINE 64
+#define CQUEUE_WAIT_ANY_MAX 128    // queues one cqueue_wait_any call can sleep on (FUTEX_WAITV_MAX)
+#define CQUEUE_ROLLBACK_HISTORY 8  // rolled-back holders a shared queue remembers for cqueue_rolled_back
 
 typedef struct timespec timespec_t;
 
+typedef enum cqueue_mode_st {
+    CqueueModeLocked,    // spinlock around head/tail updates
+    CqueueModeLockFree,  // MPMC ring with per-slot sequence numbers, num_blocks must be a power of two
+    CqueueModeByteRing,  // locked; variable-length records packed into (block_size + 8) * num_blocks bytes
+    CqueueModeSegmented, // locked; grows by segments of num_blocks slots up to max_segments (0: unbounded)
+} cqueue_mode_t;
+
 typedef struct cqueue_attr_st {
     uint32_t block_size;
     uint32_t num_blocks;
+    cqueue_mode_t mode;
     spinlock_attrs_t lock_attrs;
+    uint32_t max_segments;     // segmented mode: high-water mark in segments, 0 for unbounded
 } cqueue_attr_t;
 
+typedef struct cqueue_stats_st {
+    uint64_t enqueued;
+    uint64_t dequeued;
+    uint64_t full_waits;      // times a producer found the queue full and had to wait
+    uint64_t empty_waits;     // times a consumer found the queue empty and had to wait
+    uint64_t futex_waits;
+    uint64_t futex_wakes;
+    uint32_t depth;           // messages queued when the snapshot was taken
+    uint32_t max_depth;
+    spinlock_stats_t lock;    // locked mode
+} cqueue_stats_t;
+
+#ifdef POOL_STATS
+typedef struct cqueue_counters_st {
+    atomic_uint_fast64_t enqueued;
+    atomic_uint_fast64_t dequeued;
+    atomic_uint_fast64_t full_waits;
+    atomic_uint_fast64_t empty_waits;
+    atomic_uint_fast64_t futex_waits;
+    atomic_uint_fast64_t futex_wakes;
+    atomic_uint_fast64_t max_depth;
+    char pad[STATS_CACHE_LINE - 7 * sizeof(atomic_uint_fast64_t)];
+} cqueue_counters_t;
+#endif
+
+// Locked-mode cursors, saved by every holder of a robust lock when it takes the lock.
+typedef struct cqueue_cursors_st {
+    uint32_t head;
+    uint32_t tail;
+    uint32_t commit_index;
+    uint32_t release_index;
+    uint32_t available_msgs;
+    uint32_t free_blocks;
+} cqueue_cursors_t;
+
 typedef struct cqueue_obj_st {
     uint32_t head;
     uint32_t tail;
+    uint32_t commit_index;
+    uint32_t release_index;
     uint32_t available_msgs;
     uint32_t free_blocks;
     uint32_t num_blocks;
     uint32_t block_size;
+    uint32_t mode;
+    uint32_t ring_bytes;     // byte-ring mode: capacity; the cursors above are byte offsets
+    uint32_t unpublished;    // byte-ring mode: bytes, segmented mode: slots between commit_index and head
+    uint32_t unreleased;     // byte-ring mode: bytes, segmented mode: slots between release_index and tail
+
+    // Segmented mode: the cursors above index into these segments; free_blocks counts segments still obtainable.
+    struct cqueue_segment_st* head_segment;
+    struct cqueue_segment_st* commit_segment;
+    struct cqueue_segment_st* tail_segment;
+    struct cqueue_segment_st* release_segment;
+    struct cqueue_segment_st* spare_segments;
+    uint32_t num_segments;   // allocated, spares included
+    uint32_t num_spare;
+    uint32_t max_segments;
+    atomic_uint watchers;    // cqueue_wait_any callers watching the queue
     spinlock_obj_t lock_obj;
+
+    // Shared queues only: what the critical section in progress started from, for rolling it back.
+    cqueue_cursors_t saved;
+    uint32_t saved_valid;
+    int saved_owner;                            // the thread id of the section's holder
+    int rolled_back[CQUEUE_ROLLBACK_HISTORY];   // holders of the last sections rolled back, for cqueue_rolled_back
+    uint32_t rollbacks;
+
+    // Lock-free mode only. Producers and consumers each get their own line.
+    char pad0[CQUEUE_CACHE_LINE];
+    atomic_uint enqueue_pos;
+    atomic_uint full_waiters;
+    atomic_uint not_full;
+    char pad1[CQUEUE_CACHE_LINE - 3 * sizeof(atomic_uint)];
+    atomic_uint dequeue_pos;
+    atomic_uint empty_waiters;
+    atomic_uint not_empty;
+    char pad2[CQUEUE_CACHE_LINE - 3 * sizeof(atomic_uint)];
+
+#ifdef POOL_STATS
+    cqueue_counters_t stats[STATS_STRIPES];
+#endif
+
     uint64_t data[];
 } cqueue_obj_t;
 
 typedef struct cqueue_st {
     cqueue_obj_t* obj;
     spinlock_t lock;
+    size_t mapped_bytes;       // non-zero when obj is a shared memory mapping
 } cqueue_t;
 
 rc_t cqueue_attr_init(cqueue_attr_t* attrs);
@@ -35,8 +127,23 @@ rc_t cqueue_alloc_size(cqueue_attr_t* attrs, int* required_bytes);
 rc_t cqueue_init(cqueue_t* queue, cqueue_obj_t* obj, cqueue_attr_t* attrs);
 rc_t cqueue_create(cqueue_t* queue, cqueue_attr_t* attrs);
 rc_t cqueue_destroy(cqueue_t* queue);
+rc_t cqueue_create_shared(cqueue_t* queue, const char* name, cqueue_attr_t* attrs);
+rc_t cqueue_open_shared(cqueue_t* queue, const char* name);
+rc_t cqueue_unlink_shared(const char* name);
 rc_t cqueue_enqueue(cqueue_t* queue, void* item, uint32_t size, timespec_t* timeout);
 rc_t cqueue_dequeue(cqueue_t* handle, uint32_t max_bytes, void** item, uint32_t* size, timespec_t* timeout);
+// The item returned by cqueue_dequeue_slab comes from the slab allocator; release it with cqueue_item_free.
+rc_t cqueue_dequeue_slab(cqueue_t* handle, uint32_t max_bytes, void** item, uint32_t* size, timespec_t* timeout);
+void cqueue_item_free(void* item);
+rc_t cqueue_enqueue_batch(cqueue_t* queue, void* items, uint32_t size, uint32_t count, uint32_t* enqueued, timespec_t* timeout);
+rc_t cqueue_dequeue_batch(cqueue_t* queue, void* items, uint32_t size, uint32_t max_count, uint32_t* dequeued, timespec_t* timeout);
+rc_t cqueue_reserve(cqueue_t* queue, uint32_t size, void** slot, timespec_t* timeout);
+rc_t cqueue_commit(cqueue_t* queue, void* slot);
+rc_t cqueue_peek(cqueue_t* queue, uint32_t max_bytes, void** item, uint32_t* size, timespec_t* timeout);
+rc_t cqueue_release(cqueue_t* queue, void* item);
 rc_t cqueue_size(cqueue_t* queue, uint32_t* size);
+rc_t cqueue_stats(cqueue_t* queue, cqueue_stats_t* stats);
+rc_t cqueue_wait_any(cqueue_t* queues[], int count, int* index, timespec_t* deadline);
+rc_t cqueue_rolled_back(cqueue_t* queue, int tid, bool* rolled_back);
 
 #endif
\ No newline at end of file
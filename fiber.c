@@ -0,0 +1,396 @@
+#include "fiber.h"
+#include "futex.h"
+#include <stdio.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Add -DFIBER_UCONTEXT to CFLAGS to switch with ucontext on x86-64 too.
+#if defined(__x86_64__) && !defined(FIBER_UCONTEXT)
+#define FIBER_ASM 1
+#else
+#define FIBER_ASM 0
+#include <ucontext.h>
+#endif
+
+#ifdef __SANITIZE_THREAD__
+void* __tsan_get_current_fiber(void);
+void* __tsan_create_fiber(unsigned flags);
+void __tsan_destroy_fiber(void* fiber);
+void __tsan_switch_to_fiber(void* fiber, unsigned flags);
+#endif
+
+// The fiber the calling thread is running, NULL on the thread's own stack.
+static _Thread_local fiber_t* fiber_running;
+#if FIBER_ASM
+static _Thread_local void* fiber_thread_context;     // the thread's stack pointer while a fiber runs
+#else
+static _Thread_local ucontext_t fiber_thread_context;
+#endif
+#ifdef __SANITIZE_THREAD__
+static _Thread_local void* fiber_thread_tsan;
+#endif
+
+#if FIBER_ASM
+/*
+ * fiber_switch(save, load): pushes the callee-saved registers and the SSE and
+ * x87 control words, stores the stack pointer in *save, and pops the same
+ * from load. Everything else is caller-saved, so the call itself spills it.
+ */
+void fiber_switch(void** save, void* load);
+__asm__(
+    ".text\n"
+    ".p2align 4\n"
+    ".globl fiber_switch\n"
+    ".hidden fiber_switch\n"
+    ".type fiber_switch, @function\n"
+    "fiber_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    subq $8, %rsp\n"
+    "    stmxcsr (%rsp)\n"
+    "    fnstcw 4(%rsp)\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq %rsi, %rsp\n"
+    "    ldmxcsr (%rsp)\n"
+    "    fldcw 4(%rsp)\n"
+    "    addq $8, %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size fiber_switch, .-fiber_switch\n");
+
+// MXCSR and the x87 control word at their power-on defaults, as fiber_switch stores them.
+#define FIBER_CONTROL_WORDS (0x1f80ull | (0x037full << 32))
+#endif
+
+// Reads a futex word as the kernel would; its writers need not use atomics (cqueue's locked counters do not).
+__attribute__((no_sanitize_thread))
+static uint32_t fiber_load(void* word) {
+    uint32_t value = *(volatile uint32_t*) word;
+    atomic_thread_fence(memory_order_acquire);
+    return value;
+}
+
+static void fiber_poll_deadline(struct timespec* deadline) {
+    struct timespec poll = { 0, FIBER_POLL_NSECS };
+    futex_deadline(&poll, deadline);
+}
+
+// Switches from the thread to the fiber, until the fiber parks or its function returns.
+static void fiber_switch_in(fiber_t* fiber) {
+    fiber_running = fiber;
+#ifdef __SANITIZE_THREAD__
+    fiber_thread_tsan = __tsan_get_current_fiber();
+    __tsan_switch_to_fiber(fiber->tsan_fiber, 0);
+#endif
+#if FIBER_ASM
+    fiber_switch(&fiber_thread_context, fiber->context);
+#else
+    swapcontext(&fiber_thread_context, (ucontext_t*) fiber->context);
+#endif
+    fiber_running = NULL;
+}
+
+// Switches from the running fiber back to the thread that resumed it.
+static void fiber_switch_out(fiber_t* fiber) {
+#ifdef __SANITIZE_THREAD__
+    __tsan_switch_to_fiber(fiber_thread_tsan, 0);
+#endif
+#if FIBER_ASM
+    fiber_switch(&fiber->context, fiber_thread_context);
+#else
+    swapcontext((ucontext_t*) fiber->context, &fiber_thread_context);
+#endif
+}
+
+// The bottom frame of every fiber: runs one function per fiber_run, for as long as the fiber is reused.
+static void fiber_entry(void) {
+
+    fiber_t* self = fiber_running;
+
+    while (true) {
+        self->function(self->arg);
+        self->function = NULL;
+        fiber_switch_out(self);
+    }
+}
+
+/**
+ * @brief: Maps a fiber's stack, with a guard page below it, and prepares the fiber to run functions.
+ *
+ * The stack is only backed by memory as deep as the functions run on it go, so a fiber costs little more than its first pages.
+ *
+ * @param: fiber -- the fiber.
+ * @param: stack_bytes -- usable stack, at least FIBER_MIN_STACK; 0 for FIBER_DEFAULT_STACK.
+ * @return: the rc_t value (Success, InvalidArgument, OutOfMemory)
+*/
+rc_t fiber_create(fiber_t* fiber, size_t stack_bytes) {
+
+    if (fiber == NULL) {
+        fprintf(stderr, "The fiber cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (stack_bytes == 0)
+        stack_bytes = FIBER_DEFAULT_STACK;
+    if (stack_bytes < FIBER_MIN_STACK) {
+        fprintf(stderr, "A fiber stack needs at least %d bytes.\n", FIBER_MIN_STACK);
+        return InvalidArgument;
+    }
+
+    size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    size_t bytes = (stack_bytes + page - 1) / page * page + page;
+
+    void* stack = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        fprintf(stderr, "Out of Memory\n");
+        return OutOfMemory;
+    }
+
+    if (mprotect(stack, page, PROT_NONE) != 0) {
+        fprintf(stderr, "Out of Memory\n");
+        munmap(stack, bytes);
+        return OutOfMemory;
+    }
+
+    fiber->stack = stack;
+    fiber->stack_bytes = bytes;
+    fiber->function = NULL;
+    fiber->arg = NULL;
+    fiber->wait_word = NULL;
+    fiber->wait_value = 0;
+    fiber->has_deadline = false;
+    fiber->timed_out = false;
+    fiber->tsan_fiber = NULL;
+    fiber->next = NULL;
+
+    char* top = (char*) stack + bytes;
+
+#if FIBER_ASM
+    // What fiber_switch pops: control words, r15 to r12, rbx, rbp, then fiber_entry as the return address.
+    uint64_t* frame = (uint64_t*) top;
+    frame[-1] = 0;                           // fiber_entry's own return address; it never returns
+    frame[-2] = (uint64_t)(uintptr_t) fiber_entry;
+    for (int i = 3; i <= 8; i++)
+        frame[-i] = 0;
+    frame[-9] = FIBER_CONTROL_WORDS;
+    fiber->context = &frame[-9];
+#else
+    size_t context_bytes = (sizeof(ucontext_t) + 63) & ~(size_t) 63;
+    ucontext_t* context = (ucontext_t*)(top - context_bytes);
+    getcontext(context);
+    context->uc_stack.ss_sp = (char*) stack + page;
+    context->uc_stack.ss_size = bytes - page - context_bytes;
+    context->uc_link = NULL;
+    makecontext(context, fiber_entry, 0);
+    fiber->context = context;
+#endif
+
+#ifdef __SANITIZE_THREAD__
+    fiber->tsan_fiber = __tsan_create_fiber(0);
+#endif
+
+    return Success;
+}
+
+/**
+ * @brief: Unmaps an idle fiber's stack. A parked fiber's function would never finish.
+*/
+void fiber_destroy(fiber_t* fiber) {
+
+    if (fiber == NULL || fiber->stack == NULL)
+        return;
+
+#ifdef __SANITIZE_THREAD__
+    __tsan_destroy_fiber(fiber->tsan_fiber);
+#endif
+    munmap(fiber->stack, fiber->stack_bytes);
+    fiber->stack = NULL;
+}
+
+/**
+ * @brief: Runs function(arg) on an idle fiber until it returns or the fiber parks.
+ *
+ * @param: fiber -- an idle fiber, created by the calling thread or never run.
+ * @param: function -- what to run.
+ * @param: arg -- passed to function.
+ * @return: true once function returned and the fiber is idle again; false when it parked (see fiber_resume).
+*/
+bool fiber_run(fiber_t* fiber, fiber_fun_t function, void* arg) {
+
+    fiber->function = function;
+    fiber->arg = arg;
+    fiber->wait_word = NULL;
+    fiber_switch_in(fiber);
+
+    return fiber->function == NULL;
+}
+
+/**
+ * @brief: Continues a parked fiber, normally once fiber_ready said so, until it returns or parks again.
+ *
+ * @param: fiber -- a fiber the calling thread parked.
+ * @return: true once its function returned; false when it parked again.
+*/
+bool fiber_resume(fiber_t* fiber) {
+
+    fiber_switch_in(fiber);
+
+    return fiber->function == NULL;
+}
+
+/**
+ * @brief: Tells whether what a parked fiber waits for happened: its word changed, its deadline passed, or it only yielded.
+ *
+ * Like a futex wakeup this can be spurious; the waits parking fibers recheck their condition.
+ *
+ * @param: fiber -- a parked fiber.
+ * @return: true when the fiber should be resumed.
+*/
+bool fiber_ready(fiber_t* fiber) {
+
+    if (fiber->wait_word == NULL || fiber_load(fiber->wait_word) != fiber->wait_value)
+        return true;
+
+    if (fiber->has_deadline && futex_passed(&fiber->deadline)) {
+        fiber->timed_out = true;
+        return true;
+    }
+
+    return false;
+}
+
+fiber_t* fiber_current(void) {
+    return fiber_running;
+}
+
+/**
+ * @brief: Parks the calling fiber while the 32-bit *word holds expected, until resumed or the deadline passes.
+ *
+ * The fiber-side FUTEX_WAIT: the thread goes on with other work and resumes the fiber once fiber_ready finds the word changed. Whoever changes the word still issues FUTEX_WAKE for a sleeping thread, which wakes the thread in fiber_sleep.
+ *
+ * @param: word -- the futex word.
+ * @param: expected -- the value to park on.
+ * @param: deadline -- absolute CLOCK_MONOTONIC time to stop waiting at, NULL for none.
+ * @return: the rc_t value (Success when resumed or the word had changed already, Timeout, InvalidOperation off a fiber)
+*/
+rc_t fiber_wait(void* word, uint32_t expected, const struct timespec* deadline) {
+
+    fiber_t* self = fiber_running;
+    if (self == NULL)
+        return InvalidOperation;
+
+    if (futex_passed(deadline))
+        return Timeout;
+
+    if (fiber_load(word) != expected)
+        return Success;
+
+    self->wait_word = word;
+    self->wait_value = expected;
+    self->has_deadline = deadline != NULL;
+    if (deadline != NULL)
+        self->deadline = *deadline;
+    self->timed_out = false;
+
+    fiber_switch_out(self);
+
+    self->wait_word = NULL;
+    return self->timed_out ? Timeout : Success;
+}
+
+/**
+ * @brief: Parks the calling fiber as ready at once, so the thread runs what else it has before resuming it.
+ *
+ * @return: the rc_t value (Success, InvalidOperation off a fiber)
+*/
+rc_t fiber_yield(void) {
+
+    fiber_t* self = fiber_running;
+    if (self == NULL)
+        return InvalidOperation;
+
+    self->wait_word = NULL;
+    self->has_deadline = false;
+    self->timed_out = false;
+
+    fiber_switch_out(self);
+    return Success;
+}
+
+/**
+ * @brief: Puts the thread to sleep while *word holds expected and none of its parked fibers is ready.
+ *
+ * The thread sleeps in futex_waitv on its own word and the words its parked fibers wait on, until the earliest of their deadlines. Fibers parked on the same word and value share a watch, so many fibers waiting for one latch or signal cost one entry. Only when more than FIBER_SLEEP_MAX - 1 distinct words are parked does it nap FIBER_POLL_NSECS at a time: a wake on a word past the first FIBER_SLEEP_MAX - 1 is then seen up to that late. Without futex_waitv it sleeps on word alone that long. Returns at once while a fiber that yielded is parked. Wakeups may be spurious; the caller rechecks its word and its fibers.
+ *
+ * @param: parked -- the thread's parked fibers, linked through next.
+ * @param: word -- the futex word the thread waits on itself.
+ * @param: expected -- the value to sleep on.
+*/
+void fiber_sleep(fiber_t* parked, void* word, uint32_t expected) {
+
+    futex_watch_t watches[FIBER_SLEEP_MAX];
+    struct timespec deadline;
+    bool timed = false;
+    bool partial = false;
+    int count = 0;
+
+    watches[count].uaddr = (uintptr_t) word;
+    watches[count].val = expected;
+    watches[count].flags = FUTEX_32;
+    watches[count].reserved = 0;
+    count++;
+
+    for (fiber_t* fiber = parked; fiber != NULL; fiber = fiber->next) {
+        if (fiber->wait_word == NULL)
+            return;
+        if (fiber->has_deadline && (!timed || futex_before(&fiber->deadline, &deadline))) {
+            deadline = fiber->deadline;
+            timed = true;
+        }
+
+        bool watched = false;
+        for (int i = 1; i < count && !watched; i++)
+            watched = watches[i].uaddr == (uintptr_t) fiber->wait_word && watches[i].val == fiber->wait_value;
+        if (watched)
+            continue;
+
+        if (count == FIBER_SLEEP_MAX) {
+            partial = true;
+            continue;
+        }
+        watches[count].uaddr = (uintptr_t) fiber->wait_word;
+        watches[count].val = fiber->wait_value;
+        watches[count].flags = FUTEX_32;
+        watches[count].reserved = 0;
+        count++;
+    }
+
+    struct timespec poll;
+    if (partial) {
+        fiber_poll_deadline(&poll);
+        if (!timed || futex_before(&poll, &deadline))
+            deadline = poll;
+        timed = true;
+    }
+
+    long frc = syscall(SYS_futex_waitv, watches, count, 0, timed ? &deadline : NULL, CLOCK_MONOTONIC);
+    if (frc == -1 && errno == ENOSYS) {
+        fiber_poll_deadline(&poll);
+        if (!timed || futex_before(&poll, &deadline))
+            deadline = poll;
+        syscall(SYS_futex, word, FUTEX_WAIT_BITSET, expected, &deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef fiber_h
+#define fiber_h
+
+#include "rc.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <time.h>
+
+#define FIBER_DEFAULT_STACK (64 * 1024)
+#define FIBER_MIN_STACK (16 * 1024)
+#define FIBER_SLEEP_MAX 128          // futex words one fiber_sleep watches (FUTEX_WAITV_MAX)
+#define FIBER_POLL_NSECS 1000000     // fiber_sleep's nap when its parked fibers wait on more distinct words than it can watch
+
+/*
+ * Stackful fibers for a thread that multiplexes tasks. A fiber runs a function
+ * on a stack of its own (an mmap with a guard page below it) until the
+ * function returns or the fiber parks; either way the thread continues where
+ * it resumed the fiber, and the fiber can be resumed or reused later. On
+ * x86-64 a switch saves and restores the callee-saved registers and nothing
+ * else; other targets use ucontext.
+ *
+ * A fiber never moves between threads: the thread that runs it first resumes
+ * it every time, so thread-locals stay valid across parks.
+ *
+ * Parking mirrors FUTEX_WAIT. fiber_wait(word, expected, deadline) on a fiber
+ * records the word and switches back to the thread, which resumes the fiber
+ * once fiber_ready finds the word changed or the deadline passed. The thread
+ * watches its parked fibers' words, with what it waits on itself, in one
+ * fiber_sleep, so the FUTEX_WAKE that would have woken a blocked thread wakes
+ * the thread the fiber parked on. Past FIBER_SLEEP_MAX - 1 distinct words
+ * the thread polls instead, every FIBER_POLL_NSECS, so a fiber waiting on a
+ * word it does not watch may resume that much late. Off a fiber fiber_wait
+ * returns InvalidOperation and the caller makes the futex call itself, so
+ * primitives can use it unconditionally.
+ */
+
+typedef void fiber_fun_t(void* arg);
+
+typedef struct fiber_st {
+    void* context;             // saved stack pointer (x86-64) or ucontext_t at the top of the stack
+    void* stack;               // the mapping, guard page first
+    size_t stack_bytes;        // mapping size, guard page included
+    fiber_fun_t* function;     // NULL while idle
+    void* arg;
+    void* wait_word;           // parked: ready once this 32-bit word no longer holds wait_value; NULL after fiber_yield
+    uint32_t wait_value;
+    bool has_deadline;
+    bool timed_out;            // set by fiber_ready when it was the deadline that passed
+    struct timespec deadline;  // CLOCK_MONOTONIC
+    void* tsan_fiber;          // ThreadSanitizer's handle, built with -fsanitize=thread
+    struct fiber_st* next;     // free for the scheduler's lists
+} fiber_t;
+
+rc_t fiber_create(fiber_t* fiber, size_t stack_bytes);
+void fiber_destroy(fiber_t* fiber);
+bool fiber_run(fiber_t* fiber, fiber_fun_t function, void* arg);
+bool fiber_resume(fiber_t* fiber);
+bool fiber_ready(fiber_t* fiber);
+fiber_t* fiber_current(void);
+rc_t fiber_wait(void* word, uint32_t expected, const struct timespec* deadline);
+rc_t fiber_yield(void);
+void fiber_sleep(fiber_t* parked, void* word, uint32_t expected);
+
+#endif
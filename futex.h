@@ -0,0 +1,59 @@
+#ifndef futex_h
+#define futex_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/syscall.h>
+
+/*
+ * Futex helpers shared by cqueue, spinlock, spsc, future and fiber; not part
+ * of the public API. Every timed wait in the library sleeps until an
+ * absolute CLOCK_MONOTONIC deadline, computed once per public call from the
+ * caller's relative timeout, so a wakeup that finds nothing to do does not
+ * restart the clock.
+ */
+
+#ifndef SYS_futex_waitv
+#define SYS_futex_waitv 449
+#endif
+
+// One entry of futex_waitv's vector (struct futex_waitv, which older headers lack).
+typedef struct futex_watch_st {
+    uint64_t val;
+    uint64_t uaddr;
+    uint32_t flags;
+    uint32_t reserved;
+} futex_watch_t;
+
+// Turns a relative timeout into a CLOCK_MONOTONIC deadline. Returns deadline, or NULL (wait forever) when timeout is NULL.
+static inline struct timespec* futex_deadline(const struct timespec* timeout, struct timespec* deadline) {
+    if (timeout == NULL)
+        return NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout->tv_sec;
+    deadline->tv_nsec += timeout->tv_nsec;
+    while (deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec += 1;
+        deadline->tv_nsec -= 1000000000;
+    }
+
+    return deadline;
+}
+
+static inline bool futex_before(const struct timespec* a, const struct timespec* b) {
+    return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+// True once the deadline (NULL: none) is behind us.
+static inline bool futex_passed(const struct timespec* deadline) {
+    if (deadline == NULL)
+        return false;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return !futex_before(&now, deadline);
+}
+
+#endif
@@ -0,0 +1,256 @@
+#include "future.h"
+#include "fiber.h"
+#include "futex.h"
+#include <stdio.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Values of future_t.state. The waiters flag lets future_complete skip the wake.
+#define FUTURE_PENDING 0
+#define FUTURE_READY 1
+#define FUTURE_PENDING_WAITERS 2
+
+/*
+ * future_wait_any cannot sleep on several state words at once, so it sleeps
+ * on this process-wide event word instead. Completions only bump it (and
+ * issue the wake) while somebody is inside future_wait_any.
+ */
+static atomic_uint future_any_epoch;
+static atomic_int future_any_waiters;
+
+// The calling thread's helper, see future_set_helper.
+static _Thread_local future_helper_t* future_helper;
+static _Thread_local void* future_helper_ctx;
+
+// Sleeps while *word == expected, until woken or the absolute CLOCK_MONOTONIC deadline (NULL: none) passes. A fiber parks instead.
+static rc_t future_futex_wait(atomic_uint* word, unsigned int expected, struct timespec* deadline) {
+    rc_t rc = fiber_wait(word, expected, deadline);
+    if (rc != InvalidOperation)
+        return rc;
+
+    long frc = syscall(SYS_futex, word, FUTEX_WAIT_BITSET, expected, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    if (frc == -1 && errno == ETIMEDOUT)
+        return Timeout;
+    return Success;
+}
+
+// Runs the thread's helper once, unless the deadline has passed. Returns false when the caller should sleep instead.
+// A fiber never helps: it parks, and its thread runs the work from its own stack.
+static bool future_help(struct timespec* deadline) {
+    if (future_helper == NULL || fiber_current() != NULL)
+        return false;
+
+    if (futex_passed(deadline))
+        return false;
+
+    return future_helper(future_helper_ctx);
+}
+
+static rc_t future_wait_until(future_t* future, struct timespec* deadline, void** result) {
+    while (true) {
+        unsigned int state = atomic_load(&future->state);
+        if (state == FUTURE_READY)
+            break;
+
+        if (future_help(deadline))
+            continue;
+
+        if (state == FUTURE_PENDING &&
+            !atomic_compare_exchange_strong(&future->state, &state, FUTURE_PENDING_WAITERS))
+            continue;
+
+        if (future_futex_wait(&future->state, FUTURE_PENDING_WAITERS, deadline) == Timeout &&
+            atomic_load(&future->state) != FUTURE_READY)
+            return Timeout;
+    }
+
+    if (result != NULL)
+        *result = future->result;
+
+    return future->rc;
+}
+
+rc_t future_init(future_t* future) {
+    if (future == NULL) {
+        fprintf(stderr, "The future cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    atomic_init(&future->state, FUTURE_PENDING);
+    future->rc = Success;
+    future->result = NULL;
+
+    return Success;
+}
+
+/**
+ * @brief: Marks the future ready and wakes its waiters.
+ *
+ * The future is not touched after the state changes, so a waiter may release its storage as soon as it sees it ready.
+ */
+rc_t future_complete(future_t* future, rc_t rc, void* result) {
+    if (future == NULL) {
+        fprintf(stderr, "The future cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    // A second completion must not overwrite what the waiters of the first may be reading.
+    if (atomic_load(&future->state) == FUTURE_READY) {
+        fprintf(stderr, "The future was already completed.\n");
+        return InvalidOperation;
+    }
+
+    future->rc = rc;
+    future->result = result;
+
+    unsigned int previous = atomic_exchange(&future->state, FUTURE_READY);
+    if (previous == FUTURE_READY) {
+        fprintf(stderr, "The future was already completed.\n");
+        return InvalidOperation;
+    }
+
+    if (previous == FUTURE_PENDING_WAITERS)
+        syscall(SYS_futex, &future->state, FUTEX_WAKE, INT_MAX, NULL, NULL, NULL);
+
+    if (atomic_load(&future_any_waiters) > 0) {
+        atomic_fetch_add(&future_any_epoch, 1);
+        syscall(SYS_futex, &future_any_epoch, FUTEX_WAKE, INT_MAX, NULL, NULL, NULL);
+    }
+
+    return Success;
+}
+
+rc_t future_is_ready(future_t* future, bool* ready) {
+    if (future == NULL || ready == NULL) {
+        fprintf(stderr, "The future and ready cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    *ready = atomic_load_explicit(&future->state, memory_order_acquire) == FUTURE_READY;
+
+    return Success;
+}
+
+rc_t future_wait(future_t* future, void** result) {
+    return future_wait_timeout(future, NULL, result);
+}
+
+/**
+ * @brief: Waits until the future is ready or the timeout passes.
+ *
+ * The timeout is relative to the call, not to each wakeup: it becomes an absolute deadline once, which every wait sleeps until.
+ *
+ * @param: future -- the future.
+ * @param: timeout -- how long to wait, NULL to wait forever.
+ * @param: result -- receives the task's result (may be NULL).
+ * @return: Timeout, or the rc the task completed with.
+*/
+rc_t future_wait_timeout(future_t* future, timespec_t* timeout, void** result) {
+    struct timespec until;
+    struct timespec* deadline;
+
+    if (future == NULL) {
+        fprintf(stderr, "The future cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    deadline = futex_deadline(timeout, &until);
+
+    return future_wait_until(future, deadline, result);
+}
+
+/**
+ * @brief: Waits until every future is ready or the timeout passes.
+ *
+ * @return: Success or Timeout. Each future's rc and result are in the future itself.
+*/
+rc_t future_wait_all(future_t* futures[], int count, timespec_t* timeout) {
+    struct timespec until;
+    struct timespec* deadline;
+
+    if (futures == NULL || count < 0) {
+        fprintf(stderr, "Invalid futures.\n");
+        return InvalidArgument;
+    }
+
+    deadline = futex_deadline(timeout, &until);
+
+    for (int i = 0; i < count; i++) {
+        if (futures[i] == NULL) {
+            fprintf(stderr, "Invalid futures.\n");
+            return InvalidArgument;
+        }
+
+        // A future that completed with Timeout as its rc is still ready.
+        if (future_wait_until(futures[i], deadline, NULL) == Timeout &&
+            atomic_load(&futures[i]->state) != FUTURE_READY)
+            return Timeout;
+    }
+
+    return Success;
+}
+
+/**
+ * @brief: Waits until at least one future is ready or the timeout passes.
+ *
+ * @param: index -- receives the index of a ready future.
+ * @return: Success or Timeout.
+*/
+rc_t future_wait_any(future_t* futures[], int count, int* index, timespec_t* timeout) {
+    struct timespec until;
+    struct timespec* deadline;
+    rc_t rc = Timeout;
+
+    if (futures == NULL || count <= 0 || index == NULL) {
+        fprintf(stderr, "Invalid futures.\n");
+        return InvalidArgument;
+    }
+
+    deadline = futex_deadline(timeout, &until);
+
+    atomic_fetch_add(&future_any_waiters, 1);
+
+    while (true) {
+        unsigned int seen = atomic_load(&future_any_epoch);
+
+        for (int i = 0; i < count; i++) {
+            if (atomic_load(&futures[i]->state) == FUTURE_READY) {
+                *index = i;
+                rc = Success;
+                break;
+            }
+        }
+        if (rc == Success)
+            break;
+
+        if (future_help(deadline))
+            continue;
+
+        if (future_futex_wait(&future_any_epoch, seen, deadline) == Timeout)
+            break;
+    }
+
+    atomic_fetch_sub(&future_any_waiters, 1);
+
+    return rc;
+}
+
+/**
+ * @brief: Installs the calling thread's helper, which its future waits run instead of sleeping.
+ *
+ * A helper called with a deadline pending may overrun it by as long as the work it runs takes.
+ *
+ * @param: helper -- returns false once it found nothing to do; NULL removes the helper.
+ * @param: ctx -- passed to helper.
+ * @return: Success.
+*/
+rc_t future_set_helper(future_helper_t* helper, void* ctx) {
+    future_helper = helper;
+    future_helper_ctx = ctx;
+
+    return Success;
+}
@@ -0,0 +1,45 @@
+#ifndef future_h
+#define future_h
+
+#include "rc.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+typedef struct timespec timespec_t;
+
+/*
+ * A one-shot completion slot. The producer calls future_complete exactly once;
+ * any number of threads may wait on it. rc and result are valid once the
+ * future is ready. The storage is owned by the caller and must stay valid
+ * until the future is ready.
+ */
+/*
+ * A thread that must not sleep while it waits, such as a pool worker, installs
+ * a helper: the waits call it until the future is ready, and only sleep when
+ * it returns false (nothing left to do). On a fiber (fiber.h) the waits park
+ * the fiber instead of helping or sleeping.
+ */
+typedef bool future_helper_t(void* ctx);
+
+typedef struct future_st {
+    atomic_uint state;
+    rc_t rc;
+    void* result;
+#ifdef POOL_TRACE
+    uint64_t task[7];  // scratch space the pool keeps the task record in while pending
+#else
+    uint64_t task[5];
+#endif
+} future_t;
+
+rc_t future_init(future_t* future);
+rc_t future_complete(future_t* future, rc_t rc, void* result);
+rc_t future_is_ready(future_t* future, bool* ready);
+rc_t future_wait(future_t* future, void** result);
+rc_t future_wait_timeout(future_t* future, timespec_t* timeout, void** result);
+rc_t future_wait_all(future_t* futures[], int count, timespec_t* timeout);
+rc_t future_wait_any(future_t* futures[], int count, int* index, timespec_t* timeout);
+rc_t future_set_helper(future_helper_t* helper, void* ctx);
+
+#endif
@@ -1,308 +1,2586 @@
 #include "pool.h"
 #include "rc.h"
 #include "cqueue.h"
+#include "slab.h"
+#include "topology.h"
+#include "pool_trace.h"
+#include "pool_io.h"
+#include "fiber.h"
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <pthread.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+
+#define POOL_THREAD_BATCH 16
+#define POOL_MAP_BATCH 64
+#define POOL_FOR_TARGET_NSECS 50000
+#define POOL_FOR_PROBE_CHUNK 16
+#define POOL_FIBER_CACHE 64        // finished fibers a worker keeps for its next tasks
+
+// States of a shared-scheduler worker slot.
+#define POOL_SLOT_EMPTY 0      // no thread
+#define POOL_SLOT_RUNNING 1
+#define POOL_SLOT_EXITED 2     // the thread retired and still has to be joined
 
 typedef struct thread_pool_args_st {
-    cqueue_t* work_queue;
-    cqueue_t* results_queue;
+    pool_group_t* group;
+    thread_pool_t* pool;
+    int index;
+    bool reserved;
+    atomic_int state;          // written under the pool's resize_lock, except for RUNNING -> EXITED by the thread
+    pool_work_t* batch;        // the batch the thread claimed; batch_next is the first one nobody started
+    uint32_t batch_next;
+    uint32_t batch_count;
 } thread_pool_args_t;
 
+// The layout this library was built with; see pool.h.
+const int POOL_ABI_TAG = 1;
+
+// The pool the calling thread is a worker of, and its thread_pool_args_t or pool_worker_t.
+static _Thread_local thread_pool_t* pool_current;
+static _Thread_local thread_pool_args_t* pool_current_args;
+static _Thread_local pool_worker_t* pool_current_worker;
+
+/*
+ * A worker's fibers (attrs.fibers). Every task the worker takes runs on a
+ * fiber of its own. A task that waits on a pool primitive parks its fiber,
+ * which goes on the parked list, and the worker takes its next task; between
+ * tasks it resumes the parked fibers that fiber_ready lets go. A worker with
+ * fibers parked sleeps on their futex words too (polling once they wait on
+ * more distinct words than fiber_sleep can watch, see fiber.h), and neither
+ * retires nor stops before they finished. Finished fibers are kept for reuse.
+ */
+typedef struct pool_fibers_st {
+    fiber_t* idle;
+    int num_idle;
+    fiber_t* parked;           // in the order they parked
+    fiber_t** parked_tail;
+    int num_parked;
+    size_t stack_bytes;
+} pool_fibers_t;
+
+// A task on its fiber, with its work request copied out of the batch or deque it came from.
+typedef struct pool_fiber_st {
+    fiber_t fiber;             // first, so the lists' fiber_t* are pool_fiber_t*
+    pool_work_t work_request;
+} pool_fiber_t;
+
+// The calling worker's fibers, NULL unless the pool has them.
+static _Thread_local pool_fibers_t* pool_current_fibers;
+
+static void pool_grow(thread_pool_t* pool, pool_group_t* group, int level);
+static bool pool_help_future(void* ctx);
+static void pool_execute(pool_work_t* work_request);
+static rc_t pool_stop_workers(thread_pool_t* pool);
+
+/*
+ * Completion context of one pool_map call. Workers write results[id]
+ * directly and count pending down; the caller sleeps on pending.
+ */
+struct pool_map_st {
+    void** results;
+    atomic_uint pending;
+    atomic_int rc;
+};
+
+static uint64_t pool_now_nsecs(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Busy/idle accounting: *mark is when the worker last switched between looking for work and running it.
+static inline void pool_count_idle(thread_pool_t* pool, int index, uint64_t* mark) {
+    (void)pool;
+    (void)index;
+    uint64_t now = STATS_NOW();
+    STATS_ADD(pool->counters[index].idle_nsecs, now - *mark);
+    *mark = now;
+}
+
+static inline void pool_count_busy(thread_pool_t* pool, int index, uint64_t* mark) {
+    (void)pool;
+    (void)index;
+    uint64_t now = STATS_NOW();
+    STATS_ADD(pool->counters[index].busy_nsecs, now - *mark);
+    *mark = now;
+}
+
+// Between tasks: submits the I/O the worker deferred and hands finished I/O to the pool. True while I/O is in flight.
+static inline bool pool_poll_io(thread_pool_t* pool) {
+    return pool->io != NULL && pool_io_ring_poll(pool->io);
+}
+
+#ifdef POOL_TRACE
+// Tracing: stamps new work requests as handed to the pool. One that is run before any queue held it counts as dequeued at once.
+static inline void pool_trace_enqueued(thread_pool_t* pool, pool_work_t* work_requests, uint32_t count) {
+    if (pool->trace == NULL)
+        return;
+    uint64_t now = pool_now_nsecs();
+    for (uint32_t i = 0; i < count; i++) {
+        work_requests[i].enqueue_nsecs = now;
+        work_requests[i].dequeue_nsecs = now;
+    }
+}
+
+static inline void pool_trace_dequeued(thread_pool_t* pool, pool_work_t* work_requests, uint32_t count) {
+    if (pool->trace == NULL)
+        return;
+    uint64_t now = pool_now_nsecs();
+    for (uint32_t i = 0; i < count; i++)
+        work_requests[i].dequeue_nsecs = now;
+}
+#else
+#define pool_trace_enqueued(pool, work_requests, count) ((void)0)
+#define pool_trace_dequeued(pool, work_requests, count) ((void)0)
+#endif
+
+/**
+ * @brief: Wakes parked shared-scheduler workers after work was posted at a level.
+ * 
+ * As with pool_ws_signal, the signal word is bumped unconditionally and the futex syscall is only made when someone is parked. Reserved workers are only woken for PoolPriorityHigh work.
+ * 
+ * @param: group -- the group the work was posted to.
+ * @param: level -- the priority of the work.
+ * @param: count -- the number of work requests, and so of workers worth waking.
+*/
+static void pool_group_wake(pool_group_t* group, int level, uint32_t count) {
+
+    int wake = count < INT_MAX ? (int)count : INT_MAX;
+
+    atomic_fetch_add(&group->signal, 1);
+    if (atomic_load(&group->sleepers) > 0)
+        syscall(SYS_futex, &group->signal, FUTEX_WAKE, wake, NULL, NULL, NULL);
+
+    if (level == PoolPriorityHigh && group->num_reserved > 0) {
+        atomic_fetch_add(&group->reserved_signal, 1);
+        if (atomic_load(&group->reserved_sleepers) > 0)
+            syscall(SYS_futex, &group->reserved_signal, FUTEX_WAKE, wake, NULL, NULL, NULL);
+    }
+}
+
+/**
+ * @brief: Makes count work requests already in a level's queue claimable by the group's workers.
+ * 
+ * @param: pool -- the pool.
+ * @param: group -- the group whose queue holds the work.
+ * @param: level -- the priority of the work.
+ * @param: count -- the number of work requests.
+*/
+static void pool_group_post(thread_pool_t* pool, pool_group_t* group, int level, uint32_t count) {
+
+    unsigned int bit = 1u << level;
+
+    atomic_fetch_add(&group->pending[level], count);
+
+    // A level ages from when it became ready, not from when it was last served.
+    if ((atomic_load(&group->ready) & bit) == 0) {
+        if (pool->track_ready)
+            atomic_store(&group->ready_since[level], pool_now_nsecs());
+        atomic_fetch_or(&group->ready, bit);
+    }
+
+    pool_group_wake(group, level, count);
+
+    // Nobody was parked to take the work: an elastic pool may need another worker.
+    if (atomic_load(&group->sleepers) == 0 && atomic_load(&pool->live) < atomic_load(&pool->max_workers) &&
+        !(level == PoolPriorityHigh && atomic_load(&group->reserved_sleepers) > 0))
+        pool_grow(pool, group, level);
+}
+
+/**
+ * @brief: Enqueues all count work requests at a level of a group, one batch (one critical section) at a time.
+ * 
+ * Each batch is posted as soon as it is in: when the queue is shorter than count, the workers have to see the first batches to make room for the rest. One of the pool's own workers does not wait for room, since every worker might be enqueueing at once: it runs the next work request itself instead. A task on a fiber waits, since its stack is too small to nest tasks on and its worker keeps dequeueing while it is parked.
+ * 
+ * @param: pool -- the pool.
+ * @param: group -- the group.
+ * @param: level -- the priority, which picks the queue.
+ * @param: work_requests -- count work requests, copied into the queue.
+ * @param: count -- the number of work requests.
+ * @param: sent -- receives how many were enqueued or run, all of them on Success and possibly some on an error.
+ * @return: the rc_t value (Success, OutOfMemory etc.)
+*/
+static rc_t pool_group_enqueue_all(thread_pool_t* pool, pool_group_t* group, int level, pool_work_t* work_requests, uint32_t count,
+                                   uint32_t* sent) {
+
+    timespec_t no_wait = { 0, 0 };
+    bool inside = pool_current == pool && fiber_current() == NULL;
+
+    *sent = 0;
+    while (count > 0) {
+        uint32_t enqueued;
+        rc_t rc = cqueue_enqueue_batch(&group->work_queue[level], work_requests, sizeof(pool_work_t), count, &enqueued,
+                                       inside ? &no_wait : NULL);
+        if (rc == Timeout) {
+            pool_execute(work_requests);
+            work_requests++;
+            count--;
+            (*sent)++;
+            continue;
+        }
+        if (rc != Success) {
+            fprintf(stderr, "Error calling cqueue enqueue batch.\n");
+            return rc;
+        }
+        pool_group_post(pool, group, level, enqueued);
+        work_requests += enqueued;
+        count -= enqueued;
+        *sent += enqueued;
+    }
+
+    return Success;
+}
+
+/**
+ * @brief: Runs one pool_map work request and reports to its map call.
+ * 
+ * The result goes straight into the caller's results array. The work request and the map context belong to the caller and may be gone once pending drops to zero, so the final wake only uses the address.
+ * 
+ * @param: work_request -- the work request (map must not be NULL).
+*/
+static void pool_run_map(pool_work_t* work_request) {
+
+    pool_map_t* map = work_request->map;
+
+    // Call function on argument (get return code and result)
+    void* fun_result = NULL;
+    rc_t rc = work_request->function_ptr(work_request->arg, &fun_result);
+    if (rc != Success) {
+        fprintf(stderr, "There was an error with the user function, error value was %d\n", rc);
+        int expected = Success;
+        atomic_compare_exchange_strong(&map->rc, &expected, rc);
+    }
+
+    map->results[work_request->id] = fun_result;
+
+    if (atomic_fetch_sub(&map->pending, 1) == 1)
+        syscall(SYS_futex, &map->pending, FUTEX_WAKE, INT_MAX, NULL, NULL, NULL);
+}
+
+/**
+ * @brief: Runs a submitted work request and completes its future.
+ * 
+ * Errors from the user function go to the future rather than stopping the thread. The work request may live inside the future, so it is not touched once the future is complete.
+ * 
+ * @param: work_request -- the work request (future must not be NULL).
+*/
+static void pool_run_future(pool_work_t* work_request) {
+
+    future_t* future = work_request->future;
+
+    void* fun_result = NULL;
+    rc_t rc = work_request->function_ptr(work_request->arg, &fun_result);
+
+    future_complete(future, rc, fun_result);
+}
+
+/**
+ * @brief: Runs one work request and hands its result to whoever is waiting for it.
+ * 
+ * A detached request has nobody waiting; its result and return code are dropped.
+ * 
+ * @param: work_request -- the work request (function pointer must not be NULL).
+*/
+static void pool_run(pool_work_t* work_request) {
+
+    if (work_request->future != NULL) {
+        pool_run_future(work_request);
+    } else if (work_request->map != NULL) {
+        pool_run_map(work_request);
+    } else {
+        void* fun_result = NULL;
+        work_request->function_ptr(work_request->arg, &fun_result);
+    }
+}
+
+/**
+ * @brief: Runs a work request on the calling worker (see pool_run), timing it when the pool traces.
+ * 
+ * Every task a worker runs goes through here, whether a worker loop, a helping wait or an inline submit took it, so this is where it is counted as executed.
+ * 
+ * @param: work_request -- the work request (function pointer must not be NULL).
+*/
+static void pool_execute(pool_work_t* work_request) {
+
+    thread_pool_t* pool = pool_current;
+    int worker = pool_current_args != NULL ? pool_current_args->index : pool_current_worker->index;
+    (void)pool;
+    (void)worker;
+
+    // Counted before it runs, so once its completion is seen the count is too.
+    STATS_ADD(pool->counters[worker].executed, 1);
+
+#ifdef POOL_TRACE
+    if (pool->trace != NULL) {
+        // The request may be gone once it completed, so its stamps are kept aside
+        pool_work_t traced = *work_request;
+        uint64_t start = pool_now_nsecs();
+        pool_run(work_request);
+        pool_trace_record(pool->trace, worker, &traced, start, pool_now_nsecs());
+        return;
+    }
+#endif
+
+    pool_run(work_request);
+}
+
+static void pool_fibers_init(pool_fibers_t* fibers, size_t stack_bytes) {
+    fibers->idle = NULL;
+    fibers->num_idle = 0;
+    fibers->parked = NULL;
+    fibers->parked_tail = &fibers->parked;
+    fibers->num_parked = 0;
+    fibers->stack_bytes = stack_bytes;
+}
+
+// Frees the idle fibers; the worker only exits with none parked.
+static void pool_fibers_destroy(pool_fibers_t* fibers) {
+    while (fibers->idle != NULL) {
+        pool_fiber_t* task = (pool_fiber_t*) fibers->idle;
+        fibers->idle = task->fiber.next;
+        fiber_destroy(&task->fiber);
+        free(task);
+    }
+    fibers->num_idle = 0;
+}
+
+static inline int pool_fibers_parked(void) {
+    return pool_current_fibers != NULL ? pool_current_fibers->num_parked : 0;
+}
+
+static void pool_fibers_park(pool_fibers_t* fibers, fiber_t* fiber) {
+    fiber->next = NULL;
+    *fibers->parked_tail = fiber;
+    fibers->parked_tail = &fiber->next;
+    fibers->num_parked++;
+}
+
+static void pool_fibers_release(pool_fibers_t* fibers, pool_fiber_t* task) {
+    if (fibers->num_idle < POOL_FIBER_CACHE) {
+        task->fiber.next = fibers->idle;
+        fibers->idle = &task->fiber;
+        fibers->num_idle++;
+        return;
+    }
+    fiber_destroy(&task->fiber);
+    free(task);
+}
+
+static void pool_fiber_main(void* arg) {
+    pool_execute(&((pool_fiber_t*) arg)->work_request);
+}
+
+/**
+ * @brief: Runs a work request the calling worker took: on a fiber when the pool has them, so the task can park, and otherwise right here (see pool_execute).
+ * 
+ * A task gets the worker's stack too when no fiber can be had; it then blocks the worker while it waits, as without fibers.
+ * 
+ * @param: work_request -- the work request, copied onto the fiber, so it may be reused once this returns.
+*/
+static void pool_dispatch(pool_work_t* work_request) {
+
+    pool_fibers_t* fibers = pool_current_fibers;
+    if (fibers == NULL || fiber_current() != NULL) {
+        pool_execute(work_request);
+        return;
+    }
+
+    pool_fiber_t* task = (pool_fiber_t*) fibers->idle;
+    if (task != NULL) {
+        fibers->idle = task->fiber.next;
+        fibers->num_idle--;
+    } else {
+        task = malloc(sizeof(pool_fiber_t));
+        if (task == NULL || fiber_create(&task->fiber, fibers->stack_bytes) != Success) {
+            free(task);
+            pool_execute(work_request);
+            return;
+        }
+    }
+
+    task->work_request = *work_request;
+    if (fiber_run(&task->fiber, pool_fiber_main, task))
+        pool_fibers_release(fibers, task);
+    else
+        pool_fibers_park(fibers, &task->fiber);
+}
+
+// Between tasks: resumes each parked fiber whose wait is over once, in the order they parked.
+static void pool_fibers_resume(pool_fibers_t* fibers) {
+
+    if (fibers == NULL || fibers->num_parked == 0)
+        return;
+
+    fiber_t* fiber = fibers->parked;
+    fibers->parked = NULL;
+    fibers->parked_tail = &fibers->parked;
+    fibers->num_parked = 0;
+
+    while (fiber != NULL) {
+        fiber_t* next = fiber->next;
+        if (fiber_ready(fiber) && fiber_resume(fiber))
+            pool_fibers_release(fibers, (pool_fiber_t*) fiber);
+        else
+            pool_fibers_park(fibers, fiber);
+        fiber = next;
+    }
+}
+
+// Parks the worker on its signal word. With fibers parked their words wake it too, and there is no idle timeout.
+static rc_t pool_sleep(atomic_uint* signal, unsigned int seen, struct timespec* timeout) {
+
+    pool_fibers_t* fibers = pool_current_fibers;
+    if (fibers != NULL && fibers->num_parked > 0) {
+        fiber_sleep(fibers->parked, signal, seen);
+        return Success;
+    }
+
+    long frc = syscall(SYS_futex, signal, FUTEX_WAIT, seen, timeout, NULL, NULL);
+    if (frc == -1 && errno == ETIMEDOUT)
+        return Timeout;
+    return Success;
+}
+
+/**
+ * @brief: Picks the level a shared-scheduler worker serves next.
+ * 
+ * That is the highest priority with pending work, unless a lower level has been ready for aging_nsecs without being served; then the lowest such level goes first, so background work does not starve behind a steady stream of higher priorities. The clock is only read when more than one level is ready.
+ * 
+ * @param: pool -- the pool.
+ * @param: group -- the worker's group.
+ * @param: eligible -- bitmap of the levels the worker may run.
+ * @return: the level, or -1 if no eligible level has pending work.
+*/
+static int pool_pick_level(thread_pool_t* pool, pool_group_t* group, unsigned int eligible) {
+
+    unsigned int ready = atomic_load(&group->ready) & eligible;
+    if (ready == 0)
+        return -1;
+
+    int level = __builtin_ctz(ready);
+    if (pool->aging_nsecs == 0 || (ready & (ready - 1)) == 0)
+        return level;
+
+    uint64_t now = pool_now_nsecs();
+    for (int p = POOL_PRIORITY_LEVELS - 1; p > level; p--) {
+        if ((ready & (1u << p)) == 0)
+            continue;
+        uint64_t since = atomic_load(&group->ready_since[p]);
+        if (since < now && now - since >= pool->aging_nsecs)
+            return p;
+    }
+
+    return level;
+}
+
+/**
+ * @brief: Claims a batch of the work pending at a level.
+ * 
+ * A batch is at most this worker's fair share of what is pending, so a few long tasks still spread over all the threads. The claimed work requests are in the level's queue or about to be published there, so dequeuing them never waits for producers or races another worker for the last item.
+ * 
+ * @param: pool -- the pool.
+ * @param: group -- the worker's group.
+ * @param: level -- the level picked by pool_pick_level.
+ * @param: workers -- the number of workers sharing the group, at least 1.
+ * @return: the number of work requests claimed, 0 if other workers took them first.
+*/
+static uint32_t pool_claim(thread_pool_t* pool, pool_group_t* group, int level, int workers) {
+
+    unsigned int bit = 1u << level;
+    unsigned int pending = atomic_load(&group->pending[level]);
+    uint32_t share;
+
+    while (true) {
+        // A post racing with the last claim can leave the bit set on an empty level.
+        if (pending == 0) {
+            atomic_fetch_and(&group->ready, ~bit);
+            pending = atomic_load(&group->pending[level]);
+            if (pending == 0)
+                return 0;
+            atomic_fetch_or(&group->ready, bit);
+            continue;
+        }
+        share = pending / workers;
+        if (share < 1)
+            share = 1;
+        if (share > POOL_THREAD_BATCH)
+            share = POOL_THREAD_BATCH;
+        if (atomic_compare_exchange_weak(&group->pending[level], &pending, pending - share))
+            break;
+    }
+
+    if (pool->track_ready)
+        atomic_store(&group->ready_since[level], pool_now_nsecs());
+
+    // Took the last of it: clear the bit, and set it again if more was posted in between.
+    if (share == pending) {
+        atomic_fetch_and(&group->ready, ~bit);
+        if (atomic_load(&group->pending[level]) > 0 && (atomic_fetch_or(&group->ready, bit) & bit) == 0)
+            pool_group_wake(group, level, 1);
+    }
+
+    return share;
+}
+
+/**
+ * @brief: Parks a shared-scheduler worker until work it may run is posted or the pool stops.
+ * 
+ * The signal word is read before the final check for work so that a post racing with the check makes the futex wait return immediately. A worker that is not reserved only waits idle_nsecs while the pool runs more than min_workers and it has no fibers parked.
+ * 
+ * @param: self -- the calling worker.
+ * @param: eligible -- bitmap of the levels the worker may run.
+ * @return: Timeout if the worker waited out the idle timeout, Success otherwise.
+*/
+static rc_t pool_park(thread_pool_args_t* self, unsigned int eligible) {
+
+    thread_pool_t* pool = self->pool;
+    pool_group_t* group = self->group;
+    atomic_uint* signal = self->reserved ? &group->reserved_signal : &group->signal;
+    atomic_int* sleepers = self->reserved ? &group->reserved_sleepers : &group->sleepers;
+    rc_t rc = Success;
+
+    struct timespec idle = { (time_t)(pool->idle_nsecs / 1000000000ull), (long)(pool->idle_nsecs % 1000000000ull) };
+    struct timespec* timeout = NULL;
+    if (!self->reserved && atomic_load(&pool->live) > atomic_load(&pool->min_workers))
+        timeout = &idle;
+
+    unsigned int seen = atomic_load(signal);
+    atomic_fetch_add(sleepers, 1);
+
+    // A stopping pool's worker still waits for its parked fibers.
+    if ((atomic_load(&group->ready) & eligible) == 0 && (!atomic_load(&pool->stopping) || pool_fibers_parked() > 0)) {
+        STATS_ADD(pool->counters[self->index].parks, 1);
+        rc = pool_sleep(signal, seen, timeout);
+    }
+
+    atomic_fetch_sub(sleepers, 1);
+    return rc;
+}
+
+/**
+ * @brief: Decides whether a shared-scheduler worker leaves an elastic pool.
+ * 
+ * The last worker of a group that is not reserved never leaves, so work posted to a group always has a worker that is running or parked; an elastic pool keeps at least one worker per group.
+ * 
+ * @param: self -- the calling worker (not reserved).
+ * @param: bound -- the pool keeps at least this many workers.
+ * @return: true if the worker has to exit.
+*/
+static bool pool_retire(thread_pool_args_t* self, int bound) {
+
+    thread_pool_t* pool = self->pool;
+    pool_group_t* group = self->group;
+
+    int group_live = atomic_load(&group->live);
+    do {
+        if (group_live <= 1)
+            return false;
+    } while (!atomic_compare_exchange_weak(&group->live, &group_live, group_live - 1));
+
+    int live = atomic_load(&pool->live);
+    do {
+        if (live <= bound) {
+            atomic_fetch_add(&group->live, 1);
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&pool->live, &live, live - 1));
+
+    return true;
+}
+
+/**
+ * @brief: The function for the pool thread.
+ * 
+ * The pool thread serves its group's work queues. It picks a priority level from the group's ready bitmap, claims a batch of that level's work requests, dequeues them and does the function for each argument, handing each result straight to the map call or future that is waiting for it. With fibers each function runs on a fiber, and the thread resumes the parked ones between batches. A reserved thread only serves PoolPriorityHigh. Parks while there is nothing it may run, and exits once the pool is stopping, its levels are drained and no fiber of its own is parked. In an elastic pool a thread that is not reserved also exits after idling above min_workers, or between batches while the pool runs more than max_workers.
+ * 
+ * @param: arg the arguments (type thread_pool_args_st) which contains the group.
+ * @return: the rc_t value (Success, OutOfMemory etc.)
+*/
+
+void* pool_thread(void* arg) {
+
+    thread_pool_args_t* self = (thread_pool_args_t*) arg;
+
+    thread_pool_t* pool = self->pool;
+    pool_group_t* group = self->group;
+    unsigned int eligible = self->reserved ? 1u << PoolPriorityHigh : (1u << POOL_PRIORITY_LEVELS) - 1;
+
+    rc_t rc = Success;
+
+    pool_work_t work_requests[POOL_THREAD_BATCH];
+    pool_fibers_t fibers;
+    uint64_t mark = STATS_NOW();
+
+    pool_fibers_init(&fibers, pool->fiber_stack);
+    pool_current = pool;
+    pool_current_args = self;
+    pool_current_fibers = pool->fiber_stack > 0 ? &fibers : NULL;
+    self->batch = work_requests;
+    self->batch_next = 0;
+    self->batch_count = 0;
+    future_set_helper(pool_help_future, pool);
+
+    while (true) {
+
+        pool_poll_io(pool);
+        pool_fibers_resume(pool_current_fibers);
+
+        // pool_resize lowered max_workers: the first workers to notice leave.
+        if (!self->reserved && pool_fibers_parked() == 0 && atomic_load(&pool->live) > atomic_load(&pool->max_workers) &&
+            pool_retire(self, atomic_load(&pool->max_workers)))
+            break;
+
+        int level = pool_pick_level(pool, group, eligible);
+        if (level < 0) {
+            if (atomic_load(&pool->stopping) && pool_fibers_parked() == 0)
+                break;
+            if (pool_park(self, eligible) == Timeout && pool_retire(self, atomic_load(&pool->min_workers)))
+                break;
+            continue;
+        }
+
+        int workers = atomic_load(&group->live) + group->num_reserved;
+        uint32_t count = pool_claim(pool, group, level, workers > 0 ? workers : 1);
+
+        // get work requests, copied out so the slots can be reused while the functions run
+        for (uint32_t got = 0; got < count; ) {
+            uint32_t dequeued;
+            rc = cqueue_dequeue_batch(&group->work_queue[level], &work_requests[got], sizeof(pool_work_t),
+                                      count - got, &dequeued, NULL);
+            if (rc != Success) {
+                fprintf(stderr, "There was an error dequeueing, error value was %d\n", rc);
+                return (rc_t*) rc;
+            }
+            got += dequeued;
+        }
+
+        if (count == 0)
+            continue;
+        pool_trace_dequeued(pool, work_requests, count);
+
+        pool_count_idle(pool, self->index, &mark);
+
+        // A task that waits runs the rest of the batch first (see pool_help).
+        self->batch_next = 0;
+        self->batch_count = count;
+        while (self->batch_next < self->batch_count)
+            pool_dispatch(&work_requests[self->batch_next++]);
+
+        pool_count_busy(pool, self->index, &mark);
+    }
+
+    pool_fibers_destroy(&fibers);
+    pool_current_fibers = NULL;
+    atomic_store(&self->state, POOL_SLOT_EXITED);
+    return (rc_t*) rc;
+
+}
+
+/**
+ * @brief: Wakes parked work-stealing workers after new work became visible.
+ * 
+ * The signal word is bumped unconditionally so a worker that is about to park sees the change; the futex syscall is only made when someone is actually parked.
+ * 
+ * @param: pool -- the pool whose workers are signalled.
+*/
+static void pool_ws_signal(thread_pool_t* pool) {
+    atomic_fetch_add(&pool->ws_signal, 1);
+    if (atomic_load(&pool->ws_sleepers) > 0)
+        syscall(SYS_futex, &pool->ws_signal, FUTEX_WAKE, INT_MAX, NULL, NULL, NULL);
+}
+
+/**
+ * @brief: The group on the caller's NUMA node.
+ * 
+ * Callers on a node without workers are spread round robin over the groups.
+ * 
+ * @param: pool -- the pool.
+ * @return: the group index.
+*/
+static int pool_local_group(thread_pool_t* pool) {
+
+    if (pool->num_groups == 1)
+        return 0;
+
+    int node = topology_current_node();
+    if (node >= 0 && node < pool->num_nodes && pool->node_group[node] >= 0)
+        return pool->node_group[node];
+
+    return atomic_fetch_add(&pool->next_group, 1) % pool->num_groups;
+}
+
+static bool pool_queue_saturated(cqueue_t* queue) {
+    uint64_t capacity = queue->obj->num_blocks;
+    uint32_t queued;
+
+    // A segmented queue only fills up at its high-water mark.
+    if (queue->obj->mode == CqueueModeSegmented) {
+        if (queue->obj->max_segments == 0)
+            return false;
+        capacity *= queue->obj->max_segments;
+    }
+
+    return cqueue_size(queue, &queued) == Success && queued >= capacity;
+}
+
+/**
+ * @brief: The group a shared-scheduler submission goes to.
+ * 
+ * @param: pool -- the pool.
+ * @param: level -- the priority of the submission.
+ * @return: the local group, or the first remote group with room in the level's queue when the local one is full.
+*/
+static pool_group_t* pool_shared_group(thread_pool_t* pool, int level) {
+
+    int local = pool_local_group(pool);
+    pool_group_t* group = &pool->groups[local];
+    if (pool->num_groups == 1 || !pool_queue_saturated(&group->work_queue[level]))
+        return group;
+
+    for (int i = 1; i < pool->num_groups; i++) {
+        pool_group_t* remote = &pool->groups[(local + i) % pool->num_groups];
+        if (!pool_queue_saturated(&remote->work_queue[level]))
+            return remote;
+    }
+
+    return group;
+}
+
+// Round robin over the workers of the group that may run the level. High work goes to the reserved workers when there are any, as the others may all be held up by lower priorities; the rest of the group steals it from their deques.
+static int pool_group_next_worker(pool_group_t* group, int level) {
+    int first = group->first_worker;
+    int count = group->num_workers;
+
+    if (level != PoolPriorityHigh) {
+        first += group->num_reserved;
+        count -= group->num_reserved;
+    } else if (group->num_reserved > 0) {
+        count = group->num_reserved;
+    }
+
+    return first + atomic_fetch_add(&group->next_worker, 1) % count;
+}
+
+/**
+ * @brief: The worker a work-stealing submission goes to.
+ * 
+ * Reserved workers are only picked for PoolPriorityHigh work, and are the only ones picked for it.
+ * 
+ * @param: pool -- the pool.
+ * @param: level -- the priority of the submission.
+ * @return: the next worker of the local group round robin, or of the first remote group with room in its inbox when the local pick is full.
+*/
+static int pool_ws_pick_worker(thread_pool_t* pool, int level) {
+
+    int local = pool_local_group(pool);
+    int worker_index = pool_group_next_worker(&pool->groups[local], level);
+    if (pool->num_groups == 1 || !pool_queue_saturated(&pool->workers[worker_index].inbox))
+        return worker_index;
+
+    for (int i = 1; i < pool->num_groups; i++) {
+        int remote = pool_group_next_worker(&pool->groups[(local + i) % pool->num_groups], level);
+        if (!pool_queue_saturated(&pool->workers[remote].inbox))
+            return remote;
+    }
+
+    return worker_index;
+}
+
+/**
+ * @brief: Hands a batch of work requests to a work-stealing worker through its inbox.
+ * 
+ * @param: pool -- the pool.
+ * @param: worker_index -- the worker to hand the work to.
+ * @param: work_requests -- count pointers to work requests; each must stay valid until it has run.
+ * @param: count -- the number of work requests.
+ * @param: sent -- receives how many were enqueued, all of them on Success and possibly some on an error.
+ * @return: the rc_t value (Success, OutOfMemory etc.)
+*/
+static rc_t pool_ws_enqueue_batch(thread_pool_t* pool, int worker_index, pool_work_t** work_requests, uint32_t count,
+                                  uint32_t* sent) {
+
+    cqueue_t* inbox = &pool->workers[worker_index].inbox;
+
+    // Signal after every partial batch: the owner has to run to make room in a full inbox.
+    *sent = 0;
+    while (count > 0) {
+        uint32_t enqueued;
+        rc_t rc = cqueue_enqueue_batch(inbox, work_requests, sizeof(pool_work_t*), count, &enqueued, NULL);
+        if (rc != Success) {
+            fprintf(stderr, "Error calling cqueue enqueue batch.\n");
+            return rc;
+        }
+        pool_ws_signal(pool);
+        work_requests += enqueued;
+        count -= enqueued;
+        *sent += enqueued;
+    }
+
+    return Success;
+}
+
+/**
+ * @brief: Hands a work request to a work-stealing worker through its inbox.
+ * 
+ * Only the owner may push on its Chase-Lev deque, so outside submitters go through the worker's inbox queue and the owner moves the items onto its deque. Only the pointer travels through the inbox and the deque.
+ * 
+ * @param: pool -- the pool.
+ * @param: worker_index -- the worker to hand the work to.
+ * @param: work_request -- the work request; must stay valid until it has run.
+ * @return: the rc_t value (Success, OutOfMemory etc.)
+*/
+static rc_t pool_ws_enqueue(thread_pool_t* pool, int worker_index, pool_work_t* work_request) {
+
+    uint32_t sent;
+    return pool_ws_enqueue_batch(pool, worker_index, &work_request, 1, &sent);
+}
+
+/**
+ * @brief: Moves everything in the worker's inbox onto its deque for each request's priority.
+ * 
+ * @param: self -- the calling worker.
+ * @param: stopping -- set to true if a sentinel (NULL function pointer) was found.
+ * @return: the rc_t value (Success, OutOfMemory etc.)
+*/
+static rc_t pool_ws_drain_inbox(pool_worker_t* self, bool* stopping) {
+
+    rc_t rc;
+    uint32_t available;
+    uint32_t pushed = 0;
+    pool_work_t* work_requests[POOL_THREAD_BATCH];
+
+    rc = cqueue_size(&self->inbox, &available);
+    if (rc != Success)
+        return rc;
+
+    // This worker is the only consumer of its inbox, so none of these dequeues can block.
+    while (available > 0) {
+        uint32_t count;
+
+        rc = cqueue_dequeue_batch(&self->inbox, work_requests, sizeof(pool_work_t*),
+                                  available < POOL_THREAD_BATCH ? available : POOL_THREAD_BATCH, &count, NULL);
+        if (rc != Success) {
+            fprintf(stderr, "There was an error dequeueing, error value was %d\n", rc);
+            return rc;
+        }
+        available -= count;
+
+        for (uint32_t i = 0; i < count; i++) {
+            if (work_requests[i]->function_ptr == NULL) {
+                *stopping = true;
+                continue;
+            }
+
+            rc = wsdeque_push(&self->deque[work_requests[i]->priority], work_requests[i]);
+            if (rc != Success)
+                return rc;
+            pushed++;
+        }
+    }
+
+    // Keep one for ourselves; the rest are up for grabs.
+    if (pushed > 1)
+        pool_ws_signal(self->pool);
+
+    return Success;
+}
+
+// Tries the level's deques of workers first .. first + count - 1, starting at a random one.
+static pool_work_t* pool_ws_steal_range(pool_worker_t* self, int first, int count, uint32_t random, int level) {
+
+    thread_pool_t* pool = self->pool;
+
+    int start = random % count;
+    for (int i = 0; i < count; i++) {
+        int victim = first + (start + i) % count;
+        if (victim == self->index)
+            continue;
+
+        pool_work_t* work_request;
+        if (wsdeque_steal(&pool->workers[victim].deque[level], (void**)&work_request) == Success) {
+            STATS_ADD(pool->counters[self->index].steals, 1);
+            return work_request;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief: Tries to steal one work request, starting from a random victim.
+ * 
+ * Higher priorities are tried first, and at each level victims on the worker's own node before the rest of the pool. A reserved worker only steals PoolPriorityHigh work.
+ * 
+ * @param: self -- the calling worker.
+ * @return: the stolen work request or NULL if every other deque was empty.
+*/
+static pool_work_t* pool_ws_steal(pool_worker_t* self) {
+
+    thread_pool_t* pool = self->pool;
+
+    if (pool->size < 2)
+        return NULL;
+
+    // xorshift32
+    uint32_t x = self->rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    self->rand_state = x;
+
+    pool_group_t* group = &pool->groups[self->group];
+    int levels = self->reserved ? 1 : POOL_PRIORITY_LEVELS;
+    pool_work_t* work_request = NULL;
+
+    for (int p = 0; p < levels && work_request == NULL; p++) {
+        work_request = pool_ws_steal_range(self, group->first_worker, group->num_workers, x, p);
+        if (work_request == NULL && pool->num_groups > 1)
+            work_request = pool_ws_steal_range(self, 0, pool->size, x, p);
+    }
+
+    return work_request;
+}
+
+/**
+ * @brief: Pops the next work request from the worker's own deques.
+ * 
+ * The highest priority goes first, unless a lower level was not served for aging_nsecs; then it gets one turn. A level found empty counts as served. A reserved worker only pops PoolPriorityHigh work.
+ * 
+ * @param: self -- the calling worker.
+ * @return: the work request or NULL if the worker's deques are empty.
+*/
+static pool_work_t* pool_ws_pop(pool_worker_t* self) {
+
+    thread_pool_t* pool = self->pool;
+    int levels = self->reserved ? 1 : POOL_PRIORITY_LEVELS;
+    pool_work_t* work_request;
+    uint64_t now = 0;
+
+    if (pool->aging_nsecs != 0 && levels > 1) {
+        now = pool_now_nsecs();
+        for (int p = levels - 1; p > 0; p--) {
+            if (now - self->served_nsecs[p] < pool->aging_nsecs)
+                continue;
+            self->served_nsecs[p] = now;
+            if (wsdeque_pop(&self->deque[p], (void**)&work_request) == Success)
+                return work_request;
+        }
+    }
+
+    for (int p = 0; p < levels; p++) {
+        if (wsdeque_pop(&self->deque[p], (void**)&work_request) == Success) {
+            if (now != 0)
+                self->served_nsecs[p] = now;
+            return work_request;
+        }
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief: Parks the worker until some other thread publishes work.
+ * 
+ * The signal word is read before the final check for work so that a push racing with the check makes the futex wait return immediately.
+ * 
+ * @param: self -- the calling worker.
+*/
+static void pool_ws_park(pool_worker_t* self) {
+
+    thread_pool_t* pool = self->pool;
+    unsigned int seen = atomic_load(&pool->ws_signal);
+    atomic_fetch_add(&pool->ws_sleepers, 1);
+
+    bool idle = true;
+    uint32_t size;
+    if (cqueue_size(&self->inbox, &size) == Success && size > 0)
+        idle = false;
+
+    // A reserved worker stays parked while there is only work it may not run.
+    int levels = self->reserved ? 1 : POOL_PRIORITY_LEVELS;
+    for (int i = 0; idle && i < pool->size; i++) {
+        for (int p = 0; idle && p < levels; p++) {
+            if (wsdeque_size(&pool->workers[i].deque[p], &size) == Success && size > 0)
+                idle = false;
+        }
+    }
+
+    if (idle) {
+        STATS_ADD(pool->counters[self->index].parks, 1);
+        pool_sleep(&pool->ws_signal, seen, NULL);
+    }
+
+    atomic_fetch_sub(&pool->ws_sleepers, 1);
+}
+
+/**
+ * @brief: The function for a work-stealing pool thread.
+ * 
+ * The worker moves new work from its inbox onto its own deques, pops from the bottom of the highest-priority one (see pool_ws_pop), and steals from the top of a random victim's deques when it runs dry. With fibers each task runs on a fiber, and the worker resumes the parked ones between tasks. A sentinel in the inbox marks the worker as stopping; it keeps helping until there is nothing left to run and no fiber of its own parked, and then exits.
+ * @param: arg the pool_worker_t for this thread.
+ * @return: the rc_t value (Success, OutOfMemory etc.)
+*/
+static void* pool_ws_thread(void* arg) {
+
+    pool_worker_t* self = (pool_worker_t*) arg;
+
+    rc_t rc = Success;
+    uint64_t mark = STATS_NOW();
+
+    pool_fibers_t fibers;
+
+    pool_fibers_init(&fibers, self->pool->fiber_stack);
+    pool_current = self->pool;
+    pool_current_worker = self;
+    pool_current_fibers = self->pool->fiber_stack > 0 ? &fibers : NULL;
+    future_set_helper(pool_help_future, self->pool);
+
+    while (true) {
+
+        pool_poll_io(self->pool);
+        pool_fibers_resume(pool_current_fibers);
+
+        rc = pool_ws_drain_inbox(self, &self->stopping);
+        if (rc != Success)
+            return (rc_t*) rc;
+
+        pool_work_t* work_request = pool_ws_pop(self);
+        if (work_request == NULL)
+            work_request = pool_ws_steal(self);
+
+        if (work_request == NULL) {
+            if (self->stopping && pool_fibers_parked() == 0)
+                break;
+            pool_ws_park(self);
+            continue;
+        }
+
+        pool_trace_dequeued(self->pool, work_request, 1);
+        pool_count_idle(self->pool, self->index, &mark);
+        pool_dispatch(work_request);
+        pool_count_busy(self->pool, self->index, &mark);
+    }
+
+    pool_fibers_destroy(&fibers);
+    pool_current_fibers = NULL;
+    return (rc_t*) rc;
+}
+
+// pool_help found nothing to run: the waiter may sleep, unless I/O is in flight whose callbacks it might be waiting for.
+static rc_t pool_help_idle(bool io_pending) {
+    if (!io_pending)
+        return QueueEmpty;
+    sched_yield();
+    return Success;
+}
+
+/**
+ * @brief: Runs one piece of the pool's queued work on the calling worker, instead of letting it block.
+ * 
+ * Waits inside the pool's workers call this until what they wait for is done: pool_map, pool_parallel_for, pool_graph_run, and future_wait and friends (through the future helper every worker installs). A shared-scheduler worker first runs what is left of the batch it claimed, so work it holds never waits behind its own blocked task; then it claims single work requests from its group. A work-stealing worker pops from its own deques and steals, as its loop does. Work from outside the nesting may run on the waiting worker first, and the wait only returns once that is done. In a pool with fibers the calling task's fiber yields instead, and its worker runs the work before it resumes the task; the waits of the pool's primitives park the fiber themselves and do not call this.
+ * 
+ * @param: pool -- thread pool object.
+ * @return: the rc_t value (Success when work was run or may be left to run, or I/O is in flight; QueueEmpty when the worker found nothing it may run, InvalidOperation when the caller is not a worker of pool)
+*/
+rc_t pool_help(thread_pool_t* pool) {
+
+    if (pool == NULL || pool_current != pool)
+        return InvalidOperation;
+
+    // A task on a fiber does not nest other tasks on its small stack: it parks, and its worker runs them.
+    if (pool_current_fibers != NULL && fiber_yield() == Success)
+        return Success;
+
+    // Waiting on I/O in flight is left to the ring, which the helper keeps polling instead of sleeping.
+    bool io_pending = pool_poll_io(pool);
+
+    if (pool->scheduler == PoolSchedulerWorkStealing) {
+        pool_worker_t* self = pool_current_worker;
+
+        rc_t rc = pool_ws_drain_inbox(self, &self->stopping);
+        if (rc != Success)
+            return rc;
+
+        pool_work_t* work_request = pool_ws_pop(self);
+        if (work_request == NULL)
+            work_request = pool_ws_steal(self);
+        if (work_request == NULL)
+            return pool_help_idle(io_pending);
+
+        pool_trace_dequeued(pool, work_request, 1);
+        pool_execute(work_request);
+        return Success;
+    }
+
+    thread_pool_args_t* self = pool_current_args;
+    pool_group_t* group = self->group;
+
+    if (self->batch_next < self->batch_count) {
+        pool_execute(&self->batch[self->batch_next++]);
+        return Success;
+    }
+
+    unsigned int eligible = self->reserved ? 1u << PoolPriorityHigh : (1u << POOL_PRIORITY_LEVELS) - 1;
+    int level = pool_pick_level(pool, group, eligible);
+    if (level < 0)
+        return pool_help_idle(io_pending);
+
+    // One at a time, so nothing is held back while the helper runs it.
+    if (pool_claim(pool, group, level, INT_MAX) == 0)
+        return Success;
+
+    pool_work_t work_request;
+    uint32_t dequeued;
+    rc_t rc = cqueue_dequeue_batch(&group->work_queue[level], &work_request, sizeof(pool_work_t), 1, &dequeued, NULL);
+    if (rc != Success) {
+        fprintf(stderr, "There was an error dequeueing, error value was %d\n", rc);
+        return rc;
+    }
+
+    pool_trace_dequeued(pool, &work_request, 1);
+    pool_execute(&work_request);
+    return Success;
+}
+
+/**
+ * @brief: Tells whether the calling thread is one of the pool's workers.
+ * 
+ * @param: pool -- thread pool object.
+ * @return: true inside the pool's tasks and workers.
+*/
+bool pool_in_worker(thread_pool_t* pool) {
+    return pool != NULL && pool_current == pool;
+}
+
+// The future helper of every worker: future waits on a worker run the pool's work.
+static bool pool_help_future(void* ctx) {
+    return pool_help((thread_pool_t*) ctx) == Success;
+}
+
+/**
+ * @brief: Waits until the completion latch *pending drops to zero.
+ * 
+ * On one of the pool's workers the wait runs queued work (see pool_help) and only sleeps once there is none it may run: what it waits for is then running on other workers, whose completions wake it. On a fiber it parks the fiber until the latch moves.
+ * 
+ * @param: pool -- the pool the latch's work was handed to.
+ * @param: pending -- the latch, counted down by the work.
+*/
+static void pool_wait_latch(thread_pool_t* pool, atomic_uint* pending) {
+
+    unsigned int value;
+    while ((value = atomic_load(pending)) != 0) {
+        if (fiber_wait(pending, value, NULL) != InvalidOperation)
+            continue;
+        if (pool_current == pool && pool_help(pool) == Success)
+            continue;
+        syscall(SYS_futex, pending, FUTEX_WAIT, value, NULL, NULL, NULL);
+    }
+}
+
+/**
+ * @brief: Sets the pool attributes to their defaults.
+ * 
+ * @param: attrs -- the attributes to initialize.
+ * @return: the rc_t value (Success, OutOfMemory etc.)
+*/
+rc_t pool_attr_init(pool_attr_t* attrs) {
+
+    if (attrs == NULL) {
+        fprintf(stderr, "On pool_attr_init the attrs cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    cqueue_attr_t queue_attrs;
+    rc_t rc = cqueue_attr_init(&queue_attrs);
+    if (rc != Success)
+        return rc;
+
+    attrs->pool_size = 1;
+    attrs->min_workers = 0;
+    attrs->max_workers = 0;
+    attrs->idle_usecs = POOL_DEFAULT_IDLE_USECS;
+    attrs->spawn_wait_usecs = POOL_DEFAULT_SPAWN_WAIT_USECS;
+    attrs->scheduler = PoolSchedulerShared;
+    attrs->queue_blocks = queue_attrs.num_blocks;
+    attrs->queue_mode = queue_attrs.mode;
+    attrs->queue_max_segments = queue_attrs.max_segments;
+    attrs->affinity = PoolAffinityNone;
+    attrs->cpus = NULL;
+    attrs->num_cpus = 0;
+    attrs->numa_groups = false;
+    attrs->reserved_workers = 0;
+    attrs->aging_usecs = POOL_DEFAULT_AGING_USECS;
+    attrs->trace = false;
+    attrs->trace_events = 0;
+    attrs->io_entries = 0;
+    attrs->fibers = false;
+    attrs->fiber_stack_size = 0;
+
+    return Success;
+}
+
+/**
+ * @brief: Creates the pool and its threads.
+ * 
+ * 
+ * Creates the pool with the default (shared queue) scheduler. See pool_create_attr.
+ * 
+ * @param: pool -- the pointer to the pool object declared outside the funciton.
+ * @param: pool_size -- the size of the pool (or number of threads).
+ * @return: the rc_t value (Success, OutOfMemory etc.)
+*/
+rc_t pool_create(thread_pool_t* pool, int pool_size) {
+
+    pool_attr_t attrs;
+    rc_t rc = pool_attr_init(&attrs);
+    if (rc != Success)
+        return rc;
+
+    attrs.pool_size = pool_size;
+
+    return pool_create_attr(pool, &attrs);
+}
+
+/**
+ * @brief: Creates a queue whose memory prefers the given NUMA node.
+ * 
+ * @param: queue -- the queue handle to initialize.
+ * @param: attrs -- the queue attributes.
+ * @param: node -- the node, or -1 to allocate with malloc as usual.
+ * @return: the rc_t value (Success, OutOfMemory etc.)
+*/
+static rc_t pool_create_queue(cqueue_t* queue, cqueue_attr_t* attrs, int node) {
+
+    if (node < 0)
+        return cqueue_create(queue, attrs);
+
+    int size;
+    rc_t rc = cqueue_alloc_size(attrs, &size);
+    if (rc != Success)
+        return rc;
+
+    // cqueue_destroy releases the memory with free, which posix_memalign memory allows.
+    cqueue_obj_t* obj = topology_alloc_on_node(size, node);
+    if (obj == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        return OutOfMemory;
+    }
+
+    rc = cqueue_init(queue, obj, attrs);
+    if (rc != Success)
+        free(obj);
+
+    return rc;
+}
+
+/**
+ * @brief: Creates the per-worker inboxes and deques for the work-stealing scheduler.
+ * 
+ * @param: pool -- the pool (size and groups already set).
+ * @param: attrs -- the pool attributes (queue depth and mode of the inboxes).
+ * @return: the rc_t value (Success, OutOfMemory etc.)
+*/
+static rc_t pool_ws_create_workers(thread_pool_t* pool, pool_attr_t* attrs) {
+
+    rc_t rc;
+
+    // Zeroed, so a failed create can tell which inboxes and deques exist.
+    pool->workers = calloc(pool->size, sizeof(pool_worker_t));
+    if (pool->workers == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        return OutOfMemory;
+    }
+
+    atomic_init(&pool->ws_signal, 0);
+    atomic_init(&pool->ws_sleepers, 0);
+
+    cqueue_attr_t inbox_attrs;
+    rc = cqueue_attr_init(&inbox_attrs);
+    if (rc != Success) {
+        fprintf(stderr, "Error calling attr init.\n");
+        return rc;
+    }
+    inbox_attrs.block_size = sizeof(pool_work_t*);
+    inbox_attrs.num_blocks = attrs->queue_blocks;
+    inbox_attrs.mode = attrs->queue_mode;
+    inbox_attrs.max_segments = attrs->queue_max_segments;
+
+    for (int g = 0; g < pool->num_groups; g++) {
+        pool_group_t* group = &pool->groups[g];
+
+        for (int i = group->first_worker; i < group->first_worker + group->num_workers; i++) {
+            pool_worker_t* worker = &pool->workers[i];
+            worker->pool = pool;
+            worker->index = i;
+            worker->group = g;
+            worker->rand_state = 2654435761u * (i + 1);
+            worker->reserved = i < group->first_worker + group->num_reserved;
+            worker->stopping = false;
+
+            rc = pool_create_queue(&worker->inbox, &inbox_attrs, group->node);
+            if (rc != Success) {
+                fprintf(stderr, "Error calling cqueue create.\n");
+                return rc;
+            }
+
+            for (int p = 0; p < POOL_PRIORITY_LEVELS; p++) {
+                worker->served_nsecs[p] = 0;
+                rc = wsdeque_create(&worker->deque[p], WSDEQUE_DEFAULT_CAPACITY);
+                if (rc != Success) {
+                    fprintf(stderr, "Error calling wsdeque create.\n");
+                    return rc;
+                }
+            }
+        }
+    }
+
+    return Success;
+}
+
+/*
+ * Where each worker runs. cpus is NULL when the worker is not pinned; node is
+ * -1 when the pool is not split into NUMA groups.
+ */
+typedef struct pool_placement_st {
+    const int* cpus;
+    int num_cpus;
+    int node;
+} pool_placement_t;
+
+typedef struct pool_layout_st {
+    pool_placement_t* workers;   // by worker index, grouped by node
+    int* cpus;                   // backs the cpus lists above
+} pool_layout_t;
+
+/**
+ * @brief: Decides each worker's CPUs and node and sets up the pool's groups.
+ * 
+ * Without pinning, a NUMA group still restricts its workers to the CPUs of its node, so the node's queue memory stays local to them. Workers are dealt round robin over the nodes that have allowed CPUs.
+ * 
+ * @param: pool -- the pool (size already set).
+ * @param: attrs -- the pool attributes (affinity, cpus, numa_groups).
+ * @param: layout -- receives the placements; release with pool_free_layout.
+ * @return: the rc_t value (Success, OutOfMemory, InvalidArgument)
+*/
+static rc_t pool_plan_layout(thread_pool_t* pool, pool_attr_t* attrs, pool_layout_t* layout) {
+
+    rc_t rc = Success;
+    int size = pool->size;
+    int nodes = attrs->numa_groups ? topology_num_nodes() : 1;
+    int num_allowed = attrs->cpus != NULL ? attrs->num_cpus : topology_num_cpus();
+
+    if (num_allowed <= 0) {
+        fprintf(stderr, "The cpu set cannot be empty.\n");
+        return InvalidArgument;
+    }
+
+    // The allowed CPUs in the caller's order, followed by the same CPUs sorted by node.
+    layout->cpus = malloc(sizeof(int) * 2 * num_allowed);
+    layout->workers = malloc(sizeof(pool_placement_t) * size);
+    pool->groups = calloc(nodes, sizeof(pool_group_t));
+    int* node_start = calloc(nodes + 1, sizeof(int));
+    int* node_fill = calloc(nodes, sizeof(int));
+    pool_placement_t* planned = malloc(sizeof(pool_placement_t) * size);
+
+    if (layout->cpus == NULL || layout->workers == NULL || pool->groups == NULL ||
+        node_start == NULL || node_fill == NULL || planned == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        rc = OutOfMemory;
+        goto done;
+    }
+
+    int* allowed = layout->cpus;
+    int* by_node = layout->cpus + num_allowed;
+
+    for (int i = 0; i < num_allowed; i++) {
+        allowed[i] = attrs->cpus != NULL ? attrs->cpus[i] : i;
+        int node = attrs->numa_groups ? topology_cpu_node(allowed[i]) : 0;
+        node_start[node + 1]++;
+    }
+    for (int node = 0; node < nodes; node++)
+        node_start[node + 1] += node_start[node];
+    for (int i = 0; i < num_allowed; i++) {
+        int node = attrs->numa_groups ? topology_cpu_node(allowed[i]) : 0;
+        by_node[node_start[node] + node_fill[node]++] = allowed[i];
+    }
+
+    int used_nodes = 0;
+    for (int node = 0; node < nodes; node++)
+        if (node_start[node + 1] > node_start[node])
+            used_nodes++;
+
+    for (int i = 0; i < size; i++) {
+        pool_placement_t* placement = &planned[i];
+
+        if (attrs->affinity == PoolAffinityPerCore) {
+            placement->cpus = &allowed[i % num_allowed];
+            placement->num_cpus = 1;
+            placement->node = attrs->numa_groups ? topology_cpu_node(*placement->cpus) : -1;
+        } else if (attrs->numa_groups) {
+            int pick = i % used_nodes;
+            int node = 0;
+            while (node_start[node + 1] == node_start[node] || pick-- > 0)
+                node++;
+            placement->cpus = &by_node[node_start[node]];
+            placement->num_cpus = node_start[node + 1] - node_start[node];
+            placement->node = node;
+        } else {
+            placement->cpus = attrs->affinity == PoolAffinityCpuSet ? allowed : NULL;
+            placement->num_cpus = num_allowed;
+            placement->node = -1;
+        }
+    }
+
+    pool->num_groups = 0;
+    pool->num_nodes = 0;
+    pool->node_group = NULL;
+
+    if (!attrs->numa_groups) {
+        pool->groups[0].node = -1;
+        pool->groups[0].first_worker = 0;
+        pool->groups[0].num_workers = size;
+        atomic_init(&pool->groups[0].next_worker, 0);
+        pool->num_groups = 1;
+        for (int i = 0; i < size; i++)
+            layout->workers[i] = planned[i];
+        goto done;
+    }
+
+    pool->node_group = malloc(sizeof(int) * nodes);
+    if (pool->node_group == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        rc = OutOfMemory;
+        goto done;
+    }
+    pool->num_nodes = nodes;
+
+    int next = 0;
+    for (int node = 0; node < nodes; node++) {
+        int first = next;
+        for (int i = 0; i < size; i++)
+            if (planned[i].node == node)
+                layout->workers[next++] = planned[i];
+
+        pool->node_group[node] = -1;
+        if (next == first)
+            continue;
+
+        pool_group_t* group = &pool->groups[pool->num_groups];
+        group->node = node;
+        group->first_worker = first;
+        group->num_workers = next - first;
+        atomic_init(&group->next_worker, 0);
+        pool->node_group[node] = pool->num_groups++;
+    }
+
+done:
+    free(node_start);
+    free(node_fill);
+    free(planned);
+    return rc;
+}
+
+static void pool_free_layout(pool_layout_t* layout) {
+    free(layout->workers);
+    free(layout->cpus);
+}
+
+/**
+ * @brief: Starts the thread of a worker slot, restricted to the CPUs its placement allows.
+ * 
+ * @param: pool -- the pool (layout and worker state set up).
+ * @param: index -- the worker slot.
+ * @return: the rc_t value (Success, Error etc.)
+*/
+static rc_t pool_start_worker(thread_pool_t* pool, int index) {
+
+    rc_t rc;
+    pthread_attr_t thread_attrs;
+    pthread_attr_init(&thread_attrs);
+
+    pool_placement_t* placement = &pool->layout->workers[index];
+    if (placement->cpus != NULL) {
+        rc = topology_thread_attr(&thread_attrs, placement->cpus, placement->num_cpus);
+        if (rc != Success) {
+            pthread_attr_destroy(&thread_attrs);
+            return rc;
+        }
+    }
+
+    int prc;
+    if (pool->scheduler == PoolSchedulerWorkStealing)
+        prc = pthread_create(&pool->threads[index], &thread_attrs, pool_ws_thread, &pool->workers[index]);
+    else
+        prc = pthread_create(&pool->threads[index], &thread_attrs, pool_thread, &pool->thread_args[index]);
+    pthread_attr_destroy(&thread_attrs);
+
+    if (prc != 0) {
+        fprintf(stderr, "There was a problem during creation for pthread with error=%d\n", prc);
+        return Error;
+    }
+
+    return Success;
+}
+
+/**
+ * @brief: Starts a shared-scheduler worker in a free slot of the group, unless the pool is at max_workers or stopping.
+ * 
+ * Called with resize_lock held. A slot whose worker retired is joined before it is reused.
+ * 
+ * @param: pool -- the pool.
+ * @param: group -- the group that gets the worker.
+ * @return: true if a worker was started.
+*/
+static bool pool_spawn_locked(thread_pool_t* pool, pool_group_t* group) {
+
+    if (atomic_load(&pool->stopping) || atomic_load(&pool->live) >= atomic_load(&pool->max_workers))
+        return false;
+
+    for (int i = group->first_worker + group->num_reserved; i < group->first_worker + group->num_workers; i++) {
+        thread_pool_args_t* slot = &pool->thread_args[i];
+        int state = atomic_load(&slot->state);
+        if (state == POOL_SLOT_RUNNING)
+            continue;
+        if (state == POOL_SLOT_EXITED)
+            pthread_join(pool->threads[i], NULL);
+
+        atomic_store(&slot->state, POOL_SLOT_RUNNING);
+        atomic_fetch_add(&pool->live, 1);
+        atomic_fetch_add(&group->live, 1);
+
+        if (pool_start_worker(pool, i) != Success) {
+            atomic_fetch_sub(&group->live, 1);
+            atomic_fetch_sub(&pool->live, 1);
+            atomic_store(&slot->state, POOL_SLOT_EMPTY);
+            return false;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief: Starts another worker in a group whose posted work no parked worker could take, if the group is falling behind.
+ * 
+ * The group is behind when it has no worker yet, when more work is pending at the level than its workers claim in one batch each, or when the level has been waiting spawn_nsecs since it was last served. At most one worker is started per post, and only if resize_lock is free: whoever holds it is already starting workers.
+ * 
+ * @param: pool -- the pool (below max_workers).
+ * @param: group -- the group the work was posted to.
+ * @param: level -- the priority of the work.
+*/
+static void pool_grow(thread_pool_t* pool, pool_group_t* group, int level) {
+
+    int live = atomic_load(&group->live);
+    bool behind = live == 0 || atomic_load(&group->pending[level]) > (unsigned int)live * POOL_THREAD_BATCH;
+
+    if (!behind && pool->spawn_nsecs != 0) {
+        uint64_t since = atomic_load(&group->ready_since[level]);
+        uint64_t now = pool_now_nsecs();
+        behind = since < now && now - since >= pool->spawn_nsecs;
+    }
+
+    if (!behind)
+        return;
+
+    // A group without any worker must get one.
+    if (live == 0)
+        pthread_mutex_lock(&pool->resize_lock);
+    else if (pthread_mutex_trylock(&pool->resize_lock) != 0)
+        return;
+
+    pool_spawn_locked(pool, group);
+    pthread_mutex_unlock(&pool->resize_lock);
+}
+
+/**
+ * @brief: Starts shared-scheduler workers round robin over the groups until the pool runs count of them or no group has room.
+ * 
+ * Called with resize_lock held, or before any worker runs.
+ * 
+ * @param: pool -- the pool.
+ * @param: count -- the number of workers wanted, reserved ones included.
+*/
+static void pool_spawn_to(thread_pool_t* pool, int count) {
+
+    bool started = true;
+    while (started && atomic_load(&pool->live) < count) {
+        started = false;
+        for (int g = 0; g < pool->num_groups && atomic_load(&pool->live) < count; g++)
+            started |= pool_spawn_locked(pool, &pool->groups[g]);
+    }
+}
+
+/**
+ * @brief: Frees everything a pool holds besides its threads, in the reverse order pool_create_attr set it up.
+ * 
+ * Also undoes a pool_create_attr that failed part-way: whatever was not set up yet is NULL or empty. No worker may be running.
+ * 
+ * @param: pool -- the pool.
+*/
+static void pool_release(thread_pool_t* pool) {
+
+    // The workers are gone, so only the completion thread still reaps the ring.
+    pool_io_ring_destroy(pool->io);
+    pool->io = NULL;
+
+    if (pool->workers != NULL) {
+        for (int i = 0; i < pool->size; i++) {
+            if (pool->workers[i].inbox.obj != NULL)
+                cqueue_destroy(&pool->workers[i].inbox);
+            for (int p = 0; p < POOL_PRIORITY_LEVELS; p++)
+                wsdeque_destroy(&pool->workers[i].deque[p]);
+        }
+        free(pool->workers);
+        pool->workers = NULL;
+    }
+
+    // The groups are zeroed when allocated, so a queue that was never created has no obj.
+    for (int g = 0; pool->groups != NULL && g < pool->num_groups; g++)
+        for (int p = 0; p < POOL_PRIORITY_LEVELS; p++)
+            if (pool->groups[g].work_queue[p].obj != NULL)
+                cqueue_destroy(&pool->groups[g].work_queue[p]);
+    free(pool->thread_args);
+    pool->thread_args = NULL;
+    free(pool->groups);
+    free(pool->node_group);
+    pool->groups = NULL;
+    pool->node_group = NULL;
+
+    if (pool->layout != NULL)
+        pool_free_layout(pool->layout);
+    free(pool->layout);
+    pool->layout = NULL;
+
+#ifdef POOL_TRACE
+    pool_trace_destroy(pool->trace);
+#endif
+    pool->trace = NULL;
+#ifdef POOL_STATS
+    free(pool->counters);
+    pool->counters = NULL;
+#endif
+    free(pool->threads);
+    pool->threads = NULL;
+    pthread_mutex_destroy(&pool->resize_lock);
+}
+
+/**
+ * @brief: Creates the pool and its threads.
+ * 
+ * 
+ * Creates the pool. Initalizes the work request queues of each worker group, one per priority. Also, creates the threads based on the given pool_size, each restricted to the CPUs its placement allows. With the work-stealing scheduler each thread also gets an inbox queue and a deque of its own.
+ * 
+ * With numa_groups every NUMA node that gets workers has its own queues (or inboxes) allocated on that node. Submissions go to the submitter's node and spill to other nodes only while its queue is full.
+ * 
+ * reserved_workers of each group only run PoolPriorityHigh work, so a backlog of normal and background work cannot hold up latency-sensitive requests; aging_usecs bounds how long lower priorities wait behind higher ones.
+ * 
+ * With the shared scheduler the pool is elastic when min_workers < max_workers: it starts pool_size workers, adds workers up to max_workers while posted work finds none parked and falls behind, and lets workers above min_workers retire after idle_usecs. The counts include reserved workers, which always run.
+ * 
+ * With io_entries the pool sets up an io_uring ring for pool_read_async and pool_write_async (see pool_io.h).
+ * 
+ * With fibers every task runs on a fiber with a stack of fiber_stack_size bytes, and a task that waits on a cqueue, a future, a spinlock, an spsc channel, or a nested pool_map, pool_parallel_for or pool_graph_run parks its fiber instead of blocking the worker, which goes on with other tasks. A worker can so hold thousands of waiting tasks. Other blocking calls (sleeps, pthread locks, plain file I/O) still block the worker. A traced task's run time then includes the time it was parked.
+ * 
+ * With trace (builds with POOL_TRACE only) every task is timed into wait and run histograms, and the last trace_events tasks of each worker are kept for pool_trace_dump (see pool_trace.h).
+ * 
+ * @param: pool -- the pointer to the pool object declared outside the funciton.
+ * @param: attrs -- the pool attributes (size, scheduler, queue depth and mode, placement, priorities).
+ * @return: the rc_t value (Success, OutOfMemory, InvalidArgument etc.)
+*/
+rc_t pool_create_attr(thread_pool_t* pool, pool_attr_t* attrs) {
+
+    rc_t rc;
+
+    if (pool == NULL || attrs == NULL) {
+        fprintf(stderr, "The pool and attrs cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    int pool_size = attrs->pool_size;
+    int min_workers = attrs->min_workers > 0 ? attrs->min_workers : pool_size;
+    int max_workers = attrs->max_workers > 0 ? attrs->max_workers : pool_size;
+
+    if (pool_size <= 0) {
+        fprintf(stderr, "Error: pool_size cannot be less than 0.");
+        return InvalidArgument;
+    }
+
+    if (min_workers > pool_size || max_workers < pool_size) {
+        fprintf(stderr, "The pool_size must be between min_workers and max_workers.\n");
+        return InvalidArgument;
+    }
+
+    if (attrs->scheduler == PoolSchedulerWorkStealing && min_workers != max_workers) {
+        fprintf(stderr, "An elastic pool needs the shared scheduler.\n");
+        return InvalidArgument;
+    }
+
+    if (attrs->reserved_workers < 0 || attrs->reserved_workers >= pool_size) {
+        fprintf(stderr, "The reserved workers must leave at least one worker for every priority.\n");
+        return InvalidArgument;
+    }
+
+    if (attrs->fibers && attrs->fiber_stack_size != 0 && attrs->fiber_stack_size < FIBER_MIN_STACK) {
+        fprintf(stderr, "A fiber stack needs at least %d bytes.\n", FIBER_MIN_STACK);
+        return InvalidArgument;
+    }
+
+#ifndef POOL_TRACE
+    if (attrs->trace) {
+        fprintf(stderr, "Tracing was compiled out; build with -DPOOL_TRACE.\n");
+        return InvalidOperation;
+    }
+#endif
+
+    // Everything below starts out empty, so pool_release can undo a create that fails part-way.
+    pool->size = max_workers;
+    pool->scheduler = attrs->scheduler;
+    pool->workers = NULL;
+    pool->thread_args = NULL;
+    pool->groups = NULL;
+    pool->node_group = NULL;
+    pool->num_groups = 0;
+    pool->layout = NULL;
+    pool->trace = NULL;
+    pool->io = NULL;
+    atomic_init(&pool->next_group, 0);
+    atomic_init(&pool->stopping, false);
+    pool->aging_nsecs = (uint64_t)attrs->aging_usecs * 1000;
+    pool->idle_nsecs = (uint64_t)attrs->idle_usecs * 1000;
+    pool->spawn_nsecs = (uint64_t)attrs->spawn_wait_usecs * 1000;
+    pool->track_ready = pool->aging_nsecs != 0 || pool->spawn_nsecs != 0;
+    atomic_init(&pool->live, 0);
+    atomic_init(&pool->min_workers, min_workers);
+    atomic_init(&pool->max_workers, max_workers);
+    pthread_mutex_init(&pool->resize_lock, NULL);
+#ifdef POOL_STATS
+    pool->counters = NULL;
+#endif
+
+    pool->threads = malloc(sizeof(pthread_t) * max_workers);
+    if (pool->threads == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        rc = OutOfMemory;
+        goto fail;
+    }
+
+#ifdef POOL_STATS
+    pool->counters = calloc(max_workers, sizeof(pool_counters_t));
+    if (pool->counters == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        rc = OutOfMemory;
+        goto fail;
+    }
+    memset(pool->submitted, 0, sizeof(pool->submitted));
+#endif
+
+    pool->fiber_stack = 0;
+    if (attrs->fibers)
+        pool->fiber_stack = attrs->fiber_stack_size > 0 ? attrs->fiber_stack_size : FIBER_DEFAULT_STACK;
+#ifdef POOL_TRACE
+    if (attrs->trace) {
+        rc = pool_trace_create(&pool->trace, max_workers, attrs->trace_events);
+        if (rc != Success)
+            goto fail;
+    }
+#endif
+
+    // Kept until pool_destroy: an elastic pool starts workers later.
+    pool->layout = calloc(1, sizeof(pool_layout_t));
+    if (pool->layout == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        rc = OutOfMemory;
+        goto fail;
+    }
+
+    rc = pool_plan_layout(pool, attrs, pool->layout);
+    if (rc != Success)
+        goto fail;
+
+    // A small NUMA group keeps at least one worker for every priority.
+    for (int g = 0; g < pool->num_groups; g++) {
+        pool_group_t* group = &pool->groups[g];
+        group->num_reserved = attrs->reserved_workers < group->num_workers ? attrs->reserved_workers : group->num_workers - 1;
+        for (int p = 0; p < POOL_PRIORITY_LEVELS; p++) {
+            atomic_init(&group->pending[p], 0);
+            atomic_init(&group->ready_since[p], 0);
+        }
+        atomic_init(&group->ready, 0);
+        atomic_init(&group->signal, 0);
+        atomic_init(&group->sleepers, 0);
+        atomic_init(&group->reserved_signal, 0);
+        atomic_init(&group->reserved_sleepers, 0);
+        atomic_init(&group->live, 0);
+    }
+
+    if (pool->scheduler == PoolSchedulerWorkStealing) {
+        rc = pool_ws_create_workers(pool, attrs);
+        if (rc != Success)
+            goto fail;
+    } else {
+        cqueue_attr_t work_attrs;
+
+        rc = cqueue_attr_init(&work_attrs);
+        if (rc != Success) {
+            fprintf(stderr, "Error calling attr init.\n");
+            goto fail;
+        }
+        work_attrs.block_size = sizeof(pool_work_t);
+        work_attrs.num_blocks = attrs->queue_blocks;
+        work_attrs.mode = attrs->queue_mode;
+        work_attrs.max_segments = attrs->queue_max_segments;
+
+        pool->thread_args = malloc(sizeof(thread_pool_args_t) * max_workers);
+        if (pool->thread_args == NULL) {
+            fprintf(stderr, "Out of Memory\n");
+            rc = OutOfMemory;
+            goto fail;
+        }
+
+        for (int g = 0; g < pool->num_groups; g++) {
+            pool_group_t* group = &pool->groups[g];
+
+            for (int p = 0; p < POOL_PRIORITY_LEVELS; p++) {
+                rc = pool_create_queue(&group->work_queue[p], &work_attrs, group->node);
+                if (rc != Success) {
+                    fprintf(stderr, "Error calling cqueue create.\n");
+                    goto fail;
+                }
+            }
+
+            for (int i = group->first_worker; i < group->first_worker + group->num_workers; i++) {
+                thread_pool_args_t* thread_args = &pool->thread_args[i];
+                thread_args->group = group;
+                thread_args->pool = pool;
+                thread_args->index = i;
+                thread_args->reserved = i < group->first_worker + group->num_reserved;
+                atomic_init(&thread_args->state, POOL_SLOT_EMPTY);
+            }
+        }
+    }
+
+    // Without io_uring the I/O calls fall back to blocking tasks. The ring is set up before the workers that poll it start.
+    if (attrs->io_entries > 0) {
+        rc = pool_io_ring_create(&pool->io, pool, attrs->io_entries);
+        if (rc != Success && rc != InvalidOperation)
+            goto fail;
+    }
+
+    // The caller cannot destroy a pool whose create failed, so the workers started so far are stopped here.
+    if (pool->scheduler == PoolSchedulerWorkStealing) {
+        for (int i = 0; i < pool_size; i++) {
+            rc = pool_start_worker(pool, i);
+            if (rc != Success)
+                goto stop;
+            atomic_fetch_add(&pool->live, 1);
+        }
+    } else {
+        // Reserved workers always run; the others are dealt round robin over the groups.
+        for (int i = 0; i < pool->size; i++) {
+            if (!pool->thread_args[i].reserved)
+                continue;
+            rc = pool_start_worker(pool, i);
+            if (rc != Success)
+                goto stop;
+            atomic_store(&pool->thread_args[i].state, POOL_SLOT_RUNNING);
+            atomic_fetch_add(&pool->live, 1);
+        }
+        pool_spawn_to(pool, pool_size);
+        if (atomic_load(&pool->live) < pool_size) {
+            fprintf(stderr, "Only %d of %d workers could be started.\n", atomic_load(&pool->live), pool_size);
+            rc = Error;
+            goto stop;
+        }
+    }
+
+    return Success;
+
+stop:
+    pool_stop_workers(pool);
+fail:
+    pool_release(pool);
+    return rc;
+}
+
+/**
+ * @brief: Ends threads and frees pool's memory.
+ * 
+ * This function ends the threads: shared-scheduler workers are told the pool is stopping and exit once the queues are drained, work-stealing workers get blank work_requests. Then, it joins the threads together. Finally, it frees the memory stored by the threads.
+ * 
+ * @param: pool -- the pointer to the pool object declared outside the funciton. 
+ * @return: the rc_t value (Success, OutOfMemory etc.) 
+*/
+rc_t pool_destroy(thread_pool_t* pool) {
+
+    rc_t rc;
+
+    if (pool == NULL) {
+        fprintf(stderr, "On destroy the pool cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (pool->threads == NULL) {
+        fprintf(stderr, "The pool's thread was empty cannot destroy it.\n");
+        return InvalidArgument;
+    }
+
+    rc = pool_stop_workers(pool);
+    if (rc != Success)
+        return rc;
+
+    pool_release(pool);
+    return Success;
+}
 
 /**
- * @brief: The function for the pool thread.
+ * @brief: Tells the pool's workers to exit and joins them.
  * 
- * The pool thread takes two queues: a work queue and a result queue. From that, it dequeues work requests from the work queue and does the function for the particular argument. Then, it puts the result in the result queue. Stops if there is an error (rc_t) or if there is a work_request with a null function pointer.
- * @param: arg the arguments (type thread_pool_args_st) which contains the queues.
- * @return: the rc_t value (Success, OutOfMemory etc.)
+ * Shared-scheduler workers are told the pool is stopping and exit once the queues are drained; a slot that never ran a worker is empty and is skipped. Work-stealing workers get blank work_requests; they start in index order and never retire, so live counts the ones to stop.
+ * 
+ * @param: pool -- the pool.
+ * @return: the rc_t value (Success, Error etc.)
 */
+static rc_t pool_stop_workers(thread_pool_t* pool) {
 
-void* pool_thread(void* arg) {
+    rc_t rc;
+    int started = pool->size;
 
-    thread_pool_args_t* queues = (thread_pool_args_t*) arg;
+    // Turning off threads. The work-stealing inboxes carry a pointer, so the sentinel outlives the joins.
+    pool_work_t sentinel_wr;
+    sentinel_wr.function_ptr = NULL;
+    sentinel_wr.priority = PoolPriorityHigh;
+    sentinel_wr.future = NULL;
+    sentinel_wr.map = NULL;
 
-    cqueue_t* work_queue = queues->work_queue;
-    cqueue_t* results_queue = queues->results_queue;
+    if (pool->scheduler == PoolSchedulerWorkStealing) {
+        started = atomic_load(&pool->live);
+        for(int i = 0; i < started; i++) {
+            rc = pool_ws_enqueue(pool, i, &sentinel_wr);
+            if (rc != Success) {
+                fprintf(stderr, "Error calling cqueue enqueue.\n");
+                return rc;
+            }
+        }
+    } else {
+        // Under resize_lock no worker is being started; after it none will be.
+        pthread_mutex_lock(&pool->resize_lock);
+        atomic_store(&pool->stopping, true);
+        pthread_mutex_unlock(&pool->resize_lock);
+        for (int g = 0; g < pool->num_groups; g++) {
+            pool_group_t* group = &pool->groups[g];
+            atomic_fetch_add(&group->signal, 1);
+            atomic_fetch_add(&group->reserved_signal, 1);
+            syscall(SYS_futex, &group->signal, FUTEX_WAKE, INT_MAX, NULL, NULL, NULL);
+            syscall(SYS_futex, &group->reserved_signal, FUTEX_WAKE, INT_MAX, NULL, NULL, NULL);
+        }
+    }
 
-    rc_t rc;
-    uint32_t size;     
+    // Join threads
+    for(int i = 0; i < started; i++) {
 
-    bool loop = true;
-    while(loop) {
+        if (pool->thread_args != NULL && atomic_load(&pool->thread_args[i].state) == POOL_SLOT_EMPTY)
+            continue;
 
-        pool_work_t* work_request;
-        uint32_t size;
+        int prc = pthread_join(pool->threads[i], NULL);
+        if (prc != 0) {
+            printf("There was a problem during pthread join with error=%d\n", prc);
+            return -1;  
+        }
 
-        // get work request
-        rc = cqueue_dequeue(work_queue, sizeof(pool_work_t), (void**)&work_request, &size, NULL);
-        if (rc != Success) {
-            fprintf(stderr, "There was an error dequeueing, error value was %d\n", rc);
-            return (rc_t*) rc;
+    }
+
+    return Success;
+}
+
+
+/**
+ * @brief: Changes the worker bounds of a shared-scheduler pool while it runs.
+ * 
+ * Raising min_workers starts workers right away. Lowering max_workers lets the workers above it leave between batches, so the tasks in flight complete; parked workers are woken to notice, and to wait with the idle timeout of the new bounds. Between the bounds the pool grows with its backlog and shrinks when idle. Every group keeps one worker, so the pool does not shrink below its number of groups.
+ * 
+ * @param: pool -- thread pool object.
+ * @param: min_workers -- at least 1, reserved workers included.
+ * @param: max_workers -- at least min_workers and at most the max_workers the pool was created with.
+ * @return: the rc_t value (Success, InvalidArgument, InvalidOperation with the work-stealing scheduler)
+*/
+rc_t pool_resize(thread_pool_t* pool, int min_workers, int max_workers) {
+
+    if (pool == NULL || pool->threads == NULL) {
+        fprintf(stderr, "On resize the pool cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (min_workers < 1 || min_workers > max_workers || max_workers > pool->size) {
+        fprintf(stderr, "The bounds must satisfy 1 <= min_workers <= max_workers <= %d.\n", pool->size);
+        return InvalidArgument;
+    }
+
+    if (pool->scheduler == PoolSchedulerWorkStealing) {
+        fprintf(stderr, "Only a pool with the shared scheduler can be resized.\n");
+        return InvalidOperation;
+    }
+
+    pthread_mutex_lock(&pool->resize_lock);
+    atomic_store(&pool->min_workers, min_workers);
+    atomic_store(&pool->max_workers, max_workers);
+    pool_spawn_to(pool, min_workers);
+    pthread_mutex_unlock(&pool->resize_lock);
+
+    for (int g = 0; g < pool->num_groups; g++) {
+        pool_group_t* group = &pool->groups[g];
+        atomic_fetch_add(&group->signal, 1);
+        if (atomic_load(&group->sleepers) > 0)
+            syscall(SYS_futex, &group->signal, FUTEX_WAKE, INT_MAX, NULL, NULL, NULL);
+    }
+
+    return Success;
+}
+
+/**
+ * @brief: Maps the threads from the given argument and function.
+ * 
+ * From a given array of arguments and function, this function computes the user function on all of the arguments and puts it in the results parameter. This function also puts all of the work requests onto the queue.
+ * 
+ * The workers write each result straight into results and count the call's completion latch down; the caller sleeps on the latch, so concurrent pool_map calls on one pool do not see each other's results.
+ * 
+ * Called from a task running on the pool, the worker does not sleep: it runs queued work until the latch is down (see pool_help), so recursive divide and conquer keeps every worker busy and cannot deadlock the pool.
+ * 
+ * @param: pool -- thread pool object.
+ * @param: fun -- the user function.
+ * @param: arg_count -- number of arguments.
+ * @param: args -- the given arguments
+ * @results: results -- the results from applyting the user function to the argumnents.
+ * 
+ * @return: the rc_t value (Success, OutOfMemory etc.), or the first error returned by fun.
+
+*/
+rc_t pool_map(thread_pool_t* pool, pool_fun_t fun, int arg_count, void* args[], void* results[]) {
+
+    return pool_map_priority(pool, fun, arg_count, args, results, PoolPriorityNormal);
+}
+
+/**
+ * @brief: pool_map at a given priority.
+ * 
+ * Workers run the calls after any queued work of higher priority (within the aging bound) and before queued work of lower priority. Calls at PoolPriorityHigh may also run on the pool's reserved workers.
+ * 
+ * @param: pool -- thread pool object.
+ * @param: fun -- the user function.
+ * @param: arg_count -- number of arguments.
+ * @param: args -- the given arguments
+ * @results: results -- the results from applyting the user function to the argumnents.
+ * @param: priority -- the priority of every call.
+ * 
+ * @return: the rc_t value (Success, OutOfMemory, InvalidArgument etc.), or the first error returned by fun.
+*/
+rc_t pool_map_priority(thread_pool_t* pool, pool_fun_t fun, int arg_count, void* args[], void* results[], pool_priority_t priority) {
+
+    rc_t rc = Success;
+
+    if ((unsigned int)priority >= POOL_PRIORITY_LEVELS) {
+        fprintf(stderr, "The priority is out of range.\n");
+        return InvalidArgument;
+    }
+
+    if (arg_count <= 0)
+        return Success;
+
+    STATS_ADD(STATS_STRIPE(pool->submitted).value, arg_count);
+
+    pool_map_t map;
+    map.results = results;
+    atomic_init(&map.pending, arg_count);
+    atomic_init(&map.rc, Success);
+    int enqueued = 0;
+
+    // Make a work request of each arg (the id should be idx of array) and enqueue them a batch at a time
+    pool_work_t* work_request = NULL;
+    if (pool->scheduler == PoolSchedulerWorkStealing) {
+
+        // The workers' deques hold pointers, so the requests must stay put until the map is done.
+        work_request = slab_alloc(sizeof(pool_work_t) * arg_count);
+        if (work_request == NULL) {
+            fprintf(stderr, "Out of Memory\n");
+            return OutOfMemory;
         }
 
-        // If function pointer is null EXIT
-        if(work_request->function_ptr == NULL) {
-            loop = false;
-            return (rc_t*) rc;
-        } else {
-            // Call function on argument (get return code and result)
-            void* fun_result;
-            rc = work_request->function_ptr(work_request->arg, &fun_result);
-            if (rc != Success) {
-                fprintf(stderr, "There was an error with the user function, error value was %d\n", rc);
-                return (rc_t*) rc;
+        for (int i = 0; i < arg_count; i++) {
+            work_request[i].id = i;
+            work_request[i].priority = priority;
+            work_request[i].arg = args[i];
+            work_request[i].function_ptr = fun;
+            work_request[i].future = NULL;
+            work_request[i].map = &map;
+        }
+        pool_trace_enqueued(pool, work_request, arg_count);
+
+        // Contiguous runs of up to POOL_MAP_BATCH per inbox, handed out round robin
+        int run = (arg_count + pool->size - 1) / pool->size;
+        if (run > POOL_MAP_BATCH)
+            run = POOL_MAP_BATCH;
+
+        // A worker keeps nested work on its own deque, which cannot fill up, for the others to steal.
+        if (pool_current == pool) {
+            for (; enqueued < arg_count; enqueued++) {
+                rc = wsdeque_push(&pool_current_worker->deque[priority], &work_request[enqueued]);
+                if (rc != Success)
+                    break;
             }
+            pool_ws_signal(pool);
+        }
 
-            // Make a pool result and enqueue on result queue
-            pool_result_t* result_request = malloc(sizeof(pool_result_t));
+        pool_work_t* pointers[POOL_MAP_BATCH];
+        for (int i = enqueued; i < arg_count && rc == Success; i += run) {
+            int count = arg_count - i < run ? arg_count - i : run;
+            for (int j = 0; j < count; j++)
+                pointers[j] = &work_request[i + j];
 
-            result_request->id = work_request->id;
-            result_request->rc = Success;
-            result_request->result = fun_result;
+            int worker_index = pool_ws_pick_worker(pool, priority);
+            uint32_t sent;
+            rc = pool_ws_enqueue_batch(pool, worker_index, pointers, count, &sent);
+            enqueued += sent;
+        }
 
-            rc = cqueue_enqueue(results_queue, result_request, sizeof(pool_result_t), NULL);
-            if(rc != Success) {
-                fprintf(stderr, "There was an error enqueueing to result queue, error value was %d\n", rc);
-                return (rc_t*) rc;
+    } else {
+
+        pool_work_t batch[POOL_MAP_BATCH];
+        for (int i = 0; i < arg_count; i += POOL_MAP_BATCH) {
+            int count = arg_count - i < POOL_MAP_BATCH ? arg_count - i : POOL_MAP_BATCH;
+            for (int j = 0; j < count; j++) {
+                batch[j].id = i + j;
+                batch[j].priority = priority;
+                batch[j].arg = args[i + j];
+                batch[j].function_ptr = fun;
+                batch[j].future = NULL;
+                batch[j].map = &map;
             }
+            pool_trace_enqueued(pool, batch, count);
 
+            uint32_t sent;
+            rc = pool_group_enqueue_all(pool, pool_shared_group(pool, priority), priority, batch, count, &sent);
+            enqueued += sent;
+            if (rc != Success)
+                break;
         }
 
     }
 
-    return (rc_t*) rc;
+    // Whatever could not be enqueued will never count down; what went out before an error still will
+    if (enqueued < arg_count)
+        atomic_fetch_sub(&map.pending, arg_count - enqueued);
+
+    // Completion latch
+    pool_wait_latch(pool, &map.pending);
+
+    slab_free(work_request);
+
+    if (rc != Success)
+        return rc;
+
+    return atomic_load(&map.rc);
 
 }
 
+_Static_assert(sizeof(pool_work_t) <= sizeof(((future_t*)0)->task), "pool_work_t must fit in future_t.task");
+
 /**
- * @brief: Creates the pool and its threads.
+ * @brief: Submits one call of fun(arg) without waiting for it.
  * 
+ * The worker that runs it completes future directly, so no result thread is involved; wait with future_wait and friends. With the work-stealing scheduler the work request is kept inside the future, so the future must stay valid until it is ready. On the pool's own workers future waits run queued work instead of sleeping (see pool_help).
  * 
- * Creates the pool. Initalizes the work request queue and result queue. Also, creates the threads based on the given pool_size. 
+ * @param: pool -- thread pool object.
+ * @param: fun -- the user function.
+ * @param: arg -- the argument for fun.
+ * @param: future -- caller-owned future, initialized here.
  * 
- * @param: pool -- the pointer to the pool object declared outside the funciton.
- * @param: pool_size -- the size of the pool (or number of threads).
- * @return: the rc_t value (Success, OutOfMemory etc.)
+ * @return: the rc_t value (Success, OutOfMemory etc.) of the submission.
 */
-rc_t pool_create(thread_pool_t* pool, int pool_size) {
+rc_t pool_submit(thread_pool_t* pool, pool_fun_t fun, void* arg, future_t* future) {
 
-    rc_t rc;
-    
-    cqueue_attr_t work_attrs;
-    work_attrs.block_size = sizeof(pool_work_t);
-    cqueue_attr_t result_attrs;
-    result_attrs.block_size = sizeof(pool_result_t);
+    return pool_submit_priority(pool, fun, arg, future, PoolPriorityNormal);
+}
 
-    rc = cqueue_attr_init(&work_attrs);
-    if (rc != Success) {
-        fprintf(stderr, "Error calling attr init.\n");
-        return -1;
-    }
-    rc = cqueue_create(&pool->work_queue, &work_attrs);
-    if (rc != Success) {
-        fprintf(stderr, "Error calling cqueue create.\n");
-        return rc;
-    }
+/**
+ * @brief: pool_submit at a given priority.
+ * 
+ * @param: pool -- thread pool object.
+ * @param: fun -- the user function.
+ * @param: arg -- the argument for fun.
+ * @param: future -- caller-owned future, initialized here.
+ * @param: priority -- the priority of the call (see pool_map_priority).
+ * 
+ * @return: the rc_t value (Success, OutOfMemory, InvalidArgument etc.) of the submission.
+*/
+rc_t pool_submit_priority(thread_pool_t* pool, pool_fun_t fun, void* arg, future_t* future, pool_priority_t priority) {
 
-    // Creating result queue
-    rc = cqueue_attr_init(&result_attrs);
-    if (rc != Success) {
-        fprintf(stderr, "Error calling attr init.\n");
-        return rc;
-    }
-    rc = cqueue_create(&pool->results_queue, &result_attrs);
-    if (rc != Success) {
-        fprintf(stderr, "Error calling cqueue create.\n");
-        return rc;
+    rc_t rc;
+
+    if (pool == NULL || fun == NULL || future == NULL) {
+        fprintf(stderr, "The pool, function and future cannot be NULL.\n");
+        return InvalidArgument;
     }
 
-    if (pool_size <= 0) {
-        fprintf(stderr, "Error: pool_size cannot be less than 0.");
+    if ((unsigned int)priority >= POOL_PRIORITY_LEVELS) {
+        fprintf(stderr, "The priority is out of range.\n");
         return InvalidArgument;
     }
 
-    pool->threads = malloc(sizeof(pthread_t) * pool_size);
-    pool->size = pool_size;
+    rc = future_init(future);
+    if (rc != Success)
+        return rc;
+
+    STATS_ADD(STATS_STRIPE(pool->submitted).value, 1);
 
-    thread_pool_args_t* thread_args = malloc(sizeof(thread_pool_args_t));
-    thread_args->work_queue = &pool->work_queue;
-    thread_args->results_queue = &pool->results_queue;
+    pool_work_t work_request;
+    work_request.id = -1;
+    work_request.priority = priority;
+    work_request.arg = arg;
+    work_request.function_ptr = fun;
+    work_request.future = future;
+    work_request.map = NULL;
+    pool_trace_enqueued(pool, &work_request, 1);
 
-    for (int i = 0; i < pool_size; i++) {
+    bool inside = pool_current == pool;
 
-        rc = pthread_create(&pool->threads[i], NULL, pool_thread, thread_args);
-        if (rc != 0) {
-            fprintf(stderr, "There was a problem during creation for pthread with error=%d\n", rc);
+    if (pool->scheduler == PoolSchedulerWorkStealing) {
+        pool_work_t* stored = (pool_work_t*) future->task;
+        *stored = work_request;
+        if (inside) {
+            rc = wsdeque_push(&pool_current_worker->deque[priority], stored);
+            if (rc == Success)
+                pool_ws_signal(pool);
             return rc;
         }
+        int worker_index = pool_ws_pick_worker(pool, priority);
+        return pool_ws_enqueue(pool, worker_index, stored);
     }
 
-    return Success;
+    // A worker does not wait for room in a full queue; it completes the future itself. A task on a fiber parks for room instead.
+    timespec_t no_wait = { 0, 0 };
+    pool_group_t* group = pool_shared_group(pool, priority);
+    cqueue_t* queue = &group->work_queue[priority];
+    pool_work_t* slot;
+    bool run_inline = inside && fiber_current() == NULL;
+    rc = cqueue_reserve(queue, sizeof(pool_work_t), (void**)&slot, run_inline ? &no_wait : NULL);
+    if (rc == Timeout && run_inline) {
+        pool_execute(&work_request);
+        return Success;
+    }
+    if (rc != Success) {
+        fprintf(stderr, "Error calling cqueue enqueue.\n");
+        return rc;
+    }
+    *slot = work_request;
+
+    rc = cqueue_commit(queue, slot);
+    if (rc != Success)
+        return rc;
 
+    pool_group_post(pool, group, priority, 1);
+    return Success;
 }
 
 /**
- * @brief: Ends threads and frees pool's memory.
+ * @brief: Hands a caller-built work request to the pool without waiting for it.
  * 
- * This function ends the threads by sending blank work_requests. Then, it joins the threads together. Finally, it frees the memory stored by the threads.
+ * For executors built on the pool, such as pool_graph. With neither future nor map set the request is detached: nothing is completed when its function returns, so the function has to report completion itself. With the shared scheduler the request is copied into the queue; with the work-stealing scheduler only its address is queued, so it must stay valid and unchanged until its function has started.
  * 
- * @param: pool -- the pointer to the pool object declared outside the funciton. 
- * @return: the rc_t value (Success, OutOfMemory etc.) 
+ * Called from one of the pool's own workers it never blocks, since every worker might be submitting at once: with work stealing the request goes onto the worker's own deque, and with the shared scheduler a full queue returns QueueFull instead of waiting; the caller can run the request itself.
+ * 
+ * @param: pool -- thread pool object.
+ * @param: work_request -- the work request (function and priority set).
+ * 
+ * @return: the rc_t value (Success, QueueFull, OutOfMemory, InvalidArgument etc.) of the submission.
 */
-rc_t pool_destroy(thread_pool_t* pool) {
+rc_t pool_submit_work(thread_pool_t* pool, pool_work_t* work_request) {
 
     rc_t rc;
 
-    if (pool == NULL) {
-        fprintf(stderr, "On destroy the pool cannot be NULL.\n");
+    if (pool == NULL || work_request == NULL || work_request->function_ptr == NULL) {
+        fprintf(stderr, "The pool, work request and its function cannot be NULL.\n");
         return InvalidArgument;
     }
 
-    if (pool->threads == NULL) {
-        fprintf(stderr, "The pool's thread was empty cannot destroy it.\n");
+    pool_priority_t priority = work_request->priority;
+    if ((unsigned int)priority >= POOL_PRIORITY_LEVELS) {
+        fprintf(stderr, "The priority is out of range.\n");
         return InvalidArgument;
     }
 
-    // Turning off threads
-    for(int i = 0; i < pool->size; i++) {
+    bool inside = pool_current == pool;
+    pool_trace_enqueued(pool, work_request, 1);
 
-        pool_work_t sentinel_wr;
-        sentinel_wr.function_ptr = NULL;
-        rc = cqueue_enqueue(&pool->work_queue, &sentinel_wr, sizeof(pool_work_t), NULL);
-        if (rc != Success) {
-            fprintf(stderr, "Error calling cqueue enqueue.\n");
+    if (pool->scheduler == PoolSchedulerWorkStealing && inside) {
+        rc = wsdeque_push(&pool_current_worker->deque[priority], work_request);
+        if (rc != Success)
             return rc;
-        }
+        STATS_ADD(STATS_STRIPE(pool->submitted).value, 1);
+        pool_ws_signal(pool);
+        return Success;
     }
 
-    // Join threads
-    for(int i = 0; i < pool->size; i++) {
-
-        int prc = pthread_join(pool->threads[i], NULL);
-        if (prc != 0) {
-            printf("There was a problem during pthread join with error=%d\n", prc);
-            return -1;  
-        }
+    if (pool->scheduler == PoolSchedulerWorkStealing) {
+        STATS_ADD(STATS_STRIPE(pool->submitted).value, 1);
+        return pool_ws_enqueue(pool, pool_ws_pick_worker(pool, priority), work_request);
+    }
 
+    timespec_t no_wait = { 0, 0 };
+    pool_group_t* group = pool_shared_group(pool, priority);
+    rc = cqueue_enqueue(&group->work_queue[priority], work_request, sizeof(pool_work_t), inside ? &no_wait : NULL);
+    if (rc == Timeout)
+        return QueueFull;
+    if (rc != Success) {
+        fprintf(stderr, "Error calling cqueue enqueue.\n");
+        return rc;
     }
 
-    free(pool->threads);
+    STATS_ADD(STATS_STRIPE(pool->submitted).value, 1);
 
+    pool_group_post(pool, group, priority, 1);
     return Success;
 }
 
-
-typedef struct result_thread_args_st{
-    cqueue_t* results_queue;
-    int arg_count;
-    void** results;
-} result_thread_args_t;
+#ifdef POOL_STATS
+static void pool_add_queue_stats(cqueue_stats_t* total, cqueue_stats_t* queue) {
+    total->enqueued += queue->enqueued;
+    total->dequeued += queue->dequeued;
+    total->full_waits += queue->full_waits;
+    total->empty_waits += queue->empty_waits;
+    total->futex_waits += queue->futex_waits;
+    total->futex_wakes += queue->futex_wakes;
+    total->depth += queue->depth;
+    if (queue->max_depth > total->max_depth)
+        total->max_depth = queue->max_depth;
+    total->lock.acquisitions += queue->lock.acquisitions;
+    total->lock.contended += queue->lock.contended;
+    total->lock.spin_iterations += queue->lock.spin_iterations;
+    total->lock.futex_waits += queue->lock.futex_waits;
+    total->lock.futex_wakes += queue->lock.futex_wakes;
+    total->lock.hold_nsecs += queue->lock.hold_nsecs;
+}
+#endif
 
 /**
- * @brief: Dequeues work requests.
+ * @brief: Takes a snapshot of the pool's counters.
  * 
- * This function is a thread function that dequeues work requests and puts them into the results that are accessible outside this function.
- * 
- * @param: arg the arguments for thread (type result_thread_args_t)
- * @return: the rc_t value (Success, OutOfMemory etc.) 
+ * The counters are read while the workers keep running, so the totals are only consistent with each other once the pool is quiet.
  * 
+ * @param: pool -- thread pool object.
+ * @param: stats -- receives the pool-wide totals and the queue counters (the inboxes summed with the work-stealing scheduler).
+ * @param: workers -- optional array that receives one entry per worker.
+ * @param: max_workers -- the capacity of workers; entries past the pool size are left alone.
+ * @return: the rc_t value (Success, InvalidArgument, InvalidOperation when built with POOL_NO_STATS)
 */
-void* result_thread(void* arg){
+rc_t pool_stats(thread_pool_t* pool, pool_stats_t* stats, pool_worker_stats_t workers[], int max_workers) {
 
-    result_thread_args_t* queue = (result_thread_args_t*) arg;
-    int arg_count = queue->arg_count;
-    cqueue_t* results_queue = queue->results_queue;
+    if (pool == NULL || stats == NULL) {
+        fprintf(stderr, "The pool and stats cannot be NULL.\n");
+        return InvalidArgument;
+    }
 
-    rc_t* rc = malloc(sizeof(rc_t));
-    int args_dequeued = 0;
-    uint32_t size;
-    while(args_dequeued < arg_count) {
+    memset(stats, 0, sizeof(pool_stats_t));
 
-        pool_result_t* result_request;
-        cqueue_size(results_queue, &size);
+#ifdef POOL_STATS
+    rc_t rc;
 
-        if(size != 0) {
-            *rc = cqueue_dequeue(results_queue, sizeof(pool_result_t), (void**)&result_request, &size, NULL);
+    for (int i = 0; i < STATS_STRIPES; i++)
+        stats->submitted += stats_load(&pool->submitted[i].value);
 
-            if (*rc != Success) {
-                fprintf(stderr, "Error calling cqueue enqueue.\n");
-                return rc;
-            }
+    for (int i = 0; i < pool->size; i++) {
+        pool_counters_t* counters = &pool->counters[i];
+        pool_worker_stats_t worker;
+        worker.executed = stats_load(&counters->executed);
+        worker.steals = stats_load(&counters->steals);
+        worker.parks = stats_load(&counters->parks);
+        worker.busy_nsecs = stats_load(&counters->busy_nsecs);
+        worker.idle_nsecs = stats_load(&counters->idle_nsecs);
+
+        stats->total.executed += worker.executed;
+        stats->total.steals += worker.steals;
+        stats->total.parks += worker.parks;
+        stats->total.busy_nsecs += worker.busy_nsecs;
+        stats->total.idle_nsecs += worker.idle_nsecs;
+
+        if (workers != NULL && i < max_workers)
+            workers[i] = worker;
+    }
 
-            queue->results[result_request->id] = result_request->result;
-            args_dequeued++;
+    if (pool->scheduler != PoolSchedulerWorkStealing) {
+        for (int g = 0; g < pool->num_groups; g++) {
+            for (int p = 0; p < POOL_PRIORITY_LEVELS; p++) {
+                cqueue_stats_t queue;
+                rc = cqueue_stats(&pool->groups[g].work_queue[p], &queue);
+                if (rc != Success)
+                    return rc;
+                pool_add_queue_stats(&stats->queue, &queue);
+            }
         }
+        return Success;
+    }
 
+    for (int i = 0; i < pool->size; i++) {
+        cqueue_stats_t inbox;
+        rc = cqueue_stats(&pool->workers[i].inbox, &inbox);
+        if (rc != Success)
+            return rc;
+        pool_add_queue_stats(&stats->queue, &inbox);
     }
 
-    free(rc);
+    return Success;
+#else
+    (void)workers;
+    (void)max_workers;
+    fprintf(stderr, "The counters were compiled out (POOL_NO_STATS)\n");
+    return InvalidOperation;
+#endif
 }
 
+typedef struct pool_for_st {
+    atomic_llong next;
+    int64_t end;
+    int64_t grain;
+    int runners;
+    pool_for_fun_t* fun;
+    void* ctx;
+    atomic_llong ns_per_item;  // fixed point, 1/16 ns
+    atomic_int rc;
+} pool_for_t;
+
 /**
- * @brief: Maps the threads from the given argument and function.
- * 
- * From a given array of arguments and function, this function computes the user function on all of the arguments and puts it in the results parameter. This function also puts all of the work requests onto the queue.
+ * @brief: Picks the next chunk size for a parallel_for runner.
  * 
- * @param: pool -- thread pool object.
- * @param: fun -- the user function.
- * @param: arg_count -- number of arguments.
- * @param: args -- the given arguments
- * @results: results -- the results from applyting the user function to the argumnents.
+ * The chunk aims at POOL_FOR_TARGET_NSECS of work given the measured cost per item, but never more than half of an even share of what is left, so chunks shrink towards the end of the range and the runners finish together even when item cost varies. grain is a lower bound.
  * 
- * @return: the rc_t value (Success, OutOfMemory etc.) 
+ * @param: state -- the shared parallel_for state.
+ * @param: ns_per_item -- this runner's cost estimate (1/16 ns), 0 if nothing was measured yet.
+ * @return: the chunk size.
+*/
+static int64_t pool_for_chunk(pool_for_t* state, int64_t ns_per_item) {
+
+    int64_t remaining = state->end - atomic_load_explicit(&state->next, memory_order_relaxed);
+    int64_t balance_cap = remaining / (2 * state->runners);
+
+    int64_t chunk;
+    if (ns_per_item == 0)
+        chunk = POOL_FOR_PROBE_CHUNK;
+    else
+        chunk = (POOL_FOR_TARGET_NSECS * 16) / ns_per_item;
+
+    if (chunk > balance_cap)
+        chunk = balance_cap;
+    if (chunk < state->grain)
+        chunk = state->grain;
+    if (chunk < 1)
+        chunk = 1;
+
+    return chunk;
+}
 
+/**
+ * @brief: The pool function for one parallel_for runner.
+ * 
+ * Claims chunks from the shared cursor until the range is exhausted, timing each chunk to refine the per-item cost. Errors from the user function are recorded in the shared state and stop every runner; the pool itself always sees Success.
+ * 
+ * @param: arg -- the shared pool_for_t.
+ * @param: result -- unused.
+ * @return: Success
 */
-rc_t pool_map(thread_pool_t* pool, pool_fun_t fun, int arg_count, void* args[], void* results[]) {
+static rc_t pool_for_runner(void* arg, void** result) {
 
-    rc_t rc;
-    // Make a work request of each arg (the id should be idx of array)
-    pool_work_t work_request[arg_count];
-    int total_work_requests = 0;
+    pool_for_t* state = (pool_for_t*) arg;
+    int64_t ns_per_item = atomic_load_explicit(&state->ns_per_item, memory_order_relaxed);
 
-    for (int i = 0; i < arg_count; i++) {
-        work_request[i].id = i;
-        work_request[i].arg = args[i];
-        work_request[i].function_ptr = fun;
-        total_work_requests++;
-    }
+    *result = NULL;
 
-    // Dequeuing results
-    pthread_t result_request_thread;
-    result_thread_args_t result_thread_args;
-    result_thread_args.arg_count = arg_count;
-    result_thread_args.results_queue = &pool->results_queue;
-    result_thread_args.results = results;
+    while (true) {
+        int64_t chunk = pool_for_chunk(state, ns_per_item);
+        int64_t begin = atomic_fetch_add(&state->next, chunk);
+        if (begin >= state->end)
+            break;
 
-    rc = pthread_create(&result_request_thread, NULL, result_thread, (void*) &result_thread_args);
+        int64_t end = begin + chunk < state->end ? begin + chunk : state->end;
 
-    // Enqueue work requests to work queue
-    for(int i = 0; i < total_work_requests; i++) {
-        rc = cqueue_enqueue(&pool->work_queue, &work_request[i], sizeof(pool_work_t), NULL);
+        uint64_t start = pool_now_nsecs();
+        rc_t rc = state->fun(state->ctx, begin, end);
+        int64_t elapsed = (int64_t)(pool_now_nsecs() - start);
 
         if (rc != Success) {
-            fprintf(stderr, "Error calling cqueue enqueue.\n");
-            return rc;
+            int expected = Success;
+            atomic_compare_exchange_strong(&state->rc, &expected, rc);
+            atomic_store(&state->next, state->end);
+            break;
         }
+
+        // Exponential moving average (weight 1/4) of the cost per item
+        int64_t sample = (elapsed * 16) / (end - begin);
+        if (sample < 1)
+            sample = 1;
+        ns_per_item = ns_per_item == 0 ? sample : ns_per_item + (sample - ns_per_item) / 4;
+        atomic_store_explicit(&state->ns_per_item, ns_per_item, memory_order_relaxed);
     }
 
-    // Result Queue Threads
-    int prc = pthread_join(result_request_thread, NULL);
-    if (prc != 0) {
-        printf("There was a problem during pthread join with error=%d\n", prc);
-        return -1;  
+    return Success;
+}
+
+/**
+ * @brief: Runs fun over [begin, end) split into chunks on the pool's threads.
+ * 
+ * One runner per pool thread is submitted through pool_map. The runners claim chunks from a shared cursor, so a runner that gets cheap items simply claims more of them. Chunk sizes are chosen automatically from the measured cost per item (see pool_for_chunk).
+ * 
+ * @param: pool -- thread pool object.
+ * @param: begin -- the first index.
+ * @param: end -- one past the last index.
+ * @param: grain -- the smallest chunk to hand out, or 0 to choose automatically.
+ * @param: fun -- called as fun(ctx, chunk_begin, chunk_end) for disjoint chunks covering the range.
+ * @param: ctx -- passed through to fun.
+ * 
+ * @return: the rc_t value (Success, OutOfMemory etc.), or the first error returned by fun.
+*/
+rc_t pool_parallel_for(thread_pool_t* pool, int64_t begin, int64_t end, int64_t grain, pool_for_fun_t fun, void* ctx) {
+
+    if (pool == NULL || fun == NULL) {
+        fprintf(stderr, "The pool and function cannot be NULL.\n");
+        return InvalidArgument;
     }
 
-    uint32_t size;
-    rc = cqueue_size(&pool->results_queue, &size);
-    if (rc != Success) {
-        fprintf(stderr, "Error calling cqueue size.\n");
-        pthread_exit(NULL);
-    } 
+    if (grain < 0) {
+        fprintf(stderr, "The grain cannot be negative.\n");
+        return InvalidArgument;
+    }
 
-    return Success;
+    if (begin >= end)
+        return Success;
+
+    pool_for_t state;
+    atomic_init(&state.next, begin);
+    state.end = end;
+    state.grain = grain;
+    state.fun = fun;
+    state.ctx = ctx;
+    atomic_init(&state.ns_per_item, 0);
+    atomic_init(&state.rc, Success);
+
+    // No point waking more runners than there are probe chunks
+    int64_t probes = (end - begin + POOL_FOR_PROBE_CHUNK - 1) / POOL_FOR_PROBE_CHUNK;
+    state.runners = probes < pool->size ? (int)probes : pool->size;
 
-}
\ No newline at end of file
+    void* args[state.runners];
+    void* results[state.runners];
+    for (int i = 0; i < state.runners; i++)
+        args[i] = &state;
+
+    rc_t rc = pool_map(pool, pool_for_runner, state.runners, args, results);
+    if (rc != Success)
+        return rc;
+
+    return atomic_load(&state.rc);
+}
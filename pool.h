@@ -1,29 +1,205 @@
+#ifndef pool_h
+#define pool_h
+
 #include "rc.h"
 #include "cqueue.h"
+#include "wsdeque.h"
+#include "future.h"
+#include "stats.h"
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
 
+/*
+ * pool_work_t and future_t are larger with POOL_TRACE. Every object built
+ * against this header references the tag of its build, and pool.c defines
+ * the one it was built with, so mixing the two builds fails to link instead
+ * of corrupting tasks.
+ */
+#ifdef POOL_TRACE
+#define POOL_ABI_TAG pool_abi_trace
+#else
+#define POOL_ABI_TAG pool_abi_notrace
+#endif
+extern const int POOL_ABI_TAG;
+static const int* const pool_abi_check __attribute__((used)) = &POOL_ABI_TAG;
+
 typedef rc_t pool_fun_t(void* arg, void** result);
+typedef rc_t pool_for_fun_t(void* ctx, int64_t begin, int64_t end);
+
+#define POOL_PRIORITY_LEVELS 3
+#define POOL_DEFAULT_AGING_USECS 10000
+#define POOL_DEFAULT_IDLE_USECS 1000000
+#define POOL_DEFAULT_SPAWN_WAIT_USECS 1000
+
+typedef enum pool_priority_st {
+    PoolPriorityHigh,      // latency sensitive; the only work reserved workers run
+    PoolPriorityNormal,    // pool_map, pool_submit and pool_parallel_for
+    PoolPriorityLow,       // background batches
+} pool_priority_t;
+
+typedef enum pool_scheduler_st {
+    PoolSchedulerShared,        // every worker dequeues from its group's work queues
+    PoolSchedulerWorkStealing,  // per-worker deques, idle workers steal
+} pool_scheduler_t;
+
+typedef enum pool_affinity_st {
+    PoolAffinityNone,      // workers run wherever the kernel puts them
+    PoolAffinityCpuSet,    // every worker may run on any CPU in cpus
+    PoolAffinityPerCore,   // worker i is pinned to cpus[i % num_cpus]
+} pool_affinity_t;
+
+typedef struct pool_attr_st {
+    int pool_size;             // workers started by pool_create_attr
+    int min_workers;           // elastic bounds (shared scheduler), 0 for pool_size
+    int max_workers;
+    uint32_t idle_usecs;       // a worker above min_workers that was idle this long retires
+    uint32_t spawn_wait_usecs; // work waiting this long while no worker is parked starts another one, 0 for depth only
+    pool_scheduler_t scheduler;
+    uint32_t queue_blocks;     // depth of the work queue (shared) or of each inbox (work stealing)
+    cqueue_mode_t queue_mode;
+    uint32_t queue_max_segments; // segmented queue mode: high-water mark in segments of queue_blocks, 0 for none
+    pool_affinity_t affinity;
+    const int* cpus;           // CPU ids for the affinity policy, NULL for every CPU
+    int num_cpus;
+    bool numa_groups;          // one worker group per NUMA node, with its queue memory on that node
+    int reserved_workers;      // workers of each group that only run PoolPriorityHigh work (at most all but one)
+    uint32_t aging_usecs;      // lower-priority work ready this long runs ahead of higher priorities, 0 for strict priority
+    bool trace;                // time every task into wait and run histograms (builds with POOL_TRACE, see pool_trace.h)
+    uint32_t trace_events;     // with trace: the last tasks each worker ran, kept for pool_trace_dump, 0 for none
+    uint32_t io_entries;       // io_uring submission entries for pool_read_async and pool_write_async, 0 for blocking tasks (see pool_io.h)
+    bool fibers;               // run every task on a fiber of its own, which parks instead of blocking its worker (see fiber.h)
+    uint32_t fiber_stack_size; // with fibers: usable stack of each fiber in bytes, 0 for FIBER_DEFAULT_STACK
+} pool_attr_t;
+
+typedef struct pool_worker_stats_st {
+    uint64_t executed;
+    uint64_t steals;        // work-stealing scheduler
+    uint64_t parks;         // times the worker went to sleep for lack of work
+    uint64_t busy_nsecs;    // running tasks
+    uint64_t idle_nsecs;    // waiting for or looking for work
+} pool_worker_stats_t;
+
+typedef struct pool_stats_st {
+    uint64_t submitted;          // tasks handed in through pool_map and pool_submit
+    pool_worker_stats_t total;   // summed over the workers
+    cqueue_stats_t queue;        // all work queues (shared) or all inboxes (work stealing) summed
+} pool_stats_t;
 
-typedef struct thread_pool_st {
-    cqueue_t work_queue;
-    cqueue_t results_queue;
-    int size;
+#ifdef POOL_STATS
+typedef struct pool_counters_st {
+    atomic_uint_fast64_t executed;
+    atomic_uint_fast64_t steals;
+    atomic_uint_fast64_t parks;
+    atomic_uint_fast64_t busy_nsecs;
+    atomic_uint_fast64_t idle_nsecs;
+    char pad[STATS_CACHE_LINE - 5 * sizeof(atomic_uint_fast64_t)];
+} pool_counters_t;
+#endif
+
+typedef struct thread_pool_st thread_pool_t;
+
+/*
+ * Workers of a group are contiguous in the pool. Without numa_groups there is
+ * one group on node -1; with it there is one group per node that got workers.
+ * The first num_reserved workers of a group only run PoolPriorityHigh work.
+ *
+ * With the shared scheduler every priority has its own work queue. pending
+ * counts what was enqueued and not yet claimed by a worker, and bit p of ready
+ * is set while pending[p] is non-zero, so a worker finds the level to serve
+ * with one load. A worker claims from pending before it dequeues, so it never
+ * blocks in a queue another worker emptied.
+ */
+typedef struct pool_group_st {
+    cqueue_t work_queue[POOL_PRIORITY_LEVELS];          // shared scheduler
+    atomic_uint pending[POOL_PRIORITY_LEVELS];          // shared scheduler
+    atomic_uint ready;                                  // shared scheduler: bitmap of levels with pending work
+    atomic_uint_fast64_t ready_since[POOL_PRIORITY_LEVELS];  // when the level was last served or became ready
+    atomic_uint signal;        // shared scheduler: futex word of parked workers
+    atomic_int sleepers;
+    atomic_uint reserved_signal;   // the same for parked reserved workers, bumped for PoolPriorityHigh only
+    atomic_int reserved_sleepers;
+    int node;
+    int first_worker;
+    int num_workers;
+    int num_reserved;
+    atomic_int live;           // shared scheduler: running workers that are not reserved
+    atomic_uint next_worker;   // work stealing: round robin over the group's inboxes
+} pool_group_t;
+
+typedef struct pool_worker_st {
+    thread_pool_t* pool;
+    int index;
+    int group;
+    uint32_t rand_state;
+    bool reserved;
+    bool stopping;             // owner only: the inbox held the sentinel of pool_destroy
+    cqueue_t inbox;
+    wsdeque_t deque[POOL_PRIORITY_LEVELS];
+    uint64_t served_nsecs[POOL_PRIORITY_LEVELS];   // owner only: when the worker last ran or found empty each level
+} pool_worker_t;
+
+struct thread_pool_st {
+    int size;                  // worker slots: max_workers the pool was created with
     pthread_t* threads;
-} thread_pool_t;
+    pool_scheduler_t scheduler;
+    pool_worker_t* workers;
+    pool_group_t* groups;
+    int num_groups;
+    int* node_group;           // group of each node, -1 for nodes without workers (numa_groups only)
+    int num_nodes;
+    atomic_uint next_group;    // for submitters on a node without workers
+    atomic_uint ws_signal;
+    atomic_int ws_sleepers;
+    atomic_bool stopping;      // shared scheduler: workers exit once they find no work
+    uint64_t aging_nsecs;
+    bool track_ready;          // shared scheduler: keep ready_since for aging or spawning
+    atomic_int live;           // running workers
+    atomic_int min_workers;
+    atomic_int max_workers;
+    uint64_t idle_nsecs;
+    uint64_t spawn_nsecs;
+    pthread_mutex_t resize_lock;   // starting and joining workers
+    struct pool_layout_st* layout;
+    struct pool_trace_st* trace;   // NULL unless created with attrs.trace
+    struct pool_io_ring_st* io;    // NULL without attrs.io_entries or when io_uring is unavailable
+    size_t fiber_stack;            // stack bytes of each task fiber, 0 without attrs.fibers
+    struct thread_pool_args_st* thread_args;
+#ifdef POOL_STATS
+    pool_counters_t* counters;                // one per worker, written by that worker only
+    stats_counter_t submitted[STATS_STRIPES];
+#endif
+};
+
+typedef struct pool_map_st pool_map_t;
 
 typedef struct pool_work_st {
     int id;
+    pool_priority_t priority;
     void* arg;
     pool_fun_t* function_ptr;
-} pool_work_t;
-
-typedef struct pool_result_st {
-    int id;
-    rc_t rc;
-    void* result;
-} pool_result_t;
+    future_t* future;  // set for pool_submit
+    pool_map_t* map;   // set for pool_map; result goes to map->results[id]
+#ifdef POOL_TRACE
+    uint64_t enqueue_nsecs;   // when the request was handed to the pool, with attrs.trace
+    uint64_t dequeue_nsecs;   // when a worker took it off a queue
+#endif
+} pool_work_t;         // neither set: detached (pool_submit_work), the function reports completion itself
 
+rc_t pool_attr_init(pool_attr_t* attrs);
 rc_t pool_create(thread_pool_t* pool, int pool_size);
+rc_t pool_create_attr(thread_pool_t* pool, pool_attr_t* attrs);
 rc_t pool_destroy(thread_pool_t* pool);
-rc_t pool_map(thread_pool_t* pool, pool_fun_t fun, int arg_count, void* args[], void* results[]);
\ No newline at end of file
+rc_t pool_resize(thread_pool_t* pool, int min_workers, int max_workers);
+rc_t pool_map(thread_pool_t* pool, pool_fun_t fun, int arg_count, void* args[], void* results[]);
+rc_t pool_map_priority(thread_pool_t* pool, pool_fun_t fun, int arg_count, void* args[], void* results[], pool_priority_t priority);
+rc_t pool_submit(thread_pool_t* pool, pool_fun_t fun, void* arg, future_t* future);
+rc_t pool_submit_priority(thread_pool_t* pool, pool_fun_t fun, void* arg, future_t* future, pool_priority_t priority);
+rc_t pool_submit_work(thread_pool_t* pool, pool_work_t* work_request);
+rc_t pool_help(thread_pool_t* pool);
+bool pool_in_worker(thread_pool_t* pool);
+rc_t pool_stats(thread_pool_t* pool, pool_stats_t* stats, pool_worker_stats_t workers[], int max_workers);
+rc_t pool_parallel_for(thread_pool_t* pool, int64_t begin, int64_t end, int64_t grain, pool_for_fun_t fun, void* ctx);
+
+#endif
@@ -0,0 +1,493 @@
+#include "pool_algorithms.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define POOL_ALGORITHMS_BLOCK_BYTES (32 * 1024)   // per task for reduce, scan and transform: input and output fit in L1/L2
+#define POOL_ALGORITHMS_RUN_BYTES (256 * 1024)    // sorted by one qsort call before merging: fits in L2
+
+typedef struct pool_fold_st {
+    const char* in;
+    char* out;                 // scan only, may be in
+    size_t count;
+    size_t size;
+    size_t block;              // elements per block
+    const void* identity;
+    pool_combine_fun_t* combine;
+    void* ctx;
+    char* partials;            // two elements per block: the block's sum or running value, and a spare
+    bool inclusive;
+} pool_fold_t;
+
+typedef struct pool_map_elements_st {
+    const char* in;
+    size_t in_size;
+    char* out;
+    size_t out_size;
+    size_t count;
+    size_t block;
+    pool_transform_fun_t* fun;
+    void* ctx;
+} pool_map_elements_t;
+
+typedef struct pool_merge_st {
+    const char* src;
+    char* dst;
+    size_t count;
+    size_t size;
+    size_t run;                // elements per output chunk, divides width
+    size_t width;              // length of the sorted runs merged pairwise by this pass
+    pool_compare_fun_t* compare;
+} pool_merge_t;
+
+/**
+ * @brief: Elements per block for elements of the given size, at least one.
+ *
+ * @param: bytes -- the target block size.
+ * @param: size -- the element size.
+ * @return: the block length in elements.
+*/
+static size_t pool_block_elements(size_t bytes, size_t size) {
+    return size < bytes ? bytes / size : 1;
+}
+
+static int64_t pool_num_blocks(size_t count, size_t block) {
+    return (int64_t)((count + block - 1) / block);
+}
+
+static rc_t pool_fold_args(thread_pool_t* pool, const void* in, const void* out, size_t count, size_t size,
+                           const void* identity, pool_combine_fun_t combine) {
+
+    if (pool == NULL || identity == NULL || combine == NULL || ((in == NULL || out == NULL) && count > 0)) {
+        fprintf(stderr, "The pool, identity, combine function and buffers cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (size == 0) {
+        fprintf(stderr, "The element size cannot be 0.\n");
+        return InvalidArgument;
+    }
+
+    return Success;
+}
+
+// Folds elements [begin, end) of in into acc, which already holds a value.
+static void pool_fold_range(pool_fold_t* fold, void* acc, size_t begin, size_t end) {
+    for (size_t i = begin; i < end; i++)
+        fold->combine(fold->ctx, acc, fold->in + i * fold->size);
+}
+
+// pool_parallel_for body: partials[b] = identity combined with every element of block b.
+static rc_t pool_fold_blocks(void* ctx, int64_t begin, int64_t end) {
+
+    pool_fold_t* fold = (pool_fold_t*) ctx;
+
+    for (int64_t b = begin; b < end; b++) {
+        size_t first = (size_t) b * fold->block;
+        size_t last = first + fold->block < fold->count ? first + fold->block : fold->count;
+        char* acc = fold->partials + (size_t) b * 2 * fold->size;
+
+        memcpy(acc, fold->identity, fold->size);
+        pool_fold_range(fold, acc, first, last);
+    }
+
+    return Success;
+}
+
+/**
+ * @brief: pool_parallel_for body of a scan: writes the prefixes of each block, starting from the block's offset in partials.
+ *
+ * The exclusive scan saves each element in the block's spare slot before it writes the prefix, so out may be in.
+*/
+static rc_t pool_scan_blocks(void* ctx, int64_t begin, int64_t end) {
+
+    pool_fold_t* fold = (pool_fold_t*) ctx;
+    size_t size = fold->size;
+
+    for (int64_t b = begin; b < end; b++) {
+        size_t first = (size_t) b * fold->block;
+        size_t last = first + fold->block < fold->count ? first + fold->block : fold->count;
+        char* acc = fold->partials + (size_t) b * 2 * size;
+        char* spare = acc + size;
+
+        for (size_t i = first; i < last; i++) {
+            if (fold->inclusive) {
+                fold->combine(fold->ctx, acc, fold->in + i * size);
+                memcpy(fold->out + i * size, acc, size);
+            } else {
+                memcpy(spare, fold->in + i * size, size);
+                memcpy(fold->out + i * size, acc, size);
+                fold->combine(fold->ctx, acc, spare);
+            }
+        }
+    }
+
+    return Success;
+}
+
+/**
+ * @brief: Combines every element of an array.
+ *
+ * Each block is folded into its own partial on the pool, and the partials are folded in order by the caller.
+ *
+ * @param: pool -- thread pool object.
+ * @param: base -- the first element.
+ * @param: count -- the number of elements.
+ * @param: size -- the size of an element.
+ * @param: identity -- the neutral element of combine.
+ * @param: combine -- an associative operation, called as combine(ctx, acc, value).
+ * @param: ctx -- passed through to combine.
+ * @param: result -- receives the combined value; identity when count is 0.
+ *
+ * @return: the rc_t value (Success, OutOfMemory, InvalidArgument)
+*/
+rc_t pool_reduce(thread_pool_t* pool, const void* base, size_t count, size_t size,
+                 const void* identity, pool_combine_fun_t combine, void* ctx, void* result) {
+
+    rc_t rc = pool_fold_args(pool, base, base, count, size, identity, combine);
+    if (rc != Success)
+        return rc;
+
+    if (result == NULL) {
+        fprintf(stderr, "The result cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    pool_fold_t fold;
+    fold.in = base;
+    fold.out = NULL;
+    fold.count = count;
+    fold.size = size;
+    fold.block = pool_block_elements(POOL_ALGORITHMS_BLOCK_BYTES, size);
+    fold.identity = identity;
+    fold.combine = combine;
+    fold.ctx = ctx;
+    fold.inclusive = false;
+
+    memmove(result, identity, size);
+    int64_t blocks = pool_num_blocks(count, fold.block);
+    if (blocks <= 1) {
+        pool_fold_range(&fold, result, 0, count);
+        return Success;
+    }
+
+    fold.partials = malloc((size_t) blocks * 2 * size);
+    if (fold.partials == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        return OutOfMemory;
+    }
+
+    rc = pool_parallel_for(pool, 0, blocks, 1, pool_fold_blocks, &fold);
+    if (rc == Success)
+        for (int64_t b = 0; b < blocks; b++)
+            combine(ctx, result, fold.partials + (size_t) b * 2 * size);
+
+    free(fold.partials);
+    return rc;
+}
+
+/**
+ * @brief: The scans' three passes: block sums on the pool, their exclusive prefixes by the caller, then every block's prefixes on the pool.
+*/
+static rc_t pool_scan(thread_pool_t* pool, const void* in, void* out, size_t count, size_t size,
+                      const void* identity, pool_combine_fun_t combine, void* ctx, bool inclusive) {
+
+    rc_t rc = pool_fold_args(pool, in, out, count, size, identity, combine);
+    if (rc != Success || count == 0)
+        return rc;
+
+    pool_fold_t fold;
+    fold.in = in;
+    fold.out = out;
+    fold.count = count;
+    fold.size = size;
+    fold.block = pool_block_elements(POOL_ALGORITHMS_BLOCK_BYTES, size);
+    fold.identity = identity;
+    fold.combine = combine;
+    fold.ctx = ctx;
+    fold.inclusive = inclusive;
+
+    int64_t blocks = pool_num_blocks(count, fold.block);
+    fold.partials = malloc((size_t) blocks * 2 * size);
+    if (fold.partials == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        return OutOfMemory;
+    }
+
+    if (blocks > 1)
+        rc = pool_parallel_for(pool, 0, blocks - 1, 1, pool_fold_blocks, &fold);   // the last block's sum is not needed
+
+    if (rc == Success) {
+        // Turn the block sums into the running value each block starts from; the last spare slot carries the sum
+        char* running = fold.partials + ((size_t) blocks * 2 - 1) * size;
+        memcpy(running, identity, size);
+        for (int64_t b = 0; b < blocks; b++) {
+            char* partial = fold.partials + (size_t) b * 2 * size;
+            char* spare = partial + size;
+            if (b < blocks - 1)
+                memcpy(spare, partial, size);
+            memcpy(partial, running, size);
+            if (b < blocks - 1)
+                combine(ctx, running, spare);
+        }
+
+        if (blocks > 1)
+            rc = pool_parallel_for(pool, 0, blocks, 1, pool_scan_blocks, &fold);
+        else
+            rc = pool_scan_blocks(&fold, 0, 1);
+    }
+
+    free(fold.partials);
+    return rc;
+}
+
+/**
+ * @brief: Writes out[i] = in[0] combined with ... in[i].
+ *
+ * @param: pool -- thread pool object.
+ * @param: in -- the first input element.
+ * @param: out -- the first output element; may be in.
+ * @param: count -- the number of elements.
+ * @param: size -- the size of an element.
+ * @param: identity -- the neutral element of combine.
+ * @param: combine -- an associative operation, called as combine(ctx, acc, value).
+ * @param: ctx -- passed through to combine.
+ *
+ * @return: the rc_t value (Success, OutOfMemory, InvalidArgument)
+*/
+rc_t pool_inclusive_scan(thread_pool_t* pool, const void* in, void* out, size_t count, size_t size,
+                         const void* identity, pool_combine_fun_t combine, void* ctx) {
+    return pool_scan(pool, in, out, count, size, identity, combine, ctx, true);
+}
+
+/**
+ * @brief: Writes out[i] = identity combined with in[0] ... in[i - 1], so out[0] is identity.
+ *
+ * @param: pool -- thread pool object.
+ * @param: in -- the first input element.
+ * @param: out -- the first output element; may be in.
+ * @param: count -- the number of elements.
+ * @param: size -- the size of an element.
+ * @param: identity -- the neutral element of combine.
+ * @param: combine -- an associative operation, called as combine(ctx, acc, value).
+ * @param: ctx -- passed through to combine.
+ *
+ * @return: the rc_t value (Success, OutOfMemory, InvalidArgument)
+*/
+rc_t pool_exclusive_scan(thread_pool_t* pool, const void* in, void* out, size_t count, size_t size,
+                         const void* identity, pool_combine_fun_t combine, void* ctx) {
+    return pool_scan(pool, in, out, count, size, identity, combine, ctx, false);
+}
+
+// pool_parallel_for body: runs fun over every element of blocks [begin, end).
+static rc_t pool_transform_blocks(void* ctx, int64_t begin, int64_t end) {
+
+    pool_map_elements_t* map = (pool_map_elements_t*) ctx;
+    size_t first = (size_t) begin * map->block;
+    size_t last = (size_t) end * map->block < map->count ? (size_t) end * map->block : map->count;
+
+    for (size_t i = first; i < last; i++)
+        map->fun(map->ctx, map->out + i * map->out_size, map->in + i * map->in_size);
+
+    return Success;
+}
+
+/**
+ * @brief: Writes out[i] = fun(in[i]) for every element.
+ *
+ * @param: pool -- thread pool object.
+ * @param: in -- the first input element.
+ * @param: in_size -- the size of an input element.
+ * @param: out -- the first output element; may be in when the sizes are equal.
+ * @param: out_size -- the size of an output element.
+ * @param: count -- the number of elements.
+ * @param: fun -- called as fun(ctx, &out[i], &in[i]).
+ * @param: ctx -- passed through to fun.
+ *
+ * @return: the rc_t value (Success, OutOfMemory, InvalidArgument)
+*/
+rc_t pool_transform(thread_pool_t* pool, const void* in, size_t in_size, void* out, size_t out_size,
+                    size_t count, pool_transform_fun_t fun, void* ctx) {
+
+    if (pool == NULL || fun == NULL || ((in == NULL || out == NULL) && count > 0)) {
+        fprintf(stderr, "The pool, function and buffers cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (in_size == 0 || out_size == 0) {
+        fprintf(stderr, "The element size cannot be 0.\n");
+        return InvalidArgument;
+    }
+
+    pool_map_elements_t map;
+    map.in = in;
+    map.in_size = in_size;
+    map.out = out;
+    map.out_size = out_size;
+    map.count = count;
+    map.block = pool_block_elements(POOL_ALGORITHMS_BLOCK_BYTES, in_size > out_size ? in_size : out_size);
+    map.fun = fun;
+    map.ctx = ctx;
+
+    return pool_parallel_for(pool, 0, pool_num_blocks(count, map.block), 1, pool_transform_blocks, &map);
+}
+
+// pool_parallel_for body: qsorts runs [begin, end) in place.
+static rc_t pool_sort_runs(void* ctx, int64_t begin, int64_t end) {
+
+    pool_merge_t* merge = (pool_merge_t*) ctx;
+
+    for (int64_t r = begin; r < end; r++) {
+        size_t first = (size_t) r * merge->run;
+        size_t length = first + merge->run < merge->count ? merge->run : merge->count - first;
+        qsort(merge->dst + first * merge->size, length, merge->size, merge->compare);
+    }
+
+    return Success;
+}
+
+/**
+ * @brief: How many of the first diagonal elements of the merge of a and b come from a.
+ *
+ * Ties go to a, as in the merge itself, so every output chunk can be merged on its own.
+*/
+static size_t pool_merge_split(pool_merge_t* merge, const char* a, size_t na, const char* b, size_t nb, size_t diagonal) {
+
+    size_t size = merge->size;
+    size_t low = diagonal > nb ? diagonal - nb : 0;
+    size_t high = diagonal < na ? diagonal : na;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        size_t j = diagonal - mid;
+        if (merge->compare(a + mid * size, b + (j - 1) * size) <= 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    return low;
+}
+
+/**
+ * @brief: pool_parallel_for body of a merge pass: writes output chunks [begin, end) of dst.
+ *
+ * A chunk lies inside the merge of one pair of runs, because run divides width. Its ends are found by binary search on the pair, so a long merge is split among the workers instead of falling to one of them in the last passes.
+*/
+static rc_t pool_merge_chunks(void* ctx, int64_t begin, int64_t end) {
+
+    pool_merge_t* merge = (pool_merge_t*) ctx;
+    size_t size = merge->size;
+
+    for (int64_t c = begin; c < end; c++) {
+        size_t out_first = (size_t) c * merge->run;
+        size_t out_last = out_first + merge->run < merge->count ? out_first + merge->run : merge->count;
+        size_t pair = out_first - out_first % (2 * merge->width);
+
+        const char* a = merge->src + pair * size;
+        size_t na = merge->count - pair < merge->width ? merge->count - pair : merge->width;
+        const char* b = a + na * size;
+        size_t nb = merge->count - pair - na < merge->width ? merge->count - pair - na : merge->width;
+
+        size_t i = pool_merge_split(merge, a, na, b, nb, out_first - pair);
+        size_t j = out_first - pair - i;
+        size_t i_end = pool_merge_split(merge, a, na, b, nb, out_last - pair);
+        size_t j_end = out_last - pair - i_end;
+
+        char* out = merge->dst + out_first * size;
+        while (i < i_end && j < j_end) {
+            if (merge->compare(b + j * size, a + i * size) < 0) {
+                memcpy(out, b + j * size, size);
+                j++;
+            } else {
+                memcpy(out, a + i * size, size);
+                i++;
+            }
+            out += size;
+        }
+        memcpy(out, a + i * size, (i_end - i) * size);
+        out += (i_end - i) * size;
+        memcpy(out, b + j * size, (j_end - j) * size);
+    }
+
+    return Success;
+}
+
+// pool_parallel_for body: copies runs [begin, end) of src to dst.
+static rc_t pool_copy_runs(void* ctx, int64_t begin, int64_t end) {
+
+    pool_merge_t* merge = (pool_merge_t*) ctx;
+    size_t first = (size_t) begin * merge->run;
+    size_t last = (size_t) end * merge->run < merge->count ? (size_t) end * merge->run : merge->count;
+
+    memcpy(merge->dst + first * merge->size, merge->src + first * merge->size, (last - first) * merge->size);
+    return Success;
+}
+
+/**
+ * @brief: Sorts an array in ascending order, like qsort.
+ *
+ * Runs that fit in a core's L2 cache are sorted with qsort on the pool, then merged pairwise, a pass at a time, between the array and a buffer of the same size. Every pass is cut into output chunks of one run, so all workers take part in every pass. Not stable.
+ *
+ * @param: pool -- thread pool object.
+ * @param: base -- the first element.
+ * @param: count -- the number of elements.
+ * @param: size -- the size of an element.
+ * @param: compare -- as for qsort.
+ *
+ * @return: the rc_t value (Success, OutOfMemory, InvalidArgument)
+*/
+rc_t pool_sort(thread_pool_t* pool, void* base, size_t count, size_t size, pool_compare_fun_t compare) {
+
+    if (pool == NULL || compare == NULL || (base == NULL && count > 0)) {
+        fprintf(stderr, "The pool, compare function and array cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (size == 0) {
+        fprintf(stderr, "The element size cannot be 0.\n");
+        return InvalidArgument;
+    }
+
+    pool_merge_t merge;
+    merge.count = count;
+    merge.size = size;
+    merge.run = pool_block_elements(POOL_ALGORITHMS_RUN_BYTES, size);
+    merge.compare = compare;
+
+    if (count <= merge.run) {
+        qsort(base, count, size, compare);
+        return Success;
+    }
+
+    char* buffer = malloc(count * size);
+    if (buffer == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        return OutOfMemory;
+    }
+
+    int64_t runs = pool_num_blocks(count, merge.run);
+    merge.src = NULL;
+    merge.dst = base;
+    rc_t rc = pool_parallel_for(pool, 0, runs, 1, pool_sort_runs, &merge);
+
+    merge.src = base;
+    merge.dst = buffer;
+    for (merge.width = merge.run; rc == Success && merge.width < count; merge.width *= 2) {
+        rc = pool_parallel_for(pool, 0, runs, 1, pool_merge_chunks, &merge);
+
+        const char* src = merge.src;
+        merge.src = merge.dst;
+        merge.dst = (char*) src;
+    }
+
+    if (rc == Success && merge.src != base) {
+        merge.dst = base;
+        rc = pool_parallel_for(pool, 0, runs, 1, pool_copy_runs, &merge);
+    }
+
+    free(buffer);
+    return rc;
+}
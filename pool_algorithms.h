@@ -0,0 +1,35 @@
+#ifndef pool_algorithms_h
+#define pool_algorithms_h
+
+#include "rc.h"
+#include "pool.h"
+#include <stddef.h>
+
+/*
+ * Data-parallel algorithms over contiguous arrays of fixed-size elements,
+ * run on a pool's workers through pool_parallel_for. The array is cut into
+ * blocks of a few tens of kilobytes, so the elements a task touches stay in
+ * its core's cache, and one task handles a block, not an element. Elements
+ * are passed by address and size, as with qsort.
+ *
+ * combine must be associative; the order of the elements is kept, so it need
+ * not be commutative. identity is its neutral element: combine(identity, x)
+ * leaves x. Every call may also be made from inside a pool task.
+ */
+
+// acc = acc combined with value
+typedef void pool_combine_fun_t(void* ctx, void* acc, const void* value);
+typedef void pool_transform_fun_t(void* ctx, void* out, const void* in);
+typedef int pool_compare_fun_t(const void* a, const void* b);
+
+rc_t pool_reduce(thread_pool_t* pool, const void* base, size_t count, size_t size,
+                 const void* identity, pool_combine_fun_t combine, void* ctx, void* result);
+rc_t pool_inclusive_scan(thread_pool_t* pool, const void* in, void* out, size_t count, size_t size,
+                         const void* identity, pool_combine_fun_t combine, void* ctx);
+rc_t pool_exclusive_scan(thread_pool_t* pool, const void* in, void* out, size_t count, size_t size,
+                         const void* identity, pool_combine_fun_t combine, void* ctx);
+rc_t pool_transform(thread_pool_t* pool, const void* in, size_t in_size, void* out, size_t out_size,
+                    size_t count, pool_transform_fun_t fun, void* ctx);
+rc_t pool_sort(thread_pool_t* pool, void* base, size_t count, size_t size, pool_compare_fun_t compare);
+
+#endif
@@ -0,0 +1,539 @@
+#include "pool.h"
+#include "pool_algorithms.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+
+/*
+ * Throughput and dispatch latency of the pool over a sweep of pool size,
+ * queue depth, payload size and task cost. Dispatch latency is the time from
+ * handing a task to the pool until a worker starts running it. One line per
+ * configuration is written to stdout as CSV (default) or JSON.
+ *
+ * With -a it instead times the parallel algorithms of pool_algorithms against
+ * qsort and plain serial loops over the same data, and checks that both give
+ * the same answer.
+ */
+
+#define BENCH_MAP_BATCH 256      // args per pool_map call
+#define BENCH_WINDOW 64          // outstanding pool_submit futures per producer
+#define BENCH_PRODUCERS 4
+#define BENCH_ALGORITHM_ELEMENTS (1 << 22)
+
+typedef enum bench_scenario_st {
+    BenchScenarioMap,            // one caller issuing pool_map batches
+    BenchScenarioMixed,          // concurrent producers, half pool_submit, half pool_map
+} bench_scenario_t;
+
+typedef struct bench_cost_st {
+    const char* name;
+    uint64_t nsecs;
+    int task_divisor;            // long tasks run fewer iterations
+} bench_cost_t;
+
+typedef struct bench_task_st {
+    uint64_t enqueue_nsecs;
+    uint64_t start_nsecs;
+    unsigned char* payload;
+    uint32_t payload_bytes;
+    uint64_t cost_nsecs;
+} bench_task_t;
+
+typedef struct bench_config_st {
+    bench_scenario_t scenario;
+    pool_scheduler_t scheduler;
+    int pool_size;
+    uint32_t queue_blocks;
+    uint32_t payload_bytes;
+    const bench_cost_t* cost;
+    int tasks;
+} bench_config_t;
+
+typedef struct bench_producer_st {
+    thread_pool_t* pool;
+    bench_task_t* tasks;
+    int count;
+    bool use_submit;
+    rc_t rc;
+} bench_producer_t;
+
+static const bench_cost_t bench_costs[] = {
+    { "empty", 0, 1 },
+    { "short", 1000, 1 },
+    { "long", 50000, 20 },
+};
+
+static uint64_t bench_now_nsecs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static rc_t bench_task(void* arg, void** result) {
+    bench_task_t* task = (bench_task_t*) arg;
+    task->start_nsecs = bench_now_nsecs();
+
+    uintptr_t sum = 0;
+    for (uint32_t i = 0; i < task->payload_bytes; i++)
+        sum += task->payload[i];
+    if (task->payload_bytes > 0)
+        task->payload[0] = (unsigned char) sum;
+
+    if (task->cost_nsecs > 0)
+        while (bench_now_nsecs() - task->start_nsecs < task->cost_nsecs)
+            ;
+
+    *result = (void*) sum;
+    return Success;
+}
+
+static rc_t bench_map(thread_pool_t* pool, bench_task_t* tasks, int count) {
+    void* args[BENCH_MAP_BATCH];
+    void* results[BENCH_MAP_BATCH];
+
+    for (int done = 0; done < count; ) {
+        int batch = count - done < BENCH_MAP_BATCH ? count - done : BENCH_MAP_BATCH;
+
+        uint64_t now = bench_now_nsecs();
+        for (int i = 0; i < batch; i++) {
+            tasks[done + i].enqueue_nsecs = now;
+            args[i] = &tasks[done + i];
+        }
+
+        rc_t rc = pool_map(pool, bench_task, batch, args, results);
+        if (rc != Success)
+            return rc;
+
+        done += batch;
+    }
+
+    return Success;
+}
+
+static rc_t bench_submit(thread_pool_t* pool, bench_task_t* tasks, int count) {
+    future_t futures[BENCH_WINDOW];
+
+    for (int i = 0; i < count; i++) {
+        future_t* future = &futures[i % BENCH_WINDOW];
+        if (i >= BENCH_WINDOW && future_wait(future, NULL) != Success)
+            return Error;
+
+        tasks[i].enqueue_nsecs = bench_now_nsecs();
+        rc_t rc = pool_submit(pool, bench_task, &tasks[i], future);
+        if (rc != Success)
+            return rc;
+    }
+
+    int outstanding = count < BENCH_WINDOW ? count : BENCH_WINDOW;
+    for (int i = count - outstanding; i < count; i++)
+        if (future_wait(&futures[i % BENCH_WINDOW], NULL) != Success)
+            return Error;
+
+    return Success;
+}
+
+static void* bench_producer(void* arg) {
+    bench_producer_t* producer = (bench_producer_t*) arg;
+
+    if (producer->use_submit)
+        producer->rc = bench_submit(producer->pool, producer->tasks, producer->count);
+    else
+        producer->rc = bench_map(producer->pool, producer->tasks, producer->count);
+
+    return NULL;
+}
+
+static rc_t bench_mixed(thread_pool_t* pool, bench_task_t* tasks, int count) {
+    pthread_t threads[BENCH_PRODUCERS];
+    bench_producer_t producers[BENCH_PRODUCERS];
+    rc_t rc = Success;
+
+    for (int i = 0; i < BENCH_PRODUCERS; i++) {
+        int begin = (int)((int64_t)count * i / BENCH_PRODUCERS);
+        int end = (int)((int64_t)count * (i + 1) / BENCH_PRODUCERS);
+
+        producers[i].pool = pool;
+        producers[i].tasks = tasks + begin;
+        producers[i].count = end - begin;
+        producers[i].use_submit = (i % 2) == 0;
+        producers[i].rc = Success;
+
+        if (pthread_create(&threads[i], NULL, bench_producer, &producers[i]) != 0) {
+            fprintf(stderr, "Error creating producer thread.\n");
+            return Error;
+        }
+    }
+
+    for (int i = 0; i < BENCH_PRODUCERS; i++) {
+        pthread_join(threads[i], NULL);
+        if (producers[i].rc != Success)
+            rc = producers[i].rc;
+    }
+
+    return rc;
+}
+
+static int bench_compare(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+static double bench_percentile_usecs(uint64_t* sorted, int count, double percentile) {
+    int index = (int)(percentile * (count - 1) + 0.5);
+    return sorted[index] / 1000.0;
+}
+
+static rc_t bench_run(bench_config_t* config, bool json, bool* first) {
+    thread_pool_t pool;
+    pool_attr_t attrs;
+    rc_t rc;
+
+    rc = pool_attr_init(&attrs);
+    if (rc != Success)
+        return rc;
+    attrs.pool_size = config->pool_size;
+    attrs.scheduler = config->scheduler;
+    attrs.queue_blocks = config->queue_blocks;
+
+    bench_task_t* tasks = calloc(config->tasks, sizeof(bench_task_t));
+    unsigned char* payload = calloc((size_t) config->tasks * config->payload_bytes + 1, 1);
+    uint64_t* latencies = malloc(sizeof(uint64_t) * config->tasks);
+    if (tasks == NULL || payload == NULL || latencies == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        free(tasks);
+        free(payload);
+        free(latencies);
+        return OutOfMemory;
+    }
+
+    for (int i = 0; i < config->tasks; i++) {
+        tasks[i].payload = payload + (size_t) i * config->payload_bytes;
+        tasks[i].payload_bytes = config->payload_bytes;
+        tasks[i].cost_nsecs = config->cost->nsecs;
+    }
+
+    rc = pool_create_attr(&pool, &attrs);
+    if (rc != Success) {
+        fprintf(stderr, "Error calling pool create.\n");
+        free(tasks);
+        free(payload);
+        free(latencies);
+        return rc;
+    }
+
+    uint64_t begin = bench_now_nsecs();
+    if (config->scenario == BenchScenarioMap)
+        rc = bench_map(&pool, tasks, config->tasks);
+    else
+        rc = bench_mixed(&pool, tasks, config->tasks);
+    uint64_t elapsed = bench_now_nsecs() - begin;
+
+    pool_destroy(&pool);
+
+    if (rc == Success) {
+        for (int i = 0; i < config->tasks; i++)
+            latencies[i] = tasks[i].start_nsecs - tasks[i].enqueue_nsecs;
+        qsort(latencies, config->tasks, sizeof(uint64_t), bench_compare);
+
+        double seconds = elapsed / 1e9;
+        const char* scenario = config->scenario == BenchScenarioMap ? "map" : "mixed";
+        const char* scheduler = config->scheduler == PoolSchedulerShared ? "shared" : "stealing";
+        double p50 = bench_percentile_usecs(latencies, config->tasks, 0.50);
+        double p99 = bench_percentile_usecs(latencies, config->tasks, 0.99);
+        double p999 = bench_percentile_usecs(latencies, config->tasks, 0.999);
+
+        if (json) {
+            printf("%s  {\"scenario\": \"%s\", \"scheduler\": \"%s\", \"pool_size\": %d, \"queue_blocks\": %u, "
+                   "\"payload_bytes\": %u, \"task_cost\": \"%s\", \"tasks\": %d, \"seconds\": %.6f, "
+                   "\"tasks_per_sec\": %.1f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"p999_us\": %.3f}",
+                   *first ? "" : ",\n", scenario, scheduler, config->pool_size, config->queue_blocks,
+                   config->payload_bytes, config->cost->name, config->tasks, seconds,
+                   config->tasks / seconds, p50, p99, p999);
+        } else {
+            printf("%s,%s,%d,%u,%u,%s,%d,%.6f,%.1f,%.3f,%.3f,%.3f\n",
+                   scenario, scheduler, config->pool_size, config->queue_blocks,
+                   config->payload_bytes, config->cost->name, config->tasks, seconds,
+                   config->tasks / seconds, p50, p99, p999);
+        }
+        fflush(stdout);
+        *first = false;
+    }
+
+    free(tasks);
+    free(payload);
+    free(latencies);
+
+    return rc;
+}
+
+typedef enum bench_algorithm_st {
+    BenchAlgorithmReduce,
+    BenchAlgorithmScan,
+    BenchAlgorithmTransform,
+    BenchAlgorithmSort,
+} bench_algorithm_t;
+
+static const char* bench_algorithm_names[] = { "reduce", "inclusive_scan", "transform", "sort" };
+
+static void bench_add(void* ctx, void* acc, const void* value) {
+    (void)ctx;
+    *(uint64_t*) acc += *(const uint64_t*) value;
+}
+
+static void bench_scale(void* ctx, void* out, const void* in) {
+    (void)ctx;
+    *(uint64_t*) out = *(const uint64_t*) in * 3 + 1;
+}
+
+static uint64_t bench_random(uint64_t* state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+/**
+ * @brief: Times one algorithm serially and on the pool over the same input; the outputs must match.
+ *
+ * @return: the rc_t value, Error when the outputs differ.
+*/
+static rc_t bench_algorithm(thread_pool_t* pool, bench_algorithm_t algorithm, uint64_t* input, uint64_t* serial,
+                            uint64_t* parallel, size_t count, double* serial_seconds, double* pool_seconds) {
+    uint64_t zero = 0;
+    uint64_t serial_sum = 0;
+    uint64_t pool_sum = 0;
+    rc_t rc = Success;
+
+    if (algorithm == BenchAlgorithmSort) {
+        memcpy(serial, input, count * sizeof(uint64_t));
+        memcpy(parallel, input, count * sizeof(uint64_t));
+    }
+
+    uint64_t begin = bench_now_nsecs();
+    switch (algorithm) {
+    case BenchAlgorithmReduce:
+        for (size_t i = 0; i < count; i++)
+            serial_sum += input[i];
+        break;
+    case BenchAlgorithmScan:
+        for (size_t i = 0; i < count; i++) {
+            serial_sum += input[i];
+            serial[i] = serial_sum;
+        }
+        break;
+    case BenchAlgorithmTransform:
+        for (size_t i = 0; i < count; i++)
+            serial[i] = input[i] * 3 + 1;
+        break;
+    case BenchAlgorithmSort:
+        qsort(serial, count, sizeof(uint64_t), bench_compare);
+        break;
+    }
+    *serial_seconds = (bench_now_nsecs() - begin) / 1e9;
+
+    begin = bench_now_nsecs();
+    switch (algorithm) {
+    case BenchAlgorithmReduce:
+        rc = pool_reduce(pool, input, count, sizeof(uint64_t), &zero, bench_add, NULL, &pool_sum);
+        break;
+    case BenchAlgorithmScan:
+        rc = pool_inclusive_scan(pool, input, parallel, count, sizeof(uint64_t), &zero, bench_add, NULL);
+        break;
+    case BenchAlgorithmTransform:
+        rc = pool_transform(pool, input, sizeof(uint64_t), parallel, sizeof(uint64_t), count, bench_scale, NULL);
+        break;
+    case BenchAlgorithmSort:
+        rc = pool_sort(pool, parallel, count, sizeof(uint64_t), bench_compare);
+        break;
+    }
+    *pool_seconds = (bench_now_nsecs() - begin) / 1e9;
+
+    if (rc != Success)
+        return rc;
+
+    bool same = algorithm == BenchAlgorithmReduce ? serial_sum == pool_sum
+                                                  : memcmp(serial, parallel, count * sizeof(uint64_t)) == 0;
+    if (!same) {
+        fprintf(stderr, "The %s result differs from the serial one.\n", bench_algorithm_names[algorithm]);
+        return Error;
+    }
+
+    return Success;
+}
+
+static rc_t bench_algorithms_run(pool_scheduler_t scheduler, int pool_size, uint64_t* input, uint64_t* serial,
+                                 uint64_t* parallel, size_t count, bool json, bool* first) {
+    thread_pool_t pool;
+    pool_attr_t attrs;
+    rc_t rc;
+
+    rc = pool_attr_init(&attrs);
+    if (rc != Success)
+        return rc;
+    attrs.pool_size = pool_size;
+    attrs.scheduler = scheduler;
+
+    rc = pool_create_attr(&pool, &attrs);
+    if (rc != Success) {
+        fprintf(stderr, "Error calling pool create.\n");
+        return rc;
+    }
+
+    for (int a = BenchAlgorithmReduce; a <= BenchAlgorithmSort && rc == Success; a++) {
+        double serial_seconds, pool_seconds;
+        rc = bench_algorithm(&pool, a, input, serial, parallel, count, &serial_seconds, &pool_seconds);
+        if (rc != Success)
+            break;
+
+        const char* name = scheduler == PoolSchedulerShared ? "shared" : "stealing";
+        if (json) {
+            printf("%s  {\"algorithm\": \"%s\", \"scheduler\": \"%s\", \"pool_size\": %d, \"elements\": %zu, "
+                   "\"serial_seconds\": %.6f, \"pool_seconds\": %.6f, \"speedup\": %.2f}",
+                   *first ? "" : ",\n", bench_algorithm_names[a], name, pool_size, count,
+                   serial_seconds, pool_seconds, serial_seconds / pool_seconds);
+        } else {
+            printf("%s,%s,%d,%zu,%.6f,%.6f,%.2f\n", bench_algorithm_names[a], name, pool_size, count,
+                   serial_seconds, pool_seconds, serial_seconds / pool_seconds);
+        }
+        fflush(stdout);
+        *first = false;
+    }
+
+    pool_destroy(&pool);
+    return rc;
+}
+
+static int bench_algorithms(int* pool_sizes, int num_pool_sizes, size_t count, bool json) {
+    uint64_t* input = malloc(count * sizeof(uint64_t));
+    uint64_t* serial = malloc(count * sizeof(uint64_t));
+    uint64_t* parallel = malloc(count * sizeof(uint64_t));
+    if (input == NULL || serial == NULL || parallel == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        free(input);
+        free(serial);
+        free(parallel);
+        return 1;
+    }
+
+    uint64_t state = 88172645463325252ull;
+    for (size_t i = 0; i < count; i++)
+        input[i] = bench_random(&state);
+
+    pool_scheduler_t schedulers[] = { PoolSchedulerShared, PoolSchedulerWorkStealing };
+    bool first = true;
+    int failures = 0;
+
+    if (json)
+        printf("[\n");
+    else
+        printf("algorithm,scheduler,pool_size,elements,serial_seconds,pool_seconds,speedup\n");
+
+    for (int k = 0; k < 2; k++)
+    for (int p = 0; p < num_pool_sizes; p++) {
+        if (bench_algorithms_run(schedulers[k], pool_sizes[p], input, serial, parallel, count, json, &first) != Success) {
+            fprintf(stderr, "Configuration failed.\n");
+            failures++;
+        }
+    }
+
+    if (json)
+        printf("\n]\n");
+
+    free(input);
+    free(serial);
+    free(parallel);
+    return failures == 0 ? 0 : 1;
+}
+
+static void bench_usage(const char* name) {
+    fprintf(stderr,
+            "usage: %s [-j] [-q] [-n tasks] [-a] [-e elements]\n"
+            "  -j           write JSON instead of CSV\n"
+            "  -q           quick sweep (fewer configurations)\n"
+            "  -n tasks     tasks per configuration (default 20000; long tasks run a twentieth)\n"
+            "  -a           time pool_algorithms against qsort and serial loops instead\n"
+            "  -e elements  array length for -a (default %d)\n",
+            name, BENCH_ALGORITHM_ELEMENTS);
+}
+
+int main(int argc, char* argv[]) {
+    bool json = false;
+    bool quick = false;
+    bool algorithms = false;
+    int tasks = 20000;
+    long elements = BENCH_ALGORITHM_ELEMENTS;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "jqn:ae:h")) != -1) {
+        switch (opt) {
+        case 'j': json = true; break;
+        case 'q': quick = true; break;
+        case 'n': tasks = atoi(optarg); break;
+        case 'a': algorithms = true; break;
+        case 'e': elements = atol(optarg); break;
+        default:
+            bench_usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (tasks <= 0 || elements <= 0) {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    int cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int pool_sizes[] = { 1, 2, 4, cpus > 4 ? cpus : 8 };
+    uint32_t queue_blocks[] = { 32, 1024 };
+    uint32_t payloads[] = { 0, 64, 4096 };
+    pool_scheduler_t schedulers[] = { PoolSchedulerShared, PoolSchedulerWorkStealing };
+    bench_scenario_t scenarios[] = { BenchScenarioMap, BenchScenarioMixed };
+
+    int num_pool_sizes = quick ? 2 : 4;
+    int num_queue_blocks = quick ? 1 : 2;
+    int num_payloads = quick ? 2 : 3;
+
+    if (algorithms)
+        return bench_algorithms(pool_sizes, num_pool_sizes, (size_t) elements, json);
+
+    if (json)
+        printf("[\n");
+    else
+        printf("scenario,scheduler,pool_size,queue_blocks,payload_bytes,task_cost,tasks,seconds,tasks_per_sec,p50_us,p99_us,p999_us\n");
+
+    bool first = true;
+    int failures = 0;
+
+    for (int s = 0; s < 2; s++)
+    for (int k = 0; k < 2; k++)
+    for (int p = 0; p < num_pool_sizes; p++)
+    for (int q = 0; q < num_queue_blocks; q++)
+    for (int b = 0; b < num_payloads; b++)
+    for (int c = 0; c < 3; c++) {
+        bench_config_t config;
+        config.scenario = scenarios[s];
+        config.scheduler = schedulers[k];
+        config.pool_size = pool_sizes[p];
+        config.queue_blocks = queue_blocks[q];
+        config.payload_bytes = payloads[b];
+        config.cost = &bench_costs[c];
+        config.tasks = tasks / bench_costs[c].task_divisor;
+        if (config.tasks == 0)
+            config.tasks = 1;
+
+        if (bench_run(&config, json, &first) != Success) {
+            fprintf(stderr, "Configuration failed.\n");
+            failures++;
+        }
+    }
+
+    if (json)
+        printf("\n]\n");
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,379 @@
+#include "pool_graph.h"
+#include "fiber.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define POOL_GRAPH_INITIAL_CAPACITY 16
+
+static rc_t pool_graph_node_run(void* arg, void** result);
+
+/**
+ * @brief: Initializes an empty graph.
+ *
+ * @param: graph -- the graph.
+ * @return: the rc_t value (Success, InvalidArgument)
+*/
+rc_t pool_graph_create(pool_graph_t* graph) {
+
+    if (graph == NULL) {
+        fprintf(stderr, "The graph cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    graph->nodes = NULL;
+    graph->num_nodes = 0;
+    graph->node_capacity = 0;
+    graph->edges = NULL;
+    graph->num_edges = 0;
+    graph->edge_capacity = 0;
+    graph->successors = NULL;
+    graph->built = false;
+    graph->priority = PoolPriorityNormal;
+    graph->pool = NULL;
+    atomic_init(&graph->pending, 0);
+    atomic_init(&graph->rc, Success);
+
+    return Success;
+}
+
+/**
+ * @brief: Frees the graph's memory. The graph must not be running.
+ *
+ * @param: graph -- the graph.
+ * @return: the rc_t value (Success, InvalidArgument)
+*/
+rc_t pool_graph_destroy(pool_graph_t* graph) {
+
+    if (graph == NULL) {
+        fprintf(stderr, "The graph cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    free(graph->nodes);
+    free(graph->edges);
+    free(graph->successors);
+    graph->nodes = NULL;
+    graph->edges = NULL;
+    graph->successors = NULL;
+    graph->num_nodes = 0;
+    graph->num_edges = 0;
+    graph->node_capacity = 0;
+    graph->edge_capacity = 0;
+    graph->built = false;
+
+    return Success;
+}
+
+/**
+ * @brief: Adds a task to the graph.
+ *
+ * @param: graph -- the graph.
+ * @param: fun -- the user function, called as fun(arg, &result) once per run.
+ * @param: arg -- the argument for fun.
+ * @param: node -- receives the node's index, used by pool_graph_depend and pool_graph_result.
+ * @return: the rc_t value (Success, OutOfMemory, InvalidArgument)
+*/
+rc_t pool_graph_add(pool_graph_t* graph, pool_fun_t fun, void* arg, int* node) {
+
+    if (graph == NULL || fun == NULL || node == NULL) {
+        fprintf(stderr, "The graph, function and node cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (graph->num_nodes == graph->node_capacity) {
+        int capacity = graph->node_capacity == 0 ? POOL_GRAPH_INITIAL_CAPACITY : graph->node_capacity * 2;
+        pool_graph_node_t* nodes = realloc(graph->nodes, sizeof(pool_graph_node_t) * capacity);
+        if (nodes == NULL) {
+            fprintf(stderr, "Out of Memory\n");
+            return OutOfMemory;
+        }
+        graph->nodes = nodes;
+        graph->node_capacity = capacity;
+    }
+
+    pool_graph_node_t* added = &graph->nodes[graph->num_nodes];
+    added->fun = fun;
+    added->arg = arg;
+    added->result = NULL;
+    added->dependencies = 0;
+    atomic_init(&added->remaining, 0);
+    added->first_successor = 0;
+    added->num_successors = 0;
+    added->graph = graph;
+
+    *node = graph->num_nodes++;
+    graph->built = false;
+
+    return Success;
+}
+
+/**
+ * @brief: Makes node wait for predecessor in every run.
+ *
+ * @param: graph -- the graph.
+ * @param: node -- the node that depends on predecessor.
+ * @param: predecessor -- the node that has to finish first.
+ * @return: the rc_t value (Success, OutOfMemory, InvalidArgument)
+*/
+rc_t pool_graph_depend(pool_graph_t* graph, int node, int predecessor) {
+
+    if (graph == NULL) {
+        fprintf(stderr, "The graph cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (node < 0 || node >= graph->num_nodes || predecessor < 0 || predecessor >= graph->num_nodes) {
+        fprintf(stderr, "The node is not in the graph.\n");
+        return InvalidArgument;
+    }
+
+    if (graph->num_edges == graph->edge_capacity) {
+        int capacity = graph->edge_capacity == 0 ? POOL_GRAPH_INITIAL_CAPACITY : graph->edge_capacity * 2;
+        int* edges = realloc(graph->edges, sizeof(int) * 2 * capacity);
+        if (edges == NULL) {
+            fprintf(stderr, "Out of Memory\n");
+            return OutOfMemory;
+        }
+        graph->edges = edges;
+        graph->edge_capacity = capacity;
+    }
+
+    graph->edges[2 * graph->num_edges] = predecessor;
+    graph->edges[2 * graph->num_edges + 1] = node;
+    graph->num_edges++;
+    graph->built = false;
+
+    return Success;
+}
+
+/**
+ * @brief: Lays the edges out by predecessor, counts each node's dependencies and checks that there is no cycle.
+ *
+ * @param: graph -- the graph.
+ * @return: the rc_t value (Success, OutOfMemory, InvalidArgument when the graph has a cycle)
+*/
+static rc_t pool_graph_build(pool_graph_t* graph) {
+
+    rc_t rc = Success;
+    int n = graph->num_nodes;
+
+    int* successors = malloc(sizeof(int) * (graph->num_edges > 0 ? graph->num_edges : 1));
+    int* fill = calloc(n, sizeof(int));
+    int* ready = malloc(sizeof(int) * n);
+    int* remaining = malloc(sizeof(int) * n);
+
+    if (successors == NULL || fill == NULL || ready == NULL || remaining == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        free(successors);
+        rc = OutOfMemory;
+        goto done;
+    }
+
+    for (int i = 0; i < n; i++) {
+        graph->nodes[i].dependencies = 0;
+        graph->nodes[i].num_successors = 0;
+    }
+    for (int e = 0; e < graph->num_edges; e++) {
+        graph->nodes[graph->edges[2 * e]].num_successors++;
+        graph->nodes[graph->edges[2 * e + 1]].dependencies++;
+    }
+
+    int first = 0;
+    for (int i = 0; i < n; i++) {
+        graph->nodes[i].first_successor = first;
+        first += graph->nodes[i].num_successors;
+    }
+    for (int e = 0; e < graph->num_edges; e++) {
+        pool_graph_node_t* predecessor = &graph->nodes[graph->edges[2 * e]];
+        successors[predecessor->first_successor + fill[graph->edges[2 * e]]++] = graph->edges[2 * e + 1];
+    }
+
+    // Kahn's algorithm: every node is reached only if there is no cycle.
+    int head = 0;
+    int tail = 0;
+    for (int i = 0; i < n; i++) {
+        remaining[i] = graph->nodes[i].dependencies;
+        if (remaining[i] == 0)
+            ready[tail++] = i;
+    }
+    while (head < tail) {
+        pool_graph_node_t* node = &graph->nodes[ready[head++]];
+        for (int i = 0; i < node->num_successors; i++) {
+            int successor = successors[node->first_successor + i];
+            if (--remaining[successor] == 0)
+                ready[tail++] = successor;
+        }
+    }
+
+    if (tail < n) {
+        fprintf(stderr, "The graph has a cycle.\n");
+        free(successors);
+        rc = InvalidArgument;
+        goto done;
+    }
+
+    for (int i = 0; i < n; i++) {
+        pool_graph_node_t* node = &graph->nodes[i];
+        node->graph = graph;
+        node->work.id = i;
+        node->work.arg = node;
+        node->work.function_ptr = pool_graph_node_run;
+        node->work.future = NULL;
+        node->work.map = NULL;
+    }
+
+    free(graph->successors);
+    graph->successors = successors;
+    graph->built = true;
+
+done:
+    free(fill);
+    free(ready);
+    free(remaining);
+    return rc;
+}
+
+/**
+ * @brief: The pool function of a node: runs it and then the successors it makes ready.
+ *
+ * The first successor that becomes ready runs next on this worker; the others go to the pool. Those the pool does not take, because the worker would have to wait for a full queue, are held and run here too. Once a node has failed, the nodes that have not started yet are counted down without being run. The graph may be gone as soon as the last node is counted, so nothing touches it afterwards.
+ *
+ * @param: arg -- the pool_graph_node_t.
+ * @param: result -- unused.
+ * @return: Success; failures are reported through the graph.
+*/
+static rc_t pool_graph_node_run(void* arg, void** result) {
+
+    pool_graph_node_t* node = (pool_graph_node_t*) arg;
+    pool_graph_t* graph = node->graph;
+    pool_graph_node_t* held = NULL;
+
+    *result = NULL;
+
+    while (node != NULL) {
+        pool_graph_node_t* next = NULL;
+
+        node->result = NULL;
+        if (atomic_load_explicit(&graph->rc, memory_order_relaxed) == Success) {
+            rc_t rc = node->fun(node->arg, &node->result);
+            if (rc != Success) {
+                fprintf(stderr, "There was an error with the user function, error value was %d\n", rc);
+                int expected = Success;
+                atomic_compare_exchange_strong(&graph->rc, &expected, rc);
+            }
+        }
+
+        for (int i = 0; i < node->num_successors; i++) {
+            pool_graph_node_t* successor = &graph->nodes[graph->successors[node->first_successor + i]];
+            if (atomic_fetch_sub(&successor->remaining, 1) != 1)
+                continue;
+
+            if (next == NULL) {
+                next = successor;
+            } else if (pool_submit_work(graph->pool, &successor->work) != Success) {
+                successor->next_ready = held;
+                held = successor;
+            }
+        }
+
+        // next and the held nodes are still pending, so this cannot be the last node while there are any.
+        if (atomic_fetch_sub(&graph->pending, 1) == 1)
+            syscall(SYS_futex, &graph->pending, FUTEX_WAKE, INT_MAX, NULL, NULL, NULL);
+
+        if (next == NULL && held != NULL) {
+            next = held;
+            held = held->next_ready;
+        }
+        node = next;
+    }
+
+    return Success;
+}
+
+/**
+ * @brief: Runs every node of the graph on the pool and waits for all of them.
+ *
+ * The nodes without dependencies are handed to the pool; every other node runs once its last predecessor finished, on the worker that finished it when it is the first successor made ready there. The first run after the graph changed lays it out; later runs allocate nothing.
+ *
+ * @param: graph -- the graph; not running already.
+ * @param: pool -- thread pool object.
+ *
+ * @return: the rc_t value (Success, OutOfMemory, InvalidArgument when the graph has a cycle), or the first error returned by a node.
+*/
+rc_t pool_graph_run(pool_graph_t* graph, thread_pool_t* pool) {
+
+    rc_t rc;
+
+    if (graph == NULL || pool == NULL) {
+        fprintf(stderr, "The graph and pool cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (!graph->built) {
+        rc = pool_graph_build(graph);
+        if (rc != Success)
+            return rc;
+    }
+
+    if (graph->num_nodes == 0)
+        return Success;
+
+    graph->pool = pool;
+    atomic_store(&graph->rc, Success);
+    atomic_store(&graph->pending, graph->num_nodes);
+
+    for (int i = 0; i < graph->num_nodes; i++) {
+        pool_graph_node_t* node = &graph->nodes[i];
+        atomic_store_explicit(&node->remaining, node->dependencies, memory_order_relaxed);
+        node->work.priority = graph->priority;
+    }
+
+    // A root the pool does not take runs here, with everything it makes ready that the pool does not take either.
+    for (int i = 0; i < graph->num_nodes; i++) {
+        pool_graph_node_t* node = &graph->nodes[i];
+        if (node->dependencies == 0 && pool_submit_work(pool, &node->work) != Success) {
+            void* unused;
+            pool_graph_node_run(node, &unused);
+        }
+    }
+
+    // Completion latch; a graph run from a task of the pool helps with the work while it waits, or parks its fiber.
+    unsigned int pending;
+    while ((pending = atomic_load(&graph->pending)) != 0) {
+        if (fiber_wait(&graph->pending, pending, NULL) != InvalidOperation)
+            continue;
+        if (pool_help(pool) == Success)
+            continue;
+        syscall(SYS_futex, &graph->pending, FUTEX_WAIT, pending, NULL, NULL, NULL);
+    }
+
+    return atomic_load(&graph->rc);
+}
+
+/**
+ * @brief: The result a node's function returned in the last run.
+ *
+ * @param: graph -- the graph.
+ * @param: node -- the node.
+ * @param: result -- receives the result.
+ * @return: the rc_t value (Success, InvalidArgument)
+*/
+rc_t pool_graph_result(pool_graph_t* graph, int node, void** result) {
+
+    if (graph == NULL || result == NULL) {
+        fprintf(stderr, "The graph and result cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (node < 0 || node >= graph->num_nodes) {
+        fprintf(stderr, "The node is not in the graph.\n");
+        return InvalidArgument;
+    }
+
+    *result = graph->nodes[node].result;
+    return Success;
+}
@@ -0,0 +1,61 @@
+#ifndef pool_graph_h
+#define pool_graph_h
+
+#include "rc.h"
+#include "pool.h"
+#include <stdbool.h>
+#include <stdatomic.h>
+
+/*
+ * A graph of tasks run on a pool, where a task starts as soon as the tasks it
+ * depends on are done instead of at a barrier between pool_map calls. Every
+ * node keeps a count of the predecessors still running; the worker that
+ * finishes a node counts its successors down, runs one that became ready
+ * itself, while the node's output is still in its cache, and hands any
+ * others to the pool.
+ *
+ * A graph is built once with pool_graph_add and pool_graph_depend and can then
+ * be run any number of times. The first run after a change lays the edges out
+ * by predecessor and checks for cycles; later runs only reset the counts, so
+ * running allocates nothing. One run of a graph at a time; do not change a
+ * graph while it runs.
+ */
+
+typedef struct pool_graph_st pool_graph_t;
+
+typedef struct pool_graph_node_st {
+    pool_fun_t* fun;
+    void* arg;
+    void* result;              // of the last run
+    int dependencies;          // predecessors
+    atomic_int remaining;      // predecessors not finished in the current run
+    int first_successor;       // into graph->successors
+    int num_successors;
+    pool_graph_t* graph;
+    struct pool_graph_node_st* next_ready;   // ready nodes the pool did not take, run by the worker holding them
+    pool_work_t work;          // hands the node to the pool; only its address is queued with work stealing
+} pool_graph_node_t;
+
+struct pool_graph_st {
+    pool_graph_node_t* nodes;
+    int num_nodes;
+    int node_capacity;
+    int* edges;                // (predecessor, successor) pairs in the order they were added
+    int num_edges;
+    int edge_capacity;
+    int* successors;           // edges grouped by predecessor, built by the first run after a change
+    bool built;
+    pool_priority_t priority;  // of every node, PoolPriorityNormal unless set before a run
+    thread_pool_t* pool;       // of the run in progress
+    atomic_uint pending;       // nodes not finished in the current run, futex word
+    atomic_int rc;
+};
+
+rc_t pool_graph_create(pool_graph_t* graph);
+rc_t pool_graph_destroy(pool_graph_t* graph);
+rc_t pool_graph_add(pool_graph_t* graph, pool_fun_t fun, void* arg, int* node);
+rc_t pool_graph_depend(pool_graph_t* graph, int node, int predecessor);
+rc_t pool_graph_run(pool_graph_t* graph, thread_pool_t* pool);
+rc_t pool_graph_result(pool_graph_t* graph, int node, void** result);
+
+#endif
@@ -0,0 +1,465 @@
+#include "pool_io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#define POOL_IO_REAP_BATCH 32
+#define POOL_IO_PROBE_OPS 256
+
+struct pool_io_ring_st {
+    int fd;
+    thread_pool_t* pool;
+    uint32_t sq_entries;
+    uint32_t cq_entries;
+    atomic_uint* sq_head;
+    atomic_uint* sq_tail;
+    uint32_t sq_mask;
+    uint32_t* sq_array;
+    struct io_uring_sqe* sqes;
+    atomic_uint* cq_head;
+    atomic_uint* cq_tail;
+    uint32_t cq_mask;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;             // mappings, for munmap
+    size_t sq_ring_bytes;
+    void* cq_ring;             // sq_ring when the kernel maps both rings at once
+    size_t cq_ring_bytes;
+    size_t sqes_bytes;
+    pthread_mutex_t sq_lock;   // writing submission entries, and io_uring_enter to submit them
+    pthread_mutex_t cq_lock;   // reaping completions
+    atomic_uint unsubmitted;   // entries written but not yet handed to the kernel
+    atomic_uint in_flight;     // requests between submission and their callback being handed to the pool
+    pthread_t completion_thread;
+};
+
+static int pool_io_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+/**
+ * @brief: The pool task of a request without a ring: the blocking syscall, then the callback.
+*/
+static rc_t pool_io_run_blocking(void* arg, void** result) {
+
+    pool_io_t* io = (pool_io_t*) arg;
+
+    ssize_t done;
+    if (io->op == PoolIoRead)
+        done = pread(io->fd, io->buf, io->len, io->offset);
+    else
+        done = pwrite(io->fd, io->buf, io->len, io->offset);
+    io->result = done < 0 ? -errno : done;
+
+    io->callback(io);
+    *result = NULL;
+    return Success;
+}
+
+// The pool task of a completed ring request.
+static rc_t pool_io_run_callback(void* arg, void** result) {
+
+    pool_io_t* io = (pool_io_t*) arg;
+    io->callback(io);
+    *result = NULL;
+    return Success;
+}
+
+/**
+ * @brief: Hands a request to the pool as a detached task running fun; a worker facing a full queue runs it itself.
+*/
+static void pool_io_schedule(thread_pool_t* pool, pool_io_t* io, pool_fun_t* fun) {
+
+    io->work.id = -1;
+    io->work.priority = PoolPriorityNormal;
+    io->work.arg = io;
+    io->work.function_ptr = fun;
+    io->work.future = NULL;
+    io->work.map = NULL;
+
+    rc_t rc = pool_submit_work(pool, &io->work);
+    if (rc == Success)
+        return;
+
+    if (rc != QueueFull)
+        fprintf(stderr, "The I/O task could not be queued, error value was %d; running it here\n", rc);
+
+    void* result;
+    fun(io, &result);
+}
+
+// Called with sq_lock held. Hands the written entries to the kernel.
+static void pool_io_flush_locked(pool_io_ring_t* ring) {
+
+    unsigned int pending = atomic_load_explicit(&ring->unsubmitted, memory_order_relaxed);
+    if (pending == 0)
+        return;
+
+    int submitted = pool_io_enter(ring->fd, pending, 0, 0);
+    if (submitted > 0)
+        atomic_fetch_sub(&ring->unsubmitted, (unsigned int) submitted);
+    else if (submitted < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        fprintf(stderr, "io_uring_enter failed to submit, errno %d\n", errno);
+}
+
+/**
+ * @brief: Writes one submission entry; user_data 0 is the completion thread's stop marker.
+ *
+ * @return: Success, or QueueFull when the submission queue stays full after a flush.
+*/
+static rc_t pool_io_push(pool_io_ring_t* ring, uint8_t opcode, pool_io_t* io, bool defer) {
+
+    pthread_mutex_lock(&ring->sq_lock);
+
+    uint32_t tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) == ring->sq_entries) {
+        pool_io_flush_locked(ring);
+        if (tail - atomic_load_explicit(ring->sq_head, memory_order_acquire) == ring->sq_entries) {
+            pthread_mutex_unlock(&ring->sq_lock);
+            return QueueFull;
+        }
+    }
+
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    sqe->opcode = opcode;
+    sqe->fd = -1;
+    if (io != NULL) {
+        sqe->fd = io->fd;
+        sqe->addr = (uint64_t)(uintptr_t) io->buf;
+        sqe->len = (uint32_t) io->len;
+        sqe->off = (uint64_t) io->offset;
+    }
+    sqe->user_data = (uint64_t)(uintptr_t) io;
+
+    atomic_store_explicit(ring->sq_tail, tail + 1, memory_order_release);
+    atomic_fetch_add_explicit(&ring->unsubmitted, 1, memory_order_relaxed);
+
+    if (!defer)
+        pool_io_flush_locked(ring);
+
+    pthread_mutex_unlock(&ring->sq_lock);
+    return Success;
+}
+
+/**
+ * @brief: Reaps completions and hands their callbacks to the pool, a batch at a time.
+ *
+ * Called with cq_lock held; releases it. in_flight only drops once the callbacks are queued, so a worker polling the ring keeps helping until it can find them.
+ *
+ * @return: true when the completion thread's stop marker was reaped.
+*/
+static bool pool_io_reap_unlock(pool_io_ring_t* ring) {
+
+    pool_io_t* done[POOL_IO_REAP_BATCH];
+    uint32_t count = 0;
+    bool stop = false;
+
+    uint32_t head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+    // Pairs with the submitters' increments, so the requests they filled in before them are visible here.
+    atomic_load_explicit(&ring->in_flight, memory_order_acquire);
+    while (head != tail && count < POOL_IO_REAP_BATCH) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+        pool_io_t* io = (pool_io_t*)(uintptr_t) cqe->user_data;
+        if (io == NULL) {
+            stop = true;
+        } else {
+            io->result = cqe->res;
+            done[count++] = io;
+        }
+        head++;
+    }
+    atomic_store_explicit(ring->cq_head, head, memory_order_release);
+
+    pthread_mutex_unlock(&ring->cq_lock);
+
+    for (uint32_t i = 0; i < count; i++)
+        pool_io_schedule(ring->pool, done[i], pool_io_run_callback);
+    if (count > 0)
+        atomic_fetch_sub(&ring->in_flight, count);
+
+    return stop;
+}
+
+static bool pool_io_ready(pool_io_ring_t* ring) {
+    return atomic_load_explicit(ring->cq_tail, memory_order_acquire) != atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+}
+
+// Sleeps in the kernel until requests complete, for when no worker is polling.
+static void* pool_io_complete(void* arg) {
+
+    pool_io_ring_t* ring = (pool_io_ring_t*) arg;
+
+    while (true) {
+        if (pool_io_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            fprintf(stderr, "io_uring_enter failed to wait, errno %d\n", errno);
+            return NULL;
+        }
+
+        bool stop = false;
+        while (!stop && pool_io_ready(ring)) {
+            pthread_mutex_lock(&ring->cq_lock);
+            stop = pool_io_reap_unlock(ring);
+        }
+        if (stop)
+            return NULL;
+    }
+}
+
+/**
+ * @brief: Submits deferred entries and reaps completions, without waiting for either lock.
+ *
+ * The pool's workers call this between tasks, and in their waits.
+ *
+ * @param: ring -- the pool's ring.
+ * @return: true while requests are in flight.
+*/
+bool pool_io_ring_poll(pool_io_ring_t* ring) {
+
+    if (atomic_load_explicit(&ring->unsubmitted, memory_order_relaxed) > 0 && pthread_mutex_trylock(&ring->sq_lock) == 0) {
+        pool_io_flush_locked(ring);
+        pthread_mutex_unlock(&ring->sq_lock);
+    }
+
+    if (pool_io_ready(ring) && pthread_mutex_trylock(&ring->cq_lock) == 0)
+        pool_io_reap_unlock(ring);
+
+    return atomic_load_explicit(&ring->in_flight, memory_order_relaxed) > 0;
+}
+
+// Whether the kernel knows the read and write opcodes (5.6 and later).
+static bool pool_io_supported(int fd) {
+
+    size_t bytes = sizeof(struct io_uring_probe) + POOL_IO_PROBE_OPS * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, bytes);
+    if (probe == NULL)
+        return false;
+
+    bool supported = false;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, POOL_IO_PROBE_OPS) == 0)
+        supported = probe->last_op >= IORING_OP_WRITE &&
+                    (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+                    (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+
+    free(probe);
+    return supported;
+}
+
+static void pool_io_unmap(pool_io_ring_t* ring) {
+
+    if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+        munmap(ring->sqes, ring->sqes_bytes);
+    if (ring->cq_ring != NULL && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring, ring->cq_ring_bytes);
+    if (ring->sq_ring != NULL && ring->sq_ring != MAP_FAILED)
+        munmap(ring->sq_ring, ring->sq_ring_bytes);
+    close(ring->fd);
+}
+
+/**
+ * @brief: Sets up a pool's io_uring ring and its completion thread.
+ *
+ * @param: ring -- receives the ring.
+ * @param: pool -- the pool the callbacks run on.
+ * @param: entries -- submission queue entries; the kernel rounds up to a power of two.
+ * @return: the rc_t value (Success, OutOfMemory, InvalidOperation when io_uring is unavailable, refused, or too old)
+*/
+rc_t pool_io_ring_create(pool_io_ring_t** ring, thread_pool_t* pool, uint32_t entries) {
+
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    int fd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+        return InvalidOperation;
+
+    if (!pool_io_supported(fd)) {
+        close(fd);
+        return InvalidOperation;
+    }
+
+    pool_io_ring_t* state = calloc(1, sizeof(pool_io_ring_t));
+    if (state == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        close(fd);
+        return OutOfMemory;
+    }
+
+    state->fd = fd;
+    state->pool = pool;
+    state->sq_entries = params.sq_entries;
+    state->cq_entries = params.cq_entries;
+    state->sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    state->cq_ring_bytes = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    state->sqes_bytes = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single && state->cq_ring_bytes > state->sq_ring_bytes)
+        state->sq_ring_bytes = state->cq_ring_bytes;
+
+    state->sq_ring = mmap(NULL, state->sq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    state->cq_ring = single ? state->sq_ring :
+                     mmap(NULL, state->cq_ring_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    state->sqes = mmap(NULL, state->sqes_bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (state->sq_ring == MAP_FAILED || state->cq_ring == MAP_FAILED || state->sqes == MAP_FAILED) {
+        fprintf(stderr, "The io_uring rings could not be mapped, errno %d\n", errno);
+        pool_io_unmap(state);
+        free(state);
+        return OutOfMemory;
+    }
+
+    char* sq = state->sq_ring;
+    char* cq = state->cq_ring;
+    state->sq_head = (atomic_uint*)(sq + params.sq_off.head);
+    state->sq_tail = (atomic_uint*)(sq + params.sq_off.tail);
+    state->sq_mask = *(uint32_t*)(sq + params.sq_off.ring_mask);
+    state->sq_array = (uint32_t*)(sq + params.sq_off.array);
+    state->cq_head = (atomic_uint*)(cq + params.cq_off.head);
+    state->cq_tail = (atomic_uint*)(cq + params.cq_off.tail);
+    state->cq_mask = *(uint32_t*)(cq + params.cq_off.ring_mask);
+    state->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    // Entry i always sits in slot i, so the array never changes after this.
+    for (uint32_t i = 0; i < state->sq_entries; i++)
+        state->sq_array[i] = i;
+
+    pthread_mutex_init(&state->sq_lock, NULL);
+    pthread_mutex_init(&state->cq_lock, NULL);
+    atomic_init(&state->unsubmitted, 0);
+    atomic_init(&state->in_flight, 0);
+
+    if (pthread_create(&state->completion_thread, NULL, pool_io_complete, state) != 0) {
+        fprintf(stderr, "Error creating the I/O completion thread.\n");
+        pthread_mutex_destroy(&state->sq_lock);
+        pthread_mutex_destroy(&state->cq_lock);
+        pool_io_unmap(state);
+        free(state);
+        return Error;
+    }
+
+    *ring = state;
+    return Success;
+}
+
+/**
+ * @brief: Stops the completion thread with a no-op request and frees the ring. Nothing may be in flight.
+*/
+void pool_io_ring_destroy(pool_io_ring_t* ring) {
+
+    if (ring == NULL)
+        return;
+
+    while (pool_io_push(ring, IORING_OP_NOP, NULL, false) == QueueFull)
+        sched_yield();
+    pthread_join(ring->completion_thread, NULL);
+
+    pthread_mutex_destroy(&ring->sq_lock);
+    pthread_mutex_destroy(&ring->cq_lock);
+    pool_io_unmap(ring);
+    free(ring);
+}
+
+/**
+ * @brief: Puts a request on the pool's ring, or hands it to the pool as a blocking task.
+*/
+static rc_t pool_io_submit(thread_pool_t* pool, pool_io_t* io) {
+
+    pool_io_ring_t* ring = pool->io;
+
+    if (ring != NULL) {
+        // Never more in flight than the completion queue holds, so no completion is dropped.
+        if (atomic_fetch_add(&ring->in_flight, 1) < ring->cq_entries) {
+            uint8_t opcode = io->op == PoolIoRead ? IORING_OP_READ : IORING_OP_WRITE;
+            if (pool_io_push(ring, opcode, io, pool_in_worker(pool)) == Success)
+                return Success;
+        }
+        atomic_fetch_sub(&ring->in_flight, 1);
+    }
+
+    pool_io_schedule(pool, io, pool_io_run_blocking);
+    return Success;
+}
+
+static rc_t pool_io_prepare(thread_pool_t* pool, pool_io_t* io, pool_io_op_t op, int fd, void* buf, size_t len, off_t offset,
+                            pool_io_fun_t callback, void* arg) {
+
+    if (pool == NULL || io == NULL || callback == NULL || (buf == NULL && len > 0)) {
+        fprintf(stderr, "The pool, request, callback and buffer cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (fd < 0 || offset < 0 || len > UINT32_MAX) {
+        fprintf(stderr, "The file descriptor, offset or length is out of range.\n");
+        return InvalidArgument;
+    }
+
+    io->op = op;
+    io->fd = fd;
+    io->buf = buf;
+    io->len = len;
+    io->offset = offset;
+    io->callback = callback;
+    io->arg = arg;
+    io->result = 0;
+    io->pool = pool;
+
+    return Success;
+}
+
+/**
+ * @brief: Reads up to len bytes at offset of fd into buf, then runs callback(io) as a pool task.
+ *
+ * Called from a worker, the request reaches the kernel when the worker is next between tasks, together with the others it issued.
+ *
+ * @param: pool -- thread pool object.
+ * @param: io -- the request, owned by the caller until the callback has started.
+ * @param: fd -- the file.
+ * @param: buf -- receives the data.
+ * @param: len -- at most 4 GiB - 1.
+ * @param: offset -- where in the file to read.
+ * @param: callback -- runs on the pool once the read is done; io->result holds the bytes read or -errno.
+ * @param: arg -- kept in io->arg for the callback.
+ *
+ * @return: the rc_t value (Success, InvalidArgument)
+*/
+rc_t pool_read_async(thread_pool_t* pool, pool_io_t* io, int fd, void* buf, size_t len, off_t offset,
+                     pool_io_fun_t callback, void* arg) {
+
+    rc_t rc = pool_io_prepare(pool, io, PoolIoRead, fd, buf, len, offset, callback, arg);
+    if (rc != Success)
+        return rc;
+
+    return pool_io_submit(pool, io);
+}
+
+/**
+ * @brief: Writes len bytes of buf at offset of fd, then runs callback(io) as a pool task. See pool_read_async.
+ *
+ * @param: pool -- thread pool object.
+ * @param: io -- the request, owned by the caller until the callback has started.
+ * @param: fd -- the file.
+ * @param: buf -- the data; it must not change until the callback has started.
+ * @param: len -- at most 4 GiB - 1.
+ * @param: offset -- where in the file to write.
+ * @param: callback -- runs on the pool once the write is done; io->result holds the bytes written or -errno.
+ * @param: arg -- kept in io->arg for the callback.
+ *
+ * @return: the rc_t value (Success, InvalidArgument)
+*/
+rc_t pool_write_async(thread_pool_t* pool, pool_io_t* io, int fd, const void* buf, size_t len, off_t offset,
+                      pool_io_fun_t callback, void* arg) {
+
+    rc_t rc = pool_io_prepare(pool, io, PoolIoWrite, fd, (void*) buf, len, offset, callback, arg);
+    if (rc != Success)
+        return rc;
+
+    return pool_io_submit(pool, io);
+}
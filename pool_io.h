@@ -0,0 +1,65 @@
+#ifndef pool_io_h
+#define pool_io_h
+
+#include "rc.h"
+#include "pool.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Asynchronous file reads and writes whose completion callbacks run as pool
+ * tasks, so a task waiting for the disk does not hold a worker.
+ *
+ * A pool created with attrs.io_entries gets one io_uring ring. A request is
+ * written to the submission queue under a lock; a worker defers the
+ * io_uring_enter to its next pass between tasks, so the requests one task
+ * issues go to the kernel in one call. Workers also reap completions between
+ * tasks and hand each request's callback to the pool. A small completion
+ * thread sleeps in io_uring_enter for the times when every worker is parked;
+ * it never runs callbacks itself.
+ *
+ * Without a ring (io_entries 0, io_uring unavailable or refused, or more
+ * requests in flight than the completion queue holds) a request becomes a
+ * pool task that makes the blocking pread or pwrite and then calls the
+ * callback, as a task would have done by hand.
+ *
+ * Every request must have completed before pool_destroy.
+ */
+
+typedef struct pool_io_st pool_io_t;
+
+// Runs as a pool task once the request completed; io->result holds the bytes transferred or -errno.
+typedef void pool_io_fun_t(pool_io_t* io);
+
+typedef enum pool_io_op_st {
+    PoolIoRead,
+    PoolIoWrite,
+} pool_io_op_t;
+
+// One request, owned by the caller until its callback has started.
+struct pool_io_st {
+    pool_io_op_t op;
+    int fd;
+    void* buf;
+    size_t len;
+    off_t offset;
+    pool_io_fun_t* callback;
+    void* arg;                 // for the callback
+    ssize_t result;
+    thread_pool_t* pool;
+    pool_work_t work;          // runs the callback, or the blocking fallback
+};
+
+typedef struct pool_io_ring_st pool_io_ring_t;
+
+rc_t pool_io_ring_create(pool_io_ring_t** ring, thread_pool_t* pool, uint32_t entries);
+void pool_io_ring_destroy(pool_io_ring_t* ring);
+bool pool_io_ring_poll(pool_io_ring_t* ring);
+
+rc_t pool_read_async(thread_pool_t* pool, pool_io_t* io, int fd, void* buf, size_t len, off_t offset,
+                     pool_io_fun_t callback, void* arg);
+rc_t pool_write_async(thread_pool_t* pool, pool_io_t* io, int fd, const void* buf, size_t len, off_t offset,
+                      pool_io_fun_t callback, void* arg);
+
+#endif
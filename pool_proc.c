@@ -0,0 +1,713 @@
+#include "pool_proc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define POOL_PROC_MAGIC 0x636f72706c6f6f70ull    // "poolproc"
+#define POOL_PROC_STOP 0
+#define POOL_PROC_FORKING -1
+#define POOL_PROC_IDLE 0                         // phases in the low bits of pool_proc_worker_t.state
+#define POOL_PROC_RUNNING 1
+#define POOL_PROC_DONE 2
+#define POOL_PROC_PHASE 3u
+#define POOL_PROC_ALIGN 64
+#define POOL_PROC_CHECK_NSECS 50000000           // how often pool_proc_map looks for dead workers, and idle workers for their parent
+#define POOL_PROC_BATCH 64                       // task descriptors enqueued per call
+
+#define DEFAULT_NUM_WORKERS 4
+#define DEFAULT_MAX_WORKERS 64
+#define DEFAULT_QUEUE_BLOCKS 1024
+#define DEFAULT_ARENA_BYTES (16 * 1024 * 1024)
+
+// Inherited by forked workers; other processes register the same ids themselves.
+static pool_proc_fun_t* pool_proc_functions[POOL_PROC_MAX_FUNCTIONS];
+
+static inline uint64_t pool_proc_align(uint64_t offset) {
+    return (offset + POOL_PROC_ALIGN - 1) & ~(uint64_t)(POOL_PROC_ALIGN - 1);
+}
+
+rc_t pool_proc_attr_init(pool_proc_attr_t* attrs) {
+    if (attrs == NULL) {
+        fprintf(stderr, "On pool_proc_attr_init the attrs cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    attrs->num_workers = DEFAULT_NUM_WORKERS;
+    attrs->max_workers = DEFAULT_MAX_WORKERS;
+    attrs->queue_blocks = DEFAULT_QUEUE_BLOCKS;
+    attrs->arena_bytes = DEFAULT_ARENA_BYTES;
+
+    return Success;
+}
+
+/**
+ * @brief: Makes fun callable by tasks that name function_id. Register before pool_proc_create so the workers inherit it.
+ *
+ * @param: function_id -- 1 .. POOL_PROC_MAX_FUNCTIONS - 1, the same in every process.
+ * @param: fun -- runs with pointers into the shared region for the task's argument and result.
+ * @return: the rc_t value (Success, InvalidArgument)
+ */
+rc_t pool_proc_register(uint32_t function_id, pool_proc_fun_t* fun) {
+    if (function_id == POOL_PROC_STOP || function_id >= POOL_PROC_MAX_FUNCTIONS || fun == NULL) {
+        fprintf(stderr, "Invalid function id or function\n");
+        return InvalidArgument;
+    }
+
+    pool_proc_functions[function_id] = fun;
+    return Success;
+}
+
+// Points the per-process view at a mapped region.
+static void pool_proc_bind(pool_proc_t* pool, pool_proc_header_t* header, size_t mapped_bytes) {
+    char* base = (char*) header;
+    cqueue_obj_t* obj = (cqueue_obj_t*)(base + header->queue_offset);
+
+    pool->header = header;
+    pool->mapped_bytes = mapped_bytes;
+    pool->workers = (pool_proc_worker_t*)(base + header->workers_offset);
+    pool->latches = (pool_proc_latch_t*)(base + header->latches_offset);
+    pool->arena = base + header->arena_offset;
+    pool->queue.obj = obj;
+    pool->queue.lock.obj = &obj->lock_obj;
+    pool->queue.mapped_bytes = 0;   // part of the pool's mapping
+    pool->finish_lock.obj = &header->finish_lock;
+}
+
+/**
+ * @brief: Converts a pointer into the shared region to an offset other processes can use.
+ * @return: the offset, or 0 for NULL and for pointers outside the region.
+ */
+uint64_t pool_proc_offset(pool_proc_t* pool, void* ptr) {
+    if (pool == NULL || ptr == NULL)
+        return 0;
+
+    char* base = (char*) pool->header;
+    if ((char*) ptr <= base || (char*) ptr >= base + pool->mapped_bytes) {
+        fprintf(stderr, "The pointer is not in the shared region\n");
+        return 0;
+    }
+
+    return (char*) ptr - base;
+}
+
+/**
+ * @brief: Converts an offset from pool_proc_offset back to a pointer in this process.
+ * @return: the pointer, or NULL for 0 and for offsets outside the region.
+ */
+void* pool_proc_pointer(pool_proc_t* pool, uint64_t offset) {
+    if (pool == NULL || offset == 0 || offset >= pool->mapped_bytes)
+        return NULL;
+
+    return (char*) pool->header + offset;
+}
+
+/**
+ * @brief: Allocates 16-byte aligned memory from the shared arena for task arguments and results.
+ *
+ * The arena is a bump allocator shared by every process; memory only comes back through pool_proc_reset.
+ *
+ * @return: the memory, or NULL when the arena is exhausted.
+ */
+void* pool_proc_alloc(pool_proc_t* pool, size_t size) {
+    if (pool == NULL || size == 0)
+        return NULL;
+
+    uint64_t bytes = (size + 15) & ~(uint64_t) 15;
+    uint64_t used = atomic_load(&pool->header->arena_used);
+
+    do {
+        if (used + bytes > pool->header->arena_bytes) {
+            fprintf(stderr, "The shared arena is exhausted\n");
+            return NULL;
+        }
+    } while (!atomic_compare_exchange_weak(&pool->header->arena_used, &used, used + bytes));
+
+    return pool->arena + used;
+}
+
+/**
+ * @brief: Frees everything allocated from the arena. No task may still use arena memory.
+ * @return: the rc_t value (Success, InvalidArgument)
+ */
+rc_t pool_proc_reset(pool_proc_t* pool) {
+    if (pool == NULL) {
+        fprintf(stderr, "The pool cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    atomic_store(&pool->header->arena_used, 0);
+    return Success;
+}
+
+static void pool_proc_finish(pool_proc_t* pool, uint64_t latch_offset, rc_t rc, uint32_t count) {
+    pool_proc_latch_t* latch = pool_proc_pointer(pool, latch_offset);
+    if (latch == NULL || count == 0)
+        return;
+
+    if (rc != Success) {
+        int expected = Success;
+        atomic_compare_exchange_strong(&latch->rc, &expected, rc);
+    }
+
+    if (atomic_fetch_sub(&latch->pending, count) == count)
+        syscall(SYS_futex, &latch->pending, FUTEX_WAKE, INT_MAX, NULL, NULL, NULL);
+}
+
+// The record's state with its phase replaced; the count of finished tasks above it stays.
+static inline unsigned int pool_proc_phase(pool_proc_worker_t* worker, unsigned int phase) {
+    return (atomic_load(&worker->state) & ~POOL_PROC_PHASE) | phase;
+}
+
+// Marks a record idle if it still has the done state of the task just counted down, and not yet a later one.
+static inline void pool_proc_idle(pool_proc_t* pool, int worker, unsigned int done) {
+    atomic_compare_exchange_strong(&pool->workers[worker].state, &done, done & ~POOL_PROC_PHASE);
+}
+
+/*
+ * Finishes the count-down a holder of the finish lock died in. Count-downs
+ * only happen under the lock, and a latch is only taken again once its
+ * pending count reached zero, so the latch still showing the journaled
+ * generation and pending count means the dead holder never got to it.
+ */
+static void pool_proc_replay(pool_proc_t* pool) {
+    pool_proc_journal_t* journal = &pool->header->journal;
+    if (!journal->active)
+        return;
+
+    pool_proc_latch_t* latch = pool_proc_pointer(pool, journal->latch_offset);
+    if (latch != NULL && atomic_load(&latch->generation) == journal->generation &&
+        atomic_load(&latch->pending) == journal->pending)
+        pool_proc_finish(pool, journal->latch_offset, journal->rc, journal->count);
+
+    if (journal->worker >= 0)
+        pool_proc_idle(pool, journal->worker, journal->state);
+    journal->active = 0;
+}
+
+/**
+ * @brief: Counts count tasks of a latch down, under the finish lock and journaled, so a death at any point neither loses nor repeats it.
+ *
+ * @param: worker -- the record whose done task this is, or -1.
+ * @param: done -- the record's state when the task was done. Nothing is counted once the record has moved on: a replay delivered it.
+ */
+static void pool_proc_deliver(pool_proc_t* pool, int worker, unsigned int done, uint64_t latch_offset, rc_t rc,
+                              uint32_t count) {
+    rc_t lock_rc = spinlock_acquire(&pool->finish_lock);
+    if (lock_rc == OwnerDied) {
+        pool_proc_replay(pool);
+    } else if (lock_rc != Success) {
+        fprintf(stderr, "The finish lock was not acquired\n");
+        return;
+    }
+
+    if (worker < 0 || atomic_load(&pool->workers[worker].state) == done) {
+        pool_proc_journal_t* journal = &pool->header->journal;
+        pool_proc_latch_t* latch = pool_proc_pointer(pool, latch_offset);
+
+        journal->worker = worker;
+        journal->state = done;
+        journal->latch_offset = latch_offset;
+        journal->generation = latch != NULL ? atomic_load(&latch->generation) : 0;
+        journal->pending = latch != NULL ? atomic_load(&latch->pending) : 0;
+        journal->count = count;
+        journal->rc = rc;
+        atomic_thread_fence(memory_order_seq_cst);
+        journal->active = 1;
+        atomic_thread_fence(memory_order_seq_cst);
+
+        pool_proc_finish(pool, latch_offset, rc, count);
+        if (worker >= 0)
+            pool_proc_idle(pool, worker, done);
+
+        atomic_thread_fence(memory_order_seq_cst);
+        journal->active = 0;
+    }
+
+    spinlock_release(&pool->finish_lock);
+}
+
+/*
+ * Runs tasks until a stop descriptor arrives. The worker record is owned by
+ * the calling process. The task is dequeued straight into the record, inside
+ * the queue's critical section, so once the dequeue has committed the record
+ * names the task. If the worker dies inside the section the queue rolls the
+ * dequeue back and the task is delivered again; pool_proc_check_workers asks
+ * the queue which of the two happened before it puts the task back. Once the
+ * task has run the record says done, with its rc, until pool_proc_deliver
+ * has counted it down. A forked worker waits for tasks with a timeout and
+ * exits once its parent is gone.
+ */
+static rc_t pool_proc_serve(pool_proc_t* pool, pool_proc_worker_t* worker) {
+    int index = (int)(worker - pool->workers);
+    pid_t parent = atomic_load(&worker->parent);
+    struct timespec check = { 0, POOL_PROC_CHECK_NSECS };
+    pool_proc_task_t task;
+    uint32_t count;
+
+    while (true) {
+        worker->task.function_id = POOL_PROC_STOP;
+        atomic_store(&worker->state, pool_proc_phase(worker, POOL_PROC_RUNNING));
+
+        // The batch call copies into the record: no allocation, so it is safe right after fork.
+        rc_t rc = cqueue_dequeue_batch(&pool->queue, &worker->task, sizeof(pool_proc_task_t), 1, &count,
+                                       parent != 0 ? &check : NULL);
+        if (rc == Timeout) {
+            if (getppid() == parent)
+                continue;
+            atomic_store(&worker->state, pool_proc_phase(worker, POOL_PROC_IDLE));
+            return Success;
+        }
+        if (rc != Success) {
+            atomic_store(&worker->state, pool_proc_phase(worker, POOL_PROC_IDLE));
+            fprintf(stderr, "Worker %d could not dequeue a task\n", (int) getpid());
+            return rc;
+        }
+
+        task = worker->task;
+        if (task.function_id == POOL_PROC_STOP) {
+            atomic_store(&worker->state, pool_proc_phase(worker, POOL_PROC_IDLE));
+            return Success;
+        }
+
+        pool_proc_fun_t* fun = task.function_id < POOL_PROC_MAX_FUNCTIONS ? pool_proc_functions[task.function_id] : NULL;
+        if (fun == NULL) {
+            fprintf(stderr, "No function registered under id %u\n", task.function_id);
+            rc = InvalidArgument;
+        } else {
+            rc = fun(pool_proc_pointer(pool, task.arg_offset), pool_proc_pointer(pool, task.result_offset));
+        }
+
+        // A new count above the phase, so a replay of an earlier count-down cannot mark this task delivered.
+        unsigned int done = ((atomic_load(&worker->state) & ~POOL_PROC_PHASE) + POOL_PROC_PHASE + 1) | POOL_PROC_DONE;
+        atomic_store(&worker->rc, rc);
+        atomic_store(&worker->state, done);
+        pool_proc_deliver(pool, index, done, task.latch_offset, rc, 1);
+    }
+}
+
+// Forks a worker into the record at index, which the caller has set to POOL_PROC_FORKING.
+static rc_t pool_proc_spawn(pool_proc_t* pool, int index) {
+    pool_proc_worker_t* worker = &pool->workers[index];
+    pid_t parent = getpid();
+
+    atomic_store(&worker->state, pool_proc_phase(worker, POOL_PROC_IDLE));
+    atomic_store(&worker->parent, parent);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        atomic_store(&worker->pid, 0);
+        return Error;
+    }
+
+    if (pid == 0) {
+        // The parent may already be gone; after this pool_proc_serve keeps checking.
+        if (getppid() != parent)
+            _exit(0);
+
+        pool->owner = false;
+        int forking = POOL_PROC_FORKING;
+        atomic_compare_exchange_strong(&worker->pid, &forking, getpid());
+        rc_t rc = pool_proc_serve(pool, worker);
+        atomic_store(&worker->pid, 0);
+        _exit(rc == Success ? 0 : 1);
+    }
+
+    int forking = POOL_PROC_FORKING;
+    atomic_compare_exchange_strong(&worker->pid, &forking, pid);
+    return Success;
+}
+
+static bool pool_proc_dead(pool_proc_worker_t* worker, pid_t pid) {
+    // Our own children stay zombies, and answer kill, until we reap them.
+    if (atomic_load(&worker->parent) == getpid()) {
+        pid_t reaped = waitpid(pid, NULL, WNOHANG);
+        if (reaped == 0)
+            return false;
+        if (reaped == pid)
+            return true;
+    }
+
+    return kill(pid, 0) != 0 && errno == ESRCH;
+}
+
+/*
+ * Called by waiters in pool_proc_map. The first process to notice a dead
+ * worker frees its record, delivers the completion of a task the worker
+ * finished, puts a task it was still running back on the queue, and forks a
+ * replacement if it forked the dead one.
+ */
+static void pool_proc_check_workers(pool_proc_t* pool) {
+    for (uint32_t i = 0; i < pool->header->max_workers; i++) {
+        pool_proc_worker_t* worker = &pool->workers[i];
+        int pid = atomic_load(&worker->pid);
+
+        if (pid <= 0 || !pool_proc_dead(worker, pid))
+            continue;
+
+        bool respawn = atomic_load(&worker->parent) == getpid();
+        if (!atomic_compare_exchange_strong(&worker->pid, &pid, respawn ? POOL_PROC_FORKING : 0))
+            continue;
+
+        fprintf(stderr, "Worker %d died\n", pid);
+
+        pool_proc_task_t task = worker->task;
+        unsigned int state = atomic_load(&worker->state);
+        if ((state & POOL_PROC_PHASE) == POOL_PROC_DONE)
+            pool_proc_deliver(pool, i, state, task.latch_offset, atomic_load(&worker->rc), 1);
+
+        // Running a stop descriptor, or none, means the worker died waiting for work. A task it died
+        // dequeueing is in the record but also back on the queue once the queue rolled the dequeue back.
+        state = atomic_exchange(&worker->state, pool_proc_phase(worker, POOL_PROC_IDLE));
+        bool requeue = (state & POOL_PROC_PHASE) == POOL_PROC_RUNNING;
+        bool rolled_back = false;
+        if (requeue && task.function_id != POOL_PROC_STOP)
+            cqueue_rolled_back(&pool->queue, pid, &rolled_back);
+        requeue = requeue && task.function_id != POOL_PROC_STOP && !rolled_back;
+
+        if (respawn)
+            pool_proc_spawn(pool, i);
+
+        if (requeue && cqueue_enqueue(&pool->queue, &task, sizeof(task), NULL) != Success)
+            pool_proc_deliver(pool, -1, 0, task.latch_offset, Error, 1);
+    }
+}
+
+/**
+ * @brief: Creates the shared region under name and forks attrs->num_workers worker processes.
+ *
+ * @param: pool -- the pool.
+ * @param: name -- the shm_open name, e.g. "/frontend-pool". Fails if it already exists.
+ * @param: attrs -- the pool attributes (NULL for defaults).
+ * @return: the rc_t value (Success, InvalidArgument, Error etc.)
+ */
+rc_t pool_proc_create(pool_proc_t* pool, const char* name, pool_proc_attr_t* attrs) {
+    pool_proc_attr_t default_attrs;
+    cqueue_attr_t queue_attrs;
+    rc_t rc;
+
+    if (pool == NULL || name == NULL || strlen(name) >= POOL_PROC_NAME_MAX) {
+        fprintf(stderr, "The pool cannot be NULL and the name must be shorter than %d\n", POOL_PROC_NAME_MAX);
+        return InvalidArgument;
+    }
+
+    if (attrs == NULL) {
+        attrs = &default_attrs;
+        rc = pool_proc_attr_init(attrs);
+        if (rc != Success)
+            return rc;
+    }
+
+    if (attrs->num_workers <= 0 || attrs->max_workers < attrs->num_workers ||
+        attrs->queue_blocks == 0 || attrs->arena_bytes == 0) {
+        fprintf(stderr, "Invalid process pool attributes\n");
+        return InvalidArgument;
+    }
+
+    rc = cqueue_attr_init(&queue_attrs);
+    if (rc != Success)
+        return rc;
+    queue_attrs.block_size = sizeof(pool_proc_task_t);
+    queue_attrs.num_blocks = attrs->queue_blocks;
+    queue_attrs.lock_attrs.kind = SpinlockKindRobust;
+
+    int queue_bytes;
+    rc = cqueue_alloc_size(&queue_attrs, &queue_bytes);
+    if (rc != Success)
+        return rc;
+
+    uint64_t workers_offset = pool_proc_align(sizeof(pool_proc_header_t));
+    uint64_t latches_offset = pool_proc_align(workers_offset + sizeof(pool_proc_worker_t) * attrs->max_workers);
+    uint64_t queue_offset = pool_proc_align(latches_offset + sizeof(pool_proc_latch_t) * POOL_PROC_MAX_LATCHES);
+    uint64_t arena_offset = pool_proc_align(queue_offset + queue_bytes);
+    uint64_t size = arena_offset + attrs->arena_bytes;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        perror("shm_open");
+        return Error;
+    }
+
+    if (ftruncate(fd, size) != 0) {
+        perror("ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return Error;
+    }
+
+    pool_proc_header_t* header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        shm_unlink(name);
+        return Error;
+    }
+
+    // ftruncate zero-filled the region: every worker record and latch starts out free.
+    header->magic = POOL_PROC_MAGIC;
+    header->size = size;
+    header->max_workers = attrs->max_workers;
+    header->workers_offset = workers_offset;
+    header->latches_offset = latches_offset;
+    header->queue_offset = queue_offset;
+    header->arena_offset = arena_offset;
+    header->arena_bytes = attrs->arena_bytes;
+    atomic_init(&header->arena_used, 0);
+
+    rc = cqueue_init(&pool->queue, (cqueue_obj_t*)((char*) header + queue_offset), &queue_attrs);
+    if (rc == Success)
+        rc = spinlock_init(&pool->finish_lock, &header->finish_lock, &queue_attrs.lock_attrs);
+    if (rc != Success) {
+        fprintf(stderr, "Could not init the task queue.\n");
+        munmap(header, size);
+        shm_unlink(name);
+        return rc;
+    }
+
+    pool_proc_bind(pool, header, size);
+    pool->owner = true;
+    strcpy(pool->name, name);
+    atomic_store(&header->ready, 1);
+
+    for (int i = 0; i < attrs->num_workers; i++) {
+        atomic_store(&pool->workers[i].pid, POOL_PROC_FORKING);
+        rc = pool_proc_spawn(pool, i);
+        if (rc != Success) {
+            fprintf(stderr, "Error creating worker process.\n");
+            pool_proc_destroy(pool);
+            return rc;
+        }
+    }
+
+    return Success;
+}
+
+/**
+ * @brief: Maps a pool made by pool_proc_create in another process.
+ *
+ * @param: pool -- receives this process's view of the pool.
+ * @param: name -- the name given to pool_proc_create.
+ * @return: the rc_t value (Success, InvalidArgument, Error)
+ */
+rc_t pool_proc_attach(pool_proc_t* pool, const char* name) {
+    if (pool == NULL || name == NULL || strlen(name) >= POOL_PROC_NAME_MAX) {
+        fprintf(stderr, "The pool cannot be NULL and the name must be shorter than %d\n", POOL_PROC_NAME_MAX);
+        return InvalidArgument;
+    }
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        perror("shm_open");
+        return Error;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(pool_proc_header_t)) {
+        fprintf(stderr, "The shared memory object is not a process pool.\n");
+        close(fd);
+        return InvalidArgument;
+    }
+
+    pool_proc_header_t* header = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        return Error;
+    }
+
+    if (header->magic != POOL_PROC_MAGIC || !atomic_load(&header->ready) || header->size != (uint64_t) st.st_size) {
+        fprintf(stderr, "The shared memory object is not an initialized process pool.\n");
+        munmap(header, st.st_size);
+        return InvalidArgument;
+    }
+
+    pool_proc_bind(pool, header, st.st_size);
+    pool->owner = false;
+    strcpy(pool->name, name);
+
+    return Success;
+}
+
+/**
+ * @brief: Serves tasks in the calling process until the pool is destroyed.
+ *
+ * For worker processes started outside pool_proc_create; they must have attached and registered the functions.
+ *
+ * @return: the rc_t value (Success, InvalidArgument, InvalidOperation when every worker record is taken)
+ */
+rc_t pool_proc_worker_run(pool_proc_t* pool) {
+    if (pool == NULL) {
+        fprintf(stderr, "The pool cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    for (uint32_t i = 0; i < pool->header->max_workers; i++) {
+        pool_proc_worker_t* worker = &pool->workers[i];
+        int expected = 0;
+
+        if (!atomic_compare_exchange_strong(&worker->pid, &expected, POOL_PROC_FORKING))
+            continue;
+
+        atomic_store(&worker->state, pool_proc_phase(worker, POOL_PROC_IDLE));
+        atomic_store(&worker->parent, 0);
+        atomic_store(&worker->pid, getpid());
+
+        rc_t rc = pool_proc_serve(pool, worker);
+        atomic_store(&worker->pid, 0);
+        return rc;
+    }
+
+    fprintf(stderr, "Every worker record is taken\n");
+    return InvalidOperation;
+}
+
+/**
+ * @brief: Runs function_id once per argument on the worker processes and waits for all of them.
+ *
+ * @param: pool -- the pool.
+ * @param: function_id -- an id registered in the worker processes.
+ * @param: arg_count -- the number of tasks.
+ * @param: args -- arena offsets of the arguments (from pool_proc_offset), 0 for none.
+ * @param: results -- arena offsets the functions write their results to, 0 for none; may be NULL.
+ * @return: the rc_t value (Success, InvalidArgument, InvalidOperation, or the first error a task returned)
+ */
+rc_t pool_proc_map(pool_proc_t* pool, uint32_t function_id, int arg_count, uint64_t args[], uint64_t results[]) {
+    if (pool == NULL || args == NULL || arg_count <= 0) {
+        fprintf(stderr, "The pool and args cannot be NULL and arg_count must be positive\n");
+        return InvalidArgument;
+    }
+
+    if (function_id == POOL_PROC_STOP || function_id >= POOL_PROC_MAX_FUNCTIONS) {
+        fprintf(stderr, "Invalid function id %u\n", function_id);
+        return InvalidArgument;
+    }
+
+    pool_proc_latch_t* latch = NULL;
+    for (int i = 0; i < POOL_PROC_MAX_LATCHES && latch == NULL; i++) {
+        unsigned int expected = 0;
+        if (atomic_compare_exchange_strong(&pool->latches[i].in_use, &expected, 1))
+            latch = &pool->latches[i];
+    }
+
+    if (latch == NULL) {
+        fprintf(stderr, "Too many pool_proc_map calls in flight\n");
+        return InvalidOperation;
+    }
+
+    // The generation moves first, so a replay that sees the new pending count sees the new generation too.
+    atomic_fetch_add(&latch->generation, 1);
+    atomic_store(&latch->rc, Success);
+    atomic_store(&latch->pending, arg_count);
+
+    pool_proc_task_t tasks[POOL_PROC_BATCH];
+    uint64_t latch_offset = pool_proc_offset(pool, latch);
+    struct timespec check = { 0, POOL_PROC_CHECK_NSECS };
+    rc_t rc = Success;
+    int sent = 0;
+
+    while (sent < arg_count) {
+        int batch = arg_count - sent < POOL_PROC_BATCH ? arg_count - sent : POOL_PROC_BATCH;
+        for (int i = 0; i < batch; i++) {
+            tasks[i].function_id = function_id;
+            tasks[i].pad = 0;
+            tasks[i].arg_offset = args[sent + i];
+            tasks[i].result_offset = results != NULL ? results[sent + i] : 0;
+            tasks[i].latch_offset = latch_offset;
+        }
+
+        int done = 0;
+        while (done < batch) {
+            uint32_t enqueued;
+            rc = cqueue_enqueue_batch(&pool->queue, &tasks[done], sizeof(pool_proc_task_t), batch - done, &enqueued, &check);
+            // A full queue may be waiting on workers that died.
+            if (rc == Timeout) {
+                pool_proc_check_workers(pool);
+                rc = Success;
+                continue;
+            }
+            if (rc != Success)
+                break;
+            done += enqueued;
+        }
+
+        if (rc != Success) {
+            fprintf(stderr, "Error enqueueing the tasks.\n");
+            // Only wait for the ones that went out, this batch's included.
+            pool_proc_deliver(pool, -1, 0, latch_offset, Success, arg_count - sent - done);
+            break;
+        }
+
+        sent += batch;
+    }
+
+    unsigned int pending;
+    while ((pending = atomic_load(&latch->pending)) != 0) {
+        long frc = syscall(SYS_futex, &latch->pending, FUTEX_WAIT, pending, &check, NULL, NULL);
+        if (frc == -1 && errno == ETIMEDOUT)
+            pool_proc_check_workers(pool);
+    }
+
+    if (rc == Success)
+        rc = atomic_load(&latch->rc);
+
+    atomic_store(&latch->in_use, 0);
+    return rc;
+}
+
+/**
+ * @brief: In the process that created the pool, stops the workers and removes the name; elsewhere only unmaps the region.
+ * @return: the rc_t value (Success, InvalidArgument)
+ */
+rc_t pool_proc_destroy(pool_proc_t* pool) {
+    if (pool == NULL || pool->header == NULL) {
+        fprintf(stderr, "The pool cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    if (pool->owner) {
+        pool_proc_task_t stop;
+        memset(&stop, 0, sizeof(stop));
+        stop.function_id = POOL_PROC_STOP;
+
+        // Note our children first: a worker clears its record as it exits.
+        uint32_t max_workers = pool->header->max_workers;
+        pid_t* children = calloc(max_workers, sizeof(pid_t));
+        uint32_t running = 0;
+
+        for (uint32_t i = 0; i < max_workers; i++) {
+            pool_proc_worker_t* worker = &pool->workers[i];
+            int pid = atomic_load(&worker->pid);
+            if (pid == 0)
+                continue;
+            running++;
+            if (children != NULL && pid > 0 && atomic_load(&worker->parent) == getpid())
+                children[i] = pid;
+        }
+
+        for (uint32_t i = 0; i < running; i++)
+            cqueue_enqueue(&pool->queue, &stop, sizeof(stop), NULL);
+
+        for (uint32_t i = 0; children != NULL && i < max_workers; i++)
+            if (children[i] > 0)
+                waitpid(children[i], NULL, 0);
+        free(children);
+
+        shm_unlink(pool->name);
+    }
+
+    munmap(pool->header, pool->mapped_bytes);
+    pool->header = NULL;
+
+    return Success;
+}
@@ -0,0 +1,131 @@
+#ifndef pool_proc_h
+#define pool_proc_h
+
+#include "rc.h"
+#include "cqueue.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+/*
+ * A pool whose workers are processes. One POSIX shared memory object holds a
+ * shared cqueue of task descriptors, a record per worker, completion latches
+ * and an arena the caller allocates task arguments and results from. Nothing
+ * in the region is a pointer: a task names its function by the id it was
+ * registered under and its argument, result and latch by offsets from the
+ * start of the region, so every process may map the region at a different
+ * address. Arguments are written once into the arena and read in place by the
+ * worker, with no copy through a socket or pipe.
+ *
+ * pool_proc_create forks the workers, which inherit the registered functions.
+ * Other processes can pool_proc_attach to the same name, either to map work
+ * or to serve it with pool_proc_worker_run (they must register the same ids).
+ * A caller waiting in pool_proc_map looks at the workers while it waits: the
+ * task a dead worker was running goes back on the queue, and a worker forked
+ * by the caller is forked again. A worker dequeues a task straight into its
+ * record, so a task is never off the queue without a record naming it. Once
+ * the task has run the worker marks its record done, and it counts the task
+ * down under a robust lock with a journal of the count-down in progress, so
+ * the completion of a worker that dies after finishing is delivered exactly
+ * once: by whoever next takes the lock, or by the caller that notices the
+ * death. A worker that dies before marking its record done has its task run
+ * again.
+ * Forked workers exit once the process that forked them is gone: a worker
+ * waiting for a task checks its parent every POOL_PROC_CHECK_NSECS, so a
+ * crashed frontend does not leave them behind. Any thread of the frontend
+ * may create the pool, and it may exit before the pool is destroyed.
+ */
+
+#define POOL_PROC_MAX_FUNCTIONS 64
+#define POOL_PROC_MAX_LATCHES 64      // pool_proc_map calls in flight at once
+#define POOL_PROC_NAME_MAX 64
+
+typedef rc_t pool_proc_fun_t(void* arg, void* result);
+
+typedef struct pool_proc_attr_st {
+    int num_workers;          // processes forked by pool_proc_create
+    int max_workers;          // worker records, including workers started with pool_proc_worker_run
+    uint32_t queue_blocks;
+    size_t arena_bytes;
+} pool_proc_attr_t;
+
+typedef struct pool_proc_task_st {
+    uint32_t function_id;     // 0 tells the worker to exit
+    uint32_t pad;
+    uint64_t arg_offset;      // offsets from the start of the region, 0 for NULL
+    uint64_t result_offset;
+    uint64_t latch_offset;
+} pool_proc_task_t;
+
+typedef struct pool_proc_latch_st {
+    atomic_uint in_use;
+    atomic_uint pending;      // tasks not finished yet, futex word
+    atomic_int rc;            // first failure, Success otherwise
+    atomic_uint generation;   // bumped every time a pool_proc_map call takes the latch
+    char pad[CQUEUE_CACHE_LINE - 4 * sizeof(atomic_uint)];
+} pool_proc_latch_t;
+
+typedef struct pool_proc_worker_st {
+    pool_proc_task_t task;    // valid unless idle; function_id 0 while the worker waits for a task
+    atomic_int pid;           // 0 while the record is free, -1 while a worker is being forked into it
+    atomic_int parent;        // process that forked the worker, 0 for pool_proc_worker_run
+    atomic_uint state;        // tasks finished << 2 | phase: idle, running the task (or waiting for one), or done but not counted down
+    atomic_int rc;            // the task's rc while done
+    char pad[CQUEUE_CACHE_LINE - sizeof(pool_proc_task_t) - 4 * sizeof(atomic_int)];
+} pool_proc_worker_t;
+
+// The count-down in progress under the finish lock, replayed by the next holder if this one died.
+typedef struct pool_proc_journal_st {
+    uint32_t active;
+    int32_t worker;           // record to mark idle afterwards, -1 for none
+    uint32_t state;           // the record's done state; it is only marked idle if it still has it
+    uint64_t latch_offset;
+    uint32_t generation;      // of the latch when the count-down started
+    uint32_t pending;         // the latch's pending count before it
+    uint32_t count;
+    int32_t rc;
+} pool_proc_journal_t;
+
+typedef struct pool_proc_header_st {
+    uint64_t magic;
+    uint64_t size;
+    uint32_t max_workers;
+    atomic_uint ready;        // set once the creator has initialized the region
+    uint64_t workers_offset;
+    uint64_t latches_offset;
+    uint64_t queue_offset;
+    uint64_t arena_offset;
+    uint64_t arena_bytes;
+    atomic_uint_fast64_t arena_used;
+    pool_proc_journal_t journal;
+    spinlock_obj_t finish_lock;   // robust; serializes every latch count-down
+} pool_proc_header_t;
+
+// Per-process view of the region.
+typedef struct pool_proc_st {
+    pool_proc_header_t* header;   // start of the mapping
+    size_t mapped_bytes;
+    cqueue_t queue;
+    spinlock_t finish_lock;
+    pool_proc_worker_t* workers;
+    pool_proc_latch_t* latches;
+    char* arena;
+    bool owner;                   // created the region and forked the workers
+    char name[POOL_PROC_NAME_MAX];
+} pool_proc_t;
+
+rc_t pool_proc_attr_init(pool_proc_attr_t* attrs);
+rc_t pool_proc_register(uint32_t function_id, pool_proc_fun_t* fun);
+rc_t pool_proc_create(pool_proc_t* pool, const char* name, pool_proc_attr_t* attrs);
+rc_t pool_proc_attach(pool_proc_t* pool, const char* name);
+rc_t pool_proc_destroy(pool_proc_t* pool);
+rc_t pool_proc_worker_run(pool_proc_t* pool);
+rc_t pool_proc_map(pool_proc_t* pool, uint32_t function_id, int arg_count, uint64_t args[], uint64_t results[]);
+void* pool_proc_alloc(pool_proc_t* pool, size_t size);
+rc_t pool_proc_reset(pool_proc_t* pool);
+uint64_t pool_proc_offset(pool_proc_t* pool, void* ptr);
+void* pool_proc_pointer(pool_proc_t* pool, uint64_t offset);
+
+#endif
@@ -0,0 +1,1890 @@
+#include "pool.h"
+#include "pool_graph.h"
+#include "pool_algorithms.h"
+#include "pool_proc.h"
+#include "slab.h"
+#include "spsc.h"
+#include "pool_trace.h"
+#include "pool_io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/futex.h>
+
+/*
+ * Behavioral checks of the pool, run by `make` and `./pool_test`. Every test
+ * builds what it needs, checks the results against a plain serial answer and
+ * returns Success, or Error after printing the check that failed. The exit
+ * status is the number of tests that failed.
+ */
+
+#define TEST_WORKERS 4
+#define TEST_MAP_COUNT 1000
+#define TEST_SUBMIT_COUNT 64
+#define TEST_NESTED_COUNT 16
+#define TEST_ALGORITHM_ELEMENTS 100000
+#define TEST_PROC_COUNT 200
+#define TEST_PROC_FUN 1
+#define TEST_QUEUE_BLOCKS 8          // small, so producers and consumers keep meeting a full and an empty queue
+#define TEST_QUEUE_THREADS 2         // producers, and as many consumers
+#define TEST_QUEUE_ITEMS 20000       // per producer
+#define TEST_FIBER_OUTER 300         // nested maps parked at once, more than FIBER_SLEEP_MAX
+#define TEST_IO_REQUESTS 32
+#define TEST_IO_BLOCK 4096
+#define TEST_TRACE_EVENTS 16         // per worker, fewer than a map runs
+#define TEST_PRIORITY_TASKS 8        // high tasks queued behind a low one
+#define TEST_BYTES_RING ((128 + 8) * TEST_QUEUE_BLOCKS)  // byte-ring capacity with the default block size
+#define TEST_BYTES_MIN 16
+#define TEST_BYTES_SPREAD 600        // record sizes run from TEST_BYTES_MIN to TEST_BYTES_MIN + TEST_BYTES_SPREAD - 1
+#define TEST_BYTES_RECORDS 2000
+#define TEST_SEGMENTS 10             // segments one burst needs
+#define TEST_SLAB_OBJECTS 5000      // per producer, enough to need several chunks
+#define TEST_LOCK_THREADS 4
+#define TEST_LOCK_ROUNDS 20000
+
+#define TEST_CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        return Error; \
+    } \
+} while (0)
+
+typedef rc_t test_fun_t(pool_scheduler_t scheduler);
+
+static uint64_t test_now_nsecs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static rc_t test_create(thread_pool_t* pool, pool_scheduler_t scheduler) {
+    pool_attr_t attrs;
+    rc_t rc = pool_attr_init(&attrs);
+    if (rc != Success)
+        return rc;
+
+    attrs.pool_size = TEST_WORKERS;
+    attrs.scheduler = scheduler;
+    return pool_create_attr(pool, &attrs);
+}
+
+static rc_t test_square(void* arg, void** result) {
+    intptr_t value = (intptr_t) arg;
+    *result = (void*)(value * value);
+    return Success;
+}
+
+static rc_t test_map_submit(pool_scheduler_t scheduler) {
+    thread_pool_t pool;
+    TEST_CHECK(test_create(&pool, scheduler) == Success);
+
+    static void* args[TEST_MAP_COUNT];
+    static void* results[TEST_MAP_COUNT];
+    for (intptr_t i = 0; i < TEST_MAP_COUNT; i++) {
+        args[i] = (void*) i;
+        results[i] = NULL;
+    }
+    TEST_CHECK(pool_map(&pool, test_square, TEST_MAP_COUNT, args, results) == Success);
+    for (intptr_t i = 0; i < TEST_MAP_COUNT; i++)
+        TEST_CHECK((intptr_t) results[i] == i * i);
+
+    future_t futures[TEST_SUBMIT_COUNT];
+    for (intptr_t i = 0; i < TEST_SUBMIT_COUNT; i++)
+        TEST_CHECK(pool_submit(&pool, test_square, (void*) i, &futures[i]) == Success);
+    for (intptr_t i = 0; i < TEST_SUBMIT_COUNT; i++) {
+        void* result = NULL;
+        TEST_CHECK(future_wait(&futures[i], &result) == Success);
+        TEST_CHECK((intptr_t) result == i * i);
+    }
+
+    TEST_CHECK(pool_destroy(&pool) == Success);
+    return Success;
+}
+
+typedef struct test_nested_st {
+    thread_pool_t* pool;
+    intptr_t base;
+} test_nested_t;
+
+// Maps test_square over base .. base + TEST_NESTED_COUNT - 1 from inside a task and returns the sum.
+static rc_t test_nested_task(void* arg, void** result) {
+    test_nested_t* nested = arg;
+    void* args[TEST_NESTED_COUNT];
+    void* results[TEST_NESTED_COUNT];
+
+    for (intptr_t i = 0; i < TEST_NESTED_COUNT; i++)
+        args[i] = (void*)(nested->base + i);
+
+    rc_t rc = pool_map(nested->pool, test_square, TEST_NESTED_COUNT, args, results);
+    if (rc != Success)
+        return rc;
+
+    intptr_t sum = 0;
+    for (int i = 0; i < TEST_NESTED_COUNT; i++)
+        sum += (intptr_t) results[i];
+    *result = (void*) sum;
+    return Success;
+}
+
+static rc_t test_nested_map(pool_scheduler_t scheduler) {
+    thread_pool_t pool;
+    TEST_CHECK(test_create(&pool, scheduler) == Success);
+
+    // More outer tasks than workers, so every worker blocks in an inner map at least once.
+    enum { outer = TEST_WORKERS * 4 };
+    test_nested_t nested[outer];
+    void* args[outer];
+    void* results[outer];
+    for (int i = 0; i < outer; i++) {
+        nested[i].pool = &pool;
+        nested[i].base = i * TEST_NESTED_COUNT;
+        args[i] = &nested[i];
+    }
+    TEST_CHECK(pool_map(&pool, test_nested_task, outer, args, results) == Success);
+
+    for (int i = 0; i < outer; i++) {
+        intptr_t expected = 0;
+        for (intptr_t j = nested[i].base; j < nested[i].base + TEST_NESTED_COUNT; j++)
+            expected += j * j;
+        TEST_CHECK((intptr_t) results[i] == expected);
+    }
+
+    TEST_CHECK(pool_destroy(&pool) == Success);
+    return Success;
+}
+
+// Submits TEST_SUBMIT_COUNT squares from inside a task and waits for them; a full queue makes the worker run some inline.
+static rc_t test_submit_task(void* arg, void** result) {
+    thread_pool_t* pool = arg;
+    future_t futures[TEST_SUBMIT_COUNT];
+    intptr_t sum = 0;
+
+    for (intptr_t i = 0; i < TEST_SUBMIT_COUNT; i++) {
+        rc_t rc = pool_submit(pool, test_square, (void*) i, &futures[i]);
+        if (rc != Success)
+            return rc;
+    }
+    for (int i = 0; i < TEST_SUBMIT_COUNT; i++) {
+        void* square;
+        rc_t rc = future_wait(&futures[i], &square);
+        if (rc != Success)
+            return rc;
+        sum += (intptr_t) square;
+    }
+    *result = (void*) sum;
+    return Success;
+}
+
+// Every task is counted as executed once, whichever path ran it: worker loop, helping wait, or inline on a full queue.
+static rc_t test_stats(pool_scheduler_t scheduler) {
+    thread_pool_t pool;
+    pool_attr_t attrs;
+    pool_stats_t stats;
+    pool_worker_stats_t workers[TEST_WORKERS];
+
+    TEST_CHECK(pool_attr_init(&attrs) == Success);
+    attrs.pool_size = TEST_WORKERS;
+    attrs.scheduler = scheduler;
+    attrs.queue_blocks = 4;
+    TEST_CHECK(pool_create_attr(&pool, &attrs) == Success);
+
+    enum { outer = TEST_WORKERS * 4 };
+    test_nested_t nested[outer];
+    void* args[outer];
+    void* results[outer];
+    for (int i = 0; i < outer; i++) {
+        nested[i].pool = &pool;
+        nested[i].base = i * TEST_NESTED_COUNT;
+        args[i] = &nested[i];
+    }
+    rc_t rc = pool_map(&pool, test_nested_task, outer, args, results);
+
+    future_t future;
+    void* sum = NULL;
+    if (rc == Success)
+        rc = pool_submit(&pool, test_submit_task, &pool, &future);
+    if (rc == Success)
+        rc = future_wait(&future, &sum);
+    if (rc == Success && (intptr_t) sum != (TEST_SUBMIT_COUNT - 1) * TEST_SUBMIT_COUNT * (2 * TEST_SUBMIT_COUNT - 1) / 6)
+        rc = Error;
+
+    rc_t stats_rc = pool_stats(&pool, &stats, workers, TEST_WORKERS);
+    TEST_CHECK(pool_destroy(&pool) == Success);
+    TEST_CHECK(rc == Success);
+
+#ifdef POOL_STATS
+    TEST_CHECK(stats_rc == Success);
+    uint64_t executed = 0;
+    for (int i = 0; i < TEST_WORKERS; i++)
+        executed += workers[i].executed;
+    TEST_CHECK(stats.submitted == (uint64_t) outer * (TEST_NESTED_COUNT + 1) + TEST_SUBMIT_COUNT + 1);
+    TEST_CHECK(stats.total.executed == stats.submitted);
+    TEST_CHECK(executed == stats.total.executed);
+#else
+    TEST_CHECK(stats_rc == InvalidOperation);
+#endif
+    return Success;
+}
+
+static rc_t test_map_squares(thread_pool_t* pool) {
+    static void* args[TEST_MAP_COUNT];
+    static void* results[TEST_MAP_COUNT];
+
+    for (intptr_t i = 0; i < TEST_MAP_COUNT; i++)
+        args[i] = (void*) i;
+    TEST_CHECK(pool_map(pool, test_square, TEST_MAP_COUNT, args, results) == Success);
+    for (intptr_t i = 0; i < TEST_MAP_COUNT; i++)
+        TEST_CHECK((intptr_t) results[i] == i * i);
+    return Success;
+}
+
+// Elastic bounds need the shared scheduler; a work-stealing pool refuses to resize.
+static rc_t test_resize(pool_scheduler_t scheduler) {
+    thread_pool_t pool;
+
+    if (scheduler == PoolSchedulerWorkStealing) {
+        TEST_CHECK(test_create(&pool, scheduler) == Success);
+        TEST_CHECK(pool_resize(&pool, 1, TEST_WORKERS) == InvalidOperation);
+        TEST_CHECK(test_map_squares(&pool) == Success);
+        TEST_CHECK(pool_destroy(&pool) == Success);
+        return Success;
+    }
+
+    pool_attr_t attrs;
+    TEST_CHECK(pool_attr_init(&attrs) == Success);
+    attrs.pool_size = 2;
+    attrs.min_workers = 1;
+    attrs.max_workers = TEST_WORKERS * 2;
+    attrs.scheduler = scheduler;
+    TEST_CHECK(pool_create_attr(&pool, &attrs) == Success);
+
+    TEST_CHECK(pool_resize(&pool, TEST_WORKERS, TEST_WORKERS * 2) == Success);
+    TEST_CHECK(test_map_squares(&pool) == Success);
+    TEST_CHECK(pool_resize(&pool, 1, 2) == Success);
+    TEST_CHECK(test_map_squares(&pool) == Success);
+    TEST_CHECK(pool_resize(&pool, 0, 2) == InvalidArgument);
+    TEST_CHECK(pool_resize(&pool, 2, TEST_WORKERS * 4) == InvalidArgument);
+
+    TEST_CHECK(pool_destroy(&pool) == Success);
+    return Success;
+}
+
+typedef struct test_graph_node_st {
+    atomic_int* clock;
+    int stamp;                 // clock value when the node ran
+    intptr_t value;
+} test_graph_node_t;
+
+static rc_t test_graph_task(void* arg, void** result) {
+    test_graph_node_t* node = arg;
+    node->stamp = atomic_fetch_add(node->clock, 1);
+    *result = (void*) node->value;
+    return Success;
+}
+
+// A diamond, first -> (left, right) -> last, run twice on the same graph.
+static rc_t test_graph(pool_scheduler_t scheduler) {
+    thread_pool_t pool;
+    pool_graph_t graph;
+    atomic_int clock;
+    test_graph_node_t nodes[4];
+    int ids[4];
+
+    TEST_CHECK(test_create(&pool, scheduler) == Success);
+    TEST_CHECK(pool_graph_create(&graph) == Success);
+    for (int i = 0; i < 4; i++) {
+        nodes[i].clock = &clock;
+        nodes[i].value = i + 1;
+        TEST_CHECK(pool_graph_add(&graph, test_graph_task, &nodes[i], &ids[i]) == Success);
+    }
+    TEST_CHECK(pool_graph_depend(&graph, ids[1], ids[0]) == Success);
+    TEST_CHECK(pool_graph_depend(&graph, ids[2], ids[0]) == Success);
+    TEST_CHECK(pool_graph_depend(&graph, ids[3], ids[1]) == Success);
+    TEST_CHECK(pool_graph_depend(&graph, ids[3], ids[2]) == Success);
+
+    for (int run = 0; run < 2; run++) {
+        atomic_store(&clock, 0);
+        for (int i = 0; i < 4; i++)
+            nodes[i].stamp = -1;
+
+        TEST_CHECK(pool_graph_run(&graph, &pool) == Success);
+        TEST_CHECK(nodes[0].stamp == 0);
+        TEST_CHECK(nodes[1].stamp > nodes[0].stamp && nodes[2].stamp > nodes[0].stamp);
+        TEST_CHECK(nodes[3].stamp == 3);
+        for (int i = 0; i < 4; i++) {
+            void* result = NULL;
+            TEST_CHECK(pool_graph_result(&graph, ids[i], &result) == Success);
+            TEST_CHECK((intptr_t) result == nodes[i].value);
+        }
+    }
+
+    // A cycle is refused at the next run.
+    TEST_CHECK(pool_graph_depend(&graph, ids[0], ids[3]) == Success);
+    TEST_CHECK(pool_graph_run(&graph, &pool) != Success);
+
+    TEST_CHECK(pool_graph_destroy(&graph) == Success);
+    TEST_CHECK(pool_destroy(&pool) == Success);
+    return Success;
+}
+
+static void test_add(void* ctx, void* acc, const void* value) {
+    (void)ctx;
+    *(uint64_t*) acc += *(const uint64_t*) value;
+}
+
+static void test_scale(void* ctx, void* out, const void* in) {
+    *(uint64_t*) out = *(const uint64_t*) in * *(const uint64_t*) ctx + 1;
+}
+
+static int test_compare(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*) a;
+    uint64_t y = *(const uint64_t*) b;
+    return x < y ? -1 : x > y;
+}
+
+static rc_t test_algorithms_run(thread_pool_t* pool, uint64_t* in, uint64_t* out) {
+    const uint64_t zero = 0;
+    uint64_t factor = 3;
+    uint64_t sum = 0;
+
+    uint64_t state = 88172645463325252ull;
+    for (size_t i = 0; i < TEST_ALGORITHM_ELEMENTS; i++) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        in[i] = state % 1000000;
+    }
+
+    uint64_t expected = 0;
+    for (size_t i = 0; i < TEST_ALGORITHM_ELEMENTS; i++)
+        expected += in[i];
+    TEST_CHECK(pool_reduce(pool, in, TEST_ALGORITHM_ELEMENTS, sizeof(uint64_t), &zero, test_add, NULL, &sum) == Success);
+    TEST_CHECK(sum == expected);
+
+    TEST_CHECK(pool_inclusive_scan(pool, in, out, TEST_ALGORITHM_ELEMENTS, sizeof(uint64_t), &zero, test_add, NULL) == Success);
+    expected = 0;
+    for (size_t i = 0; i < TEST_ALGORITHM_ELEMENTS; i++) {
+        expected += in[i];
+        TEST_CHECK(out[i] == expected);
+    }
+
+    TEST_CHECK(pool_exclusive_scan(pool, in, out, TEST_ALGORITHM_ELEMENTS, sizeof(uint64_t), &zero, test_add, NULL) == Success);
+    expected = 0;
+    for (size_t i = 0; i < TEST_ALGORITHM_ELEMENTS; i++) {
+        TEST_CHECK(out[i] == expected);
+        expected += in[i];
+    }
+
+    TEST_CHECK(pool_transform(pool, in, sizeof(uint64_t), out, sizeof(uint64_t), TEST_ALGORITHM_ELEMENTS, test_scale, &factor) == Success);
+    for (size_t i = 0; i < TEST_ALGORITHM_ELEMENTS; i++)
+        TEST_CHECK(out[i] == in[i] * factor + 1);
+
+    TEST_CHECK(pool_sort(pool, in, TEST_ALGORITHM_ELEMENTS, sizeof(uint64_t), test_compare) == Success);
+    uint64_t sorted = 0;
+    for (size_t i = 0; i < TEST_ALGORITHM_ELEMENTS; i++) {
+        if (i > 0)
+            TEST_CHECK(in[i - 1] <= in[i]);
+        sorted += in[i];
+    }
+    TEST_CHECK(sorted == sum);
+
+    return Success;
+}
+
+static rc_t test_algorithms(pool_scheduler_t scheduler) {
+    thread_pool_t pool;
+    TEST_CHECK(test_create(&pool, scheduler) == Success);
+
+    uint64_t* in = malloc(TEST_ALGORITHM_ELEMENTS * sizeof(uint64_t));
+    uint64_t* out = malloc(TEST_ALGORITHM_ELEMENTS * sizeof(uint64_t));
+    rc_t rc = in != NULL && out != NULL ? test_algorithms_run(&pool, in, out) : OutOfMemory;
+    free(in);
+    free(out);
+
+    TEST_CHECK(pool_destroy(&pool) == Success);
+    return rc;
+}
+
+typedef struct test_proc_arg_st {
+    int64_t value;
+    atomic_int crash;          // the first worker to see 1 dies with the task
+} test_proc_arg_t;
+
+static rc_t test_proc_square(void* arg, void* result) {
+    test_proc_arg_t* proc_arg = arg;
+    if (atomic_exchange(&proc_arg->crash, 0) != 0)
+        raise(SIGKILL);
+    *(int64_t*) result = proc_arg->value * proc_arg->value;
+    return Success;
+}
+
+// Workers die in the middle of tasks; pool_proc_map requeues their tasks and forks replacements.
+// Allocates TEST_PROC_COUNT arguments and results in the arena; with crash, a few tasks kill the worker running them.
+static rc_t test_proc_prepare(pool_proc_t* pool, uint64_t args[], uint64_t results[], bool crash) {
+    for (int i = 0; i < TEST_PROC_COUNT; i++) {
+        test_proc_arg_t* arg = pool_proc_alloc(pool, sizeof(test_proc_arg_t));
+        int64_t* result = pool_proc_alloc(pool, sizeof(int64_t));
+        TEST_CHECK(arg != NULL && result != NULL);
+        arg->value = i;
+        atomic_init(&arg->crash, crash && i % (TEST_PROC_COUNT / TEST_WORKERS) == 7);
+        *result = -1;
+        args[i] = pool_proc_offset(pool, arg);
+        results[i] = pool_proc_offset(pool, result);
+    }
+    return Success;
+}
+
+static rc_t test_proc_check(pool_proc_t* pool, uint64_t args[], uint64_t results[]) {
+    for (int i = 0; i < TEST_PROC_COUNT; i++) {
+        test_proc_arg_t* arg = pool_proc_pointer(pool, args[i]);
+        TEST_CHECK(*(int64_t*) pool_proc_pointer(pool, results[i]) == (int64_t) i * i);
+        TEST_CHECK(atomic_load(&arg->crash) == 0);
+    }
+    return Success;
+}
+
+static rc_t test_proc_death(pool_scheduler_t scheduler) {
+    (void)scheduler;
+    pool_proc_t pool;
+    pool_proc_attr_t attrs;
+    char name[POOL_PROC_NAME_MAX];
+    uint64_t args[TEST_PROC_COUNT];
+    uint64_t results[TEST_PROC_COUNT];
+
+    TEST_CHECK(pool_proc_register(TEST_PROC_FUN, test_proc_square) == Success);
+    TEST_CHECK(pool_proc_attr_init(&attrs) == Success);
+    attrs.num_workers = TEST_WORKERS;
+    snprintf(name, sizeof(name), "/pool_test-%d", (int) getpid());
+    TEST_CHECK(pool_proc_create(&pool, name, &attrs) == Success);
+
+    rc_t rc = test_proc_prepare(&pool, args, results, true);
+    if (rc == Success)
+        rc = pool_proc_map(&pool, TEST_PROC_FUN, TEST_PROC_COUNT, args, results);
+    if (rc == Success)
+        rc = test_proc_check(&pool, args, results);
+
+    TEST_CHECK(pool_proc_destroy(&pool) == Success);
+    TEST_CHECK(rc == Success);
+    return Success;
+}
+
+typedef struct test_proc_killer_st {
+    pool_proc_t* pool;
+    atomic_int stop;
+    atomic_int kills;
+} test_proc_killer_t;
+
+// SIGKILLs a random worker every few hundred microseconds, wherever it is: dequeueing, running, or counting down.
+static void* test_proc_killer(void* arg) {
+    test_proc_killer_t* killer = arg;
+    unsigned int seed = 1;
+    int killed[TEST_WORKERS] = { 0 };
+
+    while (!atomic_load(&killer->stop)) {
+        usleep(200 + rand_r(&seed) % 2000);
+        int index = rand_r(&seed) % TEST_WORKERS;
+        int pid = atomic_load(&killer->pool->workers[index].pid);
+        // A dead worker keeps its record until the caller notices, and answers kill until it is reaped.
+        if (pid > 0 && pid != killed[index] && kill(pid, SIGKILL) == 0) {
+            killed[index] = pid;
+            atomic_fetch_add(&killer->kills, 1);
+        }
+    }
+    return NULL;
+}
+
+// Workers killed at random points: every task's completion is counted once, so each map returns with every result.
+static rc_t test_proc_kill(pool_scheduler_t scheduler) {
+    (void)scheduler;
+    pool_proc_t pool;
+    pool_proc_attr_t attrs;
+    char name[POOL_PROC_NAME_MAX];
+    uint64_t args[TEST_PROC_COUNT];
+    uint64_t results[TEST_PROC_COUNT];
+    pthread_t thread;
+
+    TEST_CHECK(pool_proc_register(TEST_PROC_FUN, test_proc_square) == Success);
+    TEST_CHECK(pool_proc_attr_init(&attrs) == Success);
+    attrs.num_workers = TEST_WORKERS;
+    snprintf(name, sizeof(name), "/pool_test-kill-%d", (int) getpid());
+    TEST_CHECK(pool_proc_create(&pool, name, &attrs) == Success);
+
+    test_proc_killer_t killer = { .pool = &pool, .stop = 0, .kills = 0 };
+    TEST_CHECK(pthread_create(&thread, NULL, test_proc_killer, &killer) == 0);
+
+    // Until enough deaths were seen, but not forever when the kills keep missing.
+    rc_t rc = Success;
+    for (int round = 0; rc == Success && round < 10000 && atomic_load(&killer.kills) < 50; round++) {
+        rc = pool_proc_reset(&pool);
+        if (rc == Success)
+            rc = test_proc_prepare(&pool, args, results, false);
+        if (rc == Success)
+            rc = pool_proc_map(&pool, TEST_PROC_FUN, TEST_PROC_COUNT, args, results);
+        if (rc == Success)
+            rc = test_proc_check(&pool, args, results);
+    }
+
+    atomic_store(&killer.stop, 1);
+    pthread_join(thread, NULL);
+    TEST_CHECK(pool_proc_destroy(&pool) == Success);
+    TEST_CHECK(rc == Success);
+    TEST_CHECK(atomic_load(&killer.kills) >= 50);
+    return Success;
+}
+
+typedef struct test_proc_creator_st {
+    pool_proc_t* pool;
+    const char* name;
+    rc_t rc;
+} test_proc_creator_t;
+
+static void* test_proc_creator(void* arg) {
+    test_proc_creator_t* creator = arg;
+    pool_proc_attr_t attrs;
+
+    creator->rc = pool_proc_attr_init(&attrs);
+    attrs.num_workers = TEST_WORKERS;
+    if (creator->rc == Success)
+        creator->rc = pool_proc_create(creator->pool, creator->name, &attrs);
+
+    // Give the workers time to settle in before the thread that forked them goes away.
+    usleep(50000);
+    return NULL;
+}
+
+// The workers outlive the thread that forked them, and exit once the process that did is gone.
+static rc_t test_proc_parent(pool_scheduler_t scheduler) {
+    (void)scheduler;
+    pool_proc_t pool;
+    char name[POOL_PROC_NAME_MAX];
+    uint64_t args[TEST_PROC_COUNT];
+    uint64_t results[TEST_PROC_COUNT];
+    int pids[TEST_WORKERS];
+    pthread_t thread;
+
+    TEST_CHECK(pool_proc_register(TEST_PROC_FUN, test_proc_square) == Success);
+    snprintf(name, sizeof(name), "/pool_test-parent-%d", (int) getpid());
+    test_proc_creator_t creator = { .pool = &pool, .name = name, .rc = Error };
+    TEST_CHECK(pthread_create(&thread, NULL, test_proc_creator, &creator) == 0);
+    pthread_join(thread, NULL);
+    TEST_CHECK(creator.rc == Success);
+
+    usleep(100000);
+    for (int i = 0; i < TEST_WORKERS; i++)
+        pids[i] = atomic_load(&pool.workers[i].pid);
+    rc_t rc = test_proc_prepare(&pool, args, results, false);
+    if (rc == Success)
+        rc = pool_proc_map(&pool, TEST_PROC_FUN, TEST_PROC_COUNT, args, results);
+    if (rc == Success)
+        rc = test_proc_check(&pool, args, results);
+    for (int i = 0; rc == Success && i < TEST_WORKERS; i++) {
+        if (atomic_load(&pool.workers[i].pid) != pids[i])
+            rc = Error;
+    }
+    TEST_CHECK(pool_proc_destroy(&pool) == Success);
+    TEST_CHECK(rc == Success);
+
+    // A frontend that exits without pool_proc_destroy: its workers are handed to us, and have to exit on their own.
+    TEST_CHECK(prctl(PR_SET_CHILD_SUBREAPER, 1) == 0);
+    pid_t frontend = fork();
+    TEST_CHECK(frontend >= 0);
+    if (frontend == 0) {
+        pool_proc_attr_t attrs;
+        pool_proc_attr_init(&attrs);
+        attrs.num_workers = TEST_WORKERS;
+        _exit(pool_proc_create(&pool, name, &attrs) == Success ? 0 : 1);
+    }
+
+    int status = -1;
+    int reaped = 0;
+    TEST_CHECK(waitpid(frontend, &status, 0) == frontend);
+    for (int i = 0; i < 2000 && reaped < TEST_WORKERS; i++) {
+        if (waitpid(-1, NULL, WNOHANG) > 0)
+            reaped++;
+        else
+            usleep(1000);
+    }
+    prctl(PR_SET_CHILD_SUBREAPER, 0);
+    shm_unlink(name);
+
+    TEST_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    TEST_CHECK(reaped == TEST_WORKERS);
+    return Success;
+}
+
+static rc_t test_queue_create(cqueue_t* queue, cqueue_mode_t mode, uint32_t num_blocks) {
+    cqueue_attr_t attrs;
+    rc_t rc = cqueue_attr_init(&attrs);
+    if (rc != Success)
+        return rc;
+
+    attrs.mode = mode;
+    attrs.num_blocks = num_blocks;
+    return cqueue_create(queue, &attrs);
+}
+
+typedef struct test_queue_side_st {
+    cqueue_t* queue;
+    int index;
+    uint32_t batch;                    // items per enqueue or dequeue call
+    atomic_uint_fast64_t* consumed;    // by all consumers
+    uint64_t sum;                      // of what this consumer took
+    rc_t rc;
+} test_queue_side_t;
+
+// Items are producer << 32 | sequence number, so a consumer can check that each producer's items arrive in order.
+static void* test_queue_producer(void* arg) {
+    test_queue_side_t* side = arg;
+    uint64_t items[TEST_QUEUE_BLOCKS];
+
+    for (uint32_t sent = 0; sent < TEST_QUEUE_ITEMS && side->rc == Success; ) {
+        uint32_t count = TEST_QUEUE_ITEMS - sent < side->batch ? TEST_QUEUE_ITEMS - sent : side->batch;
+        for (uint32_t i = 0; i < count; i++)
+            items[i] = (uint64_t) side->index << 32 | (sent + i);
+
+        uint32_t enqueued = 1;
+        if (side->batch == 1)
+            side->rc = cqueue_enqueue(side->queue, items, sizeof(uint64_t), NULL);
+        else
+            side->rc = cqueue_enqueue_batch(side->queue, items, sizeof(uint64_t), count, &enqueued, NULL);
+        sent += enqueued;
+    }
+    return NULL;
+}
+
+static void* test_queue_consumer(void* arg) {
+    test_queue_side_t* side = arg;
+    uint64_t items[TEST_QUEUE_BLOCKS];
+    int64_t last[TEST_QUEUE_THREADS];
+    timespec_t timeout = { 0, 10000000 };
+
+    for (int i = 0; i < TEST_QUEUE_THREADS; i++)
+        last[i] = -1;
+
+    // The timeout only lets the consumers notice that the others took the last items.
+    while (atomic_load(side->consumed) < (uint64_t) TEST_QUEUE_THREADS * TEST_QUEUE_ITEMS) {
+        uint32_t dequeued = 0;
+        rc_t rc = cqueue_dequeue_batch(side->queue, items, sizeof(uint64_t), side->batch, &dequeued, &timeout);
+        if (rc == Timeout)
+            continue;
+        if (rc != Success) {
+            side->rc = rc;
+            return NULL;
+        }
+
+        for (uint32_t i = 0; i < dequeued; i++) {
+            uint32_t producer = items[i] >> 32;
+            int64_t sequence = (uint32_t) items[i];
+            if (producer >= TEST_QUEUE_THREADS || sequence <= last[producer]) {
+                side->rc = Error;
+                return NULL;
+            }
+            last[producer] = sequence;
+            side->sum += items[i];
+        }
+        atomic_fetch_add(side->consumed, dequeued);
+    }
+    return NULL;
+}
+
+// Runs TEST_QUEUE_THREADS producers against as many consumers and checks that every item arrived once, in order per producer.
+static rc_t test_queue_exchange(cqueue_t* queue, uint32_t batch) {
+    atomic_uint_fast64_t consumed = 0;
+    test_queue_side_t producers[TEST_QUEUE_THREADS];
+    test_queue_side_t consumers[TEST_QUEUE_THREADS];
+    pthread_t threads[2 * TEST_QUEUE_THREADS];
+    uint64_t expected = 0;
+    uint64_t sum = 0;
+
+    for (int i = 0; i < TEST_QUEUE_THREADS; i++) {
+        producers[i] = (test_queue_side_t) { queue, i, batch, &consumed, 0, Success };
+        consumers[i] = (test_queue_side_t) { queue, i, batch, &consumed, 0, Success };
+        for (uint64_t j = 0; j < TEST_QUEUE_ITEMS; j++)
+            expected += (uint64_t) i << 32 | j;
+    }
+    for (int i = 0; i < TEST_QUEUE_THREADS; i++) {
+        TEST_CHECK(pthread_create(&threads[i], NULL, test_queue_consumer, &consumers[i]) == 0);
+        TEST_CHECK(pthread_create(&threads[TEST_QUEUE_THREADS + i], NULL, test_queue_producer, &producers[i]) == 0);
+    }
+    for (int i = 0; i < 2 * TEST_QUEUE_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < TEST_QUEUE_THREADS; i++) {
+        TEST_CHECK(producers[i].rc == Success && consumers[i].rc == Success);
+        sum += consumers[i].sum;
+    }
+    TEST_CHECK(atomic_load(&consumed) == (uint64_t) TEST_QUEUE_THREADS * TEST_QUEUE_ITEMS);
+    TEST_CHECK(sum == expected);
+    return Success;
+}
+
+// Fills the queue until a zero timeout fails, then drains it in order.
+static rc_t test_queue_fill(cqueue_t* queue, uint32_t capacity) {
+    timespec_t zero = { 0, 0 };
+    uint32_t size = 0;
+    uint64_t item = 0;
+    uint32_t dequeued = 0;
+
+    for (uint64_t i = 0; i < capacity; i++)
+        TEST_CHECK(cqueue_enqueue(queue, &i, sizeof(i), &zero) == Success);
+    TEST_CHECK(cqueue_enqueue(queue, &item, sizeof(item), &zero) == Timeout);
+    TEST_CHECK(cqueue_size(queue, &size) == Success && size == capacity);
+
+    for (uint64_t i = 0; i < capacity; i++) {
+        TEST_CHECK(cqueue_dequeue_batch(queue, &item, sizeof(item), 1, &dequeued, &zero) == Success);
+        TEST_CHECK(dequeued == 1 && item == i);
+    }
+    TEST_CHECK(cqueue_dequeue_batch(queue, &item, sizeof(item), 1, &dequeued, &zero) == Timeout);
+    return Success;
+}
+
+static rc_t test_queue_lock_free(pool_scheduler_t scheduler) {
+    (void)scheduler;
+    cqueue_t queue;
+    cqueue_attr_t attrs;
+
+    // The ring indexes slots with a mask.
+    TEST_CHECK(cqueue_attr_init(&attrs) == Success);
+    attrs.mode = CqueueModeLockFree;
+    attrs.num_blocks = 6;
+    TEST_CHECK(cqueue_create(&queue, &attrs) != Success);
+
+    TEST_CHECK(test_queue_create(&queue, CqueueModeLockFree, TEST_QUEUE_BLOCKS) == Success);
+    rc_t rc = test_queue_fill(&queue, TEST_QUEUE_BLOCKS);
+    if (rc == Success)
+        rc = test_queue_exchange(&queue, 1);
+    TEST_CHECK(cqueue_destroy(&queue) == Success);
+    return rc;
+}
+
+// Slots are written and read in place; commits and releases out of order still publish and free in ring order.
+static rc_t test_queue_zero_copy_mode(cqueue_mode_t mode) {
+    cqueue_t queue;
+    timespec_t zero = { 0, 0 };
+    void* slots[2];
+    void* items[2];
+    uint32_t sizes[2];
+
+    TEST_CHECK(test_queue_create(&queue, mode, TEST_QUEUE_BLOCKS) == Success);
+
+    TEST_CHECK(cqueue_reserve(&queue, sizeof(uint64_t), &slots[0], &zero) == Success);
+    TEST_CHECK(cqueue_reserve(&queue, sizeof(uint64_t), &slots[1], &zero) == Success);
+    *(uint64_t*) slots[0] = 10;
+    *(uint64_t*) slots[1] = 11;
+
+    // The second slot is committed first, but the consumer must not see it ahead of the first.
+    TEST_CHECK(cqueue_commit(&queue, slots[1]) == Success);
+    TEST_CHECK(cqueue_peek(&queue, sizeof(uint64_t), &items[0], &sizes[0], &zero) == Timeout);
+    TEST_CHECK(cqueue_commit(&queue, slots[0]) == Success);
+
+    TEST_CHECK(cqueue_peek(&queue, sizeof(uint64_t), &items[0], &sizes[0], &zero) == Success);
+    TEST_CHECK(cqueue_peek(&queue, sizeof(uint64_t), &items[1], &sizes[1], &zero) == Success);
+    TEST_CHECK(sizes[0] == sizeof(uint64_t) && *(uint64_t*) items[0] == 10);
+    TEST_CHECK(sizes[1] == sizeof(uint64_t) && *(uint64_t*) items[1] == 11);
+
+    // Until both are released the ring has only num_blocks - 2 free slots.
+    TEST_CHECK(cqueue_release(&queue, items[1]) == Success);
+    for (uint64_t i = 0; i < TEST_QUEUE_BLOCKS - 2; i++)
+        TEST_CHECK(cqueue_enqueue(&queue, &i, sizeof(i), &zero) == Success);
+    TEST_CHECK(cqueue_enqueue(&queue, &zero, sizeof(uint64_t), &zero) == Timeout);
+    TEST_CHECK(cqueue_release(&queue, items[0]) == Success);
+
+    rc_t rc = Success;
+    uint64_t item;
+    uint32_t dequeued;
+    for (uint64_t i = 0; rc == Success && i < TEST_QUEUE_BLOCKS - 2; i++) {
+        if (cqueue_dequeue_batch(&queue, &item, sizeof(item), 1, &dequeued, &zero) != Success || item != i)
+            rc = Error;
+    }
+    if (rc == Success)
+        rc = test_queue_fill(&queue, TEST_QUEUE_BLOCKS);
+
+    TEST_CHECK(cqueue_destroy(&queue) == Success);
+    TEST_CHECK(rc == Success);
+    return Success;
+}
+
+static rc_t test_queue_zero_copy(pool_scheduler_t scheduler) {
+    (void)scheduler;
+    TEST_CHECK(test_queue_zero_copy_mode(CqueueModeLocked) == Success);
+    TEST_CHECK(test_queue_zero_copy_mode(CqueueModeLockFree) == Success);
+    return Success;
+}
+
+// A batch takes what fits or what is there, at least one item, and keeps the order.
+static rc_t test_queue_batch_mode(cqueue_mode_t mode) {
+    cqueue_t queue;
+    timespec_t zero = { 0, 0 };
+    uint64_t items[TEST_QUEUE_BLOCKS + 4];
+    uint32_t count = 0;
+
+    for (uint64_t i = 0; i < TEST_QUEUE_BLOCKS + 4; i++)
+        items[i] = i;
+
+    TEST_CHECK(test_queue_create(&queue, mode, TEST_QUEUE_BLOCKS) == Success);
+    rc_t rc = cqueue_enqueue_batch(&queue, items, sizeof(uint64_t), TEST_QUEUE_BLOCKS + 4, &count, &zero);
+    if (rc == Success && count == TEST_QUEUE_BLOCKS)
+        rc = cqueue_enqueue_batch(&queue, items, sizeof(uint64_t), 1, &count, &zero) == Timeout ? Success : Error;
+    else
+        rc = Error;
+
+    uint64_t next = 0;
+    while (rc == Success && next < TEST_QUEUE_BLOCKS) {
+        uint64_t out[5];
+        rc = cqueue_dequeue_batch(&queue, out, sizeof(uint64_t), 5, &count, &zero);
+        if (rc == Success && count != (TEST_QUEUE_BLOCKS - next < 5 ? TEST_QUEUE_BLOCKS - next : 5))
+            rc = Error;
+        for (uint32_t i = 0; rc == Success && i < count; i++) {
+            if (out[i] != next++)
+                rc = Error;
+        }
+    }
+    if (rc == Success)
+        rc = cqueue_dequeue_batch(&queue, items, sizeof(uint64_t), 1, &count, &zero) == Timeout ? Success : Error;
+    if (rc == Success)
+        rc = test_queue_exchange(&queue, 4);
+
+    TEST_CHECK(cqueue_destroy(&queue) == Success);
+    TEST_CHECK(rc == Success);
+    return Success;
+}
+
+static rc_t test_queue_batch(pool_scheduler_t scheduler) {
+    (void)scheduler;
+    TEST_CHECK(test_queue_batch_mode(CqueueModeLocked) == Success);
+    TEST_CHECK(test_queue_batch_mode(CqueueModeLockFree) == Success);
+    return Success;
+}
+
+// cqueue_dequeue hands out malloc memory, cqueue_dequeue_slab slab memory; both copies outlive the slot.
+static rc_t test_queue_dequeue_mode(cqueue_mode_t mode) {
+    cqueue_t queue;
+    timespec_t zero = { 0, 0 };
+    void* item;
+    uint32_t size;
+
+    TEST_CHECK(test_queue_create(&queue, mode, TEST_QUEUE_BLOCKS) == Success);
+    rc_t rc = Success;
+    for (uint64_t i = 0; rc == Success && i < 2 * TEST_QUEUE_BLOCKS; i++) {
+        rc = cqueue_enqueue(&queue, &i, sizeof(i), &zero);
+        if (rc != Success)
+            break;
+        if (i % 2 == 0) {
+            rc = cqueue_dequeue(&queue, sizeof(i), &item, &size, &zero);
+            if (rc == Success && (size != sizeof(i) || *(uint64_t*) item != i))
+                rc = Error;
+            if (rc == Success)
+                free(item);
+        } else {
+            rc = cqueue_dequeue_slab(&queue, sizeof(i), &item, &size, &zero);
+            if (rc == Success && (size != sizeof(i) || *(uint64_t*) item != i))
+                rc = Error;
+            if (rc == Success)
+                cqueue_item_free(item);
+        }
+    }
+    if (rc == Success)
+        rc = cqueue_dequeue(&queue, sizeof(uint64_t), &item, &size, &zero) == Timeout ? Success : Error;
+
+    TEST_CHECK(cqueue_destroy(&queue) == Success);
+    TEST_CHECK(rc == Success);
+    return Success;
+}
+
+static rc_t test_queue_dequeue(pool_scheduler_t scheduler) {
+    (void)scheduler;
+    TEST_CHECK(test_queue_dequeue_mode(CqueueModeLocked) == Success);
+    TEST_CHECK(test_queue_dequeue_mode(CqueueModeLockFree) == Success);
+    TEST_CHECK(test_queue_dequeue_mode(CqueueModeByteRing) == Success);
+    TEST_CHECK(test_queue_dequeue_mode(CqueueModeSegmented) == Success);
+    return Success;
+}
+
+// Checks that a byte-ring record holds sequence number sequence and the bytes derived from it.
+static bool test_bytes_check(uint8_t* item, uint32_t size, uint64_t sequence) {
+    if (size != TEST_BYTES_MIN + sequence * 97 % TEST_BYTES_SPREAD || *(uint64_t*) item != sequence)
+        return false;
+    for (uint32_t i = sizeof(uint64_t); i < size; i++) {
+        if (item[i] != (uint8_t)(sequence + i))
+            return false;
+    }
+    return true;
+}
+
+// Records take their own size, not a slot each: small ones outnumber the slots, one may fill the ring, and mixed sizes wrap.
+static rc_t test_queue_byte_ring(pool_scheduler_t scheduler) {
+    (void)scheduler;
+    cqueue_t queue;
+    timespec_t zero = { 0, 0 };
+    uint8_t* record = malloc(TEST_BYTES_RING);
+    uint64_t item = 0;
+    uint32_t size = 0;
+    uint32_t count = 0;
+
+    TEST_CHECK(record != NULL);
+    TEST_CHECK(test_queue_create(&queue, CqueueModeByteRing, TEST_QUEUE_BLOCKS) == Success);
+
+    // Each 8 byte item takes a header and its payload, 16 bytes.
+    rc_t rc = Success;
+    while (rc == Success && count < TEST_BYTES_RING) {
+        item = count;
+        rc = cqueue_enqueue(&queue, &item, sizeof(item), &zero);
+        if (rc == Success)
+            count++;
+    }
+    if (rc == Timeout && count == TEST_BYTES_RING / 16)
+        rc = Success;
+    else
+        rc = Error;
+    for (uint64_t i = 0; rc == Success && i < count; i++) {
+        uint32_t dequeued = 0;
+        if (cqueue_dequeue_batch(&queue, &item, sizeof(item), 1, &dequeued, &zero) != Success || item != i)
+            rc = Error;
+    }
+
+    // The largest message takes the whole ring; one byte more never fits.
+    memset(record, 7, TEST_BYTES_RING);
+    if (rc == Success && (cqueue_enqueue(&queue, record, TEST_BYTES_RING - 7, &zero) != InvalidArgument ||
+                          cqueue_enqueue(&queue, record, TEST_BYTES_RING - 8, &zero) != Success ||
+                          cqueue_enqueue(&queue, &item, sizeof(item), &zero) != Timeout))
+        rc = Error;
+    if (rc == Success) {
+        void* out = NULL;
+        rc = cqueue_dequeue(&queue, TEST_BYTES_RING, &out, &size, &zero);
+        if (rc == Success && (size != TEST_BYTES_RING - 8 || memcmp(out, record, size) != 0))
+            rc = Error;
+        free(out);
+    }
+
+    // Sizes that do not divide the ring make records wrap with padding; the oldest is taken whenever there is no room.
+    uint64_t next = 0;
+    for (uint64_t sent = 0; rc == Success && sent < TEST_BYTES_RECORDS; ) {
+        size = TEST_BYTES_MIN + sent * 97 % TEST_BYTES_SPREAD;
+        *(uint64_t*) record = sent;
+        for (uint32_t i = sizeof(uint64_t); i < size; i++)
+            record[i] = (uint8_t)(sent + i);
+
+        rc = cqueue_enqueue(&queue, record, size, &zero);
+        if (rc == Success) {
+            sent++;
+            continue;
+        }
+        void* out = NULL;
+        if (rc == Timeout)
+            rc = cqueue_dequeue(&queue, TEST_BYTES_RING, &out, &size, &zero);
+        if (rc == Success && !test_bytes_check(out, size, next++))
+            rc = Error;
+        free(out);
+    }
+    while (rc == Success && next < TEST_BYTES_RECORDS) {
+        void* out = NULL;
+        rc = cqueue_dequeue(&queue, TEST_BYTES_RING, &out, &size, &zero);
+        if (rc == Success && !test_bytes_check(out, size, next++))
+            rc = Error;
+        free(out);
+    }
+    if (rc == Success)
+        rc = test_queue_exchange(&queue, 4);
+
+    free(record);
+    TEST_CHECK(cqueue_destroy(&queue) == Success);
+    TEST_CHECK(rc == Success);
+    return Success;
+}
+
+// Producers never wait on an unbounded queue, drained segments are reused, and a high-water mark caps the growth.
+static rc_t test_queue_segmented(pool_scheduler_t scheduler) {
+    (void)scheduler;
+    cqueue_t queue;
+    cqueue_attr_t attrs;
+    timespec_t zero = { 0, 0 };
+    uint32_t size = 0;
+
+    TEST_CHECK(test_queue_create(&queue, CqueueModeSegmented, TEST_QUEUE_BLOCKS) == Success);
+    rc_t rc = Success;
+    uint32_t segments = 0;
+    for (int round = 0; rc == Success && round < 2; round++) {
+        for (uint64_t i = 0; rc == Success && i < TEST_SEGMENTS * TEST_QUEUE_BLOCKS; i++)
+            rc = cqueue_enqueue(&queue, &i, sizeof(i), &zero);
+        if (rc == Success && (cqueue_size(&queue, &size) != Success || size != TEST_SEGMENTS * TEST_QUEUE_BLOCKS))
+            rc = Error;
+
+        // The second burst must reuse spares rather than allocate more segments than the first.
+        if (round == 0)
+            segments = queue.obj->num_segments;
+        else if (rc == Success && queue.obj->num_segments > segments)
+            rc = Error;
+
+        for (uint64_t i = 0; rc == Success && i < TEST_SEGMENTS * TEST_QUEUE_BLOCKS; i++) {
+            uint64_t item;
+            uint32_t dequeued = 0;
+            if (cqueue_dequeue_batch(&queue, &item, sizeof(item), 1, &dequeued, &zero) != Success || item != i)
+                rc = Error;
+        }
+    }
+    TEST_CHECK(cqueue_destroy(&queue) == Success);
+    TEST_CHECK(rc == Success && segments >= TEST_SEGMENTS);
+
+    TEST_CHECK(cqueue_attr_init(&attrs) == Success);
+    attrs.mode = CqueueModeSegmented;
+    attrs.num_blocks = TEST_QUEUE_BLOCKS;
+    attrs.max_segments = 2;
+    TEST_CHECK(cqueue_create(&queue, &attrs) == Success);
+    rc = test_queue_fill(&queue, 2 * TEST_QUEUE_BLOCKS);
+    if (rc == Success)
+        rc = test_queue_exchange(&queue, 4);
+    if (rc == Success && queue.obj->num_segments > 2)
+        rc = Error;
+    TEST_CHECK(cqueue_destroy(&queue) == Success);
+    TEST_CHECK(rc == Success);
+    return Success;
+}
+
+typedef struct test_waiter_st {
+    cqueue_t* queue;
+    atomic_int* stop;        // test_queue_noise: runs until set
+    rc_t rc;
+} test_waiter_t;
+
+// Takes a wake from the queue, as a consumer serving several queues would, and then dequeues nothing.
+static void* test_queue_watcher(void* arg) {
+    test_waiter_t* waiter = arg;
+    int index;
+
+    waiter->rc = cqueue_wait_any(&waiter->queue, 1, &index, NULL);
+    return NULL;
+}
+
+static void* test_queue_blocked(void* arg) {
+    test_waiter_t* waiter = arg;
+    timespec_t timeout = { 2, 0 };
+    uint64_t item;
+    uint32_t dequeued = 0;
+
+    waiter->rc = cqueue_dequeue_batch(waiter->queue, &item, sizeof(item), 1, &dequeued, &timeout);
+    return NULL;
+}
+
+// Wakes whoever sleeps for an item, with no item, until told to stop.
+static void* test_queue_noise(void* arg) {
+    test_waiter_t* waiter = arg;
+
+    while (atomic_load(waiter->stop) == 0) {
+        syscall(SYS_futex, &waiter->queue->obj->available_msgs, FUTEX_WAKE, INT_MAX, NULL, NULL, NULL);
+        usleep(1000);
+    }
+    return NULL;
+}
+
+// A deadline now + nsecs for cqueue_wait_any.
+static timespec_t test_deadline(uint64_t nsecs) {
+    uint64_t at = test_now_nsecs() + nsecs;
+    return (timespec_t) { at / 1000000000, at % 1000000000 };
+}
+
+// An item published while a cqueue_wait_any caller sleeps first in line still reaches a blocked consumer.
+static rc_t test_queue_wait_any_wake(cqueue_mode_t mode) {
+    cqueue_t queue;
+    pthread_t threads[2];
+    test_waiter_t watcher = { &queue, NULL, Error };
+    test_waiter_t blocked = { &queue, NULL, Error };
+    uint64_t item = 1;
+
+    TEST_CHECK(test_queue_create(&queue, mode, TEST_QUEUE_BLOCKS) == Success);
+    TEST_CHECK(pthread_create(&threads[0], NULL, test_queue_watcher, &watcher) == 0);
+    usleep(20000);
+    TEST_CHECK(pthread_create(&threads[1], NULL, test_queue_blocked, &blocked) == 0);
+    usleep(20000);
+    rc_t rc = cqueue_enqueue(&queue, &item, sizeof(item), NULL);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    TEST_CHECK(cqueue_destroy(&queue) == Success);
+    TEST_CHECK(rc == Success && watcher.rc == Success && blocked.rc == Success);
+    return Success;
+}
+
+// cqueue_wait_any over queues of every mode, and deadlines that hold however often the sleeper is woken.
+static rc_t test_queue_wait_any(pool_scheduler_t scheduler) {
+    (void)scheduler;
+    static const cqueue_mode_t modes[] = { CqueueModeLocked, CqueueModeLockFree, CqueueModeByteRing, CqueueModeSegmented };
+    enum { count = sizeof(modes) / sizeof(modes[0]) };
+    cqueue_t queues[count];
+    cqueue_t* waited[count];
+    timespec_t zero = { 0, 0 };
+    uint64_t item = 5;
+    uint32_t dequeued = 0;
+    int index = -1;
+
+    for (int i = 0; i < count; i++) {
+        TEST_CHECK(test_queue_create(&queues[i], modes[i], TEST_QUEUE_BLOCKS) == Success);
+        waited[i] = &queues[i];
+    }
+
+    rc_t rc = Success;
+    timespec_t deadline = test_deadline(20000000);
+    uint64_t start = test_now_nsecs();
+    if (cqueue_wait_any(waited, count, &index, &deadline) != Timeout || test_now_nsecs() - start < 20000000)
+        rc = Error;
+    deadline = test_deadline(0);
+    if (rc == Success && cqueue_wait_any(waited, count, &index, &deadline) != Timeout)
+        rc = Error;
+
+    for (int i = 0; rc == Success && i < count; i++) {
+        if (cqueue_enqueue(&queues[i], &item, sizeof(item), &zero) != Success ||
+            cqueue_wait_any(waited, count, &index, NULL) != Success || index != i ||
+            cqueue_dequeue_batch(&queues[i], &item, sizeof(item), 1, &dequeued, &zero) != Success)
+            rc = Error;
+    }
+
+    // Woken every millisecond with nothing to take, a 50 ms wait still ends at its deadline, not after the noise.
+    atomic_int stop = 0;
+    test_waiter_t noise = { &queues[0], &stop, Success };
+    pthread_t thread;
+    TEST_CHECK(pthread_create(&thread, NULL, test_queue_noise, &noise) == 0);
+    timespec_t timeout = { 0, 50000000 };
+    start = test_now_nsecs();
+    if (rc == Success && (cqueue_dequeue_batch(&queues[0], &item, sizeof(item), 1, &dequeued, &timeout) != Timeout ||
+                          test_now_nsecs() - start >= 150000000))
+        rc = Error;
+    deadline = test_deadline(50000000);
+    start = test_now_nsecs();
+    if (rc == Success && (cqueue_wait_any(waited, 1, &index, &deadline) != Timeout ||
+                          test_now_nsecs() - start >= 150000000))
+        rc = Error;
+    usleep(200000);
+    atomic_store(&stop, 1);
+    pthread_join(thread, NULL);
+
+    for (int i = 0; i < count; i++)
+        TEST_CHECK(cqueue_destroy(&queues[i]) == Success);
+    TEST_CHECK(rc == Success);
+
+    for (int i = 0; i < count; i++)
+        TEST_CHECK(test_queue_wait_any_wake(modes[i]) == Success);
+    return Success;
+}
+
+// Allocates objects of every class, and some too large for one, and passes them to the main thread to free.
+static void* test_slab_producer(void* arg) {
+    test_queue_side_t* side = arg;
+
+    for (uint64_t i = 0; i < TEST_SLAB_OBJECTS; i++) {
+        size_t bytes = i % 7 == 0 ? 8192 : (size_t) SLAB_MIN_CLASS << (i % SLAB_NUM_CLASSES);
+        uint64_t* object = slab_alloc(bytes);
+        if (object == NULL) {
+            side->rc = OutOfMemory;
+            return NULL;
+        }
+        object[0] = i;
+
+        // Keep some objects local, so the owner frees into its own list while the main thread frees remotely.
+        if (i % 3 == 0) {
+            slab_free(object);
+            continue;
+        }
+        if (cqueue_enqueue(side->queue, &object, sizeof(object), NULL) != Success) {
+            side->rc = Error;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static rc_t test_slab(pool_scheduler_t scheduler) {
+    (void)scheduler;
+    cqueue_t queue;
+    slab_stats_t before;
+    slab_stats_t after;
+    pthread_t threads[TEST_QUEUE_THREADS];
+    test_queue_side_t producers[TEST_QUEUE_THREADS];
+    uint64_t remote = 0;
+
+    TEST_CHECK(slab_stats(&before) == Success);
+    TEST_CHECK(test_queue_create(&queue, CqueueModeLocked, TEST_QUEUE_BLOCKS) == Success);
+    for (int i = 0; i < TEST_QUEUE_THREADS; i++) {
+        producers[i] = (test_queue_side_t) { .queue = &queue, .index = i, .rc = Success };
+        TEST_CHECK(pthread_create(&threads[i], NULL, test_slab_producer, &producers[i]) == 0);
+    }
+
+    // Freed here while the producers are still allocating from the same caches.
+    uint64_t expected = 0;
+    for (uint64_t i = 0; i < TEST_SLAB_OBJECTS; i++)
+        expected += i % 3 != 0;
+    expected *= TEST_QUEUE_THREADS;
+
+    rc_t rc = Success;
+    while (rc == Success && remote < expected) {
+        uint64_t* object;
+        uint32_t size;
+        rc = cqueue_dequeue_batch(&queue, &object, sizeof(object), 1, &size, NULL);
+        if (rc != Success)
+            break;
+        if (object[0] >= TEST_SLAB_OBJECTS)
+            rc = Error;
+        slab_free(object);
+        remote++;
+    }
+
+    for (int i = 0; i < TEST_QUEUE_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        TEST_CHECK(producers[i].rc == Success);
+    }
+    TEST_CHECK(cqueue_destroy(&queue) == Success);
+    TEST_CHECK(rc == Success);
+
+    TEST_CHECK(slab_stats(&after) == Success);
+    TEST_CHECK(after.objects_in_use == before.objects_in_use);
+    TEST_CHECK(after.bytes_in_use == before.bytes_in_use);
+    TEST_CHECK(after.bytes_reserved >= before.bytes_reserved);
+    TEST_CHECK(slab_stats(NULL) == InvalidArgument);
+    return Success;
+}
+
+// Waits up to a second for the other side to raise its parked flag.
+static bool test_spsc_parked(atomic_uint* parked) {
+    for (int i = 0; i < 1000; i++) {
+        if (atomic_load(parked) != 0)
+            return true;
+        usleep(1000);
+    }
+    return false;
+}
+
+typedef struct test_spsc_st {
+    spsc_t channel;
+    rc_t rc;
+} test_spsc_t;
+
+// Receives TEST_QUEUE_ITEMS items in order; parks on the empty channel first, and lets the producer park on a full one.
+static void* test_spsc_consumer(void* arg) {
+    test_spsc_t* shared = arg;
+    timespec_t timeout = { 1, 0 };
+    uint64_t item;
+    uint32_t size;
+
+    for (uint64_t i = 0; i < TEST_QUEUE_ITEMS; i++) {
+        if (i == 1 && !test_spsc_parked(&shared->channel.obj->producer_parked)) {
+            shared->rc = Error;
+            return NULL;
+        }
+        if (spsc_receive(&shared->channel, &item, sizeof(item), &size, &timeout) != Success ||
+            size != sizeof(item) || item != i) {
+            shared->rc = Error;
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+static rc_t test_spsc(pool_scheduler_t scheduler) {
+    (void)scheduler;
+    test_spsc_t shared = { .rc = Success };
+    spsc_attr_t attrs;
+    timespec_t zero = { 0, 0 };
+    timespec_t timeout = { 1, 0 };
+    pthread_t consumer;
+    uint64_t item;
+    uint32_t size;
+
+    TEST_CHECK(spsc_attr_init(&attrs) == Success);
+    attrs.block_size = sizeof(uint64_t);
+    attrs.num_blocks = 3;
+    TEST_CHECK(spsc_create(&shared.channel, &attrs) == InvalidArgument);
+    attrs.num_blocks = 4;
+    TEST_CHECK(spsc_create(&shared.channel, &attrs) == Success);
+
+    // A zero timeout is a try on both ends.
+    TEST_CHECK(spsc_receive(&shared.channel, &item, sizeof(item), &size, &zero) == Timeout);
+    for (item = 0; item < 4; item++)
+        TEST_CHECK(spsc_send(&shared.channel, &item, sizeof(item), &zero) == Success);
+    TEST_CHECK(spsc_send(&shared.channel, &item, sizeof(item), &zero) == Timeout);
+    TEST_CHECK(spsc_size(&shared.channel, &size) == Success && size == 4);
+    for (uint64_t i = 0; i < 4; i++)
+        TEST_CHECK(spsc_receive(&shared.channel, &item, sizeof(item), &size, &zero) == Success && item == i);
+
+    TEST_CHECK(pthread_create(&consumer, NULL, test_spsc_consumer, &shared) == 0);
+
+    // The consumer is asleep on the empty channel; the first send has to wake it.
+    rc_t rc = test_spsc_parked(&shared.channel.obj->consumer_parked) ? Success : Error;
+    for (item = 0; rc == Success && item < TEST_QUEUE_ITEMS; item++) {
+        // Item 0 is in, then four more fill the channel, and the next send parks until the consumer drains it.
+        rc = spsc_send(&shared.channel, &item, sizeof(item), &timeout);
+    }
+
+    pthread_join(consumer, NULL);
+    TEST_CHECK(spsc_destroy(&shared.channel) == Success);
+    TEST_CHECK(rc == Success);
+    TEST_CHECK(shared.rc == Success);
+    return Success;
+}
+
+typedef struct test_lock_st {
+    spinlock_t lock;
+    uint64_t counter;          // only touched under the lock
+    atomic_int started;
+    rc_t rc;
+} test_lock_t;
+
+static void* test_lock_thread(void* arg) {
+    test_lock_t* shared = arg;
+    atomic_fetch_add(&shared->started, 1);
+
+    for (int i = 0; i < TEST_LOCK_ROUNDS; i++) {
+        if (spinlock_acquire(&shared->lock) != Success) {
+            shared->rc = Error;
+            return NULL;
+        }
+        shared->counter++;
+        spinlock_release(&shared->lock);
+    }
+    return NULL;
+}
+
+static rc_t test_lock_kind(spinlock_kind_t kind, int spin_limit) {
+    test_lock_t shared = { .counter = 0, .started = 0, .rc = Success };
+    spinlock_attrs_t attrs;
+    pthread_t threads[TEST_LOCK_THREADS];
+
+    TEST_CHECK(spinlock_attr_init(&attrs) == Success);
+    attrs.kind = kind;
+    attrs.spin_limit = spin_limit;
+    TEST_CHECK(spinlock_create(&shared.lock, &attrs) == Success);
+
+    // Start everybody behind a held lock, so they spin out and park before the first release.
+    TEST_CHECK(spinlock_acquire(&shared.lock) == Success);
+    for (int i = 0; i < TEST_LOCK_THREADS; i++)
+        TEST_CHECK(pthread_create(&threads[i], NULL, test_lock_thread, &shared) == 0);
+    while (atomic_load(&shared.started) < TEST_LOCK_THREADS)
+        usleep(1000);
+    usleep(10000);
+    TEST_CHECK(spinlock_release(&shared.lock) == Success);
+
+    for (int i = 0; i < TEST_LOCK_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    TEST_CHECK(shared.rc == Success);
+    TEST_CHECK(shared.counter == (uint64_t) TEST_LOCK_THREADS * TEST_LOCK_ROUNDS);
+    TEST_CHECK(spinlock_release(&shared.lock) == InvalidOperation);
+    TEST_CHECK(spinlock_destroy(&shared.lock) == Success);
+    return Success;
+}
+
+static rc_t test_lock_adaptive(pool_scheduler_t scheduler) {
+    (void)scheduler;
+    TEST_CHECK(test_lock_kind(SpinlockKindAdaptive, 1024) == Success);
+    TEST_CHECK(test_lock_kind(SpinlockKindAdaptive, 0) == Success);    // parks at once
+    TEST_CHECK(test_lock_kind(SpinlockKindRobust, 1024) == Success);
+    return Success;
+}
+
+// Holds its worker until *arg is set.
+static rc_t test_gate(void* arg, void** result) {
+    while (atomic_load((atomic_int*) arg) == 0)
+        usleep(1000);
+    *result = arg;
+    return Success;
+}
+
+static rc_t test_fail(void* arg, void** result) {
+    *result = arg;
+    return InvalidOperation;
+}
+
+static rc_t test_futures(pool_scheduler_t scheduler) {
+    thread_pool_t pool;
+    atomic_int open = 0;
+    future_t futures[3];
+    future_t* pending[2] = { &futures[0], &futures[1] };
+    timespec_t timeout = { 0, 20000000 };
+    void* result = NULL;
+    bool ready = true;
+    int index = -1;
+
+    TEST_CHECK(test_create(&pool, scheduler) == Success);
+    TEST_CHECK(pool_submit(&pool, test_gate, &open, &futures[0]) == Success);
+    TEST_CHECK(pool_submit(&pool, test_square, (void*) 7, &futures[1]) == Success);
+
+    // The timeout counts from the call, however often the wait wakes up.
+    uint64_t start = test_now_nsecs();
+    TEST_CHECK(future_wait_timeout(&futures[0], &timeout, &result) == Timeout);
+    TEST_CHECK(test_now_nsecs() - start >= 20000000);
+    TEST_CHECK(future_is_ready(&futures[0], &ready) == Success && !ready);
+
+    TEST_CHECK(future_wait_any(pending, 2, &index, &timeout) == Success && index == 1);
+    TEST_CHECK(future_wait(&futures[1], &result) == Success && (intptr_t) result == 49);
+    TEST_CHECK(future_wait_all(pending, 2, &timeout) == Timeout);
+
+    atomic_store(&open, 1);
+    TEST_CHECK(future_wait_all(pending, 2, NULL) == Success);
+    TEST_CHECK(future_wait(&futures[0], &result) == Success && result == &open);
+
+    // A task's error goes to its future, and the pool goes on.
+    TEST_CHECK(pool_submit(&pool, test_fail, &open, &futures[2]) == Success);
+    TEST_CHECK(future_wait(&futures[2], &result) == InvalidOperation && result == &open);
+    TEST_CHECK(test_map_squares(&pool) == Success);
+
+    // A future completes once, from anywhere.
+    future_t local;
+    TEST_CHECK(future_init(&local) == Success);
+    TEST_CHECK(future_wait_any((future_t*[]) { &local }, 1, &index, &(timespec_t) { 0, 0 }) == Timeout);
+    TEST_CHECK(future_complete(&local, Success, &local) == Success);
+    TEST_CHECK(future_complete(&local, Success, NULL) == InvalidOperation);
+    TEST_CHECK(future_wait(&local, &result) == Success && result == &local);
+
+    TEST_CHECK(pool_destroy(&pool) == Success);
+    return Success;
+}
+
+// Marks *arg 1 once a worker runs it, then holds that worker until *arg is 2.
+static rc_t test_hold(void* arg, void** result) {
+    atomic_int* hold = arg;
+    int expected = 0;
+
+    atomic_compare_exchange_strong(hold, &expected, 1);
+    while (atomic_load(hold) != 2)
+        usleep(1000);
+    *result = NULL;
+    return Success;
+}
+
+// Waits up to a second for count of the total holds to start.
+static bool test_held(atomic_int holds[], int total, int count) {
+    for (int wait = 0; wait < 1000; wait++) {
+        int started = 0;
+        for (int i = 0; i < total; i++)
+            started += atomic_load(&holds[i]) == 1;
+        if (started >= count)
+            return true;
+        usleep(1000);
+    }
+    return false;
+}
+
+typedef struct test_order_st {
+    atomic_int* next;
+    int position;    // among the tasks run after the hold
+} test_order_t;
+
+static rc_t test_order(void* arg, void** result) {
+    test_order_t* order = arg;
+    order->position = atomic_fetch_add(order->next, 1);
+    *result = NULL;
+    return Success;
+}
+
+// One worker held while a low task and then a run of high tasks queue up: the low one runs last under strict priority, early with aging.
+static rc_t test_priority_aging(pool_scheduler_t scheduler, uint32_t aging_usecs) {
+    thread_pool_t pool;
+    pool_attr_t attrs;
+    atomic_int hold = 0;
+    atomic_int next = 0;
+    test_order_t orders[TEST_PRIORITY_TASKS + 1];
+    future_t futures[TEST_PRIORITY_TASKS + 2];
+
+    TEST_CHECK(pool_attr_init(&attrs) == Success);
+    attrs.scheduler = scheduler;
+    attrs.aging_usecs = aging_usecs;
+    TEST_CHECK(pool_create_attr(&pool, &attrs) == Success);
+
+    rc_t rc = pool_submit(&pool, test_hold, &hold, &futures[0]);
+    int submitted = rc == Success ? 1 : 0;
+    if (rc == Success && !test_held(&hold, 1, 1))
+        rc = Error;
+    for (int i = 0; rc == Success && i <= TEST_PRIORITY_TASKS; i++) {
+        orders[i] = (test_order_t) { &next, -1 };
+        rc = pool_submit_priority(&pool, test_order, &orders[i], &futures[i + 1],
+                                  i == 0 ? PoolPriorityLow : PoolPriorityHigh);
+        if (rc == Success)
+            submitted++;
+    }
+
+    // Long enough past aging_usecs that the low task is overdue once the worker is free.
+    usleep(20000);
+    atomic_store(&hold, 2);
+    for (int i = 0; i < submitted; i++)
+        future_wait(&futures[i], NULL);
+    TEST_CHECK(pool_destroy(&pool) == Success);
+
+    TEST_CHECK(rc == Success);
+    if (aging_usecs == 0)
+        TEST_CHECK(orders[0].position == TEST_PRIORITY_TASKS);
+    else
+        TEST_CHECK(orders[0].position >= 0 && orders[0].position < TEST_PRIORITY_TASKS);
+    return Success;
+}
+
+// With every other worker held by normal work, a reserved worker still runs high work, and never normal work.
+static rc_t test_priority_reserved(pool_scheduler_t scheduler) {
+    thread_pool_t pool;
+    pool_attr_t attrs;
+    atomic_int holds[TEST_WORKERS] = { 0 };
+    future_t futures[TEST_WORKERS];
+    future_t high[TEST_PRIORITY_TASKS];
+    future_t* pending[TEST_PRIORITY_TASKS];
+    timespec_t timeout = { 2, 0 };
+
+    TEST_CHECK(pool_attr_init(&attrs) == Success);
+    attrs.pool_size = TEST_WORKERS;
+    attrs.scheduler = scheduler;
+    attrs.reserved_workers = 1;
+    TEST_CHECK(pool_create_attr(&pool, &attrs) == Success);
+
+    int submitted = 0;
+    rc_t rc = Success;
+    for (int i = 0; rc == Success && i < TEST_WORKERS; i++) {
+        rc = pool_submit(&pool, test_hold, &holds[i], &futures[i]);
+        if (rc == Success)
+            submitted++;
+    }
+    if (rc == Success && !test_held(holds, TEST_WORKERS, TEST_WORKERS - 1))
+        rc = Error;
+
+    int queued = 0;
+    for (intptr_t i = 0; rc == Success && i < TEST_PRIORITY_TASKS; i++) {
+        pending[i] = &high[i];
+        rc = pool_submit_priority(&pool, test_square, (void*) i, &high[i], PoolPriorityHigh);
+        if (rc == Success)
+            queued++;
+    }
+    if (rc == Success)
+        rc = future_wait_all(pending, queued, &timeout);
+    for (intptr_t i = 0; rc == Success && i < queued; i++) {
+        void* result = NULL;
+        if (future_wait(&high[i], &result) != Success || (intptr_t) result != i * i)
+            rc = Error;
+    }
+
+    // The reserved worker was free all along, yet the last hold has not started.
+    if (rc == Success && test_held(holds, TEST_WORKERS, TEST_WORKERS))
+        rc = Error;
+
+    for (int i = 0; i < TEST_WORKERS; i++)
+        atomic_store(&holds[i], 2);
+    for (int i = 0; i < submitted; i++)
+        future_wait(&futures[i], NULL);
+    TEST_CHECK(pool_destroy(&pool) == Success);
+    TEST_CHECK(rc == Success);
+    return Success;
+}
+
+static rc_t test_priority(pool_scheduler_t scheduler) {
+    TEST_CHECK(test_priority_aging(scheduler, 0) == Success);
+    TEST_CHECK(test_priority_aging(scheduler, 1000) == Success);
+    TEST_CHECK(test_priority_reserved(scheduler) == Success);
+    return Success;
+}
+
+#ifdef POOL_TRACE
+// Every task of a map lands in the histograms, and the dump holds at most the last TEST_TRACE_EVENTS tasks of each worker.
+static rc_t test_trace(pool_scheduler_t scheduler) {
+    thread_pool_t pool;
+    pool_attr_t attrs;
+    stats_distribution_t* wait = malloc(sizeof(stats_distribution_t));
+    stats_distribution_t* run = malloc(sizeof(stats_distribution_t));
+    char line[512];
+
+    TEST_CHECK(wait != NULL && run != NULL);
+    TEST_CHECK(pool_attr_init(&attrs) == Success);
+    attrs.pool_size = TEST_WORKERS;
+    attrs.scheduler = scheduler;
+    attrs.trace = true;
+    attrs.trace_events = TEST_TRACE_EVENTS;
+    TEST_CHECK(pool_create_attr(&pool, &attrs) == Success);
+
+    rc_t rc = test_map_squares(&pool);
+
+    // A task is recorded just after it completed, so the last ones may trail the map's return.
+    for (int i = 0; rc == Success && i < 1000; i++) {
+        rc = pool_trace_histograms(&pool, wait, run);
+        if (rc != Success || run->count >= TEST_MAP_COUNT)
+            break;
+        usleep(1000);
+    }
+    if (rc == Success && (wait->count != TEST_MAP_COUNT || run->count != TEST_MAP_COUNT || run->sum == 0))
+        rc = Error;
+
+    int events = 0;
+    FILE* out = tmpfile();
+    if (rc == Success && (out == NULL || pool_trace_dump(&pool, out) != Success))
+        rc = Error;
+    if (out != NULL) {
+        rewind(out);
+        while (fgets(line, sizeof(line), out) != NULL)
+            events += strstr(line, "\"ph\": \"X\"") != NULL;
+        fclose(out);
+    }
+    if (rc == Success && (events == 0 || events > TEST_WORKERS * TEST_TRACE_EVENTS))
+        rc = Error;
+
+    TEST_CHECK(pool_destroy(&pool) == Success);
+    free(wait);
+    free(run);
+    TEST_CHECK(rc == Success);
+
+    // A pool created without tracing has nothing to report.
+    TEST_CHECK(test_create(&pool, scheduler) == Success);
+    rc = pool_trace_dump(&pool, stdout);
+    TEST_CHECK(pool_destroy(&pool) == Success);
+    TEST_CHECK(rc == InvalidOperation);
+    return Success;
+}
+#else
+// Compiled out, tracing is refused rather than silently not done.
+static rc_t test_trace(pool_scheduler_t scheduler) {
+    thread_pool_t pool;
+    pool_attr_t attrs;
+
+    TEST_CHECK(pool_attr_init(&attrs) == Success);
+    attrs.scheduler = scheduler;
+    attrs.trace = true;
+    TEST_CHECK(pool_create_attr(&pool, &attrs) == InvalidOperation);
+
+    TEST_CHECK(test_create(&pool, scheduler) == Success);
+    rc_t rc = pool_trace_histograms(&pool, NULL, NULL);
+    TEST_CHECK(pool_destroy(&pool) == Success);
+    TEST_CHECK(rc == InvalidOperation);
+    return Success;
+}
+#endif
+
+static void test_io_done(pool_io_t* io) {
+    atomic_fetch_add((atomic_int*) io->arg, 1);
+}
+
+// Waits up to five seconds for count callbacks.
+static bool test_io_wait(atomic_int* done, int count) {
+    for (int wait = 0; wait < 5000 && atomic_load(done) < count; wait++)
+        usleep(1000);
+    return atomic_load(done) == count;
+}
+
+typedef struct test_io_reads_st {
+    pool_io_t* ios;
+    int fd;
+    char (*blocks)[TEST_IO_BLOCK];
+    atomic_int* done;
+} test_io_reads_t;
+
+// Issues every read from a worker, whose submissions go to the kernel together once the task returns.
+static rc_t test_io_reader(void* arg, void** result) {
+    test_io_reads_t* reads = arg;
+    *result = NULL;
+
+    for (int i = 0; i < TEST_IO_REQUESTS; i++) {
+        rc_t rc = pool_read_async(reads->ios[i].pool, &reads->ios[i], reads->fd, reads->blocks[i], TEST_IO_BLOCK,
+                                  (off_t) i * TEST_IO_BLOCK, test_io_done, reads->done);
+        if (rc != Success)
+            return rc;
+    }
+    return Success;
+}
+
+// Writes blocks from outside the pool and reads them back from inside it; a failed transfer reports -errno to its callback.
+static rc_t test_io_run(pool_scheduler_t scheduler, uint32_t io_entries) {
+    static char written[TEST_IO_REQUESTS][TEST_IO_BLOCK];
+    static char read[TEST_IO_REQUESTS][TEST_IO_BLOCK];
+    pool_io_t ios[TEST_IO_REQUESTS];
+    thread_pool_t pool;
+    pool_attr_t attrs;
+    char path[] = "/tmp/pool_test-io-XXXXXX";
+    atomic_int done = 0;
+    future_t future;
+
+    int fd = mkstemp(path);
+    TEST_CHECK(fd >= 0);
+    int write_only = open(path, O_WRONLY);
+    unlink(path);
+    TEST_CHECK(write_only >= 0);
+
+    for (int i = 0; i < TEST_IO_REQUESTS; i++) {
+        memset(written[i], 'a' + i % 26, TEST_IO_BLOCK);
+        memset(read[i], 0, TEST_IO_BLOCK);
+    }
+
+    TEST_CHECK(pool_attr_init(&attrs) == Success);
+    attrs.pool_size = TEST_WORKERS;
+    attrs.scheduler = scheduler;
+    attrs.io_entries = io_entries;
+    TEST_CHECK(pool_create_attr(&pool, &attrs) == Success);
+
+    rc_t rc = Success;
+    int issued = 0;
+    for (int i = 0; rc == Success && i < TEST_IO_REQUESTS; i++) {
+        rc = pool_write_async(&pool, &ios[i], fd, written[i], TEST_IO_BLOCK, (off_t) i * TEST_IO_BLOCK, test_io_done, &done);
+        if (rc == Success)
+            issued++;
+    }
+    if (!test_io_wait(&done, issued))
+        rc = Error;
+    for (int i = 0; rc == Success && i < TEST_IO_REQUESTS; i++) {
+        if (ios[i].result != TEST_IO_BLOCK)
+            rc = Error;
+    }
+
+    atomic_store(&done, 0);
+    issued = 0;
+    test_io_reads_t reads = { ios, fd, read, &done };
+    for (int i = 0; i < TEST_IO_REQUESTS; i++)
+        ios[i].pool = &pool;
+    if (rc == Success)
+        rc = pool_submit(&pool, test_io_reader, &reads, &future);
+    if (rc == Success) {
+        rc = future_wait(&future, NULL);
+        issued = TEST_IO_REQUESTS;
+    }
+    if (rc == Success && !test_io_wait(&done, issued))
+        rc = Error;
+    for (int i = 0; rc == Success && i < TEST_IO_REQUESTS; i++) {
+        if (ios[i].result != TEST_IO_BLOCK || memcmp(read[i], written[i], TEST_IO_BLOCK) != 0)
+            rc = Error;
+    }
+
+    atomic_store(&done, 0);
+    if (rc == Success)
+        rc = pool_read_async(&pool, &ios[0], write_only, read[0], TEST_IO_BLOCK, 0, test_io_done, &done);
+    if (rc == Success && (!test_io_wait(&done, 1) || ios[0].result != -EBADF))
+        rc = Error;
+
+    TEST_CHECK(pool_destroy(&pool) == Success);
+    close(write_only);
+    close(fd);
+    TEST_CHECK(rc == Success);
+    return Success;
+}
+
+// With blocking tasks, with a ring, and with a ring too small for the requests in flight.
+static rc_t test_io(pool_scheduler_t scheduler) {
+    TEST_CHECK(test_io_run(scheduler, 0) == Success);
+    TEST_CHECK(test_io_run(scheduler, 64) == Success);
+    TEST_CHECK(test_io_run(scheduler, 4) == Success);
+    return Success;
+}
+
+// Waits 20 ms for a future nobody completes, and returns how long the wait took.
+static rc_t test_fiber_timed(void* arg, void** result) {
+    timespec_t timeout = { 0, 20000000 };
+    uint64_t start = test_now_nsecs();
+
+    rc_t rc = future_wait_timeout(arg, &timeout, NULL);
+    *result = (void*)(uintptr_t)(test_now_nsecs() - start);
+    return rc;
+}
+
+// Tasks on fibers park in nested maps, future waits and timed waits, more of them at once than fiber_sleep watches words.
+static rc_t test_fibers(pool_scheduler_t scheduler) {
+    thread_pool_t pool;
+    pool_attr_t attrs;
+    static test_nested_t nested[TEST_FIBER_OUTER];
+    static void* args[TEST_FIBER_OUTER];
+    static void* results[TEST_FIBER_OUTER];
+
+    TEST_CHECK(pool_attr_init(&attrs) == Success);
+    attrs.pool_size = 2;
+    attrs.scheduler = scheduler;
+    attrs.fibers = true;
+    TEST_CHECK(pool_create_attr(&pool, &attrs) == Success);
+
+    for (int i = 0; i < TEST_FIBER_OUTER; i++) {
+        nested[i].pool = &pool;
+        nested[i].base = i * TEST_NESTED_COUNT;
+        args[i] = &nested[i];
+    }
+    rc_t rc = pool_map(&pool, test_nested_task, TEST_FIBER_OUTER, args, results);
+    for (int i = 0; rc == Success && i < TEST_FIBER_OUTER; i++) {
+        intptr_t expected = 0;
+        for (intptr_t j = nested[i].base; j < nested[i].base + TEST_NESTED_COUNT; j++)
+            expected += j * j;
+        if ((intptr_t) results[i] != expected)
+            rc = Error;
+    }
+
+    for (int i = 0; i < TEST_WORKERS; i++)
+        args[i] = &pool;
+    if (rc == Success)
+        rc = pool_map(&pool, test_submit_task, TEST_WORKERS, args, results);
+    for (int i = 0; rc == Success && i < TEST_WORKERS; i++) {
+        if ((intptr_t) results[i] != (TEST_SUBMIT_COUNT - 1) * TEST_SUBMIT_COUNT * (2 * TEST_SUBMIT_COUNT - 1) / 6)
+            rc = Error;
+    }
+
+    future_t never;
+    future_t timed;
+    void* waited = NULL;
+    TEST_CHECK(future_init(&never) == Success);
+    if (rc == Success)
+        rc = pool_submit(&pool, test_fiber_timed, &never, &timed);
+    if (rc == Success)
+        rc = future_wait(&timed, &waited) == Timeout && (uintptr_t) waited >= 20000000 ? Success : Error;
+
+    TEST_CHECK(pool_destroy(&pool) == Success);
+    TEST_CHECK(rc == Success);
+    return Success;
+}
+
+typedef struct test_case_st {
+    const char* name;
+    test_fun_t* fun;
+    bool per_scheduler;
+} test_case_t;
+
+static const test_case_t test_cases[] = {
+    { "map_submit", test_map_submit, true },
+    { "nested_map", test_nested_map, true },
+    { "futures", test_futures, true },
+    { "priority", test_priority, true },
+    { "trace", test_trace, true },
+    { "io", test_io, true },
+    { "fibers", test_fibers, true },
+    { "stats", test_stats, true },
+    { "resize", test_resize, true },
+    { "graph", test_graph, true },
+    { "algorithms", test_algorithms, true },
+    { "proc_worker_death", test_proc_death, false },
+    { "proc_worker_kill", test_proc_kill, false },
+    { "proc_parent", test_proc_parent, false },
+    { "queue_lock_free", test_queue_lock_free, false },
+    { "queue_zero_copy", test_queue_zero_copy, false },
+    { "queue_batch", test_queue_batch, false },
+    { "queue_dequeue", test_queue_dequeue, false },
+    { "queue_byte_ring", test_queue_byte_ring, false },
+    { "queue_segmented", test_queue_segmented, false },
+    { "queue_wait_any", test_queue_wait_any, false },
+    { "slab", test_slab, false },
+    { "spsc", test_spsc, false },
+    { "lock_adaptive", test_lock_adaptive, false },
+};
+
+int main(void) {
+    static const pool_scheduler_t schedulers[] = { PoolSchedulerShared, PoolSchedulerWorkStealing };
+    static const char* scheduler_names[] = { "shared", "work_stealing" };
+    int failed = 0;
+
+    for (size_t i = 0; i < sizeof(test_cases) / sizeof(test_cases[0]); i++) {
+        int runs = test_cases[i].per_scheduler ? 2 : 1;
+        for (int s = 0; s < runs; s++) {
+            rc_t rc = test_cases[i].fun(schedulers[s]);
+            printf("%-20s %-14s %s\n", test_cases[i].name, test_cases[i].per_scheduler ? scheduler_names[s] : "",
+                   rc == Success ? "ok" : "FAILED");
+            if (rc != Success)
+                failed++;
+        }
+    }
+
+    printf("%d failed\n", failed);
+    return failed;
+}
@@ -0,0 +1,263 @@
+#include "pool_trace.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef POOL_TRACE
+
+// One event as read back by pool_trace_dump.
+typedef struct pool_trace_sample_st {
+    uint64_t enqueue_nsecs;
+    uint64_t dequeue_nsecs;
+    uint64_t start_nsecs;
+    uint64_t end_nsecs;
+    int id;
+    int priority;
+} pool_trace_sample_t;
+
+/**
+ * @brief: Allocates the tracing state of a pool: histograms, and a ring of num_events per worker.
+ *
+ * @param: trace -- receives the state.
+ * @param: num_workers -- the pool's worker slots.
+ * @param: num_events -- events kept per worker, 0 for none.
+ * @return: the rc_t value (Success, OutOfMemory)
+*/
+rc_t pool_trace_create(pool_trace_t** trace, int num_workers, uint32_t num_events) {
+
+    pool_trace_t* state = malloc(sizeof(pool_trace_t));
+    if (state == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        return OutOfMemory;
+    }
+
+    if (posix_memalign((void**)&state->workers, STATS_CACHE_LINE, sizeof(pool_trace_worker_t) * num_workers) != 0) {
+        fprintf(stderr, "Out of Memory\n");
+        free(state);
+        return OutOfMemory;
+    }
+
+    state->num_workers = num_workers;
+    state->num_events = num_events;
+    state->origin_nsecs = stats_now_nsecs();
+
+    for (int i = 0; i < num_workers; i++) {
+        pool_trace_worker_t* worker = &state->workers[i];
+        stats_histogram_init(&worker->wait);
+        stats_histogram_init(&worker->run);
+        atomic_init(&worker->recorded, 0);
+        worker->events = NULL;
+        if (num_events == 0)
+            continue;
+
+        worker->events = calloc(num_events, sizeof(pool_trace_event_t));
+        if (worker->events == NULL) {
+            fprintf(stderr, "Out of Memory\n");
+            state->num_workers = i;
+            pool_trace_destroy(state);
+            return OutOfMemory;
+        }
+    }
+
+    *trace = state;
+    return Success;
+}
+
+void pool_trace_destroy(pool_trace_t* trace) {
+
+    if (trace == NULL)
+        return;
+
+    for (int i = 0; i < trace->num_workers; i++)
+        free(trace->workers[i].events);
+    free(trace->workers);
+    free(trace);
+}
+
+/**
+ * @brief: Records a task the calling worker ran. Only that worker writes its histograms and ring.
+ *
+ * The ring slot is guarded by a sequence number, odd while it is written, so pool_trace_dump can read the rings of a running pool and skip the slots it raced with.
+ *
+ * @param: trace -- the pool's tracing state.
+ * @param: worker -- the index of the calling worker.
+ * @param: work_request -- a copy of the request taken before it ran, with its stamps.
+ * @param: start_nsecs -- when the task started.
+ * @param: end_nsecs -- when it returned.
+*/
+void pool_trace_record(pool_trace_t* trace, int worker, pool_work_t* work_request, uint64_t start_nsecs, uint64_t end_nsecs) {
+
+    pool_trace_worker_t* self = &trace->workers[worker];
+    uint64_t enqueue_nsecs = work_request->enqueue_nsecs;
+
+    stats_histogram_record(&self->wait, start_nsecs > enqueue_nsecs ? start_nsecs - enqueue_nsecs : 0);
+    stats_histogram_record(&self->run, end_nsecs - start_nsecs);
+
+    if (trace->num_events == 0)
+        return;
+
+    uint64_t recorded = atomic_load_explicit(&self->recorded, memory_order_relaxed);
+    pool_trace_event_t* event = &self->events[recorded % trace->num_events];
+
+    atomic_store_explicit(&event->sequence, 2 * recorded + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&event->enqueue_nsecs, enqueue_nsecs, memory_order_relaxed);
+    atomic_store_explicit(&event->dequeue_nsecs, work_request->dequeue_nsecs, memory_order_relaxed);
+    atomic_store_explicit(&event->start_nsecs, start_nsecs, memory_order_relaxed);
+    atomic_store_explicit(&event->end_nsecs, end_nsecs, memory_order_relaxed);
+    atomic_store_explicit(&event->id, work_request->id, memory_order_relaxed);
+    atomic_store_explicit(&event->priority, work_request->priority, memory_order_relaxed);
+    atomic_store_explicit(&event->sequence, 2 * recorded + 2, memory_order_release);
+
+    atomic_store_explicit(&self->recorded, recorded + 1, memory_order_release);
+}
+
+/**
+ * @brief: Sums the wait and run histograms of every worker.
+ *
+ * @param: pool -- thread pool object, created with attrs.trace.
+ * @param: wait -- receives the distribution of enqueue-to-start times in nanoseconds (may be NULL).
+ * @param: run -- receives the distribution of task run times in nanoseconds (may be NULL).
+ * @return: the rc_t value (Success, InvalidArgument, InvalidOperation when the pool does not trace)
+*/
+rc_t pool_trace_histograms(thread_pool_t* pool, stats_distribution_t* wait, stats_distribution_t* run) {
+
+    if (pool == NULL) {
+        fprintf(stderr, "The pool cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    pool_trace_t* trace = pool->trace;
+    if (trace == NULL) {
+        fprintf(stderr, "The pool was not created with tracing.\n");
+        return InvalidOperation;
+    }
+
+    stats_distribution_t* worker = malloc(sizeof(stats_distribution_t));
+    if (worker == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        return OutOfMemory;
+    }
+
+    if (wait != NULL)
+        stats_distribution_init(wait);
+    if (run != NULL)
+        stats_distribution_init(run);
+
+    for (int i = 0; i < trace->num_workers; i++) {
+        if (wait != NULL) {
+            stats_histogram_snapshot(&trace->workers[i].wait, worker);
+            stats_distribution_add(wait, worker);
+        }
+        if (run != NULL) {
+            stats_histogram_snapshot(&trace->workers[i].run, worker);
+            stats_distribution_add(run, worker);
+        }
+    }
+
+    free(worker);
+    return Success;
+}
+
+/**
+ * @brief: Reads ring slot number index of a worker, unless it was overwritten or is being written.
+*/
+static bool pool_trace_read(pool_trace_t* trace, pool_trace_worker_t* worker, uint64_t index, pool_trace_sample_t* sample) {
+
+    pool_trace_event_t* event = &worker->events[index % trace->num_events];
+
+    uint64_t sequence = atomic_load_explicit(&event->sequence, memory_order_acquire);
+    if (sequence != 2 * index + 2)
+        return false;
+
+    sample->enqueue_nsecs = atomic_load_explicit(&event->enqueue_nsecs, memory_order_relaxed);
+    sample->dequeue_nsecs = atomic_load_explicit(&event->dequeue_nsecs, memory_order_relaxed);
+    sample->start_nsecs = atomic_load_explicit(&event->start_nsecs, memory_order_relaxed);
+    sample->end_nsecs = atomic_load_explicit(&event->end_nsecs, memory_order_relaxed);
+    sample->id = atomic_load_explicit(&event->id, memory_order_relaxed);
+    sample->priority = atomic_load_explicit(&event->priority, memory_order_relaxed);
+
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&event->sequence, memory_order_relaxed) == sequence;
+}
+
+static double pool_trace_usecs(pool_trace_t* trace, uint64_t nsecs) {
+    return nsecs > trace->origin_nsecs ? (nsecs - trace->origin_nsecs) / 1000.0 : 0.0;
+}
+
+/**
+ * @brief: Writes the tasks kept in the workers' rings as Chrome trace JSON.
+ *
+ * Every task is a complete ("X") event on its worker's row, from start to end, with its map index, priority, and the microseconds it spent queued (enqueue to dequeue) and waiting in total (enqueue to start) as arguments. Times count from pool creation.
+ *
+ * @param: pool -- thread pool object, created with attrs.trace and trace_events.
+ * @param: out -- the stream to write to.
+ * @return: the rc_t value (Success, InvalidArgument, InvalidOperation when the pool keeps no events, Error on a write error)
+*/
+rc_t pool_trace_dump(thread_pool_t* pool, FILE* out) {
+
+    if (pool == NULL || out == NULL) {
+        fprintf(stderr, "The pool and stream cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    pool_trace_t* trace = pool->trace;
+    if (trace == NULL || trace->num_events == 0) {
+        fprintf(stderr, "The pool was not created with trace events.\n");
+        return InvalidOperation;
+    }
+
+    static const char* priorities[POOL_PRIORITY_LEVELS] = { "high", "normal", "low" };
+    bool first = true;
+
+    fprintf(out, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+
+    for (int i = 0; i < trace->num_workers; i++) {
+        fprintf(out, "%s  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"worker %d\"}}",
+                first ? "" : ",\n", i, i);
+        first = false;
+    }
+
+    for (int i = 0; i < trace->num_workers; i++) {
+        pool_trace_worker_t* worker = &trace->workers[i];
+        uint64_t recorded = atomic_load_explicit(&worker->recorded, memory_order_acquire);
+        uint64_t index = recorded > trace->num_events ? recorded - trace->num_events : 0;
+
+        for (; index < recorded; index++) {
+            pool_trace_sample_t event;
+            if (!pool_trace_read(trace, worker, index, &event))
+                continue;
+
+            uint64_t enqueue = event.enqueue_nsecs;
+            uint64_t start = event.start_nsecs;
+
+            fprintf(out, ",\n  {\"name\": \"task\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                    "\"ts\": %.3f, \"dur\": %.3f, \"args\": {\"id\": %d, \"queued_us\": %.3f, \"wait_us\": %.3f}}",
+                    (unsigned int) event.priority < POOL_PRIORITY_LEVELS ? priorities[event.priority] : "unknown", i,
+                    pool_trace_usecs(trace, start), (event.end_nsecs - start) / 1000.0, event.id,
+                    event.dequeue_nsecs > enqueue ? (event.dequeue_nsecs - enqueue) / 1000.0 : 0.0,
+                    start > enqueue ? (start - enqueue) / 1000.0 : 0.0);
+        }
+    }
+
+    fprintf(out, "\n]}\n");
+    return ferror(out) ? Error : Success;
+}
+
+#else
+
+rc_t pool_trace_histograms(thread_pool_t* pool, stats_distribution_t* wait, stats_distribution_t* run) {
+    (void)pool;
+    (void)wait;
+    (void)run;
+    fprintf(stderr, "Tracing was compiled out; build with -DPOOL_TRACE.\n");
+    return InvalidOperation;
+}
+
+rc_t pool_trace_dump(thread_pool_t* pool, FILE* out) {
+    (void)pool;
+    (void)out;
+    fprintf(stderr, "Tracing was compiled out; build with -DPOOL_TRACE.\n");
+    return InvalidOperation;
+}
+
+#endif
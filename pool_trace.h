@@ -0,0 +1,61 @@
+#ifndef pool_trace_h
+#define pool_trace_h
+
+#include "rc.h"
+#include "pool.h"
+#include "stats.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Per-task latency tracing. Built with -DPOOL_TRACE, the pool stamps every
+ * pool_work_t with the times it was handed to the pool and taken off a
+ * queue, and a pool created with attrs.trace also times the task itself. Each worker then
+ * records how long the task waited (enqueue to start) and ran (start to end)
+ * into its own histograms, and the last trace_events tasks it ran into its
+ * own ring, each on cache lines of its own.
+ *
+ * pool_trace_histograms sums the workers' histograms. pool_trace_dump writes
+ * the rings as Chrome trace JSON (chrome://tracing, Perfetto), one row per
+ * worker. A task is recorded just after it completed, so a dump taken right
+ * after the pool_map being looked at returned can miss its last tasks.
+ *
+ * Without POOL_TRACE nothing is recorded, pool_work_t keeps its size, and a
+ * pool asked for tracing fails to create. Built with it, a pool created
+ * without attrs.trace pays one branch per task. Objects built with and
+ * without POOL_TRACE do not link together (see POOL_ABI_TAG in pool.h).
+ */
+
+typedef struct pool_trace_event_st {
+    atomic_uint_fast64_t sequence;   // odd while the worker writes the event
+    atomic_uint_fast64_t enqueue_nsecs;
+    atomic_uint_fast64_t dequeue_nsecs;
+    atomic_uint_fast64_t start_nsecs;
+    atomic_uint_fast64_t end_nsecs;
+    atomic_int id;
+    atomic_int priority;
+} pool_trace_event_t;
+
+typedef struct pool_trace_worker_st {
+    _Alignas(STATS_CACHE_LINE) stats_histogram_t wait;   // enqueue to start
+    stats_histogram_t run;           // start to end
+    pool_trace_event_t* events;      // ring of trace_events
+    atomic_uint_fast64_t recorded;   // events written so far, by the worker only
+} pool_trace_worker_t;
+
+typedef struct pool_trace_st {
+    pool_trace_worker_t* workers;    // one per worker slot
+    int num_workers;
+    uint32_t num_events;             // ring size per worker, 0 for histograms only
+    uint64_t origin_nsecs;           // time 0 of the dump
+} pool_trace_t;
+
+rc_t pool_trace_create(pool_trace_t** trace, int num_workers, uint32_t num_events);
+void pool_trace_destroy(pool_trace_t* trace);
+void pool_trace_record(pool_trace_t* trace, int worker, pool_work_t* work_request, uint64_t start_nsecs, uint64_t end_nsecs);
+
+rc_t pool_trace_histograms(thread_pool_t* pool, stats_distribution_t* wait, stats_distribution_t* run);
+rc_t pool_trace_dump(thread_pool_t* pool, FILE* out);
+
+#endif
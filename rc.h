@@ -10,6 +10,7 @@ typedef enum rc_st {
     Error,
     QueueFull,
     QueueEmpty,
+    OwnerDied,     // a robust lock was taken over from a holder that died; the lock is held
 } rc_t;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,235 @@
+#include "slab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define SLAB_LARGE SLAB_NUM_CLASSES
+
+typedef struct slab_cache_st slab_cache_t;
+
+// Precedes every object. 16 bytes so the payload keeps malloc's alignment.
+typedef struct slab_header_st {
+    slab_cache_t* cache;
+    uint32_t size_class;
+    uint32_t size;
+} slab_header_t;
+
+// Overlays the payload while the object is free.
+typedef struct slab_free_st {
+    struct slab_free_st* next;
+} slab_free_t;
+
+typedef struct slab_chunk_st {
+    struct slab_chunk_st* next;
+} slab_chunk_t;
+
+struct slab_cache_st {
+    slab_header_t* free_list[SLAB_NUM_CLASSES];            // owner only
+    _Atomic(slab_header_t*) remote_free[SLAB_NUM_CLASSES];  // pushed by other threads
+    slab_chunk_t* chunks;
+    atomic_llong bytes_in_use;     // may go negative per cache; the sum is exact
+    atomic_llong objects_in_use;
+    atomic_llong bytes_reserved;
+    slab_cache_t* next;            // all caches, for stats
+    slab_cache_t* next_orphan;
+    bool orphaned;
+};
+
+static pthread_mutex_t slab_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t slab_once = PTHREAD_ONCE_INIT;
+static pthread_key_t slab_key;
+static slab_cache_t* slab_caches;
+static slab_cache_t* slab_orphans;
+static _Thread_local slab_cache_t* slab_local;
+
+static void slab_thread_exit(void* arg) {
+    slab_cache_t* cache = (slab_cache_t*) arg;
+
+    slab_local = NULL;
+
+    pthread_mutex_lock(&slab_mutex);
+    cache->orphaned = true;
+    cache->next_orphan = slab_orphans;
+    slab_orphans = cache;
+    pthread_mutex_unlock(&slab_mutex);
+}
+
+static void slab_key_create(void) {
+    pthread_key_create(&slab_key, slab_thread_exit);
+}
+
+static slab_cache_t* slab_cache(void) {
+    if (slab_local != NULL)
+        return slab_local;
+
+    pthread_once(&slab_once, slab_key_create);
+
+    pthread_mutex_lock(&slab_mutex);
+    slab_cache_t* cache = slab_orphans;
+    if (cache != NULL) {
+        slab_orphans = cache->next_orphan;
+        cache->orphaned = false;
+    } else {
+        cache = calloc(1, sizeof(slab_cache_t));
+        if (cache != NULL) {
+            cache->next = slab_caches;
+            slab_caches = cache;
+        }
+    }
+    pthread_mutex_unlock(&slab_mutex);
+
+    if (cache == NULL)
+        return NULL;
+
+    pthread_setspecific(slab_key, cache);
+    slab_local = cache;
+    return cache;
+}
+
+static inline size_t slab_class_size(uint32_t size_class) {
+    return (size_t)SLAB_MIN_CLASS << size_class;
+}
+
+static inline uint32_t slab_size_class(size_t size) {
+    uint32_t size_class = 0;
+    while (size_class < SLAB_NUM_CLASSES && slab_class_size(size_class) < size)
+        size_class++;
+    return size_class;
+}
+
+static inline void slab_free_push(slab_header_t** list, slab_header_t* header) {
+    ((slab_free_t*)(header + 1))->next = (slab_free_t*)*list;
+    *list = header;
+}
+
+// Carves a fresh chunk into objects of one class.
+static bool slab_refill(slab_cache_t* cache, uint32_t size_class) {
+    slab_chunk_t* chunk = malloc(SLAB_CHUNK_BYTES);
+    if (chunk == NULL)
+        return false;
+
+    chunk->next = cache->chunks;
+    cache->chunks = chunk;
+    atomic_fetch_add_explicit(&cache->bytes_reserved, SLAB_CHUNK_BYTES, memory_order_relaxed);
+
+    size_t stride = sizeof(slab_header_t) + slab_class_size(size_class);
+    char* cursor = (char*)chunk + sizeof(slab_header_t);   // keep the first header 16-byte aligned
+    char* end = (char*)chunk + SLAB_CHUNK_BYTES;
+
+    for (; cursor + stride <= end; cursor += stride) {
+        slab_header_t* header = (slab_header_t*) cursor;
+        header->cache = cache;
+        header->size_class = size_class;
+        slab_free_push(&cache->free_list[size_class], header);
+    }
+
+    return true;
+}
+
+/**
+ * @brief: Allocates size bytes from the calling thread's cache.
+ * @return: the memory, or NULL when out of memory. Release it with slab_free.
+ */
+void* slab_alloc(size_t size) {
+    slab_cache_t* cache = slab_cache();
+    if (cache == NULL)
+        return NULL;
+
+    uint32_t size_class = slab_size_class(size);
+    slab_header_t* header;
+
+    if (size_class == SLAB_LARGE) {
+        header = malloc(sizeof(slab_header_t) + size);
+        if (header == NULL)
+            return NULL;
+        header->cache = cache;
+        atomic_fetch_add_explicit(&cache->bytes_reserved, sizeof(slab_header_t) + size, memory_order_relaxed);
+    } else {
+        header = cache->free_list[size_class];
+        if (header == NULL) {
+            // Take back everything other threads freed for us before carving new memory.
+            header = atomic_exchange_explicit(&cache->remote_free[size_class], NULL, memory_order_acquire);
+            if (header == NULL) {
+                if (!slab_refill(cache, size_class))
+                    return NULL;
+                header = cache->free_list[size_class];
+            }
+        }
+        cache->free_list[size_class] = (slab_header_t*)((slab_free_t*)(header + 1))->next;
+    }
+
+    header->size_class = size_class;
+    header->size = size;
+
+    atomic_fetch_add_explicit(&cache->bytes_in_use, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&cache->objects_in_use, 1, memory_order_relaxed);
+
+    return header + 1;
+}
+
+/**
+ * @brief: Returns memory from slab_alloc. Safe to call from any thread.
+ */
+void slab_free(void* ptr) {
+    if (ptr == NULL)
+        return;
+
+    slab_header_t* header = (slab_header_t*)ptr - 1;
+    slab_cache_t* owner = header->cache;
+
+    // Account to the freeing thread's cache so no counter is shared between threads.
+    slab_cache_t* cache = slab_cache();
+    bool local = cache == owner;
+    if (cache == NULL)
+        cache = owner;
+    atomic_fetch_sub_explicit(&cache->bytes_in_use, header->size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&cache->objects_in_use, 1, memory_order_relaxed);
+
+    if (header->size_class == SLAB_LARGE) {
+        atomic_fetch_sub_explicit(&cache->bytes_reserved, sizeof(slab_header_t) + header->size, memory_order_relaxed);
+        free(header);
+        return;
+    }
+
+    // Only the owner touches its local list; a thread without a cache of its own counts as foreign.
+    if (local) {
+        slab_free_push(&owner->free_list[header->size_class], header);
+        return;
+    }
+
+    _Atomic(slab_header_t*)* remote = &owner->remote_free[header->size_class];
+    slab_header_t* head = atomic_load_explicit(remote, memory_order_relaxed);
+    do {
+        ((slab_free_t*)(header + 1))->next = (slab_free_t*)head;
+    } while (!atomic_compare_exchange_weak_explicit(remote, &head, header,
+                                                    memory_order_release, memory_order_relaxed));
+}
+
+/**
+ * @brief: Sums the counters of every thread cache.
+ *
+ * @param: stats -- receives the bytes and objects currently in use and the memory reserved from malloc.
+ * @return: the rc_t value (Success, InvalidArgument)
+ */
+rc_t slab_stats(slab_stats_t* stats) {
+    if (stats == NULL) {
+        fprintf(stderr, "The stats cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    stats->bytes_in_use = 0;
+    stats->objects_in_use = 0;
+    stats->bytes_reserved = 0;
+
+    pthread_mutex_lock(&slab_mutex);
+    for (slab_cache_t* cache = slab_caches; cache != NULL; cache = cache->next) {
+        stats->bytes_in_use += atomic_load_explicit(&cache->bytes_in_use, memory_order_relaxed);
+        stats->objects_in_use += atomic_load_explicit(&cache->objects_in_use, memory_order_relaxed);
+        stats->bytes_reserved += atomic_load_explicit(&cache->bytes_reserved, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&slab_mutex);
+
+    return Success;
+}
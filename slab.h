@@ -0,0 +1,35 @@
+#ifndef slab_h
+#define slab_h
+
+#include "rc.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Size-class allocator with a cache per thread. Each thread allocates from
+ * and frees into its own cache without locking; an object freed by another
+ * thread goes onto its owning cache's remote free list, which the owner
+ * drains when its local list runs dry. Requests above the largest class
+ * fall through to malloc. Caches of exited threads are handed to the next
+ * new thread instead of being freed.
+ *
+ * The allocator never shrinks: chunks stay with their cache for reuse until
+ * the process exits, so bytes_reserved is the high-water mark of the small
+ * classes plus the live large objects.
+ */
+
+#define SLAB_MIN_CLASS 16
+#define SLAB_NUM_CLASSES 9     // 16, 32, ... 4096 bytes
+#define SLAB_CHUNK_BYTES (64 * 1024)
+
+typedef struct slab_stats_st {
+    int64_t bytes_in_use;      // requested bytes of live objects
+    int64_t objects_in_use;
+    int64_t bytes_reserved;    // chunk and large-object memory obtained from malloc
+} slab_stats_t;
+
+void* slab_alloc(size_t size);
+void slab_free(void* ptr);
+rc_t slab_stats(slab_stats_t* stats);
+
+#endif
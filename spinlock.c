@@ -1,17 +1,58 @@
 #include "spinlock.h"
+#include "fiber.h"
+#include "futex.h"
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdatomic.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 
 #define SPINLOCK_DEFAULT_SLEEP_USECS 10
+#define SPINLOCK_DEFAULT_SPIN_LIMIT 1024
+#define SPINLOCK_MAX_BACKOFF 64
+
+// Lock word values for the adaptive kind.
+#define SPINLOCK_UNLOCKED 0
+#define SPINLOCK_LOCKED 1
+#define SPINLOCK_CONTENDED 2
+
+// Robust kind: the lock word is the owner's thread id, plus this bit while somebody may be parked.
+#define SPINLOCK_ROBUST_WAITERS 0x40000000
+#define SPINLOCK_ROBUST_CHECK_NSECS 10000000   // how often a parked waiter looks at the owner
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SPINLOCK_CPU_RELAX() __builtin_ia32_pause()
+#elif defined(__aarch64__)
+#define SPINLOCK_CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define SPINLOCK_CPU_RELAX() atomic_signal_fence(memory_order_seq_cst)
+#endif
+
+// FUTEX_WAIT on the lock word with a relative timeout (NULL: none). On a fiber only the fiber parks, so a fiber of the same thread holding the lock can run and release it.
+static void spinlock_futex_wait(volatile atomic_int* lock, int word, const struct timespec* timeout) {
+    if (fiber_current() != NULL) {
+        struct timespec deadline;
+        fiber_wait((void*) lock, (uint32_t) word, futex_deadline(timeout, &deadline));
+        return;
+    }
+
+    syscall(SYS_futex, lock, FUTEX_WAIT, word, timeout, NULL, NULL);
+}
 
 rc_t spinlock_attr_init(spinlock_attrs_t* attrs) {
     if (attrs == NULL)
         return InvalidArgument;
 
     attrs->sleep_usecs = SPINLOCK_DEFAULT_SLEEP_USECS;
+    attrs->kind = SpinlockKindAdaptive;
+    attrs->spin_limit = SPINLOCK_DEFAULT_SPIN_LIMIT;
 
     return Success;
 }
@@ -41,7 +82,14 @@ rc_t spinlock_init(spinlock_t* handle, spinlock_obj_t* obj, spinlock_attrs_t* at
         
     handle->obj = obj;
     handle->obj->sleep_usecs = attrs->sleep_usecs;
+    handle->obj->kind = attrs->kind;
+    handle->obj->spin_limit = attrs->spin_limit;
     atomic_init(&handle->obj->lock, 0);
+    atomic_init(&handle->obj->waiters, 0);
+#ifdef POOL_STATS
+    handle->obj->acquired_nsecs = 0;
+    memset(handle->obj->stats, 0, sizeof(handle->obj->stats));
+#endif
 
     return Success;
 }
@@ -67,6 +115,8 @@ rc_t spinlock_create(spinlock_t* handle, spinlock_attrs_t* attrs) {
         free(obj);
         return rc;
     }
+
+    return Success;
 }
 
 rc_t spinlock_destroy(spinlock_t* handle) {
@@ -78,21 +128,245 @@ rc_t spinlock_destroy(spinlock_t* handle) {
     return Success;
 }
 
+/*
+ * Adaptive kind. The lock word is UNLOCKED, LOCKED, or CONTENDED (locked and
+ * somebody may be parked). Acquire spins with a CPU pause and exponential
+ * backoff for up to spin_limit pauses, then marks the word CONTENDED and parks
+ * on it. Release only issues FUTEX_WAKE when the word was CONTENDED and a
+ * waiter is registered, so the uncontended path never enters the kernel.
+ */
+
+static void spinlock_acquire_adaptive(spinlock_obj_t* obj) {
+    int expected = SPINLOCK_UNLOCKED;
+    if (atomic_compare_exchange_strong(&obj->lock, &expected, SPINLOCK_LOCKED))
+        return;
+
+    STATS_ADD(STATS_STRIPE(obj->stats).contended, 1);
+
+    int backoff = 1;
+    int spun = 0;
+    for (; spun < obj->spin_limit; spun += backoff) {
+        for (int i = 0; i < backoff; i++)
+            SPINLOCK_CPU_RELAX();
+
+        expected = SPINLOCK_UNLOCKED;
+        if (atomic_load_explicit(&obj->lock, memory_order_relaxed) == SPINLOCK_UNLOCKED &&
+            atomic_compare_exchange_weak(&obj->lock, &expected, SPINLOCK_LOCKED)) {
+            STATS_ADD(STATS_STRIPE(obj->stats).spin_iterations, spun + backoff);
+            return;
+        }
+
+        if (backoff < SPINLOCK_MAX_BACKOFF)
+            backoff <<= 1;
+    }
+    STATS_ADD(STATS_STRIPE(obj->stats).spin_iterations, spun);
+
+    atomic_fetch_add(&obj->waiters, 1);
+    while (atomic_exchange(&obj->lock, SPINLOCK_CONTENDED) != SPINLOCK_UNLOCKED) {
+        STATS_ADD(STATS_STRIPE(obj->stats).futex_waits, 1);
+        spinlock_futex_wait(&obj->lock, SPINLOCK_CONTENDED, NULL);
+    }
+    atomic_fetch_sub(&obj->waiters, 1);
+}
+
+static rc_t spinlock_release_adaptive(spinlock_obj_t* obj) {
+    int previous = atomic_exchange(&obj->lock, SPINLOCK_UNLOCKED);
+
+    if (previous == SPINLOCK_UNLOCKED) {
+        fprintf(stderr, "Trying to release from thread that does not have lock acquired.\n");
+        return InvalidOperation;
+    }
+
+    if (previous == SPINLOCK_CONTENDED && atomic_load(&obj->waiters) > 0) {
+        STATS_ADD(STATS_STRIPE(obj->stats).futex_wakes, 1);
+        syscall(SYS_futex, &obj->lock, FUTEX_WAKE, 1, NULL, NULL, NULL);
+    }
+
+    return Success;
+}
+
+/*
+ * Robust kind, for locks in memory shared between processes. The lock word
+ * holds the owner's thread id, so a waiter can tell whether the owner still
+ * exists. Waiters spin like the adaptive kind, then set the waiters bit and
+ * park with a short timeout; every time they wake up with the lock still taken
+ * they check the owner, and the first to find it gone swaps its own id in and
+ * gets OwnerDied instead of Success. The caller then holds the lock and has to
+ * repair whatever the dead owner left half done.
+ *
+ * The processes must share a pid namespace. An owner that exited but was not
+ * yet reaped by its parent is dead too (/proc shows it as a zombie).
+ */
+
+static _Thread_local int spinlock_tid;
+static pthread_once_t spinlock_atfork_once = PTHREAD_ONCE_INIT;
+
+// A forked child keeps the parent's thread-local copy; make it look its own id up again.
+static void spinlock_atfork_child(void) {
+    spinlock_tid = 0;
+}
+
+static void spinlock_atfork_register(void) {
+    pthread_atfork(NULL, NULL, spinlock_atfork_child);
+}
+
+static inline int spinlock_gettid(void) {
+    if (spinlock_tid == 0) {
+        pthread_once(&spinlock_atfork_once, spinlock_atfork_register);
+        spinlock_tid = (int) syscall(SYS_gettid);
+    }
+    return spinlock_tid;
+}
+
+static bool spinlock_owner_alive(int tid) {
+    if (kill(tid, 0) != 0 && errno == ESRCH)
+        return false;
+
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", tid);
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return errno != ENOENT;
+
+    char line[512];
+    char* end = fgets(line, sizeof(line), file) != NULL ? strrchr(line, ')') : NULL;
+    fclose(file);
+
+    // The state follows the command name, which may itself contain parentheses.
+    return end == NULL || (end[1] != '\0' && end[2] != 'Z' && end[2] != 'X');
+}
+
+static rc_t spinlock_acquire_robust(spinlock_obj_t* obj) {
+    int tid = spinlock_gettid();
+    int expected = 0;
+    if (atomic_compare_exchange_strong(&obj->lock, &expected, tid))
+        return Success;
+
+    STATS_ADD(STATS_STRIPE(obj->stats).contended, 1);
+
+    int backoff = 1;
+    int spun = 0;
+    for (; spun < obj->spin_limit; spun += backoff) {
+        for (int i = 0; i < backoff; i++)
+            SPINLOCK_CPU_RELAX();
+
+        expected = 0;
+        if (atomic_load_explicit(&obj->lock, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_weak(&obj->lock, &expected, tid)) {
+            STATS_ADD(STATS_STRIPE(obj->stats).spin_iterations, spun + backoff);
+            return Success;
+        }
+
+        if (backoff < SPINLOCK_MAX_BACKOFF)
+            backoff <<= 1;
+    }
+    STATS_ADD(STATS_STRIPE(obj->stats).spin_iterations, spun);
+
+    struct timespec check = { 0, SPINLOCK_ROBUST_CHECK_NSECS };
+    bool waited = false;
+
+    while (true) {
+        int word = atomic_load(&obj->lock);
+
+        if (word == 0) {
+            // Keep the waiters bit: others may still be parked behind us.
+            if (atomic_compare_exchange_strong(&obj->lock, &word, tid | SPINLOCK_ROBUST_WAITERS))
+                return Success;
+            continue;
+        }
+
+        if (waited && !spinlock_owner_alive(word & ~SPINLOCK_ROBUST_WAITERS)) {
+            if (atomic_compare_exchange_strong(&obj->lock, &word, tid | SPINLOCK_ROBUST_WAITERS))
+                return OwnerDied;
+            continue;
+        }
+
+        if ((word & SPINLOCK_ROBUST_WAITERS) == 0) {
+            if (!atomic_compare_exchange_strong(&obj->lock, &word, word | SPINLOCK_ROBUST_WAITERS))
+                continue;
+            word |= SPINLOCK_ROBUST_WAITERS;
+        }
+
+        STATS_ADD(STATS_STRIPE(obj->stats).futex_waits, 1);
+        spinlock_futex_wait(&obj->lock, word, &check);
+        waited = true;
+    }
+}
+
+static rc_t spinlock_release_robust(spinlock_obj_t* obj) {
+    int word = atomic_load(&obj->lock);
+
+    if ((word & ~SPINLOCK_ROBUST_WAITERS) != spinlock_gettid()) {
+        fprintf(stderr, "Trying to release from thread that does not have lock acquired.\n");
+        return InvalidOperation;
+    }
+
+    if (atomic_exchange(&obj->lock, 0) & SPINLOCK_ROBUST_WAITERS) {
+        STATS_ADD(STATS_STRIPE(obj->stats).futex_wakes, 1);
+        syscall(SYS_futex, &obj->lock, FUTEX_WAKE, 1, NULL, NULL, NULL);
+    }
+
+    return Success;
+}
+
+/**
+ * @brief: Takes the lock.
+ *
+ * @param: handle -- the lock.
+ * @return: the rc_t value (Success, InvalidArgument, OwnerDied). With OwnerDied the lock is held,
+ *          but the robust kind took it over from a holder that died while holding it.
+ */
 rc_t spinlock_acquire(spinlock_t* handle) {
+    rc_t rc = Success;
+
     if (handle == NULL)
         return InvalidArgument;
 
-    atomic_int expected = 0;
+    if (handle->obj->kind == SpinlockKindAdaptive) {
+        spinlock_acquire_adaptive(handle->obj);
+    } else if (handle->obj->kind == SpinlockKindRobust) {
+        rc = spinlock_acquire_robust(handle->obj);
+    } else {
+        atomic_int expected = 0;
+        int slept = 0;
 
-    while (!atomic_compare_exchange_strong(&handle->obj->lock, &expected, 1)) {
-        expected = 0;
-        usleep(handle->obj->sleep_usecs);
+        while (!atomic_compare_exchange_strong(&handle->obj->lock, &expected, 1)) {
+            expected = 0;
+            if (fiber_yield() != Success)
+                usleep(handle->obj->sleep_usecs);
+            slept++;
+        }
+
+        if (slept > 0) {
+            STATS_ADD(STATS_STRIPE(handle->obj->stats).contended, 1);
+            STATS_ADD(STATS_STRIPE(handle->obj->stats).spin_iterations, slept);
+        }
     }
-    
-    return Success;
+
+    STATS_ADD(STATS_STRIPE(handle->obj->stats).acquisitions, 1);
+#if defined(POOL_STATS) && defined(POOL_LOCK_TIMING)
+    handle->obj->acquired_nsecs = stats_now_nsecs();
+#endif
+
+    return rc;
 }
 
 rc_t spinlock_release(spinlock_t* handle) {
+    if (handle == NULL)
+        return InvalidArgument;
+
+#if defined(POOL_STATS) && defined(POOL_LOCK_TIMING)
+    // Read before the lock word changes hands; the next holder overwrites it.
+    uint64_t held = stats_now_nsecs() - handle->obj->acquired_nsecs;
+    STATS_ADD(STATS_STRIPE(handle->obj->stats).hold_nsecs, held);
+#endif
+
+    if (handle->obj->kind == SpinlockKindAdaptive)
+        return spinlock_release_adaptive(handle->obj);
+
+    if (handle->obj->kind == SpinlockKindRobust)
+        return spinlock_release_robust(handle->obj);
+
     atomic_int expected = 1;
 
     if (atomic_compare_exchange_strong(&handle->obj->lock, &expected, 0))
@@ -102,3 +376,48 @@ rc_t spinlock_release(spinlock_t* handle) {
     return InvalidOperation;
 }
 
+/**
+ * @brief: Tells which thread holds a robust lock.
+ *
+ * @param: handle -- the lock.
+ * @return: the holder's thread id, or 0 when the lock is free or not of the robust kind.
+ */
+int spinlock_owner(spinlock_t* handle) {
+    if (handle == NULL || handle->obj->kind != SpinlockKindRobust)
+        return 0;
+
+    return atomic_load(&handle->obj->lock) & ~SPINLOCK_ROBUST_WAITERS;
+}
+
+/**
+ * @brief: Sums the lock's counters.
+ *
+ * @param: handle -- the lock.
+ * @param: stats -- receives the totals since the lock was initialized.
+ * @return: the rc_t value (Success, InvalidArgument, InvalidOperation when built with POOL_NO_STATS)
+ */
+rc_t spinlock_stats(spinlock_t* handle, spinlock_stats_t* stats) {
+    if (handle == NULL || stats == NULL) {
+        fprintf(stderr, "The handle and stats cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    memset(stats, 0, sizeof(spinlock_stats_t));
+
+#ifdef POOL_STATS
+    for (int i = 0; i < STATS_STRIPES; i++) {
+        spinlock_counters_t* stripe = &handle->obj->stats[i];
+        stats->acquisitions += stats_load(&stripe->acquisitions);
+        stats->contended += stats_load(&stripe->contended);
+        stats->spin_iterations += stats_load(&stripe->spin_iterations);
+        stats->futex_waits += stats_load(&stripe->futex_waits);
+        stats->futex_wakes += stats_load(&stripe->futex_wakes);
+        stats->hold_nsecs += stats_load(&stripe->hold_nsecs);
+    }
+
+    return Success;
+#else
+    fprintf(stderr, "The counters were compiled out (POOL_NO_STATS)\n");
+    return InvalidOperation;
+#endif
+}
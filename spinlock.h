@@ -2,15 +2,53 @@
 #define spinlock_h
 
 #include "rc.h"
+#include "stats.h"
+#include <stdint.h>
 #include <stdatomic.h>
 
+typedef enum spinlock_kind_st {
+    SpinlockKindSleep,     // retry the CAS, usleep(sleep_usecs) after every failure
+    SpinlockKindAdaptive,  // bounded spin with exponential backoff, then park on a futex
+    SpinlockKindRobust,    // owner's thread id in the lock word, taken over when the owner dies (shared memory)
+} spinlock_kind_t;
+
 typedef struct spinlock_attrs_st {
     int sleep_usecs;
+    spinlock_kind_t kind;
+    int spin_limit;
 } spinlock_attrs_t;
 
+typedef struct spinlock_stats_st {
+    uint64_t acquisitions;
+    uint64_t contended;        // acquisitions that found the lock taken
+    uint64_t spin_iterations;  // CPU pauses (adaptive) or sleeps (sleep kind) spent waiting
+    uint64_t futex_waits;
+    uint64_t futex_wakes;
+    uint64_t hold_nsecs;       // total time the lock was held, 0 unless built with POOL_LOCK_TIMING
+} spinlock_stats_t;
+
+#ifdef POOL_STATS
+typedef struct spinlock_counters_st {
+    atomic_uint_fast64_t acquisitions;
+    atomic_uint_fast64_t contended;
+    atomic_uint_fast64_t spin_iterations;
+    atomic_uint_fast64_t futex_waits;
+    atomic_uint_fast64_t futex_wakes;
+    atomic_uint_fast64_t hold_nsecs;
+    char pad[STATS_CACHE_LINE - 6 * sizeof(atomic_uint_fast64_t)];
+} spinlock_counters_t;
+#endif
+
 typedef struct spinlock_obj_st {
     volatile atomic_int lock;
     int sleep_usecs;
+    int kind;
+    int spin_limit;
+    atomic_int waiters;
+#ifdef POOL_STATS
+    uint64_t acquired_nsecs;   // written by the holder only, POOL_LOCK_TIMING builds
+    spinlock_counters_t stats[STATS_STRIPES];
+#endif
 } spinlock_obj_t;
 
 typedef struct spinlock_st {
@@ -22,6 +60,8 @@ rc_t spinlock_init(spinlock_t* handle, spinlock_obj_t* obj, spinlock_attrs_t* at
 rc_t spinlock_create(spinlock_t* handle, spinlock_attrs_t* attrs);
 rc_t spinlock_acquire(spinlock_t* handle);
 rc_t spinlock_release(spinlock_t* handle);
+int spinlock_owner(spinlock_t* handle);
 rc_t spinlock_destroy(spinlock_t* handle);
+rc_t spinlock_stats(spinlock_t* handle, spinlock_stats_t* stats);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,292 @@
+#include "spsc.h"
+#include "fiber.h"
+#include "futex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define SPSC_DEFAULT_BLOCK_SIZE 128
+#define SPSC_DEFAULT_NUM_BLOCKS 32
+
+typedef struct spsc_slot_st {
+    uint32_t size;
+    uint32_t reserved;
+    char data[];
+} spsc_slot_t;
+
+static inline spsc_slot_t* spsc_slot(spsc_obj_t* obj, uint32_t index) {
+    return (spsc_slot_t*)((char*)obj->data + (size_t)(index & (obj->num_blocks - 1)) * obj->stride);
+}
+
+/*
+ * Parking. The waiting side raises its flag on the other side's line and then
+ * rechecks the other side's index; the other side publishes its index and then
+ * reads the flag. Both pairs are seq_cst, so at least one of them sees the
+ * other and a wakeup cannot be lost. The futex word is the index the waiter is
+ * watching, so a publish that lands between the recheck and the wait makes
+ * FUTEX_WAIT return at once. A side running on a fiber parks the fiber on the
+ * same word instead (see fiber_wait).
+ */
+
+// Sleeps while *index == seen, until woken or the absolute CLOCK_MONOTONIC deadline (NULL: none) passes. A fiber parks instead.
+static rc_t spsc_futex_wait(atomic_uint* index, uint32_t seen, timespec_t* deadline) {
+    if (futex_passed(deadline))
+        return Timeout;
+
+    rc_t rc = fiber_wait(index, seen, deadline);
+    if (rc != InvalidOperation)
+        return rc;
+
+    long frc = syscall(SYS_futex, index, FUTEX_WAIT_BITSET, seen, deadline, NULL, FUTEX_BITSET_MATCH_ANY);
+    if (frc == -1 && errno == ETIMEDOUT)
+        return Timeout;
+    return Success;
+}
+
+static rc_t spsc_park(atomic_uint* index, uint32_t seen, atomic_uint* parked, timespec_t* deadline) {
+    rc_t rc = Success;
+
+    atomic_store(parked, 1);
+    if (atomic_load(index) == seen)
+        rc = spsc_futex_wait(index, seen, deadline);
+    atomic_store_explicit(parked, 0, memory_order_relaxed);
+
+    return rc;
+}
+
+static inline void spsc_publish(atomic_uint* index, uint32_t value, atomic_uint* parked) {
+    atomic_store(index, value);
+    if (atomic_load(parked) != 0)
+        syscall(SYS_futex, index, FUTEX_WAKE, 1, NULL, NULL, NULL);
+}
+
+rc_t spsc_attr_init(spsc_attr_t* attrs) {
+    if (attrs == NULL) {
+        fprintf(stderr, "On spsc_attr_init the attrs cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    attrs->block_size = SPSC_DEFAULT_BLOCK_SIZE;
+    attrs->num_blocks = SPSC_DEFAULT_NUM_BLOCKS;
+
+    return Success;
+}
+
+static inline uint32_t spsc_stride(uint32_t block_size) {
+    return (sizeof(spsc_slot_t) + block_size + 7) & ~7u;
+}
+
+rc_t spsc_alloc_size(spsc_attr_t* attrs, size_t* required_bytes) {
+    if (attrs == NULL || required_bytes == NULL) {
+        fprintf(stderr, "On spsc_alloc_size the attrs and required_bytes cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    *required_bytes = sizeof(spsc_obj_t) + (size_t)spsc_stride(attrs->block_size) * attrs->num_blocks;
+
+    return Success;
+}
+
+rc_t spsc_init(spsc_t* channel, spsc_obj_t* obj, spsc_attr_t* attrs) {
+    spsc_attr_t default_attrs;
+    rc_t rc;
+
+    if (channel == NULL || obj == NULL) {
+        fprintf(stderr, "The channel and obj cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (attrs == NULL) {
+        attrs = &default_attrs;
+        rc = spsc_attr_init(attrs);
+        if (rc != Success)
+            return rc;
+    }
+
+    if (attrs->block_size == 0 || attrs->num_blocks == 0 || (attrs->num_blocks & (attrs->num_blocks - 1)) != 0) {
+        fprintf(stderr, "The channel needs a block size and a power-of-two num_blocks.\n");
+        return InvalidArgument;
+    }
+
+    obj->block_size = attrs->block_size;
+    obj->num_blocks = attrs->num_blocks;
+    obj->stride = spsc_stride(attrs->block_size);
+    atomic_init(&obj->head, 0);
+    obj->cached_tail = 0;
+    atomic_init(&obj->consumer_parked, 0);
+    atomic_init(&obj->tail, 0);
+    obj->cached_head = 0;
+    atomic_init(&obj->producer_parked, 0);
+
+    channel->obj = obj;
+
+    return Success;
+}
+
+rc_t spsc_create(spsc_t* channel, spsc_attr_t* attrs) {
+    spsc_attr_t default_attrs;
+    size_t size;
+    rc_t rc;
+
+    if (channel == NULL) {
+        fprintf(stderr, "The channel cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (attrs == NULL) {
+        attrs = &default_attrs;
+        rc = spsc_attr_init(attrs);
+        if (rc != Success)
+            return rc;
+    }
+
+    rc = spsc_alloc_size(attrs, &size);
+    if (rc != Success)
+        return rc;
+
+    // Keep the producer and consumer lines on line boundaries.
+    spsc_obj_t* obj;
+    if (posix_memalign((void**)&obj, SPSC_CACHE_LINE, size) != 0) {
+        fprintf(stderr, "Out of Memory\n");
+        return OutOfMemory;
+    }
+
+    rc = spsc_init(channel, obj, attrs);
+    if (rc != Success) {
+        free(obj);
+        return rc;
+    }
+
+    return Success;
+}
+
+rc_t spsc_destroy(spsc_t* channel) {
+    if (channel == NULL || channel->obj == NULL) {
+        fprintf(stderr, "On destroy the channel cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    free(channel->obj);
+    channel->obj = NULL;
+
+    return Success;
+}
+
+/**
+ * @brief: Copies one item into the channel, waiting while it is full.
+ * 
+ * Only the producer thread may call this.
+ * 
+ * @param: channel -- the channel.
+ * @param: item -- the item.
+ * @param: size -- the item size (at most block_size).
+ * @param: timeout -- optional timeout for the whole call, NULL to wait forever.
+ * @return: the rc_t value (Success, Timeout, InvalidArgument)
+*/
+rc_t spsc_send(spsc_t* channel, void* item, uint32_t size, timespec_t* timeout) {
+    if (channel == NULL || item == NULL) {
+        fprintf(stderr, "The channel and item cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    spsc_obj_t* obj = channel->obj;
+
+    if (size == 0 || size > obj->block_size) {
+        fprintf(stderr, "The item cannot fit in the channel\n");
+        return InvalidArgument;
+    }
+
+    uint32_t head = atomic_load_explicit(&obj->head, memory_order_relaxed);
+    timespec_t until;
+    timespec_t* deadline = NULL;
+
+    // Only look at the consumer's line when the cached view says we are full.
+    while (head - obj->cached_tail == obj->num_blocks) {
+        obj->cached_tail = atomic_load_explicit(&obj->tail, memory_order_acquire);
+        if (head - obj->cached_tail < obj->num_blocks)
+            break;
+
+        // The clock starts at the first wait, so the fast path never reads it.
+        if (deadline == NULL)
+            deadline = futex_deadline(timeout, &until);
+        rc_t rc = spsc_park(&obj->tail, obj->cached_tail, &obj->producer_parked, deadline);
+        if (rc != Success)
+            return rc;
+    }
+
+    spsc_slot_t* slot = spsc_slot(obj, head);
+    slot->size = size;
+    memcpy(slot->data, item, size);
+
+    spsc_publish(&obj->head, head + 1, &obj->consumer_parked);
+
+    return Success;
+}
+
+/**
+ * @brief: Copies the oldest item out of the channel, waiting while it is empty.
+ * 
+ * Only the consumer thread may call this.
+ * 
+ * @param: channel -- the channel.
+ * @param: item -- a buffer of max_size bytes.
+ * @param: max_size -- the largest item the caller accepts.
+ * @param: size -- receives the item size.
+ * @param: timeout -- optional timeout for the whole call, NULL to wait forever.
+ * @return: the rc_t value (Success, Timeout, InvalidArgument)
+*/
+rc_t spsc_receive(spsc_t* channel, void* item, uint32_t max_size, uint32_t* size, timespec_t* timeout) {
+    if (channel == NULL || item == NULL || size == NULL) {
+        fprintf(stderr, "The channel, item and size cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    spsc_obj_t* obj = channel->obj;
+    uint32_t tail = atomic_load_explicit(&obj->tail, memory_order_relaxed);
+    timespec_t until;
+    timespec_t* deadline = NULL;
+
+    // Only look at the producer's line when the cached view says we are empty.
+    while (tail == obj->cached_head) {
+        obj->cached_head = atomic_load_explicit(&obj->head, memory_order_acquire);
+        if (tail != obj->cached_head)
+            break;
+
+        // The clock starts at the first wait, so the fast path never reads it.
+        if (deadline == NULL)
+            deadline = futex_deadline(timeout, &until);
+        rc_t rc = spsc_park(&obj->head, tail, &obj->consumer_parked, deadline);
+        if (rc != Success)
+            return rc;
+    }
+
+    spsc_slot_t* slot = spsc_slot(obj, tail);
+    if (slot->size > max_size) {
+        fprintf(stderr, "The item is larger than max_size\n");
+        return InvalidArgument;
+    }
+    *size = slot->size;
+    memcpy(item, slot->data, slot->size);
+
+    spsc_publish(&obj->tail, tail + 1, &obj->producer_parked);
+
+    return Success;
+}
+
+rc_t spsc_size(spsc_t* channel, uint32_t* size) {
+    if (channel == NULL || size == NULL) {
+        fprintf(stderr, "The channel and size cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    uint32_t tail = atomic_load(&channel->obj->tail);
+    *size = atomic_load(&channel->obj->head) - tail;
+
+    return Success;
+}
@@ -0,0 +1,63 @@
+#ifndef spsc_h
+#define spsc_h
+
+#include "rc.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+#define SPSC_CACHE_LINE 64
+
+typedef struct timespec timespec_t;
+
+/*
+ * Bounded single-producer/single-consumer channel of fixed-size blocks. The
+ * producer and the consumer each own one cache line holding their index and a
+ * cached copy of the other side's index, so in the common case neither touches
+ * the other's line. There is no lock. A side only parks on a futex when it
+ * finds the channel empty (consumer) or full (producer), and the other side
+ * only issues FUTEX_WAKE when it sees the parked flag on its own line.
+ *
+ * Exactly one thread may send and exactly one thread may receive at a time.
+ */
+
+typedef struct spsc_attr_st {
+    uint32_t block_size;
+    uint32_t num_blocks;   // power of two
+} spsc_attr_t;
+
+typedef struct spsc_obj_st {
+    uint32_t block_size;
+    uint32_t num_blocks;
+    uint32_t stride;
+    char pad0[SPSC_CACHE_LINE - 3 * sizeof(uint32_t)];
+
+    // Producer line: written by the producer, except consumer_parked.
+    atomic_uint head;
+    uint32_t cached_tail;
+    atomic_uint consumer_parked;
+    char pad1[SPSC_CACHE_LINE - 3 * sizeof(uint32_t)];
+
+    // Consumer line: written by the consumer, except producer_parked.
+    atomic_uint tail;
+    uint32_t cached_head;
+    atomic_uint producer_parked;
+    char pad2[SPSC_CACHE_LINE - 3 * sizeof(uint32_t)];
+
+    uint64_t data[];
+} spsc_obj_t;
+
+typedef struct spsc_st {
+    spsc_obj_t* obj;
+} spsc_t;
+
+rc_t spsc_attr_init(spsc_attr_t* attrs);
+rc_t spsc_alloc_size(spsc_attr_t* attrs, size_t* required_bytes);
+rc_t spsc_init(spsc_t* channel, spsc_obj_t* obj, spsc_attr_t* attrs);
+rc_t spsc_create(spsc_t* channel, spsc_attr_t* attrs);
+rc_t spsc_destroy(spsc_t* channel);
+rc_t spsc_send(spsc_t* channel, void* item, uint32_t size, timespec_t* timeout);
+rc_t spsc_receive(spsc_t* channel, void* item, uint32_t max_size, uint32_t* size, timespec_t* timeout);
+rc_t spsc_size(spsc_t* channel, uint32_t* size);
+
+#endif
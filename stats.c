@@ -0,0 +1,90 @@
+#include "stats.h"
+#include <time.h>
+#include <string.h>
+
+_Thread_local int stats_thread_stripe = -1;
+
+static atomic_int stats_next_stripe;
+
+int stats_stripe_slow(void) {
+    stats_thread_stripe = atomic_fetch_add_explicit(&stats_next_stripe, 1, memory_order_relaxed) % STATS_STRIPES;
+    return stats_thread_stripe;
+}
+
+uint64_t stats_now_nsecs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+void stats_histogram_init(stats_histogram_t* histogram) {
+    atomic_init(&histogram->count, 0);
+    atomic_init(&histogram->sum, 0);
+    atomic_init(&histogram->max, 0);
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+        atomic_init(&histogram->buckets[i], 0);
+}
+
+// Approximate while values are being recorded: count may not match the buckets exactly.
+void stats_histogram_snapshot(stats_histogram_t* histogram, stats_distribution_t* distribution) {
+    distribution->count = stats_load(&histogram->count);
+    distribution->sum = stats_load(&histogram->sum);
+    distribution->max = stats_load(&histogram->max);
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+        distribution->buckets[i] = stats_load(&histogram->buckets[i]);
+}
+
+void stats_distribution_init(stats_distribution_t* distribution) {
+    memset(distribution, 0, sizeof(stats_distribution_t));
+}
+
+void stats_distribution_add(stats_distribution_t* total, const stats_distribution_t* distribution) {
+    total->count += distribution->count;
+    total->sum += distribution->sum;
+    if (distribution->max > total->max)
+        total->max = distribution->max;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+        total->buckets[i] += distribution->buckets[i];
+}
+
+// The largest value of a bucket.
+static uint64_t stats_bucket_high(int bucket) {
+    if (bucket < STATS_HISTOGRAM_SUB_BUCKETS)
+        return (uint64_t) bucket;
+
+    int exponent = bucket / STATS_HISTOGRAM_SUB_BUCKETS + STATS_HISTOGRAM_SUB_BITS - 1;
+    int sub = bucket % STATS_HISTOGRAM_SUB_BUCKETS;
+    int shift = exponent - STATS_HISTOGRAM_SUB_BITS;
+    uint64_t low = (uint64_t)(STATS_HISTOGRAM_SUB_BUCKETS + sub) << shift;
+    return low + ((1ull << shift) - 1);
+}
+
+/*
+ * The value below which the given fraction (0 to 1) of the recorded values
+ * fall, to within a bucket: the top of the bucket holding that rank, but never
+ * more than the largest value recorded. 0 for an empty distribution.
+ */
+uint64_t stats_distribution_percentile(const stats_distribution_t* distribution, double percentile) {
+    uint64_t total = 0;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++)
+        total += distribution->buckets[i];
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(percentile * (double) total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_HISTOGRAM_BUCKETS; i++) {
+        seen += distribution->buckets[i];
+        if (seen >= rank) {
+            uint64_t high = stats_bucket_high(i);
+            return high < distribution->max ? high : distribution->max;
+        }
+    }
+
+    return distribution->max;
+}
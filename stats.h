@@ -0,0 +1,114 @@
+#ifndef stats_h
+#define stats_h
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Runtime counters for cqueue, spinlock and pool. A counted object keeps
+ * STATS_STRIPES copies of its counters, each on its own cache line, and a
+ * thread only ever bumps the copy picked by its stripe index; the *_stats
+ * snapshot calls add the copies up. All updates are relaxed, so a snapshot
+ * taken while the object is in use is approximate.
+ *
+ * Build with -DPOOL_NO_STATS to compile every counter and clock read out.
+ * Lock hold times cost a clock read on every acquire and release, so they
+ * are only measured when built with -DPOOL_LOCK_TIMING as well.
+ */
+
+#ifndef POOL_NO_STATS
+#define POOL_STATS 1
+#endif
+
+#define STATS_STRIPES 16
+#define STATS_CACHE_LINE 64
+
+typedef struct stats_counter_st {
+    atomic_uint_fast64_t value;
+    char pad[STATS_CACHE_LINE - sizeof(atomic_uint_fast64_t)];
+} stats_counter_t;
+
+extern _Thread_local int stats_thread_stripe;
+
+int stats_stripe_slow(void);
+uint64_t stats_now_nsecs(void);
+
+// This thread's stripe, assigned round robin on first use.
+static inline int stats_stripe(void) {
+    int stripe = stats_thread_stripe;
+    return stripe >= 0 ? stripe : stats_stripe_slow();
+}
+
+static inline void stats_max(atomic_uint_fast64_t* counter, uint64_t value) {
+    uint64_t seen = atomic_load_explicit(counter, memory_order_relaxed);
+    while (seen < value &&
+           !atomic_compare_exchange_weak_explicit(counter, &seen, value, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static inline uint64_t stats_load(atomic_uint_fast64_t* counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/*
+ * A log-linear (HDR-style) histogram of non-negative values such as
+ * nanoseconds. Values below STATS_HISTOGRAM_SUB_BUCKETS get a bucket each;
+ * above that every power of two is split into STATS_HISTOGRAM_SUB_BUCKETS
+ * buckets, so a bucket is never wider than 1/16 of the values in it and the
+ * whole uint64_t range fits in under a thousand counters. Recording is one
+ * relaxed add per counter and never blocks. stats_histogram_snapshot copies
+ * the counters into a stats_distribution_t to read percentiles from.
+ */
+#define STATS_HISTOGRAM_SUB_BITS 4
+#define STATS_HISTOGRAM_SUB_BUCKETS (1 << STATS_HISTOGRAM_SUB_BITS)
+#define STATS_HISTOGRAM_BUCKETS ((64 - STATS_HISTOGRAM_SUB_BITS + 1) * STATS_HISTOGRAM_SUB_BUCKETS)
+
+typedef struct stats_histogram_st {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t sum;
+    atomic_uint_fast64_t max;
+    atomic_uint_fast64_t buckets[STATS_HISTOGRAM_BUCKETS];
+} stats_histogram_t;
+
+typedef struct stats_distribution_st {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[STATS_HISTOGRAM_BUCKETS];
+} stats_distribution_t;
+
+void stats_histogram_init(stats_histogram_t* histogram);
+void stats_histogram_snapshot(stats_histogram_t* histogram, stats_distribution_t* distribution);
+void stats_distribution_init(stats_distribution_t* distribution);
+void stats_distribution_add(stats_distribution_t* total, const stats_distribution_t* distribution);
+uint64_t stats_distribution_percentile(const stats_distribution_t* distribution, double percentile);
+
+static inline int stats_histogram_bucket(uint64_t value) {
+    if (value < STATS_HISTOGRAM_SUB_BUCKETS)
+        return (int) value;
+
+    int exponent = 63 - __builtin_clzll(value);
+    int sub = (int)(value >> (exponent - STATS_HISTOGRAM_SUB_BITS)) & (STATS_HISTOGRAM_SUB_BUCKETS - 1);
+    return (exponent - STATS_HISTOGRAM_SUB_BITS + 1) * STATS_HISTOGRAM_SUB_BUCKETS + sub;
+}
+
+static inline void stats_histogram_record(stats_histogram_t* histogram, uint64_t value) {
+    atomic_fetch_add_explicit(&histogram->buckets[stats_histogram_bucket(value)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sum, value, memory_order_relaxed);
+    stats_max(&histogram->max, value);
+}
+
+#ifdef POOL_STATS
+#define STATS_STRIPE(stripes) ((stripes)[stats_stripe()])
+#define STATS_ADD(counter, n) atomic_fetch_add_explicit(&(counter), (n), memory_order_relaxed)
+#define STATS_MAX(counter, n) stats_max(&(counter), (n))
+#define STATS_NOW() stats_now_nsecs()
+#else
+#define STATS_STRIPE(stripes) ((void)0)
+#define STATS_ADD(counter, n) ((void)0)
+#define STATS_MAX(counter, n) ((void)0)
+#define STATS_NOW() ((uint64_t)0)
+#endif
+
+#endif
@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+#include "topology.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+static int topology_cpus;
+static int topology_nodes;
+static int topology_node_of[TOPOLOGY_MAX_CPUS];
+
+// Marks every CPU in a sysfs list such as "0-3,8-11" as belonging to node.
+static void topology_parse_cpulist(const char* list, int node) {
+    const char* p = list;
+
+    while (*p != '\0' && *p != '\n') {
+        char* end;
+        long first = strtol(p, &end, 10);
+        if (end == p)
+            return;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            last = strtol(p + 1, &end, 10);
+            p = end;
+        }
+        for (long cpu = first; cpu <= last && cpu < TOPOLOGY_MAX_CPUS; cpu++)
+            if (cpu >= 0)
+                topology_node_of[cpu] = node;
+        if (*p == ',')
+            p++;
+    }
+}
+
+static void topology_load(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    topology_cpus = cpus > 0 ? (cpus < TOPOLOGY_MAX_CPUS ? (int)cpus : TOPOLOGY_MAX_CPUS) : 1;
+    topology_nodes = 1;
+
+    for (int node = 0; node < TOPOLOGY_MAX_NODES; node++) {
+        char path[64];
+        char list[4096];
+
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE* file = fopen(path, "r");
+        if (file == NULL)
+            continue;
+        if (fgets(list, sizeof(list), file) != NULL) {
+            topology_parse_cpulist(list, node);
+            if (node + 1 > topology_nodes)
+                topology_nodes = node + 1;
+        }
+        fclose(file);
+    }
+}
+
+int topology_num_cpus(void) {
+    pthread_once(&topology_once, topology_load);
+    return topology_cpus;
+}
+
+/**
+ * @brief: One past the highest node id that has CPUs (node ids may have gaps).
+ */
+int topology_num_nodes(void) {
+    pthread_once(&topology_once, topology_load);
+    return topology_nodes;
+}
+
+int topology_cpu_node(int cpu) {
+    pthread_once(&topology_once, topology_load);
+    if (cpu < 0 || cpu >= TOPOLOGY_MAX_CPUS)
+        return 0;
+    return topology_node_of[cpu];
+}
+
+/**
+ * @brief: The node of the CPU the caller is running on right now.
+ */
+int topology_current_node(void) {
+    unsigned int cpu;
+    unsigned int node;
+
+    if (syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+        return 0;
+    return (int)node;
+}
+
+/**
+ * @brief: Allocates memory whose pages prefer the given node.
+ *
+ * The block is page aligned and a whole number of pages, so moving its pages never drags a neighbour along. Placement is best effort: where mbind is not permitted the memory simply comes from wherever it faults in.
+ *
+ * @param: size -- the number of bytes.
+ * @param: node -- the node, or -1 for no preference.
+ * @return: the memory (release it with free), or NULL when out of memory.
+ */
+void* topology_alloc_on_node(size_t size, int node) {
+    long page = sysconf(_SC_PAGESIZE);
+    if (page <= 0)
+        page = 4096;
+    size = (size + page - 1) / page * page;
+
+    void* memory;
+    if (posix_memalign(&memory, page, size) != 0)
+        return NULL;
+
+    if (node >= 0 && node < TOPOLOGY_MAX_NODES) {
+        unsigned long mask[(TOPOLOGY_MAX_NODES + 63) / 64] = { 0 };
+        mask[node / 64] = 1ul << (node % 64);
+        syscall(SYS_mbind, memory, size, MPOL_PREFERRED, mask, TOPOLOGY_MAX_NODES + 1, MPOL_MF_MOVE);
+    }
+
+    return memory;
+}
+
+/**
+ * @brief: Restricts threads created with attr to the given CPUs.
+ *
+ * @param: attr -- an initialized thread attribute object.
+ * @param: cpus -- the CPU ids.
+ * @param: num_cpus -- the number of ids (at least 1).
+ * @return: the rc_t value (Success, InvalidArgument, Error)
+ */
+rc_t topology_thread_attr(pthread_attr_t* attr, const int* cpus, int num_cpus) {
+    cpu_set_t set;
+
+    if (attr == NULL || cpus == NULL || num_cpus <= 0) {
+        fprintf(stderr, "The attr and cpus cannot be empty.\n");
+        return InvalidArgument;
+    }
+
+    CPU_ZERO(&set);
+    for (int i = 0; i < num_cpus; i++) {
+        if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+            fprintf(stderr, "CPU %d is out of range.\n", cpus[i]);
+            return InvalidArgument;
+        }
+        CPU_SET(cpus[i], &set);
+    }
+
+    if (pthread_attr_setaffinity_np(attr, sizeof(cpu_set_t), &set) != 0) {
+        fprintf(stderr, "Could not set the thread affinity.\n");
+        return Error;
+    }
+
+    return Success;
+}
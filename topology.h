@@ -0,0 +1,23 @@
+#ifndef topology_h
+#define topology_h
+
+#include "rc.h"
+#include <stddef.h>
+#include <pthread.h>
+
+/*
+ * CPU and NUMA node lookup for worker placement. The node layout is read once
+ * from /sys/devices/system/node; without it every CPU is reported on node 0.
+ */
+
+#define TOPOLOGY_MAX_CPUS 1024
+#define TOPOLOGY_MAX_NODES 64
+
+int topology_num_cpus(void);
+int topology_num_nodes(void);
+int topology_cpu_node(int cpu);
+int topology_current_node(void);
+void* topology_alloc_on_node(size_t size, int node);
+rc_t topology_thread_attr(pthread_attr_t* attr, const int* cpus, int num_cpus);
+
+#endif
@@ -0,0 +1,183 @@
+#include "wsdeque.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+static wsdeque_array_t* wsdeque_array_alloc(int64_t capacity) {
+    wsdeque_array_t* array = malloc(sizeof(wsdeque_array_t) + capacity * sizeof(_Atomic(void*)));
+    if (array == NULL)
+        return NULL;
+
+    array->capacity = capacity;
+    array->retired = NULL;
+    for (int64_t i = 0; i < capacity; i++)
+        atomic_init(&array->items[i], NULL);
+
+    return array;
+}
+
+static wsdeque_array_t* wsdeque_grow(wsdeque_t* deque, wsdeque_array_t* old, int64_t top, int64_t bottom) {
+    wsdeque_array_t* array = wsdeque_array_alloc(old->capacity * 2);
+    if (array == NULL)
+        return NULL;
+
+    for (int64_t i = top; i < bottom; i++) {
+        void* item = atomic_load_explicit(&old->items[i & (old->capacity - 1)], memory_order_relaxed);
+        atomic_store_explicit(&array->items[i & (array->capacity - 1)], item, memory_order_relaxed);
+    }
+
+    // Thieves may still hold a pointer to the old ring, so it lives until destroy.
+    array->retired = old;
+    atomic_store_explicit(&deque->array, array, memory_order_release);
+
+    return array;
+}
+
+rc_t wsdeque_create(wsdeque_t* deque, uint32_t capacity) {
+    if (deque == NULL) {
+        fprintf(stderr, "The deque cannot be NULL.\n");
+        return InvalidArgument;
+    }
+
+    if (capacity == 0)
+        capacity = WSDEQUE_DEFAULT_CAPACITY;
+
+    // Round up to a power of two so indices can be masked.
+    int64_t rounded = 1;
+    while (rounded < capacity)
+        rounded <<= 1;
+
+    wsdeque_array_t* array = wsdeque_array_alloc(rounded);
+    if (array == NULL) {
+        fprintf(stderr, "Out of Memory\n");
+        return OutOfMemory;
+    }
+
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, array);
+
+    return Success;
+}
+
+rc_t wsdeque_destroy(wsdeque_t* deque) {
+    if (deque == NULL) {
+        fprintf(stderr, "On destroy the deque cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    wsdeque_array_t* array = atomic_load(&deque->array);
+    while (array != NULL) {
+        wsdeque_array_t* retired = array->retired;
+        free(array);
+        array = retired;
+    }
+    atomic_store(&deque->array, NULL);
+
+    return Success;
+}
+
+/**
+ * @brief: Pushes an item on the bottom of the deque. Only the owner may call this.
+ */
+rc_t wsdeque_push(wsdeque_t* deque, void* item) {
+    if (deque == NULL) {
+        fprintf(stderr, "The deque cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    wsdeque_array_t* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+    if (bottom - top > array->capacity - 1) {
+        array = wsdeque_grow(deque, array, top, bottom);
+        if (array == NULL) {
+            fprintf(stderr, "Out of Memory\n");
+            return OutOfMemory;
+        }
+    }
+
+    atomic_store_explicit(&array->items[bottom & (array->capacity - 1)], item, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+
+    return Success;
+}
+
+/**
+ * @brief: Pops the most recently pushed item. Only the owner may call this.
+ * @return: Success, or QueueEmpty when there was nothing left (or a thief won the last item).
+ */
+rc_t wsdeque_pop(wsdeque_t* deque, void** item) {
+    if (deque == NULL || item == NULL) {
+        fprintf(stderr, "The deque and item cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    wsdeque_array_t* array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return QueueEmpty;
+    }
+
+    void* result = atomic_load_explicit(&array->items[bottom & (array->capacity - 1)], memory_order_relaxed);
+    if (top == bottom) {
+        // Last item: race the thieves for it.
+        bool won = atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                           memory_order_seq_cst, memory_order_relaxed);
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        if (!won)
+            return QueueEmpty;
+    }
+
+    *item = result;
+    return Success;
+}
+
+/**
+ * @brief: Steals the oldest item. Safe to call from any thread.
+ * @return: Success, or QueueEmpty when there was nothing to steal.
+ */
+rc_t wsdeque_steal(wsdeque_t* deque, void** item) {
+    if (deque == NULL || item == NULL) {
+        fprintf(stderr, "The deque and item cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    for (;;) {
+        int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+        atomic_thread_fence(memory_order_seq_cst);
+        int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+
+        if (top >= bottom)
+            return QueueEmpty;
+
+        wsdeque_array_t* array = atomic_load_explicit(&deque->array, memory_order_acquire);
+        void* result = atomic_load_explicit(&array->items[top & (array->capacity - 1)], memory_order_relaxed);
+        if (atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                    memory_order_seq_cst, memory_order_relaxed)) {
+            *item = result;
+            return Success;
+        }
+        // Another thief or the owner took it; try the next one.
+    }
+}
+
+rc_t wsdeque_size(wsdeque_t* deque, uint32_t* size) {
+    if (deque == NULL || size == NULL) {
+        fprintf(stderr, "The deque and size cannot be NULL\n");
+        return InvalidArgument;
+    }
+
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    *size = bottom > top ? (uint32_t)(bottom - top) : 0;
+
+    return Success;
+}
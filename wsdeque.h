@@ -0,0 +1,37 @@
+#ifndef wsdeque_h
+#define wsdeque_h
+
+#include "rc.h"
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define WSDEQUE_DEFAULT_CAPACITY 64
+
+/*
+ * Chase-Lev work-stealing deque of pointers.
+ *
+ * The owning thread pushes and pops at the bottom (LIFO); any other thread
+ * may steal from the top (FIFO). The ring grows on push; retired rings are
+ * kept on a list until destroy because a thief may still be reading them.
+ */
+
+typedef struct wsdeque_array_st {
+    int64_t capacity;
+    struct wsdeque_array_st* retired;
+    _Atomic(void*) items[];
+} wsdeque_array_t;
+
+typedef struct wsdeque_st {
+    atomic_int_fast64_t top;
+    atomic_int_fast64_t bottom;
+    _Atomic(wsdeque_array_t*) array;
+} wsdeque_t;
+
+rc_t wsdeque_create(wsdeque_t* deque, uint32_t capacity);
+rc_t wsdeque_destroy(wsdeque_t* deque);
+rc_t wsdeque_push(wsdeque_t* deque, void* item);
+rc_t wsdeque_pop(wsdeque_t* deque, void** item);
+rc_t wsdeque_steal(wsdeque_t* deque, void** item);
+rc_t wsdeque_size(wsdeque_t* deque, uint32_t* size);
+
+#endif